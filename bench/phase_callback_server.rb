@@ -0,0 +1,29 @@
+# Benchmark server for the per-phase callback overhead.
+#
+#   ./bin/mruby ../mruby-http2/bench/phase_callback_server.rb [none|empty]
+#
+# "none"  : callback disabled, static file path only (baseline)
+# "empty" : callback enabled, an empty block is set for every phase
+#
+# The difference between the two runs is the dispatch cost of the
+# map_to_storage, access_checker, fixups and logging phases.
+
+root_dir = "/usr/local/trusterd"
+mode = ARGV[0] || "empty"
+
+s = HTTP2::Server.new({
+  :port           => 8080,
+  :document_root  => "#{root_dir}/htdocs",
+  :server_name    => "mruby-http2 bench server",
+  :tls            => false,
+  :callback       => (mode != "none"),
+})
+
+if mode != "none"
+  s.set_map_to_storage_cb {}
+  s.set_access_checker_cb {}
+  s.set_fixups_cb {}
+  s.set_logging_cb {}
+end
+
+s.run
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Run a benchmark server script and measure it with h2load.
+#
+#   cd mruby
+#   sh ../mruby-http2/bench/run.sh ../mruby-http2/bench/phase_callback_server.rb none
+#   sh ../mruby-http2/bench/run.sh ../mruby-http2/bench/phase_callback_server.rb empty
+#
+# MRUBY, H2LOAD, URL and H2LOAD_OPTS can be overridden from the environment.
+
+MRUBY=${MRUBY:-./bin/mruby}
+H2LOAD=${H2LOAD:-./build/host/mrbgems/mruby-http2/nghttp2/src/h2load}
+URL=${URL:-http://127.0.0.1:8080/index.html}
+H2LOAD_OPTS=${H2LOAD_OPTS:--c 100 -m 100 -n 200000}
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 server_script [args...]" >&2
+  exit 1
+fi
+
+$MRUBY "$@" &
+server_pid=$!
+trap 'kill $server_pid 2>/dev/null' EXIT INT TERM
+
+# wait for the listener
+sleep 1
+
+$H2LOAD $H2LOAD_OPTS $URL
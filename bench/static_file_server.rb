@@ -0,0 +1,22 @@
+# Benchmark server for the static file and pipe bodies sent without
+# copying, with and without TCP_CORK around each batch.
+#
+#   dd if=/dev/urandom of=/usr/local/trusterd/htdocs/1m.bin bs=1M count=1
+#   URL=http://127.0.0.1:8080/1m.bin \
+#     sh ../mruby-http2/bench/run.sh ../mruby-http2/bench/static_file_server.rb [nopush|push]
+#
+# "nopush" : tcp_nopush off, frames are pushed as they are written
+# "push"   : tcp_nopush on, the socket is corked until a batch was written
+
+root_dir = "/usr/local/trusterd"
+mode = ARGV[0] || "push"
+
+s = HTTP2::Server.new({
+  :port           => 8080,
+  :document_root  => "#{root_dir}/htdocs",
+  :server_name    => "mruby-http2 bench server",
+  :tls            => false,
+  :tcp_nopush     => (mode == "push"),
+})
+
+s.run
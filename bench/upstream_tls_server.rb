@@ -0,0 +1,46 @@
+# Benchmark server for the proxy hop to a local https backend, to measure
+# the cost of TLS handshakes on new upstream connections.
+#
+#   ./bin/mruby ../mruby-http2/bench/upstream_tls_server.rb [full|resume|keepalive]
+#
+# The backend serves https on 127.0.0.1:8443 with a certificate for
+# localhost in /tmp/mruby-http2-bench.crt, e.g. nginx with
+# upstream_backend.conf.
+#
+# "full"      : a new connection per request with a full handshake
+# "resume"    : a new connection per request resuming the last session
+# "keepalive" : requests on pooled connections (baseline)
+#
+# The counters of handshakes and resumptions are printed at every 10000th
+# request.
+
+mode = ARGV[0] || "resume"
+
+s = HTTP2::Server.new({
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 bench server",
+  :tls            => false,
+  :callback       => true,
+  :upstream       => true,
+  :server_status  => true,
+  :upstream_keepalive_max_idle => 128,
+  :upstream_tls_ca_file        => "/tmp/mruby-http2-bench.crt",
+  :upstream_tls_session_cache  => mode != "full",
+})
+
+s.set_map_to_storage_cb {
+  s.upstream_scheme = "https"
+  s.upstream_host = "localhost"
+  s.upstream_port = 8443
+  s.upstream_uri = s.unparsed_uri
+  s.upstream_keepalive = false if mode != "keepalive"
+}
+
+s.set_logging_cb {
+  if s.total_stream_requests % 10000 == 0
+    puts "handshakes=#{s.upstream_tls_handshakes} resumptions=#{s.upstream_tls_resumptions}"
+  end
+}
+
+s.run
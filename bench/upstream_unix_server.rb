@@ -0,0 +1,41 @@
+# Benchmark server for the proxy hop to a local backend over TCP loopback
+# and over a unix domain socket.
+#
+#   ./bin/mruby ../mruby-http2/bench/upstream_unix_server.rb [tcp|unix]
+#
+# The backend serves the same content on 127.0.0.1:8081 and on
+# /tmp/mruby-http2-bench.sock, e.g. nginx with upstream_backend.conf:
+#
+#   nginx -c /path/to/mruby-http2/bench/upstream_backend.conf
+#
+# "tcp"  : proxy to 127.0.0.1:8081 (baseline)
+# "unix" : proxy to unix:/tmp/mruby-http2-bench.sock
+#
+# HTTP/1.1 upstreams over a unix domain socket need libevent 2.2, run
+# with UPSTREAM_H2=1 and an h2c backend to compare the h2 upstream path.
+
+mode = ARGV[0] || "unix"
+h2 = ENV["UPSTREAM_H2"] == "1"
+
+s = HTTP2::Server.new({
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 bench server",
+  :tls            => false,
+  :callback       => true,
+  :upstream       => true,
+  :upstream_keepalive_max_idle => 128,
+})
+
+s.set_map_to_storage_cb {
+  if mode == "tcp"
+    s.upstream_host = "127.0.0.1"
+    s.upstream_port = 8081
+  else
+    s.upstream_host = "unix:/tmp/mruby-http2-bench.sock"
+  end
+  s.upstream_uri = s.unparsed_uri
+  s.upstream_proto_major = 2 if h2
+}
+
+s.run
@@ -0,0 +1,28 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :async_handler  => true,
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri == "/slow"
+    s.set_content_cb {
+      # other streams are served while this one waits
+      s.async_sleep 500
+      res = s.async_http_get "127.0.0.1", 8081, "/"
+      if res.nil?
+        s.set_status 502
+      else
+        s.rputs "upstream status: #{res[0]}\n"
+        s.rputs res[1]
+      end
+    }
+  end
+}
+
+s.run
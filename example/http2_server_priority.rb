@@ -0,0 +1,18 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :server_status  => true,
+
+  # responses are scheduled by the urgency and incremental of the
+  # priority header and PRIORITY_UPDATE frames of RFC 9218, static
+  # contents without them default to the type of the file, html and css
+  # first, then scripts and fonts, images and media incrementally
+  :extensible_priorities => true,
+
+  :key            => "/usr/local/trusterd/ssl/server.key",
+  :crt            => "/usr/local/trusterd/ssl/server.crt",
+})
+
+s.run
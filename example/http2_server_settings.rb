@@ -0,0 +1,31 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :server_status  => true,
+
+  # SETTINGS sent to each client, max_header_list_size 0 isn't sent
+  :max_concurrent_streams => 256,
+  :initial_window_size    => 1048576,
+  :max_frame_size         => 16384,
+  :header_table_size      => 4096,
+  :max_header_list_size   => 65536,
+
+  # the connection window is enlarged from 65535 by WINDOW_UPDATE
+  :connection_window_size => 4194304,
+
+  # double both receive windows, up to window_max_size, while a client
+  # uploads about half of them per round trip
+  :window_autotune        => true,
+  :window_max_size        => 16777216,
+
+  :key            => "/usr/local/trusterd/ssl/server.key",
+  :crt            => "/usr/local/trusterd/ssl/server.crt",
+})
+
+s.set_content_cb {
+  s.rputs "window_grows: #{s.window_grows}\n"
+}
+
+s.run
@@ -0,0 +1,26 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :server_status  => true,
+
+  # nghttp2 sessions allocate from a size-class slab of the worker, and
+  # the mrb_state of each script not shared and of each handler thread
+  # from a slab of its thread
+  :slab_allocator       => true,
+  :mruby_slab_allocator => true,
+
+  :key            => "/usr/local/trusterd/ssl/server.key",
+  :crt            => "/usr/local/trusterd/ssl/server.crt",
+})
+
+s.set_content_cb {
+  s.rputs "slab_bytes: #{s.slab_bytes}\n"
+  s.rputs "slab_held_bytes: #{s.slab_held_bytes}\n"
+  s.slab_live_objects.each do |size, live|
+    s.rputs "#{size || "large"}: #{live}\n"
+  end
+}
+
+s.run
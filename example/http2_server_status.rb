@@ -0,0 +1,99 @@
+root_dir = "/usr/local/trusterd"
+
+s = HTTP2::Server.new({
+
+  :port           => 8082,
+  :document_root  => "#{root_dir}/htdocs",
+  :server_name    => "mruby-http2 server",
+  :server_status  => true,
+  :callback       => true,
+
+  # test/http2_test.rb speaks h2c to this server and reads the counters
+  # of /server-status
+  :extensible_priorities => true,
+  :window_autotune       => true,
+
+  # a handler running more instructions is aborted with 503
+  :handler_instruction_limit => 1000000,
+
+  # /proxy/ is fetched from /origin/ of this server and cached
+  :upstream       => true,
+  :upstream_cache => true,
+
+  :tls => false,
+  :daemon => true,
+})
+
+# the counters of the worker, one "name: value" line each
+stats = %w(
+  priority_updates
+  window_grows
+  upstream_cache_hits
+  upstream_cache_stale
+  upstream_cache_revalidated
+  upstream_cache_misses
+  upstream_cache_hit_bytes
+  upstream_cache_stored_bytes
+  dns_cache_hits
+  dns_cache_negative_hits
+  gc_count
+  gc_full_count
+  gc_time
+  gc_pause_max
+  handler_budget_exceeded
+  upstream_conn_hits
+  upstream_conn_connects
+  upstream_conn_waits
+  upstream_ejections
+  upstream_collapsed
+  upstream_timeouts
+  upstream_retries
+  upstream_breaker_opens
+  upstream_breaker_rejects
+  upstream_tls_handshakes
+  upstream_tls_resumptions
+  handshake_timeouts
+  idle_timeouts
+  header_timeouts
+  write_timeouts
+  accept_pauses
+  slab_bytes
+  slab_held_bytes
+)
+
+# cache-control of the responses of /origin/<name>
+cache_controls = {
+  "max-age"  => "max-age=60",
+  "s-maxage" => "max-age=0, s-maxage=60",
+  "expired"  => "max-age=0",
+  "no-store" => "max-age=60, no-store",
+  "private"  => "max-age=60, private",
+}
+
+s.set_map_to_storage_cb {
+  if s.uri == "/server-status"
+    s.set_content_cb {
+      stats.each { |name| s.rputs "#{name}: #{s.send(name)}\n" }
+    }
+  elsif s.uri[0, 8] == "/origin/"
+    s.set_content_cb {
+      s.headers_out["cache-control"] = cache_controls[s.uri[8..-1]]
+      s.rputs "origin\n"
+    }
+  elsif s.uri[0, 7] == "/proxy/"
+    s.upstream_host = "127.0.0.1"
+    s.upstream_port = 8082
+    s.upstream_proto_major = 2
+    s.upstream_uri = "/origin/" + s.unparsed_uri[7..-1]
+  elsif s.uri == "/spin"
+    s.set_content_cb {
+      while true; end
+    }
+  elsif s.uri == "/dns"
+    # nothing listens on 8084, each try connects and resolves again
+    s.upstream_host = "localhost"
+    s.upstream_port = 8084
+  end
+}
+
+s.run
@@ -0,0 +1,31 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :server_status  => true,
+
+  # msec, a session is closed when the TLS handshake, the next request,
+  # the rest of request headers or writing its output takes longer, 0
+  # disables each
+  :handshake_timeout => 10000,
+  :idle_timeout      => 60000,
+  :header_timeout    => 30000,
+  :write_timeout     => 60000,
+
+  # a worker stops accepting at 10000 sessions until one of them closed
+  :max_connections   => 10000,
+
+  :key            => "/usr/local/trusterd/ssl/server.key",
+  :crt            => "/usr/local/trusterd/ssl/server.crt",
+})
+
+s.set_content_cb {
+  s.rputs "handshake_timeouts: #{s.handshake_timeouts}\n"
+  s.rputs "idle_timeouts: #{s.idle_timeouts}\n"
+  s.rputs "header_timeouts: #{s.header_timeouts}\n"
+  s.rputs "write_timeouts: #{s.write_timeouts}\n"
+  s.rputs "accept_pauses: #{s.accept_pauses}\n"
+}
+
+s.run
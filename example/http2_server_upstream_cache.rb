@@ -0,0 +1,41 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :upstream       => true,
+
+  # cacheable upstream responses are kept in a per worker memory cache,
+  # and in files under upstream_cache_dir shared by all workers
+  :upstream_cache                 => true,
+  :upstream_cache_memory_size     => 64 * 1024 * 1024,
+  :upstream_cache_max_object_size => 1024 * 1024,
+  :upstream_cache_dir             => "/var/cache/trusterd",
+  :upstream_cache_disk_slots      => 65536,
+
+  # server_status is required for upstream_cache_* counters
+  :server_status  => true,
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri =~ /^\/api\//
+    s.upstream_host = "127.0.0.1"
+    s.upstream_port = 8081
+    s.upstream_uri = s.unparsed_uri
+  end
+}
+
+s.set_access_checker_cb {
+  if s.uri =~ /^\/api\/user\//
+    # personalized responses never come from the cache
+    s.upstream_cache_bypass = true
+  elsif s.uri =~ /^\/api\/search/
+    # ignore the tracking parameters
+    s.upstream_cache_key = s.uri.sub(/[?&]utm_[^&]*/, "")
+  end
+}
+
+s.run
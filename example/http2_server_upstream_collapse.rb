@@ -0,0 +1,28 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :upstream       => true,
+
+  # concurrent GET/HEAD requests of the same upstream uri wait for the
+  # first one and share its response, unless it varies by their headers
+  :upstream_collapse => true,
+  :upstream_cache    => true,
+
+  # server_status is required for upstream_collapsed
+  :server_status  => true,
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri =~ /^\/api\//
+    s.upstream_host = "127.0.0.1"
+    s.upstream_port = 8081
+    s.upstream_uri = s.unparsed_uri
+  end
+}
+
+s.run
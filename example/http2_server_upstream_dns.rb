@@ -0,0 +1,27 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :upstream       => true,
+
+  # upstream hosts are resolved on the event loop of each worker, by
+  # resolv.conf when dns_nameservers is nil, and the addresses are cached
+  # for dns_positive_ttl sec, failed names for dns_negative_ttl sec
+  :dns_nameservers  => "127.0.0.1:53,[::1]:53",
+  :dns_positive_ttl => 30,
+  :dns_negative_ttl => 5,
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri =~ /^\/api\//
+    s.upstream_host = "api.internal.example.com"
+    s.upstream_port = 8081
+    s.upstream_uri = s.unparsed_uri
+  end
+}
+
+s.run
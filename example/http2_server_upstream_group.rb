@@ -0,0 +1,35 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :upstream       => true,
+  :server_status  => true,
+
+  # policy: round_robin, weighted, least_conn or ewma
+  :upstream_groups => {
+    "app" => {
+      :policy => "ewma",
+      :servers => [
+        {:host => "127.0.0.1", :port => 8081, :weight => 2},
+        {:host => "127.0.0.1", :port => 8082},
+      ],
+      :health_check_path     => "/health",
+      :health_check_interval => 5000,
+      :max_fails             => 3,
+      :fail_timeout          => 10000,
+    },
+  },
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri =~ /^\/app\//
+    s.upstream_group = "app"
+    s.upstream_uri = s.unparsed_uri
+  end
+}
+
+s.run
@@ -0,0 +1,31 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :upstream       => true,
+
+  # streams of all clients share these connections to each h2c upstream
+  :upstream_h2_max_connections => 2,
+  :upstream_keepalive_timeout  => 60000,
+
+  # request bodies are streamed to h2c upstreams as they arrive, the
+  # map_to_storage and access_checker callbacks of a request with a body
+  # run before the body is received. HTTP/1.x upstreams still get the
+  # whole body at the end of the stream, up to 16MB
+  :upstream_request_buffering  => false,
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri =~ /^\/api\//
+    s.upstream_host = "127.0.0.1"
+    s.upstream_port = 8081
+    s.upstream_proto_major = 2
+    s.upstream_uri = s.unparsed_uri
+  end
+}
+
+s.run
@@ -0,0 +1,49 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :upstream       => true,
+
+  # msec to connect, and to the response headers since the request was
+  # sent, s.upstream_timeout = sec is the idle timeout of the response
+  :upstream_connect_timeout    => 1000,
+  :upstream_first_byte_timeout => 10000,
+
+  # GET, HEAD, OPTIONS, TRACE, PUT and DELETE which got no response are
+  # sent again once, at most for 20% of the upstream requests
+  :upstream_retries      => 1,
+  :upstream_retry_budget => 20,
+
+  # the circuit of an upstream host:port opens for 5 sec, replying 503
+  # without going upstream, when 50% of at least 20 requests failed in
+  # the last two 10 sec windows, then one request probes it
+  :upstream_breaker_threshold    => 50,
+  :upstream_breaker_min_requests => 20,
+  :upstream_breaker_window       => 10000,
+  :upstream_breaker_open_time    => 5000,
+
+  # server_status is required for the upstream_* counters
+  :server_status  => true,
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri =~ /^\/api\//
+    s.upstream_host = "127.0.0.1"
+    s.upstream_port = 8081
+    s.upstream_uri = s.unparsed_uri
+    s.upstream_timeout = 30
+  end
+}
+
+s.set_logging_cb {
+  if s.status == 503
+    puts "upstream circuit open: retries=#{s.upstream_retries} timeouts=#{s.upstream_timeouts} " \
+          "opens=#{s.upstream_breaker_opens} rejects=#{s.upstream_breaker_rejects}"
+  end
+}
+
+s.run
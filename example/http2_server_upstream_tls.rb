@@ -0,0 +1,47 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :upstream       => true,
+
+  # https upstreams are verified against this CA file, or the default CA
+  # paths of openssl when it's nil, and their TLS sessions are resumed by
+  # new connections to the same host:port
+  :upstream_tls_ca_file       => "/etc/ssl/internal-ca.pem",
+  :upstream_tls_verify        => true,
+  :upstream_tls_session_cache => true,
+
+  # :scheme => "https" connects to the server over TLS, on 443 by default
+  :upstream_groups => {
+    "api" => {
+      :servers => [
+        {:host => "api1.internal.example.com", :scheme => "https"},
+        {:host => "api2.internal.example.com", :scheme => "https"},
+      ],
+      :health_check_path => "/health",
+    },
+  },
+
+  # server_status is required for the upstream_tls_* counters
+  :server_status  => true,
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri =~ /^\/api\//
+    s.upstream_group = "api"
+    s.upstream_uri = s.unparsed_uri
+  elsif s.uri =~ /^\/static\//
+    # HTTP/2 over TLS is negotiated by ALPN
+    s.upstream_scheme = "https"
+    s.upstream_host = "static.internal.example.com"
+    s.upstream_port = 443
+    s.upstream_proto_major = 2
+    s.upstream_uri = s.unparsed_uri
+  end
+}
+
+s.run
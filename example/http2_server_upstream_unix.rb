@@ -0,0 +1,35 @@
+s = HTTP2::Server.new({
+
+  :port           => 8080,
+  :document_root  => "/usr/local/trusterd/htdocs",
+  :server_name    => "mruby-http2 server",
+  :callback       => true,
+  :upstream       => true,
+
+  # backends on the same host can be connected by unix domain sockets,
+  # HTTP/1.x ones and health checks need libevent 2.2, so with libevent
+  # 2.1 the backends are proxied by HTTP/2 without health_check_path
+  :upstream_groups => {
+    "app" => {
+      :policy  => "least_conn",
+      :servers => [{:host => "unix:/run/app/0.sock"}, {:host => "unix:/run/app/1.sock"}],
+    },
+  },
+
+  :tls => false,
+})
+
+s.set_map_to_storage_cb {
+  if s.uri =~ /^\/app\//
+    s.upstream_group = "app"
+    s.upstream_proto_major = 2
+    s.upstream_uri = s.unparsed_uri
+  elsif s.uri =~ /^\/api\//
+    # port is not used, Host is sent as localhost
+    s.upstream_host = "unix:/run/api.sock"
+    s.upstream_proto_major = 2
+    s.upstream_uri = s.unparsed_uri
+  end
+}
+
+s.run
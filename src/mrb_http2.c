@@ -115,6 +115,27 @@ void set_http_date_str(time_t *time, char *date)
   *p = '\0';
 }
 
+// monotonic clock in usec for measuring intervals
+uint64_t mrb_http2_monotonic_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// FNV-1a of a null terminated key, for the cache and collapse tables
+uint64_t mrb_http2_hash(const char *key)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
 // get nghttp2_nv by name
 int mrb_http2_get_nv_id(nghttp2_nv *nva, size_t nvlen, const char *key)
 {
@@ -129,13 +150,14 @@ int mrb_http2_get_nv_id(nghttp2_nv *nva, size_t nvlen, const char *key)
   return MRB_HTTP2_HEADER_NOT_FOUND;
 }
 
-// free nghttp2_nv
+// free nghttp2_nv, name and value are plain malloc because a handler
+// thread adds headers to a record the loop frees
 void mrb_http2_free_nva(mrb_state *mrb, nghttp2_nv *nva, size_t nvlen)
 {
   int i;
   for (i = 0; i < nvlen; i++) {
-    mrb_free(mrb, nva[i].name);
-    mrb_free(mrb, nva[i].value);
+    free(nva[i].name);
+    free(nva[i].value);
     nva[i].namelen = 0;
     nva[i].valuelen = 0;
   }
@@ -145,11 +167,11 @@ void mrb_http2_free_nva(mrb_state *mrb, nghttp2_nv *nva, size_t nvlen)
 void mrb_http2_create_nv(mrb_state *mrb, nghttp2_nv *nv, const uint8_t *name, size_t namelen, const uint8_t *value,
                          size_t valuelen)
 {
-  nv->name = mrb_malloc(mrb, namelen);
+  nv->name = malloc(namelen);
   memcpy(nv->name, name, namelen);
   nv->namelen = namelen;
 
-  nv->value = mrb_malloc(mrb, valuelen);
+  nv->value = malloc(valuelen);
   memcpy(nv->value, value, valuelen);
   nv->valuelen = valuelen;
 
@@ -59,6 +59,13 @@
 #endif
 #define OUTPUT_WOULDBLOCK_THRESHOLD (1 << 16)
 #define ARRLEN(x) (sizeof(x) / sizeof(x[0]))
+
+// worker stats are counted on the loop and read by the handler threads
+#define MRB_HTTP2_STAT_ADD(STAT, N) __atomic_add_fetch(&(STAT), (N), __ATOMIC_RELAXED)
+#define MRB_HTTP2_STAT_SUB(STAT, N) __atomic_sub_fetch(&(STAT), (N), __ATOMIC_RELAXED)
+#define MRB_HTTP2_STAT_INC(STAT) MRB_HTTP2_STAT_ADD(STAT, 1)
+#define MRB_HTTP2_STAT_DEC(STAT) MRB_HTTP2_STAT_SUB(STAT, 1)
+#define MRB_HTTP2_STAT_GET(STAT) __atomic_load_n(&(STAT), __ATOMIC_RELAXED)
 #define MAKE_NV(NAME, VALUE)                                                                                           \
   {                                                                                                                    \
     (uint8_t *) NAME, (uint8_t *)VALUE, (uint16_t)(sizeof(NAME) - 1), (uint16_t)(sizeof(VALUE) - 1),                   \
@@ -88,6 +95,8 @@ void mrb_free_unless_null(mrb_state *mrb, void *ptr);
 void debug_header(const char *tag, const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen);
 uid_t mrb_http2_get_uid(mrb_state *mrb, const char *user);
 void set_http_date_str(time_t *time, char *date);
+uint64_t mrb_http2_monotonic_usec(void);
+uint64_t mrb_http2_hash(const char *key);
 int mrb_http2_get_nv_id(nghttp2_nv *nva, size_t nvlen, const char *key);
 void mrb_http2_free_nva(mrb_state *mrb, nghttp2_nv *nva, size_t nvlen);
 void mrb_http2_create_nv(mrb_state *mrb, nghttp2_nv *nv, const uint8_t *name, size_t namelen, const uint8_t *value,
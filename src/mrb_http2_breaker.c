@@ -0,0 +1,190 @@
+/*
+// mrb_http2_breaker.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_breaker.h"
+
+static void mrb_http2_breaker_after(struct timeval *tv, const struct timeval *from, unsigned int msec)
+{
+  struct timeval d;
+
+  d.tv_sec = msec / 1000;
+  d.tv_usec = (msec % 1000) * 1000;
+  evutil_timeradd(from, &d, tv);
+}
+
+// move the window forward, the counts older than two windows are dropped
+static void mrb_http2_breaker_slide(mrb_http2_breaker_entry *entry, const struct timeval *now)
+{
+  struct timeval end;
+
+  mrb_http2_breaker_after(&end, &entry->window_start, entry->breaker->window);
+  if (evutil_timercmp(now, &end, <)) {
+    return;
+  }
+  mrb_http2_breaker_after(&end, &end, entry->breaker->window);
+  if (evutil_timercmp(now, &end, <)) {
+    entry->prev_requests = entry->requests;
+    entry->prev_failures = entry->failures;
+  } else {
+    entry->prev_requests = 0;
+    entry->prev_failures = 0;
+  }
+  entry->requests = 0;
+  entry->failures = 0;
+  entry->window_start = *now;
+}
+
+static void mrb_http2_breaker_open(mrb_http2_breaker_entry *entry, const struct timeval *now)
+{
+  entry->state = MRB_HTTP2_BREAKER_OPEN;
+  entry->probing = 0;
+  mrb_http2_breaker_after(&entry->open_until, now, entry->breaker->open_time);
+}
+
+static void mrb_http2_breaker_close(mrb_http2_breaker_entry *entry, const struct timeval *now)
+{
+  entry->state = MRB_HTTP2_BREAKER_CLOSED;
+  entry->probing = 0;
+  entry->requests = entry->failures = 0;
+  entry->prev_requests = entry->prev_failures = 0;
+  entry->window_start = *now;
+}
+
+mrb_http2_breaker *mrb_http2_breaker_new(struct event_base *evbase, unsigned int threshold, unsigned int min_requests,
+                                         unsigned int window, unsigned int open_time)
+{
+  mrb_http2_breaker *breaker;
+
+  breaker = (mrb_http2_breaker *)calloc(1, sizeof(mrb_http2_breaker));
+  if (breaker == NULL) {
+    return NULL;
+  }
+  breaker->evbase = evbase;
+  breaker->threshold = threshold;
+  breaker->min_requests = min_requests > 0 ? min_requests : 1;
+  breaker->window = window > 0 ? window : 1000;
+  breaker->open_time = open_time;
+  return breaker;
+}
+
+mrb_http2_breaker_entry *mrb_http2_breaker_get(mrb_http2_breaker *breaker, const char *name, int port)
+{
+  mrb_http2_breaker_entry *entry;
+
+  for (entry = breaker->entries; entry != NULL; entry = entry->next) {
+    if (entry->port == port && strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+
+  entry = (mrb_http2_breaker_entry *)calloc(1, sizeof(mrb_http2_breaker_entry));
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->name = strdup(name);
+  if (entry->name == NULL) {
+    free(entry);
+    return NULL;
+  }
+  entry->port = port;
+  entry->breaker = breaker;
+  event_base_gettimeofday_cached(breaker->evbase, &entry->window_start);
+  entry->next = breaker->entries;
+  breaker->entries = entry;
+
+  return entry;
+}
+
+// whether a request may go upstream, pair it with _done or _cancel, probe
+// is set when the request is the one probing a half open circuit
+int mrb_http2_breaker_allow(mrb_http2_breaker_entry *entry, int *probe)
+{
+  struct timeval now;
+
+  *probe = 0;
+  switch (entry->state) {
+  case MRB_HTTP2_BREAKER_CLOSED:
+    return 1;
+  case MRB_HTTP2_BREAKER_OPEN:
+    event_base_gettimeofday_cached(entry->breaker->evbase, &now);
+    if (evutil_timercmp(&now, &entry->open_until, <)) {
+      return 0;
+    }
+    entry->state = MRB_HTTP2_BREAKER_HALF_OPEN;
+    entry->probing = 1;
+    *probe = 1;
+    return 1;
+  case MRB_HTTP2_BREAKER_HALF_OPEN:
+    if (entry->probing) {
+      return 0;
+    }
+    entry->probing = 1;
+    *probe = 1;
+    return 1;
+  }
+  return 1;
+}
+
+// count the outcome of an allowed request, return 1 when the circuit opened
+int mrb_http2_breaker_done(mrb_http2_breaker_entry *entry, int probe, int failed)
+{
+  mrb_http2_breaker *breaker = entry->breaker;
+  struct timeval now;
+  unsigned int requests, failures;
+
+  event_base_gettimeofday_cached(breaker->evbase, &now);
+  switch (entry->state) {
+  case MRB_HTTP2_BREAKER_HALF_OPEN:
+    // sent before the circuit opened, only the probe decides
+    if (!probe) {
+      return 0;
+    }
+    if (failed) {
+      mrb_http2_breaker_open(entry, &now);
+      return 1;
+    }
+    mrb_http2_breaker_close(entry, &now);
+    return 0;
+  case MRB_HTTP2_BREAKER_OPEN:
+    // sent before the circuit opened
+    return 0;
+  case MRB_HTTP2_BREAKER_CLOSED:
+    break;
+  }
+
+  mrb_http2_breaker_slide(entry, &now);
+  entry->requests++;
+  if (failed) {
+    entry->failures++;
+  }
+  requests = entry->requests + entry->prev_requests;
+  failures = entry->failures + entry->prev_failures;
+  if (failed && requests >= breaker->min_requests && failures * 100 >= breaker->threshold * requests) {
+    mrb_http2_breaker_open(entry, &now);
+    return 1;
+  }
+  return 0;
+}
+
+// an allowed request ended without an outcome
+void mrb_http2_breaker_cancel(mrb_http2_breaker_entry *entry, int probe)
+{
+  if (probe && entry->state == MRB_HTTP2_BREAKER_HALF_OPEN) {
+    entry->probing = 0;
+  }
+}
+
+void mrb_http2_breaker_free(mrb_http2_breaker *breaker)
+{
+  mrb_http2_breaker_entry *entry, *next;
+
+  for (entry = breaker->entries; entry != NULL; entry = next) {
+    next = entry->next;
+    free(entry->name);
+    free(entry);
+  }
+  free(breaker);
+}
@@ -0,0 +1,64 @@
+/*
+// mrb_http2_breaker.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_BREAKER_H
+#define MRB_HTTP2_BREAKER_H
+
+#include <event2/event.h>
+
+typedef enum {
+  // requests go upstream, outcomes are counted
+  MRB_HTTP2_BREAKER_CLOSED,
+  // requests fail fast until open_until
+  MRB_HTTP2_BREAKER_OPEN,
+  // one request probes upstream, the others fail fast
+  MRB_HTTP2_BREAKER_HALF_OPEN
+} mrb_http2_breaker_state;
+
+struct mrb_http2_breaker;
+
+// circuit of one upstream host:port
+typedef struct mrb_http2_breaker_entry {
+  struct mrb_http2_breaker_entry *next;
+  struct mrb_http2_breaker *breaker;
+  char *name;
+  int port;
+  mrb_http2_breaker_state state;
+
+  // outcomes of the current window, and of the previous one
+  unsigned int requests;
+  unsigned int failures;
+  unsigned int prev_requests;
+  unsigned int prev_failures;
+  struct timeval window_start;
+
+  struct timeval open_until;
+  unsigned int probing : 1;
+} mrb_http2_breaker_entry;
+
+typedef struct mrb_http2_breaker {
+  struct event_base *evbase;
+  mrb_http2_breaker_entry *entries;
+
+  // open when threshold percent of at least min_requests failed in the
+  // last two windows
+  unsigned int threshold;
+  unsigned int min_requests;
+
+  // msec
+  unsigned int window;
+  unsigned int open_time;
+} mrb_http2_breaker;
+
+mrb_http2_breaker *mrb_http2_breaker_new(struct event_base *evbase, unsigned int threshold, unsigned int min_requests,
+                                         unsigned int window, unsigned int open_time);
+mrb_http2_breaker_entry *mrb_http2_breaker_get(mrb_http2_breaker *breaker, const char *name, int port);
+int mrb_http2_breaker_allow(mrb_http2_breaker_entry *entry, int *probe);
+int mrb_http2_breaker_done(mrb_http2_breaker_entry *entry, int probe, int failed);
+void mrb_http2_breaker_cancel(mrb_http2_breaker_entry *entry, int probe);
+void mrb_http2_breaker_free(mrb_http2_breaker *breaker);
+
+#endif
@@ -0,0 +1,870 @@
+/*
+// mrb_http2_cache.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+// strptime and timegm
+#define _GNU_SOURCE
+#include "mrb_http2.h"
+#include "mrb_http2_cache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#define MRB_HTTP2_CACHE_BUCKETS 4096
+#define MRB_HTTP2_CACHE_FILE_MAGIC 0x3143484d
+
+typedef struct {
+  uint32_t magic;
+  int32_t status;
+  int64_t stored;
+  int64_t fresh_until;
+  uint32_t stale_while_revalidate;
+  uint32_t stale_if_error;
+  uint32_t must_revalidate;
+  uint32_t key_len;
+  uint64_t headers_len;
+  uint64_t vary_len;
+  uint64_t body_len;
+} mrb_http2_cache_file_header;
+
+// directives of cache-control, -1 when not given
+typedef struct {
+  int64_t max_age;
+  int64_t s_maxage;
+  int64_t stale_while_revalidate;
+  int64_t stale_if_error;
+  unsigned int no_store : 1;
+  unsigned int no_cache : 1;
+  unsigned int private_ : 1;
+  unsigned int must_revalidate : 1;
+} mrb_http2_cache_control;
+
+static size_t mrb_http2_cache_entry_size(const mrb_http2_cache_entry *entry)
+{
+  return sizeof(mrb_http2_cache_entry) + strlen(entry->key) + entry->headers_len + entry->vary_len +
+         entry->body_len;
+}
+
+static int mrb_http2_cache_name_eq(const uint8_t *name, size_t namelen, const char *s)
+{
+  return namelen == strlen(s) && strncasecmp((const char *)name, s, namelen) == 0;
+}
+
+// append "name\0value\0" with the lowercased name
+static int mrb_http2_cache_pair_add(char **buf, size_t *len, const uint8_t *name, size_t namelen,
+                                    const uint8_t *value, size_t valuelen)
+{
+  char *p;
+  size_t i;
+
+  p = realloc(*buf, *len + namelen + valuelen + 2);
+  if (p == NULL) {
+    return -1;
+  }
+  *buf = p;
+  p += *len;
+  for (i = 0; i < namelen; i++) {
+    p[i] = tolower(name[i]);
+  }
+  p[namelen] = '\0';
+  memcpy(p + namelen + 1, value, valuelen);
+  p[namelen + 1 + valuelen] = '\0';
+  *len += namelen + valuelen + 2;
+  return 0;
+}
+
+// iterate "name\0value\0" pairs, return the position of the next pair
+size_t mrb_http2_cache_pair_next(const char *buf, size_t pos, const char **name, const char **value)
+{
+  *name = buf + pos;
+  pos += strlen(*name) + 1;
+  *value = buf + pos;
+  return pos + strlen(*value) + 1;
+}
+
+static const char *mrb_http2_cache_pair_find(const char *buf, size_t len, const char *key)
+{
+  const char *name, *value;
+  size_t pos = 0;
+
+  while (pos < len) {
+    pos = mrb_http2_cache_pair_next(buf, pos, &name, &value);
+    if (strcasecmp(name, key) == 0) {
+      return value;
+    }
+  }
+  return NULL;
+}
+
+static time_t mrb_http2_cache_parse_date(const char *value)
+{
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  if (strptime(value, "%a, %d %b %Y %H:%M:%S", &tm) == NULL) {
+    return -1;
+  }
+  return timegm(&tm);
+}
+
+static void mrb_http2_cache_parse_control(const char *value, mrb_http2_cache_control *cc)
+{
+  const char *p = value;
+
+  while (*p) {
+    const char *name, *arg = NULL;
+    size_t namelen;
+
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+    }
+    name = p;
+    while (*p && *p != ',' && *p != '=' && *p != ' ') {
+      p++;
+    }
+    namelen = p - name;
+    if (*p == '=') {
+      arg = ++p;
+      if (*p == '"') {
+        arg = ++p;
+      }
+    }
+    while (*p && *p != ',') {
+      p++;
+    }
+    if (namelen == 0) {
+      continue;
+    }
+#define MRB_HTTP2_CACHE_DIRECTIVE(s) (namelen == sizeof(s) - 1 && strncasecmp(name, s, namelen) == 0)
+    if (MRB_HTTP2_CACHE_DIRECTIVE("no-store")) {
+      cc->no_store = 1;
+    } else if (MRB_HTTP2_CACHE_DIRECTIVE("no-cache")) {
+      cc->no_cache = 1;
+    } else if (MRB_HTTP2_CACHE_DIRECTIVE("private")) {
+      cc->private_ = 1;
+    } else if (MRB_HTTP2_CACHE_DIRECTIVE("must-revalidate") || MRB_HTTP2_CACHE_DIRECTIVE("proxy-revalidate")) {
+      cc->must_revalidate = 1;
+    } else if (arg == NULL) {
+      // no other directive without an argument is used
+    } else if (MRB_HTTP2_CACHE_DIRECTIVE("max-age")) {
+      cc->max_age = atoll(arg);
+    } else if (MRB_HTTP2_CACHE_DIRECTIVE("s-maxage")) {
+      cc->s_maxage = atoll(arg);
+    } else if (MRB_HTTP2_CACHE_DIRECTIVE("stale-while-revalidate")) {
+      cc->stale_while_revalidate = atoll(arg);
+    } else if (MRB_HTTP2_CACHE_DIRECTIVE("stale-if-error")) {
+      cc->stale_if_error = atoll(arg);
+    }
+#undef MRB_HTTP2_CACHE_DIRECTIVE
+  }
+}
+
+// set the freshness from the stored headers, return -1 when the response
+// must not be stored by a shared cache
+static int mrb_http2_cache_entry_freshness(mrb_http2_cache_entry *entry, time_t now)
+{
+  mrb_http2_cache_control cc;
+  const char *name, *value;
+  time_t date = -1, expires = -1;
+  int64_t lifetime, age = 0;
+  int validator = 0, has_expires = 0;
+  size_t pos = 0;
+
+  memset(&cc, 0, sizeof(cc));
+  cc.max_age = cc.s_maxage = cc.stale_while_revalidate = cc.stale_if_error = -1;
+
+  while (pos < entry->headers_len) {
+    pos = mrb_http2_cache_pair_next(entry->headers, pos, &name, &value);
+    if (strcmp(name, "cache-control") == 0) {
+      mrb_http2_cache_parse_control(value, &cc);
+    } else if (strcmp(name, "expires") == 0) {
+      // an invalid date means already expired
+      expires = mrb_http2_cache_parse_date(value);
+      has_expires = 1;
+    } else if (strcmp(name, "date") == 0) {
+      date = mrb_http2_cache_parse_date(value);
+    } else if (strcmp(name, "age") == 0) {
+      age = atoll(value);
+    } else if (strcmp(name, "etag") == 0 || strcmp(name, "last-modified") == 0) {
+      validator = 1;
+    } else if (strcmp(name, "set-cookie") == 0) {
+      return -1;
+    }
+  }
+  if (cc.no_store || cc.private_) {
+    return -1;
+  }
+
+  if (cc.s_maxage >= 0) {
+    // s-maxage implies proxy-revalidate
+    lifetime = cc.s_maxage;
+    cc.must_revalidate = 1;
+  } else if (cc.max_age >= 0) {
+    lifetime = cc.max_age;
+  } else if (has_expires) {
+    lifetime = expires == -1 ? 0 : expires - (date == -1 ? now : date);
+  } else if (validator) {
+    // no heuristic freshness, revalidated every time
+    lifetime = 0;
+  } else {
+    return -1;
+  }
+  if (cc.no_cache) {
+    if (!validator) {
+      return -1;
+    }
+    lifetime = 0;
+  }
+  if (lifetime < 0) {
+    lifetime = 0;
+  }
+
+  entry->stored = now - (age > 0 ? age : 0);
+  entry->fresh_until = entry->stored + lifetime;
+  entry->stale_while_revalidate = cc.stale_while_revalidate > 0 ? cc.stale_while_revalidate : 0;
+  entry->stale_if_error = cc.stale_if_error > 0 ? cc.stale_if_error : 0;
+  entry->must_revalidate = cc.must_revalidate;
+  return 0;
+}
+
+static void mrb_http2_cache_entry_free(mrb_http2_cache_entry *entry)
+{
+  free(entry->key);
+  free(entry->headers);
+  free(entry->vary);
+  free(entry->body);
+  free(entry);
+}
+
+void mrb_http2_cache_entry_unref(mrb_http2_cache_entry *entry)
+{
+  if (--entry->refs == 0) {
+    mrb_http2_cache_entry_free(entry);
+  }
+}
+
+static int mrb_http2_cache_vary_match(const mrb_http2_cache_entry *entry, const nghttp2_nv *reqhdr, size_t reqhdrlen)
+{
+  const char *name, *value;
+  size_t pos = 0, i;
+
+  while (pos < entry->vary_len) {
+    const uint8_t *v = (const uint8_t *)"";
+    size_t vlen = 0;
+
+    pos = mrb_http2_cache_pair_next(entry->vary, pos, &name, &value);
+    for (i = 0; i < reqhdrlen; i++) {
+      if (mrb_http2_cache_name_eq(reqhdr[i].name, reqhdr[i].namelen, name)) {
+        v = reqhdr[i].value;
+        vlen = reqhdr[i].valuelen;
+        break;
+      }
+    }
+    if (vlen != strlen(value) || memcmp(v, value, vlen) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// record the request headers named by vary, return -1 for "Vary: *"
+static int mrb_http2_cache_entry_vary(mrb_http2_cache_entry *entry, const char *vary, const nghttp2_nv *reqhdr,
+                                      size_t reqhdrlen)
+{
+  const char *p = vary;
+
+  while (*p) {
+    const char *name;
+    size_t namelen, i;
+
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+    }
+    name = p;
+    while (*p && *p != ',' && *p != ' ' && *p != '\t') {
+      p++;
+    }
+    namelen = p - name;
+    if (namelen == 0) {
+      continue;
+    }
+    if (namelen == 1 && *name == '*') {
+      return -1;
+    }
+    for (i = 0; i < reqhdrlen; i++) {
+      if (reqhdr[i].namelen == namelen && strncasecmp((const char *)reqhdr[i].name, name, namelen) == 0) {
+        break;
+      }
+    }
+    if (mrb_http2_cache_pair_add(&entry->vary, &entry->vary_len, (const uint8_t *)name, namelen,
+                                 i < reqhdrlen ? reqhdr[i].value : (const uint8_t *)"",
+                                 i < reqhdrlen ? reqhdr[i].valuelen : 0) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int mrb_http2_cache_status_storable(int status)
+{
+  switch (status) {
+  case 200:
+  case 203:
+  case 204:
+  case 300:
+  case 301:
+  case 308:
+  case 404:
+  case 405:
+  case 410:
+  case 414:
+  case 501:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// a new entry for the response, NULL when the response can't be stored
+mrb_http2_cache_entry *mrb_http2_cache_entry_new(mrb_http2_cache *cache, const char *key, int status,
+                                                 const nghttp2_nv *reshdrs, size_t reshdrslen,
+                                                 const nghttp2_nv *reqhdr, size_t reqhdrlen, time_t now)
+{
+  mrb_http2_cache_entry *entry;
+  const char *vary;
+  size_t i;
+
+  if (!mrb_http2_cache_status_storable(status)) {
+    return NULL;
+  }
+  entry = (mrb_http2_cache_entry *)calloc(1, sizeof(mrb_http2_cache_entry));
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->refs = 1;
+  entry->status = status;
+  entry->key = strdup(key);
+  entry->hash = mrb_http2_hash(key);
+
+  for (i = 0; i < reshdrslen; i++) {
+    if (reshdrs[i].namelen > 0 && reshdrs[i].name[0] == ':') {
+      continue;
+    }
+    if (mrb_http2_cache_pair_add(&entry->headers, &entry->headers_len, reshdrs[i].name, reshdrs[i].namelen,
+                                 reshdrs[i].value, reshdrs[i].valuelen) != 0) {
+      goto fail;
+    }
+  }
+  if (mrb_http2_cache_entry_freshness(entry, now) != 0) {
+    goto fail;
+  }
+  vary = mrb_http2_cache_pair_find(entry->headers, entry->headers_len, "vary");
+  if (vary != NULL && mrb_http2_cache_entry_vary(entry, vary, reqhdr, reqhdrlen) != 0) {
+    goto fail;
+  }
+  return entry;
+
+fail:
+  mrb_http2_cache_entry_free(entry);
+  return NULL;
+}
+
+// add a part of the body, return -1 when it went over max_object_size
+int mrb_http2_cache_entry_append(mrb_http2_cache *cache, mrb_http2_cache_entry *entry, const void *data, size_t len)
+{
+  if (entry->too_large) {
+    return -1;
+  }
+  if (entry->body_len + len > cache->max_object_size) {
+    entry->too_large = 1;
+    free(entry->body);
+    entry->body = NULL;
+    entry->body_len = entry->body_cap = 0;
+    return -1;
+  }
+  if (entry->body_len + len > entry->body_cap) {
+    size_t cap = entry->body_cap > 0 ? entry->body_cap * 2 : 4096;
+    char *p;
+
+    while (cap < entry->body_len + len) {
+      cap *= 2;
+    }
+    if (cap > cache->max_object_size) {
+      cap = cache->max_object_size;
+    }
+    p = realloc(entry->body, cap);
+    if (p == NULL) {
+      entry->too_large = 1;
+      return -1;
+    }
+    entry->body = p;
+    entry->body_cap = cap;
+  }
+  memcpy(entry->body + entry->body_len, data, len);
+  entry->body_len += len;
+  return 0;
+}
+
+mrb_http2_cache_state mrb_http2_cache_entry_state(const mrb_http2_cache_entry *entry, time_t now)
+{
+  if (now < entry->fresh_until) {
+    return MRB_HTTP2_CACHE_FRESH;
+  }
+  if (entry->must_revalidate) {
+    return MRB_HTTP2_CACHE_STALE;
+  }
+  if (now < entry->fresh_until + (time_t)entry->stale_while_revalidate) {
+    return MRB_HTTP2_CACHE_STALE_WHILE_REVALIDATE;
+  }
+  if (now < entry->fresh_until + (time_t)entry->stale_if_error) {
+    return MRB_HTTP2_CACHE_STALE_IF_ERROR;
+  }
+  return MRB_HTTP2_CACHE_STALE;
+}
+
+const char *mrb_http2_cache_entry_header(const mrb_http2_cache_entry *entry, const char *name)
+{
+  return mrb_http2_cache_pair_find(entry->headers, entry->headers_len, name);
+}
+
+//
+// disk tier, content files are written by a temporary file and rename, so
+// other workers read a whole file or nothing
+//
+
+static void mrb_http2_cache_path(mrb_http2_cache *cache, uint64_t hash, char *path, size_t len)
+{
+  snprintf(path, len, "%s/%016llx", cache->dir, (unsigned long long)hash);
+}
+
+// record locks are held per process, so only other workers wait
+static void mrb_http2_cache_slot_lock(mrb_http2_cache *cache, uint64_t hash, short type)
+{
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = (off_t)(hash % cache->nslots) * sizeof(mrb_http2_cache_slot);
+  fl.l_len = sizeof(mrb_http2_cache_slot);
+  while (fcntl(cache->index_fd, F_SETLKW, &fl) == -1 && errno == EINTR)
+    ;
+}
+
+static int mrb_http2_cache_write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int mrb_http2_cache_read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void mrb_http2_cache_disk_write(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  mrb_http2_cache_file_header hdr;
+  mrb_http2_cache_slot *slot;
+  char path[PATH_MAX], tmp[PATH_MAX];
+  int fd;
+
+  if (cache->dir == NULL) {
+    return;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = MRB_HTTP2_CACHE_FILE_MAGIC;
+  hdr.status = entry->status;
+  hdr.stored = entry->stored;
+  hdr.fresh_until = entry->fresh_until;
+  hdr.stale_while_revalidate = entry->stale_while_revalidate;
+  hdr.stale_if_error = entry->stale_if_error;
+  hdr.must_revalidate = entry->must_revalidate;
+  hdr.key_len = strlen(entry->key);
+  hdr.headers_len = entry->headers_len;
+  hdr.vary_len = entry->vary_len;
+  hdr.body_len = entry->body_len;
+
+  snprintf(tmp, sizeof(tmp), "%s/.tmp.%d.%u", cache->dir, (int)getpid(), cache->tmpseq++);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    return;
+  }
+  if (mrb_http2_cache_write_all(fd, &hdr, sizeof(hdr)) != 0 ||
+      mrb_http2_cache_write_all(fd, entry->key, hdr.key_len) != 0 ||
+      mrb_http2_cache_write_all(fd, entry->headers, entry->headers_len) != 0 ||
+      mrb_http2_cache_write_all(fd, entry->vary, entry->vary_len) != 0 ||
+      mrb_http2_cache_write_all(fd, entry->body, entry->body_len) != 0) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  close(fd);
+
+  mrb_http2_cache_slot_lock(cache, entry->hash, F_WRLCK);
+  mrb_http2_cache_path(cache, entry->hash, path, sizeof(path));
+  if (rename(tmp, path) != 0) {
+    mrb_http2_cache_slot_lock(cache, entry->hash, F_UNLCK);
+    unlink(tmp);
+    return;
+  }
+
+  slot = &cache->index[entry->hash % cache->nslots];
+  if (slot->hash != 0 && slot->hash != entry->hash) {
+    char old[PATH_MAX];
+    mrb_http2_cache_path(cache, slot->hash, old, sizeof(old));
+    unlink(old);
+  }
+  slot->hash = entry->hash;
+  slot->fresh_until = entry->fresh_until;
+  slot->size = sizeof(hdr) + hdr.key_len + entry->headers_len + entry->vary_len + entry->body_len;
+  mrb_http2_cache_slot_lock(cache, entry->hash, F_UNLCK);
+}
+
+static mrb_http2_cache_entry *mrb_http2_cache_disk_load(mrb_http2_cache *cache, const char *key, uint64_t hash)
+{
+  mrb_http2_cache_file_header hdr;
+  mrb_http2_cache_entry *entry;
+  char path[PATH_MAX];
+  int fd;
+
+  if (cache->dir == NULL) {
+    return NULL;
+  }
+  // the open file stays readable when another worker replaces it
+  mrb_http2_cache_slot_lock(cache, hash, F_RDLCK);
+  if (cache->index[hash % cache->nslots].hash != hash) {
+    mrb_http2_cache_slot_lock(cache, hash, F_UNLCK);
+    return NULL;
+  }
+  mrb_http2_cache_path(cache, hash, path, sizeof(path));
+  fd = open(path, O_RDONLY);
+  mrb_http2_cache_slot_lock(cache, hash, F_UNLCK);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (mrb_http2_cache_read_all(fd, &hdr, sizeof(hdr)) != 0 || hdr.magic != MRB_HTTP2_CACHE_FILE_MAGIC ||
+      hdr.key_len != strlen(key) || hdr.body_len > cache->max_object_size ||
+      hdr.headers_len + hdr.vary_len > cache->max_object_size) {
+    close(fd);
+    return NULL;
+  }
+
+  entry = (mrb_http2_cache_entry *)calloc(1, sizeof(mrb_http2_cache_entry));
+  if (entry == NULL) {
+    close(fd);
+    return NULL;
+  }
+  entry->refs = 1;
+  entry->hash = hash;
+  entry->status = hdr.status;
+  entry->stored = hdr.stored;
+  entry->fresh_until = hdr.fresh_until;
+  entry->stale_while_revalidate = hdr.stale_while_revalidate;
+  entry->stale_if_error = hdr.stale_if_error;
+  entry->must_revalidate = hdr.must_revalidate;
+  entry->headers_len = hdr.headers_len;
+  entry->vary_len = hdr.vary_len;
+  entry->body_len = entry->body_cap = hdr.body_len;
+  entry->key = malloc(hdr.key_len + 1);
+  entry->headers = malloc(hdr.headers_len + 1);
+  entry->vary = malloc(hdr.vary_len + 1);
+  entry->body = malloc(hdr.body_len + 1);
+  if (entry->key == NULL || entry->headers == NULL || entry->vary == NULL || entry->body == NULL ||
+      mrb_http2_cache_read_all(fd, entry->key, hdr.key_len) != 0 ||
+      mrb_http2_cache_read_all(fd, entry->headers, hdr.headers_len) != 0 ||
+      mrb_http2_cache_read_all(fd, entry->vary, hdr.vary_len) != 0 ||
+      mrb_http2_cache_read_all(fd, entry->body, hdr.body_len) != 0) {
+    close(fd);
+    mrb_http2_cache_entry_free(entry);
+    return NULL;
+  }
+  close(fd);
+
+  // a hash collision of another key
+  entry->key[hdr.key_len] = '\0';
+  if (strcmp(entry->key, key) != 0) {
+    mrb_http2_cache_entry_free(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+//
+// memory tier
+//
+
+static mrb_http2_cache_entry *mrb_http2_cache_find(mrb_http2_cache *cache, const char *key, uint64_t hash)
+{
+  mrb_http2_cache_entry *entry;
+
+  for (entry = cache->buckets[hash % cache->nbuckets]; entry != NULL; entry = entry->hnext) {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void mrb_http2_cache_lru_unlink(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+  entry->prev = entry->next = NULL;
+}
+
+static void mrb_http2_cache_lru_push(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+// drop the reference of the memory tier
+static void mrb_http2_cache_remove(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  mrb_http2_cache_entry **p;
+
+  for (p = &cache->buckets[entry->hash % cache->nbuckets]; *p != NULL; p = &(*p)->hnext) {
+    if (*p == entry) {
+      *p = entry->hnext;
+      break;
+    }
+  }
+  mrb_http2_cache_lru_unlink(cache, entry);
+  cache->size -= mrb_http2_cache_entry_size(entry);
+  entry->cached = 0;
+  mrb_http2_cache_entry_unref(entry);
+}
+
+// the memory tier takes a reference, and evicts the least recently used
+static void mrb_http2_cache_insert(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  mrb_http2_cache_entry *old;
+
+  old = mrb_http2_cache_find(cache, entry->key, entry->hash);
+  if (old != NULL) {
+    mrb_http2_cache_remove(cache, old);
+  }
+  entry->refs++;
+  entry->cached = 1;
+  entry->hnext = cache->buckets[entry->hash % cache->nbuckets];
+  cache->buckets[entry->hash % cache->nbuckets] = entry;
+  mrb_http2_cache_lru_push(cache, entry);
+  cache->size += mrb_http2_cache_entry_size(entry);
+
+  while (cache->size > cache->max_size && cache->tail != entry) {
+    mrb_http2_cache_remove(cache, cache->tail);
+  }
+}
+
+// find the entry of the key in memory then on disk, matching the request
+// headers named by vary, the caller owns a reference
+mrb_http2_cache_entry *mrb_http2_cache_lookup(mrb_http2_cache *cache, const char *key, const nghttp2_nv *reqhdr,
+                                              size_t reqhdrlen)
+{
+  mrb_http2_cache_entry *entry;
+  uint64_t hash = mrb_http2_hash(key);
+
+  entry = mrb_http2_cache_find(cache, key, hash);
+  if (entry != NULL) {
+    mrb_http2_cache_lru_unlink(cache, entry);
+    mrb_http2_cache_lru_push(cache, entry);
+    entry->refs++;
+  } else {
+    entry = mrb_http2_cache_disk_load(cache, key, hash);
+    if (entry == NULL) {
+      return NULL;
+    }
+    mrb_http2_cache_insert(cache, entry);
+  }
+
+  if (!mrb_http2_cache_vary_match(entry, reqhdr, reqhdrlen)) {
+    mrb_http2_cache_entry_unref(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+// store a completed entry, the reference of the caller is taken over
+void mrb_http2_cache_store(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  if (!entry->too_large) {
+    mrb_http2_cache_insert(cache, entry);
+    mrb_http2_cache_disk_write(cache, entry);
+  }
+  mrb_http2_cache_entry_unref(entry);
+}
+
+// a 304 response revalidated the entry, update the stored headers and
+// the freshness by the headers of the response except content-length
+void mrb_http2_cache_entry_update(mrb_http2_cache *cache, mrb_http2_cache_entry *entry, const nghttp2_nv *reshdrs,
+                                  size_t reshdrslen, time_t now)
+{
+  const char *name, *value;
+  char *headers = NULL;
+  size_t headers_len = 0, pos = 0, i;
+  size_t old_size = mrb_http2_cache_entry_size(entry);
+
+  while (pos < entry->headers_len) {
+    pos = mrb_http2_cache_pair_next(entry->headers, pos, &name, &value);
+    for (i = 0; i < reshdrslen; i++) {
+      if (mrb_http2_cache_name_eq(reshdrs[i].name, reshdrs[i].namelen, name)) {
+        break;
+      }
+    }
+    // the age of the old response is replaced by the new one
+    if (strcmp(name, "age") == 0) {
+      continue;
+    }
+    if ((i == reshdrslen || strcmp(name, "content-length") == 0) &&
+        mrb_http2_cache_pair_add(&headers, &headers_len, (const uint8_t *)name, strlen(name),
+                                 (const uint8_t *)value, strlen(value)) != 0) {
+      free(headers);
+      return;
+    }
+  }
+  for (i = 0; i < reshdrslen; i++) {
+    if ((reshdrs[i].namelen > 0 && reshdrs[i].name[0] == ':') ||
+        mrb_http2_cache_name_eq(reshdrs[i].name, reshdrs[i].namelen, "content-length")) {
+      continue;
+    }
+    if (mrb_http2_cache_pair_add(&headers, &headers_len, reshdrs[i].name, reshdrs[i].namelen, reshdrs[i].value,
+                                 reshdrs[i].valuelen) != 0) {
+      free(headers);
+      return;
+    }
+  }
+  free(entry->headers);
+  entry->headers = headers;
+  entry->headers_len = headers_len;
+  if (entry->cached) {
+    cache->size += mrb_http2_cache_entry_size(entry) - old_size;
+  }
+
+  if (mrb_http2_cache_entry_freshness(entry, now) != 0) {
+    // not storable any more
+    entry->fresh_until = 0;
+    entry->must_revalidate = 1;
+    if (entry->cached) {
+      mrb_http2_cache_remove(cache, entry);
+    }
+    return;
+  }
+  if (entry->cached) {
+    mrb_http2_cache_disk_write(cache, entry);
+  }
+}
+
+static int mrb_http2_cache_index_open(mrb_http2_cache *cache)
+{
+  char path[PATH_MAX];
+  size_t size = sizeof(mrb_http2_cache_slot) * cache->nslots;
+  struct stat st;
+  void *p;
+  int fd;
+
+  if (mkdir(cache->dir, 0700) != 0 && errno != EEXIST) {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/index", cache->dir);
+  fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1) {
+    return -1;
+  }
+  // the slots were resized, start over
+  if (fstat(fd, &st) != 0 || ((size_t)st.st_size != size && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0))) {
+    close(fd);
+    return -1;
+  }
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  cache->index = (mrb_http2_cache_slot *)p;
+  cache->index_fd = fd;
+  return 0;
+}
+
+mrb_http2_cache *mrb_http2_cache_new(size_t max_size, size_t max_object_size, const char *dir, unsigned int nslots)
+{
+  mrb_http2_cache *cache;
+
+  cache = (mrb_http2_cache *)calloc(1, sizeof(mrb_http2_cache));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->max_size = max_size;
+  cache->max_object_size = max_object_size;
+  cache->nbuckets = MRB_HTTP2_CACHE_BUCKETS;
+  cache->buckets = (mrb_http2_cache_entry **)calloc(cache->nbuckets, sizeof(mrb_http2_cache_entry *));
+  if (cache->buckets == NULL) {
+    free(cache);
+    return NULL;
+  }
+  if (dir != NULL && nslots > 0) {
+    cache->dir = strdup(dir);
+    cache->nslots = nslots;
+    if (mrb_http2_cache_index_open(cache) != 0) {
+      fprintf(stderr, "upstream cache: %s: %s, disk tier disabled\n", dir, strerror(errno));
+      free(cache->dir);
+      cache->dir = NULL;
+    }
+  }
+  return cache;
+}
+
+void mrb_http2_cache_free(mrb_http2_cache *cache)
+{
+  while (cache->head != NULL) {
+    mrb_http2_cache_remove(cache, cache->head);
+  }
+  if (cache->dir != NULL) {
+    munmap(cache->index, sizeof(mrb_http2_cache_slot) * cache->nslots);
+    close(cache->index_fd);
+    free(cache->dir);
+  }
+  free(cache->buckets);
+  free(cache);
+}
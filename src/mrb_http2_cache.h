@@ -0,0 +1,112 @@
+/*
+// mrb_http2_cache.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_CACHE_H
+#define MRB_HTTP2_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <nghttp2/nghttp2.h>
+
+typedef enum {
+  // servable as is
+  MRB_HTTP2_CACHE_FRESH,
+  // servable while revalidated in the background
+  MRB_HTTP2_CACHE_STALE_WHILE_REVALIDATE,
+  // must be revalidated, servable only when upstream fails
+  MRB_HTTP2_CACHE_STALE_IF_ERROR,
+  // must be revalidated
+  MRB_HTTP2_CACHE_STALE
+} mrb_http2_cache_state;
+
+typedef struct mrb_http2_cache_entry {
+  // hash chain and lru list of the memory tier
+  struct mrb_http2_cache_entry *hnext;
+  struct mrb_http2_cache_entry *prev, *next;
+
+  uint64_t hash;
+  char *key;
+  int status;
+
+  // response headers, and the request headers named by vary of the
+  // response, both "name\0value\0" pairs
+  char *headers;
+  size_t headers_len;
+  char *vary;
+  size_t vary_len;
+
+  char *body;
+  size_t body_len;
+  size_t body_cap;
+
+  // response time corrected by age, and the end of the freshness lifetime
+  time_t stored;
+  time_t fresh_until;
+
+  // sec
+  unsigned int stale_while_revalidate;
+  unsigned int stale_if_error;
+
+  unsigned int refs;
+  unsigned int must_revalidate : 1;
+
+  // in the memory tier
+  unsigned int cached : 1;
+
+  // a background revalidation is in flight
+  unsigned int revalidating : 1;
+
+  // the body went over max_object_size while filled
+  unsigned int too_large : 1;
+} mrb_http2_cache_entry;
+
+// a slot of the disk index shared by workers through mmap, direct mapped
+// by the key hash, the content file of a replaced hash is unlinked, and
+// workers lock the slot by a record lock of index_fd
+typedef struct {
+  uint64_t hash;
+  int64_t fresh_until;
+  uint64_t size;
+} mrb_http2_cache_slot;
+
+typedef struct {
+  mrb_http2_cache_entry **buckets;
+  unsigned int nbuckets;
+
+  // lru list, most recently used at head
+  mrb_http2_cache_entry *head, *tail;
+
+  size_t size;
+  size_t max_size;
+  size_t max_object_size;
+
+  // disk tier, disabled when dir is NULL
+  char *dir;
+  mrb_http2_cache_slot *index;
+  int index_fd;
+  unsigned int nslots;
+  unsigned int tmpseq;
+} mrb_http2_cache;
+
+mrb_http2_cache *mrb_http2_cache_new(size_t max_size, size_t max_object_size, const char *dir, unsigned int nslots);
+void mrb_http2_cache_free(mrb_http2_cache *cache);
+
+mrb_http2_cache_entry *mrb_http2_cache_lookup(mrb_http2_cache *cache, const char *key, const nghttp2_nv *reqhdr,
+                                              size_t reqhdrlen);
+mrb_http2_cache_state mrb_http2_cache_entry_state(const mrb_http2_cache_entry *entry, time_t now);
+const char *mrb_http2_cache_entry_header(const mrb_http2_cache_entry *entry, const char *name);
+size_t mrb_http2_cache_pair_next(const char *buf, size_t pos, const char **name, const char **value);
+
+mrb_http2_cache_entry *mrb_http2_cache_entry_new(mrb_http2_cache *cache, const char *key, int status,
+                                                 const nghttp2_nv *reshdrs, size_t reshdrslen,
+                                                 const nghttp2_nv *reqhdr, size_t reqhdrlen, time_t now);
+int mrb_http2_cache_entry_append(mrb_http2_cache *cache, mrb_http2_cache_entry *entry, const void *data, size_t len);
+void mrb_http2_cache_entry_update(mrb_http2_cache *cache, mrb_http2_cache_entry *entry, const nghttp2_nv *reshdrs,
+                                  size_t reshdrslen, time_t now);
+void mrb_http2_cache_entry_unref(mrb_http2_cache_entry *entry);
+void mrb_http2_cache_store(mrb_http2_cache *cache, mrb_http2_cache_entry *entry);
+
+#endif
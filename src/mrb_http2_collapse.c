@@ -0,0 +1,197 @@
+/*
+// mrb_http2_collapse.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_collapse.h"
+
+#define MRB_HTTP2_COLLAPSE_BUCKETS 1024
+
+mrb_http2_collapse *mrb_http2_collapse_new(struct event_base *evbase, event_callback_fn settle_cb, void *arg)
+{
+  mrb_http2_collapse *collapse;
+
+  collapse = (mrb_http2_collapse *)calloc(1, sizeof(mrb_http2_collapse));
+  if (collapse == NULL) {
+    return NULL;
+  }
+  collapse->buckets = (mrb_http2_collapse_flight **)calloc(MRB_HTTP2_COLLAPSE_BUCKETS, sizeof(*collapse->buckets));
+  if (collapse->buckets == NULL) {
+    free(collapse);
+    return NULL;
+  }
+  collapse->nbuckets = MRB_HTTP2_COLLAPSE_BUCKETS;
+  collapse->evbase = evbase;
+  collapse->settle_cb = settle_cb;
+  collapse->arg = arg;
+  return collapse;
+}
+
+void mrb_http2_collapse_free(mrb_http2_collapse *collapse)
+{
+  unsigned int i;
+
+  for (i = 0; i < collapse->nbuckets; i++) {
+    while (collapse->buckets[i] != NULL) {
+      mrb_http2_collapse_flight_free(collapse->buckets[i]);
+    }
+  }
+  free(collapse->buckets);
+  free(collapse);
+}
+
+// a joinable flight of the key
+mrb_http2_collapse_flight *mrb_http2_collapse_find(mrb_http2_collapse *collapse, const char *key)
+{
+  uint64_t hash = mrb_http2_hash(key);
+  mrb_http2_collapse_flight *flight;
+
+  for (flight = collapse->buckets[hash % collapse->nbuckets]; flight != NULL; flight = flight->hnext) {
+    if (flight->hash == hash && strcmp(flight->key, key) == 0) {
+      return flight;
+    }
+  }
+  return NULL;
+}
+
+mrb_http2_collapse_flight *mrb_http2_collapse_start(mrb_http2_collapse *collapse, const char *key, void *leader)
+{
+  mrb_http2_collapse_flight *flight;
+  mrb_http2_collapse_flight **bucket;
+
+  flight = (mrb_http2_collapse_flight *)calloc(1, sizeof(mrb_http2_collapse_flight));
+  if (flight == NULL) {
+    return NULL;
+  }
+  flight->key = strdup(key);
+  flight->ev = event_new(collapse->evbase, -1, 0, collapse->settle_cb, flight);
+  if (flight->key == NULL || flight->ev == NULL) {
+    if (flight->ev != NULL) {
+      event_free(flight->ev);
+    }
+    free(flight->key);
+    free(flight);
+    return NULL;
+  }
+  flight->collapse = collapse;
+  flight->hash = mrb_http2_hash(key);
+  flight->leader = leader;
+  flight->waiters.prev = flight->waiters.next = &flight->waiters;
+  flight->waiters.flight = flight;
+  flight->followers.prev = flight->followers.next = &flight->followers;
+  flight->followers.flight = flight;
+
+  bucket = &collapse->buckets[flight->hash % collapse->nbuckets];
+  flight->hnext = *bucket;
+  *bucket = flight;
+  flight->joinable = 1;
+  return flight;
+}
+
+// no more streams join the flight
+void mrb_http2_collapse_close(mrb_http2_collapse_flight *flight)
+{
+  mrb_http2_collapse_flight **p;
+
+  if (!flight->joinable) {
+    return;
+  }
+  for (p = &flight->collapse->buckets[flight->hash % flight->collapse->nbuckets]; *p != NULL; p = &(*p)->hnext) {
+    if (*p == flight) {
+      *p = flight->hnext;
+      break;
+    }
+  }
+  flight->joinable = 0;
+}
+
+// the leader is done with the flight, the streams left are settled by
+// settle_cb on the next loop iteration, out of the callbacks of the leader
+void mrb_http2_collapse_settle(mrb_http2_collapse_flight *flight)
+{
+  mrb_http2_collapse_close(flight);
+  flight->leader = NULL;
+  event_active(flight->ev, 0, 0);
+}
+
+void mrb_http2_collapse_flight_free(mrb_http2_collapse_flight *flight)
+{
+  mrb_http2_collapse_close(flight);
+  while (mrb_http2_collapse_pop(&flight->waiters) != NULL)
+    ;
+  while (mrb_http2_collapse_pop(&flight->followers) != NULL)
+    ;
+  event_free(flight->ev);
+  free(flight->key);
+  free(flight);
+}
+
+void mrb_http2_collapse_link(mrb_http2_collapse_waiter *head, mrb_http2_collapse_waiter *waiter)
+{
+  waiter->prev = head->prev;
+  waiter->next = head;
+  head->prev->next = waiter;
+  head->prev = waiter;
+  waiter->flight = head->flight;
+}
+
+void mrb_http2_collapse_unlink(mrb_http2_collapse_waiter *waiter)
+{
+  if (waiter->flight == NULL) {
+    return;
+  }
+  waiter->prev->next = waiter->next;
+  waiter->next->prev = waiter->prev;
+  waiter->prev = waiter->next = NULL;
+  waiter->flight = NULL;
+}
+
+// unlink the first stream of the list, NULL when empty
+mrb_http2_collapse_waiter *mrb_http2_collapse_pop(mrb_http2_collapse_waiter *head)
+{
+  mrb_http2_collapse_waiter *waiter = head->next;
+
+  if (waiter == head) {
+    return NULL;
+  }
+  mrb_http2_collapse_unlink(waiter);
+  return waiter;
+}
+
+mrb_http2_collapse_chunk *mrb_http2_collapse_chunk_new(const void *data, size_t len)
+{
+  mrb_http2_collapse_chunk *chunk;
+
+  chunk = (mrb_http2_collapse_chunk *)malloc(sizeof(mrb_http2_collapse_chunk) + len);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  chunk->refs = 1;
+  chunk->len = len;
+  memcpy(chunk->data, data, len);
+  return chunk;
+}
+
+static void mrb_http2_collapse_chunk_cleanup(const void *data, size_t datalen, void *extra)
+{
+  mrb_http2_collapse_chunk_unref((mrb_http2_collapse_chunk *)extra);
+}
+
+// reference the chunk from buf, released when buf drained it
+int mrb_http2_collapse_chunk_add(struct evbuffer *buf, mrb_http2_collapse_chunk *chunk)
+{
+  chunk->refs++;
+  if (evbuffer_add_reference(buf, chunk->data, chunk->len, mrb_http2_collapse_chunk_cleanup, chunk) != 0) {
+    chunk->refs--;
+    return -1;
+  }
+  return 0;
+}
+
+void mrb_http2_collapse_chunk_unref(mrb_http2_collapse_chunk *chunk)
+{
+  if (--chunk->refs == 0) {
+    free(chunk);
+  }
+}
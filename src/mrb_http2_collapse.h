@@ -0,0 +1,86 @@
+/*
+// mrb_http2_collapse.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_COLLAPSE_H
+#define MRB_HTTP2_COLLAPSE_H
+
+#include <stdint.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+struct mrb_http2_collapse_flight;
+
+// a stream attached to a flight, embedded in the stream
+typedef struct mrb_http2_collapse_waiter {
+  struct mrb_http2_collapse_waiter *prev, *next;
+
+  // NULL when not linked
+  struct mrb_http2_collapse_flight *flight;
+  void *data;
+} mrb_http2_collapse_waiter;
+
+// an upstream request in flight fetched by the leader stream for the
+// streams of the same key
+typedef struct mrb_http2_collapse_flight {
+  struct mrb_http2_collapse_flight *hnext;
+  struct mrb_http2_collapse *collapse;
+  uint64_t hash;
+  char *key;
+
+  // NULL after the leader finished or was gone
+  void *leader;
+
+  // streams waiting for the response headers of the leader, and streams
+  // following its response body, both list heads
+  mrb_http2_collapse_waiter waiters;
+  mrb_http2_collapse_waiter followers;
+
+  // settles the streams left on the loop after the leader finished
+  struct event *ev;
+
+  // in the table, new streams join until the response headers arrived
+  unsigned int joinable : 1;
+
+  // the leader received the whole response, or no response at all
+  unsigned int complete : 1;
+  unsigned int failed : 1;
+} mrb_http2_collapse_flight;
+
+typedef struct mrb_http2_collapse {
+  struct event_base *evbase;
+  mrb_http2_collapse_flight **buckets;
+  unsigned int nbuckets;
+
+  // called with the flight by ev
+  event_callback_fn settle_cb;
+  void *arg;
+} mrb_http2_collapse;
+
+// a part of the response body shared by the buffers of the followers
+typedef struct {
+  unsigned int refs;
+  size_t len;
+  char data[];
+} mrb_http2_collapse_chunk;
+
+mrb_http2_collapse *mrb_http2_collapse_new(struct event_base *evbase, event_callback_fn settle_cb, void *arg);
+void mrb_http2_collapse_free(mrb_http2_collapse *collapse);
+
+mrb_http2_collapse_flight *mrb_http2_collapse_find(mrb_http2_collapse *collapse, const char *key);
+mrb_http2_collapse_flight *mrb_http2_collapse_start(mrb_http2_collapse *collapse, const char *key, void *leader);
+void mrb_http2_collapse_close(mrb_http2_collapse_flight *flight);
+void mrb_http2_collapse_settle(mrb_http2_collapse_flight *flight);
+void mrb_http2_collapse_flight_free(mrb_http2_collapse_flight *flight);
+
+void mrb_http2_collapse_link(mrb_http2_collapse_waiter *head, mrb_http2_collapse_waiter *waiter);
+void mrb_http2_collapse_unlink(mrb_http2_collapse_waiter *waiter);
+mrb_http2_collapse_waiter *mrb_http2_collapse_pop(mrb_http2_collapse_waiter *head);
+
+mrb_http2_collapse_chunk *mrb_http2_collapse_chunk_new(const void *data, size_t len);
+int mrb_http2_collapse_chunk_add(struct evbuffer *buf, mrb_http2_collapse_chunk *chunk);
+void mrb_http2_collapse_chunk_unref(mrb_http2_collapse_chunk *chunk);
+
+#endif
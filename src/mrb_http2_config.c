@@ -5,6 +5,7 @@
 */
 #include "mrb_http2.h"
 #include "mrb_http2_config.h"
+#include "mrb_http2_resolver.h"
 
 #define MRB_HTTP2_CONFIG_LIT(lit) lit
 #define MRB_HTTP2_CONFIG_ENABLED 1
@@ -14,20 +15,6 @@
 #define mrb_http2_config_get_obj_cstr(mrb, args, str)                                                                  \
   mrb_hash_get(mrb, args, mrb_symbol_value(mrb_intern_cstr(mrb, str)))
 
-static mruby_cb_list *mruby_cb_list_init(mrb_state *mrb)
-{
-  mruby_cb_list *list = (mruby_cb_list *)mrb_malloc(mrb, sizeof(mruby_cb_list));
-  memset(list, 0, sizeof(mruby_cb_list));
-
-  list->map_to_storage_cb = NULL;
-  list->access_checker_cb = NULL;
-  list->fixups_cb = NULL;
-  list->content_cb = NULL;
-  list->logging_cb = NULL;
-
-  return list;
-}
-
 static unsigned int mrb_http2_config_get_worker(mrb_state *mrb, mrb_value args, mrb_value w)
 {
   int worker;
@@ -100,6 +87,122 @@ static void set_config_port(mrb_state *mrb, mrb_value args, mrb_http2_config_t *
   config->service = mrb_str_to_cstr(mrb, mrb_fixnum_to_str(mrb, val, 10));
 }
 
+static mrb_http2_upstream_lb_policy mrb_http2_config_get_lb_policy(mrb_state *mrb, mrb_value p)
+{
+  const char *policy;
+
+  if (mrb_nil_p(p)) {
+    return MRB_HTTP2_UPSTREAM_LB_ROUND_ROBIN;
+  }
+  policy = mrb_str_to_cstr(mrb, mrb_obj_as_string(mrb, p));
+  if (strcmp(policy, "round_robin") == 0) {
+    return MRB_HTTP2_UPSTREAM_LB_ROUND_ROBIN;
+  } else if (strcmp(policy, "weighted") == 0) {
+    return MRB_HTTP2_UPSTREAM_LB_WEIGHTED;
+  } else if (strcmp(policy, "least_conn") == 0) {
+    return MRB_HTTP2_UPSTREAM_LB_LEAST_CONN;
+  } else if (strcmp(policy, "ewma") == 0) {
+    return MRB_HTTP2_UPSTREAM_LB_EWMA;
+  }
+  mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstream group policy: %S", p);
+
+  return MRB_HTTP2_UPSTREAM_LB_ROUND_ROBIN;
+}
+
+static unsigned int mrb_http2_config_get_uint(mrb_state *mrb, mrb_value h, const char *key, unsigned int def)
+{
+  mrb_value v = mrb_http2_config_get_obj_cstr(mrb, h, key);
+
+  if (!mrb_nil_p(v) && mrb_type(v) == MRB_TT_FIXNUM && mrb_fixnum(v) >= 0) {
+    return (unsigned int)mrb_fixnum(v);
+  }
+  return def;
+}
+
+// :upstream_groups => {
+//   "app" => {
+//     :policy => "round_robin" | "weighted" | "least_conn" | "ewma",
+//     :servers => [{:host => "127.0.0.1", :port => 8081, :weight => 1}, ...],
+//                 ({:host => "unix:/run/app.sock"} for a unix domain socket,
+//                  HTTP/2 only and without health check before libevent 2.2)
+//     :health_check_path => "/health", :health_check_interval => 5000,
+//     :max_fails => 3, :fail_timeout => 10000,
+//   },
+// }
+static void set_config_upstream_groups(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  mrb_value names;
+  mrb_int i, j;
+
+  if (mrb_nil_p(val)) {
+    return;
+  }
+  if (mrb_type(val) != MRB_TT_HASH) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "upstream_groups MUST be hash");
+  }
+
+  names = mrb_hash_keys(mrb, val);
+  config->upstream_groups_len = RARRAY_LEN(names);
+  config->upstream_groups = (mrb_http2_upstream_group_conf *)mrb_malloc(
+      mrb, sizeof(mrb_http2_upstream_group_conf) * config->upstream_groups_len);
+  memset(config->upstream_groups, 0, sizeof(mrb_http2_upstream_group_conf) * config->upstream_groups_len);
+
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    mrb_http2_upstream_group_conf *g = &config->upstream_groups[i];
+    mrb_value name = mrb_ary_ref(mrb, names, i);
+    mrb_value h = mrb_hash_get(mrb, val, name);
+    mrb_value servers, path;
+
+    if (mrb_type(h) != MRB_TT_HASH) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstream group: %S", name);
+    }
+    g->name = strdup(mrb_str_to_cstr(mrb, mrb_obj_as_string(mrb, name)));
+    g->policy = mrb_http2_config_get_lb_policy(mrb, mrb_http2_config_get_obj(mrb, h, "policy"));
+    g->health_check_interval = mrb_http2_config_get_uint(mrb, h, "health_check_interval", 5000);
+    g->max_fails = mrb_http2_config_get_uint(mrb, h, "max_fails", 3);
+    g->fail_timeout = mrb_http2_config_get_uint(mrb, h, "fail_timeout", 10000);
+    path = mrb_http2_config_get_obj(mrb, h, "health_check_path");
+    if (!mrb_nil_p(path)) {
+      g->health_check_path = strdup(mrb_str_to_cstr(mrb, path));
+    }
+
+    servers = mrb_http2_config_get_obj(mrb, h, "servers");
+    if (mrb_type(servers) != MRB_TT_ARRAY || RARRAY_LEN(servers) == 0) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream group %S MUST have servers", name);
+    }
+    g->nservers = RARRAY_LEN(servers);
+    g->servers =
+        (mrb_http2_upstream_server_conf *)mrb_malloc(mrb, sizeof(mrb_http2_upstream_server_conf) * g->nservers);
+    for (j = 0; j < RARRAY_LEN(servers); j++) {
+      mrb_value s = mrb_ary_ref(mrb, servers, j);
+      mrb_value host, scheme;
+
+      if (mrb_type(s) != MRB_TT_HASH) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid server of upstream group %S", name);
+      }
+      host = mrb_http2_config_get_obj(mrb, s, "host");
+      if (mrb_nil_p(host)) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "server of upstream group %S MUST have host", name);
+      }
+      g->servers[j].host = strdup(mrb_str_to_cstr(mrb, host));
+#ifndef MRB_HTTP2_RESOLVER_EVHTTP_UNIX
+      // health checks are HTTP/1.1 requests by evhttp
+      if (g->health_check_path != NULL && mrb_http2_resolver_unix_path(g->servers[j].host) != NULL) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream group %S: health check of a unix domain socket needs libevent 2.2",
+                   name);
+      }
+#endif
+      scheme = mrb_http2_config_get_obj(mrb, s, "scheme");
+      g->servers[j].tls = !mrb_nil_p(scheme) && strcmp(mrb_str_to_cstr(mrb, scheme), "https") == 0;
+      g->servers[j].port = mrb_http2_config_get_uint(mrb, s, "port", g->servers[j].tls ? 443 : 80);
+      g->servers[j].weight = mrb_http2_config_get_uint(mrb, s, "weight", 1);
+      if (g->servers[j].weight == 0) {
+        g->servers[j].weight = 1;
+      }
+    }
+  }
+}
+
 static void set_config_worker(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
 {
   config->worker = mrb_http2_config_get_worker(mrb, args, val);
@@ -181,16 +284,65 @@ static void config_defualt_value(mrb_state *mrb, mrb_http2_config_t *config)
   config->tcp_nopush = MRB_HTTP2_CONFIG_DISABLED;
   config->server_status = MRB_HTTP2_CONFIG_DISABLED;
   config->upstream = MRB_HTTP2_CONFIG_DISABLED;
+  config->idle_gc = MRB_HTTP2_CONFIG_DISABLED;
+  config->async_handler = MRB_HTTP2_CONFIG_DISABLED;
+  config->upstream_cache = MRB_HTTP2_CONFIG_DISABLED;
+  config->upstream_collapse = MRB_HTTP2_CONFIG_DISABLED;
+  config->upstream_request_buffering = MRB_HTTP2_CONFIG_ENABLED;
+  config->upstream_tls_verify = MRB_HTTP2_CONFIG_ENABLED;
+  config->upstream_tls_session_cache = MRB_HTTP2_CONFIG_ENABLED;
+  config->slab_allocator = MRB_HTTP2_CONFIG_ENABLED;
+  config->mruby_slab_allocator = MRB_HTTP2_CONFIG_DISABLED;
+  config->window_autotune = MRB_HTTP2_CONFIG_DISABLED;
+  config->extensible_priorities = MRB_HTTP2_CONFIG_ENABLED;
 
   config->server_host = MRB_HTTP2_CONFIG_LIT("0.0.0.0");
   config->server_name = MRB_HTTP2_CONFIG_LIT(MRUBY_HTTP2_SERVER);
   config->document_root = MRB_HTTP2_CONFIG_LIT("./");
   config->run_user = NULL;
   config->dh_params_file = NULL;
+  config->handler_thread_preload = NULL;
+  config->upstream_cache_dir = NULL;
+  config->dns_nameservers = NULL;
+  config->upstream_tls_ca_file = NULL;
 
   config->rlimit_nofile = 0;
+  config->tcp_notsent_lowat = 0;
+  config->handshake_timeout = 10000;
+  config->idle_timeout = 60000;
+  config->header_timeout = 30000;
+  config->write_timeout = 60000;
+  config->max_connections = 0;
+  config->max_concurrent_streams = 100;
+  config->initial_window_size = (1 << 18) - 1;
+  config->connection_window_size = 0;
+  config->max_frame_size = 1 << 14;
+  config->header_table_size = 1 << 12;
+  config->max_header_list_size = 0;
+  config->window_max_size = 1 << 24;
   config->write_packet_buffer_expand_size = 0;
   config->write_packet_buffer_limit_size = 0;
+  config->idle_gc_full_timeout = 1000;
+  config->handler_timeout = 0;
+  config->handler_instruction_limit = 0;
+  config->handler_threads = 0;
+  config->upstream_keepalive_max_idle = 16;
+  config->upstream_max_connections = 0;
+  config->upstream_keepalive_timeout = 60000;
+  config->upstream_h2_max_connections = 2;
+  config->upstream_cache_memory_size = 1 << 26;
+  config->upstream_cache_max_object_size = 1 << 20;
+  config->upstream_cache_disk_slots = 1 << 16;
+  config->dns_positive_ttl = 30;
+  config->dns_negative_ttl = 5;
+  config->upstream_connect_timeout = 5000;
+  config->upstream_first_byte_timeout = 60000;
+  config->upstream_retries = 1;
+  config->upstream_retry_budget = 20;
+  config->upstream_breaker_threshold = 50;
+  config->upstream_breaker_min_requests = 20;
+  config->upstream_breaker_window = 10000;
+  config->upstream_breaker_open_time = 5000;
 }
 
 mrb_http2_config_t *mrb_http2_s_config_init(mrb_state *mrb, mrb_value args)
@@ -208,25 +360,117 @@ mrb_http2_config_t *mrb_http2_s_config_init(mrb_state *mrb, mrb_value args)
   mrb_http2_config_define_flag(mrb, args, &config->tcp_nopush, NULL, "tcp_nopush");
   mrb_http2_config_define_flag(mrb, args, &config->server_status, NULL, "server_status");
   mrb_http2_config_define_flag(mrb, args, &config->upstream, NULL, "upstream");
+  mrb_http2_config_define_flag(mrb, args, &config->idle_gc, NULL, "idle_gc");
+  mrb_http2_config_define_flag(mrb, args, &config->async_handler, NULL, "async_handler");
+  mrb_http2_config_define_flag(mrb, args, &config->upstream_cache, NULL, "upstream_cache");
+  mrb_http2_config_define_flag(mrb, args, &config->upstream_collapse, NULL, "upstream_collapse");
+  mrb_http2_config_define_flag(mrb, args, &config->upstream_request_buffering, NULL, "upstream_request_buffering");
+  mrb_http2_config_define_flag(mrb, args, &config->upstream_tls_verify, NULL, "upstream_tls_verify");
+  mrb_http2_config_define_flag(mrb, args, &config->upstream_tls_session_cache, NULL, "upstream_tls_session_cache");
+  mrb_http2_config_define_flag(mrb, args, &config->slab_allocator, NULL, "slab_allocator");
+  mrb_http2_config_define_flag(mrb, args, &config->mruby_slab_allocator, NULL, "mruby_slab_allocator");
+  mrb_http2_config_define_flag(mrb, args, &config->window_autotune, NULL, "window_autotune");
+  mrb_http2_config_define_flag(mrb, args, &config->extensible_priorities, NULL, "extensible_priorities");
 
   mrb_http2_config_define_cstr(mrb, args, &config->server_host, NULL, "server_host");
   mrb_http2_config_define_cstr(mrb, args, &config->server_name, NULL, "server_name");
   mrb_http2_config_define_cstr(mrb, args, &config->document_root, NULL, "document_root");
   mrb_http2_config_define_cstr(mrb, args, &config->run_user, NULL, "run_user");
   mrb_http2_config_define_cstr(mrb, args, &config->dh_params_file, NULL, "dh_params_file");
+  mrb_http2_config_define_cstr(mrb, args, &config->handler_thread_preload, NULL, "handler_thread_preload");
+  mrb_http2_config_define_cstr(mrb, args, &config->upstream_cache_dir, NULL, "upstream_cache_dir");
+  mrb_http2_config_define_cstr(mrb, args, &config->dns_nameservers, NULL, "dns_nameservers");
+  mrb_http2_config_define_cstr(mrb, args, &config->upstream_tls_ca_file, NULL, "upstream_tls_ca_file");
 
   mrb_http2_config_define_fixnum(mrb, args, &config->rlimit_nofile, NULL, "rlimit_nofile");
+  mrb_http2_config_define_fixnum(mrb, args, &config->tcp_notsent_lowat, NULL, "tcp_notsent_lowat");
+  mrb_http2_config_define_fixnum(mrb, args, &config->handshake_timeout, NULL, "handshake_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->idle_timeout, NULL, "idle_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->header_timeout, NULL, "header_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->write_timeout, NULL, "write_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->max_connections, NULL, "max_connections");
+  mrb_http2_config_define_fixnum(mrb, args, &config->max_concurrent_streams, NULL, "max_concurrent_streams");
+  mrb_http2_config_define_fixnum(mrb, args, &config->initial_window_size, NULL, "initial_window_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->connection_window_size, NULL, "connection_window_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->max_frame_size, NULL, "max_frame_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->header_table_size, NULL, "header_table_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->max_header_list_size, NULL, "max_header_list_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->window_max_size, NULL, "window_max_size");
   mrb_http2_config_define_fixnum(mrb, args, &config->write_packet_buffer_expand_size, NULL,
                                  "write_packet_buffer_expand_size");
   mrb_http2_config_define_fixnum(mrb, args, &config->write_packet_buffer_limit_size, NULL,
                                  "write_packet_buffer_limit_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->idle_gc_full_timeout, NULL, "idle_gc_full_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->handler_timeout, NULL, "handler_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->handler_instruction_limit, NULL, "handler_instruction_limit");
+  mrb_http2_config_define_fixnum(mrb, args, &config->handler_threads, NULL, "handler_threads");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_keepalive_max_idle, NULL,
+                                 "upstream_keepalive_max_idle");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_max_connections, NULL, "upstream_max_connections");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_keepalive_timeout, NULL,
+                                 "upstream_keepalive_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_h2_max_connections, NULL,
+                                 "upstream_h2_max_connections");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_cache_memory_size, NULL,
+                                 "upstream_cache_memory_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_cache_max_object_size, NULL,
+                                 "upstream_cache_max_object_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_cache_disk_slots, NULL,
+                                 "upstream_cache_disk_slots");
+  mrb_http2_config_define_fixnum(mrb, args, &config->dns_positive_ttl, NULL, "dns_positive_ttl");
+  mrb_http2_config_define_fixnum(mrb, args, &config->dns_negative_ttl, NULL, "dns_negative_ttl");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_connect_timeout, NULL, "upstream_connect_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_first_byte_timeout, NULL,
+                                 "upstream_first_byte_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_retries, NULL, "upstream_retries");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_retry_budget, NULL, "upstream_retry_budget");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_breaker_threshold, NULL,
+                                 "upstream_breaker_threshold");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_breaker_min_requests, NULL,
+                                 "upstream_breaker_min_requests");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_breaker_window, NULL, "upstream_breaker_window");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_breaker_open_time, NULL,
+                                 "upstream_breaker_open_time");
 
   mrb_http2_config_define(mrb, args, config, set_config_port, "port");
   mrb_http2_config_define(mrb, args, config, set_config_worker, "worker");
   mrb_http2_config_define(mrb, args, config, set_config_key, "key");
   mrb_http2_config_define(mrb, args, config, set_config_crt, "crt");
+  mrb_http2_config_define(mrb, args, config, set_config_upstream_groups, "upstream_groups");
 
-  config->cb_list = mruby_cb_list_init(mrb);
+  if (config->max_frame_size < MRB_HTTP2_CONFIG_MAX_FRAME_SIZE_MIN ||
+      config->max_frame_size > MRB_HTTP2_CONFIG_MAX_FRAME_SIZE_MAX) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "max_frame_size MUST be 16384..16777215");
+  }
+  if (config->max_concurrent_streams < 0 || config->header_table_size < 0 || config->max_header_list_size < 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "max_concurrent_streams, header_table_size and max_header_list_size MUST NOT "
+                                    "be negative");
+  }
+  if (config->initial_window_size < 0 || config->initial_window_size > NGHTTP2_MAX_WINDOW_SIZE ||
+      config->connection_window_size < 0 || config->connection_window_size > NGHTTP2_MAX_WINDOW_SIZE ||
+      config->window_max_size < 0 || config->window_max_size > NGHTTP2_MAX_WINDOW_SIZE) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "window sizes MUST be 0..2147483647");
+  }
+  if (config->handshake_timeout < 0 || config->idle_timeout < 0 || config->header_timeout < 0 ||
+      config->write_timeout < 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "handshake_timeout, idle_timeout, header_timeout and write_timeout MUST NOT "
+                                    "be negative");
+  }
+  if (config->dns_positive_ttl < 0 || config->dns_negative_ttl < 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "dns_positive_ttl and dns_negative_ttl MUST NOT be negative");
+  }
 
   return config;
 }
+
+int mrb_http2_config_upstream_group_index(mrb_http2_config_t *config, const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < config->upstream_groups_len; i++) {
+    if (strcmp(config->upstream_groups[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
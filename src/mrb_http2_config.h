@@ -8,6 +8,7 @@
 #define MRB_HTTP2_CONFIG_H
 
 #include "mrb_http2.h"
+#include "mrb_http2_upstream.h"
 
 #define MRB_HTTP2_WORKER_MAX 1024
 
@@ -15,26 +16,6 @@ typedef unsigned int mrb_http2_config_flag;
 typedef const char mrb_http2_config_cstr;
 typedef mrb_int mrb_http2_config_fixnum;
 
-// callback block symbol literal list
-typedef struct {
-
-  // callback block at a phase of mapping uri to filename
-  const char *map_to_storage_cb;
-
-  // callback block at a phase of access checker
-  const char *access_checker_cb;
-
-  // callback block at a phase of fixups
-  const char *fixups_cb;
-
-  // callback block at a phase of creating content
-  const char *content_cb;
-
-  // callback block after send response
-  const char *logging_cb;
-
-} mruby_cb_list;
-
 // mruby-http2 config parameter getting from HTTP2::Server#init
 typedef struct {
 
@@ -46,6 +27,13 @@ typedef struct {
   mrb_http2_config_flag server_status;
   mrb_http2_config_flag upstream;
 
+  // drive mruby gc from the worker event loop while it is idle
+  mrb_http2_config_flag idle_gc;
+
+  // run set_content_cb blocks in a fiber, so async_* methods can wait on
+  // the event loop without blocking the worker
+  mrb_http2_config_flag async_handler;
+
   // connection record option
   // default enabled and can use connection methods
   mrb_http2_config_flag connection_record;
@@ -62,8 +50,6 @@ typedef struct {
   // server listen hostname
   mrb_http2_config_cstr *server_host;
 
-  mruby_cb_list *cb_list;
-
   // the number of worker process, need SO_REUSEPORT linux kernel 3.9 or later
   unsigned int worker;
 
@@ -76,9 +62,129 @@ typedef struct {
   mrb_http2_config_fixnum write_packet_buffer_expand_size;
   mrb_http2_config_fixnum write_packet_buffer_limit_size;
 
+  // bytes not sent yet the kernel keeps per client socket by
+  // TCP_NOTSENT_LOWAT, and the frames buffered by the server are sized to
+  // the congestion window of TCP_INFO, 0 or less buffers 64KB of frames
+  mrb_http2_config_fixnum tcp_notsent_lowat;
+
+  // msec a session may wait for the TLS handshake, for a request while it
+  // has no stream, for the rest of request headers, and for its output to
+  // be written, 0 disables each
+  mrb_http2_config_fixnum handshake_timeout;
+  mrb_http2_config_fixnum idle_timeout;
+  mrb_http2_config_fixnum header_timeout;
+  mrb_http2_config_fixnum write_timeout;
+
+  // sessions per worker before accepting pauses, 0 means unlimited
+  mrb_http2_config_fixnum max_connections;
+
+  // nghttp2 sessions, and the mrb_state of scripts not shared and of the
+  // handler threads, allocate from the size-class slabs of their thread
+  mrb_http2_config_flag slab_allocator;
+  mrb_http2_config_flag mruby_slab_allocator;
+
+  // SETTINGS sent to clients, max_header_list_size 0 isn't sent, and the
+  // connection window enlarged from 65535 when larger
+  mrb_http2_config_fixnum max_concurrent_streams;
+  mrb_http2_config_fixnum initial_window_size;
+  mrb_http2_config_fixnum connection_window_size;
+  mrb_http2_config_fixnum max_frame_size;
+  mrb_http2_config_fixnum header_table_size;
+  mrb_http2_config_fixnum max_header_list_size;
+
+  // grow the receive windows up to window_max_size by the body consumed
+  // per round trip of the connection
+  mrb_http2_config_flag window_autotune;
+  mrb_http2_config_fixnum window_max_size;
+
+  // schedule responses by the priority header and PRIORITY_UPDATE of RFC
+  // 9218, static contents default to the urgency of their file type
+  mrb_http2_config_flag extensible_priorities;
+
+  // execution budget of Ruby handlers per request, 0 means unlimited
+  mrb_http2_config_fixnum handler_timeout;
+  mrb_http2_config_fixnum handler_instruction_limit;
+
+  // msec without requests before running full gc when idle_gc enabled
+  mrb_http2_config_fixnum idle_gc_full_timeout;
+
+  // the number of threads running mruby scripts off the event loop, 0 means
+  // scripts run on the event loop, and the script loaded into each thread
+  mrb_http2_config_fixnum handler_threads;
+  mrb_http2_config_cstr *handler_thread_preload;
+
+  // upstream connections per host:port kept by each worker, the max number
+  // of idle and all connections (0 means unlimited) and idle timeout msec
+  mrb_http2_config_fixnum upstream_keepalive_max_idle;
+  mrb_http2_config_fixnum upstream_max_connections;
+  mrb_http2_config_fixnum upstream_keepalive_timeout;
+
+  // connections per host:port of HTTP/2 upstreams (upstream_proto_major = 2),
+  // streams are multiplexed and a new one is opened only when all reached
+  // the concurrent streams limit, idle ones close by upstream_keepalive_timeout
+  mrb_http2_config_fixnum upstream_h2_max_connections;
+
+  // request bodies are received whole before the request phases, when
+  // disabled a request with a body runs map_to_storage and access_checker
+  // as its HEADERS arrive, and the body is streamed to an HTTP/2 upstream
+  mrb_http2_config_flag upstream_request_buffering;
+
+  // response cache of upstream_cache, the memory tier of each worker in
+  // bytes, the max size of a cached response, and the disk tier shared by
+  // workers in upstream_cache_dir (disabled when nil) indexed by slots
+  mrb_http2_config_flag upstream_cache;
+  mrb_http2_config_fixnum upstream_cache_memory_size;
+  mrb_http2_config_fixnum upstream_cache_max_object_size;
+  mrb_http2_config_cstr *upstream_cache_dir;
+  mrb_http2_config_fixnum upstream_cache_disk_slots;
+
+  // concurrent identical upstream requests of a worker share one fetch
+  mrb_http2_config_flag upstream_collapse;
+
+  // asynchronous resolver of upstream hosts, nameservers "ip[:port],..."
+  // or resolv.conf when nil, and sec to cache resolved and failed names
+  mrb_http2_config_cstr *dns_nameservers;
+  mrb_http2_config_fixnum dns_positive_ttl;
+  mrb_http2_config_fixnum dns_negative_ttl;
+
+  // msec to connect to upstream, and to its response headers since the
+  // request was sent, 0 disables them, upstream_timeout= is the idle one
+  mrb_http2_config_fixnum upstream_connect_timeout;
+  mrb_http2_config_fixnum upstream_first_byte_timeout;
+
+  // retries of idempotent requests which got no response, at most
+  // upstream_retry_budget percent of upstream requests of a worker
+  mrb_http2_config_fixnum upstream_retries;
+  mrb_http2_config_fixnum upstream_retry_budget;
+
+  // circuit of each upstream host:port opens for upstream_breaker_open_time
+  // msec when upstream_breaker_threshold percent of at least min_requests
+  // failed in the last two windows of msec, 0 threshold disables it
+  mrb_http2_config_fixnum upstream_breaker_threshold;
+  mrb_http2_config_fixnum upstream_breaker_min_requests;
+  mrb_http2_config_fixnum upstream_breaker_window;
+  mrb_http2_config_fixnum upstream_breaker_open_time;
+
+  // https upstreams are verified against upstream_tls_ca_file, or the
+  // default CA paths of openssl when nil, unless upstream_tls_verify false
+  mrb_http2_config_cstr *upstream_tls_ca_file;
+  mrb_http2_config_flag upstream_tls_verify;
+
+  // reconnect to an https upstream resuming its last TLS session
+  mrb_http2_config_flag upstream_tls_session_cache;
+
+  // upstream groups selected by upstream_group= instead of host and port
+  mrb_http2_upstream_group_conf *upstream_groups;
+  unsigned int upstream_groups_len;
+
 } mrb_http2_config_t;
 
+// SETTINGS_MAX_FRAME_SIZE allowed by RFC 7540
+#define MRB_HTTP2_CONFIG_MAX_FRAME_SIZE_MIN (1 << 14)
+#define MRB_HTTP2_CONFIG_MAX_FRAME_SIZE_MAX ((1 << 24) - 1)
+
 mrb_http2_config_t *mrb_http2_s_config_init(mrb_state *mrb, mrb_value args);
+int mrb_http2_config_upstream_group_index(mrb_http2_config_t *config, const char *name);
 
 // Configuration API
 void mrb_http2_config_define(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, void (*func_ptr)(),
@@ -5,13 +5,16 @@ void mrb_http2_request_rec_free(mrb_state *mrb, mrb_http2_request_rec *r)
 {
   TRACER;
   if (r->filename != NULL) {
-    mrb_free(mrb, r->filename);
+    free(r->filename);
     r->filename = NULL;
   }
 
   if (r->upstream != NULL) {
     free(r->upstream->host);
-    mrb_free(mrb, r->upstream);
+    free(r->upstream->uri);
+    free(r->upstream->unparsed_host);
+    free(r->upstream->cache_key);
+    free(r->upstream);
     r->upstream = NULL;
   }
 
@@ -23,6 +26,10 @@ void mrb_http2_request_rec_free(mrb_state *mrb, mrb_http2_request_rec *r)
   r->write_fd = -1;
   r->write_size = 0;
 
+  // the budget of the handlers is charged per request
+  r->handler_usec = 0;
+  r->handler_insns = 0;
+
   // for conn_rec_free when disconnected
   if (r->conn != NULL) {
     r->conn = NULL;
@@ -70,6 +77,48 @@ mrb_http2_request_rec *mrb_http2_request_rec_init(mrb_state *mrb)
   return r;
 }
 
+mrb_http2_request_rec *mrb_http2_request_rec_pool_get(mrb_state *mrb, mrb_http2_request_rec_pool *pool)
+{
+  if (pool->len == 0) {
+    return mrb_http2_request_rec_init(mrb);
+  }
+  return pool->recs[--pool->len];
+}
+
+// the record must not own write_large_buf any more
+void mrb_http2_request_rec_pool_put(mrb_state *mrb, mrb_http2_request_rec_pool *pool, mrb_http2_request_rec *r)
+{
+  mrb_http2_request_rec_free(mrb, r);
+
+  if (pool->len == MRB_HTTP2_REQUEST_REC_POOL_MAX) {
+    mrb_free(mrb, r);
+    return;
+  }
+
+  // keep the date caches, reset per request fields
+  r->uri = NULL;
+  r->percent_encode_uri = NULL;
+  r->unparsed_uri = NULL;
+  r->args = NULL;
+  r->method = NULL;
+  r->scheme = NULL;
+  r->authority = NULL;
+  r->request_body = NULL;
+  r->request_body_len = 0;
+  r->finfo = NULL;
+  r->phase = MRB_HTTP2_SERVER_INIT_REQUEST;
+  r->response_type = MRB_HTTP2_RESPONSE_TYPE_NONE;
+  r->write_large_buf = NULL;
+  pool->recs[pool->len++] = r;
+}
+
+void mrb_http2_request_rec_pool_free(mrb_state *mrb, mrb_http2_request_rec_pool *pool)
+{
+  while (pool->len > 0) {
+    mrb_free(mrb, pool->recs[--pool->len]);
+  }
+}
+
 /*
  *
  * Request methods
@@ -25,7 +25,8 @@ typedef enum mrb_http2_server_phase {
   MRB_HTTP2_SERVER_ACCESS_CHECKER,
   MRB_HTTP2_SERVER_FIXUPS,
   MRB_HTTP2_SERVER_CONTENT,
-  MRB_HTTP2_SERVER_LOGGING
+  MRB_HTTP2_SERVER_LOGGING,
+  MRB_HTTP2_SERVER_PHASE_MAX
 } mrb_http2_server_phase;
 
 #define HTTP_CONTINUE 100
@@ -138,8 +139,9 @@ typedef struct {
   // request authority(hostname and port)
   char *authority;
 
-  // request body
+  // request body, may include NUL
   char *request_body;
+  int64_t request_body_len;
 
   // filename is mapped from uri
   char *filename;
@@ -198,9 +200,25 @@ typedef struct {
 
   // write buffer from mruby
   mrb_http2_large_buf *write_large_buf;
+
+  // usec and instructions the handlers of the request ran for, charged
+  // across the resumes of an async fiber
+  uint64_t handler_usec;
+  uint64_t handler_insns;
 } mrb_http2_request_rec;
 
 mrb_http2_request_rec *mrb_http2_request_rec_init(mrb_state *mrb);
 void mrb_http2_request_rec_free(mrb_state *mrb, mrb_http2_request_rec *r);
 
+// free list of request records, one record is used per stream
+#define MRB_HTTP2_REQUEST_REC_POOL_MAX 256
+typedef struct {
+  mrb_http2_request_rec *recs[MRB_HTTP2_REQUEST_REC_POOL_MAX];
+  size_t len;
+} mrb_http2_request_rec_pool;
+
+mrb_http2_request_rec *mrb_http2_request_rec_pool_get(mrb_state *mrb, mrb_http2_request_rec_pool *pool);
+void mrb_http2_request_rec_pool_put(mrb_state *mrb, mrb_http2_request_rec_pool *pool, mrb_http2_request_rec *r);
+void mrb_http2_request_rec_pool_free(mrb_state *mrb, mrb_http2_request_rec_pool *pool);
+
 #endif
@@ -0,0 +1,243 @@
+/*
+// mrb_http2_resolver.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_resolver.h"
+
+#include <event2/util.h>
+
+static time_t mrb_http2_resolver_now(mrb_http2_resolver *resolver)
+{
+  struct timeval tv;
+
+  event_base_gettimeofday_cached(resolver->evbase, &tv);
+  return tv.tv_sec;
+}
+
+// add "ip[:port]" separated by comma
+static int mrb_http2_resolver_add_nameservers(struct evdns_base *dnsbase, const char *nameservers)
+{
+  char buf[128];
+  const char *p = nameservers, *end;
+  size_t len;
+
+  while (*p != '\0') {
+    while (*p == ',' || *p == ' ') {
+      p++;
+    }
+    end = p;
+    while (*end != '\0' && *end != ',' && *end != ' ') {
+      end++;
+    }
+    len = end - p;
+    if (len == 0) {
+      break;
+    }
+    if (len >= sizeof(buf)) {
+      return -1;
+    }
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    if (evdns_base_nameserver_ip_add(dnsbase, buf) != 0) {
+      return -1;
+    }
+    p = end;
+  }
+  return evdns_base_count_nameservers(dnsbase) > 0 ? 0 : -1;
+}
+
+mrb_http2_resolver *mrb_http2_resolver_new(struct event_base *evbase, const char *nameservers,
+                                           unsigned int positive_ttl, unsigned int negative_ttl, uint64_t *hits,
+                                           uint64_t *negative_hits)
+{
+  mrb_http2_resolver *resolver;
+
+  resolver = (mrb_http2_resolver *)calloc(1, sizeof(mrb_http2_resolver));
+  if (resolver == NULL) {
+    return NULL;
+  }
+  resolver->evbase = evbase;
+  resolver->positive_ttl = positive_ttl;
+  resolver->negative_ttl = negative_ttl;
+  resolver->hits = hits;
+  resolver->negative_hits = negative_hits;
+
+  // resolv.conf and the hosts file, or the given nameservers and the hosts
+  // file, the loop isn't kept alive by the sockets of idle nameservers
+  if (nameservers == NULL) {
+    resolver->dnsbase =
+        evdns_base_new(evbase, EVDNS_BASE_INITIALIZE_NAMESERVERS | EVDNS_BASE_DISABLE_WHEN_INACTIVE);
+  } else {
+    resolver->dnsbase = evdns_base_new(evbase, EVDNS_BASE_DISABLE_WHEN_INACTIVE);
+    if (resolver->dnsbase != NULL && (mrb_http2_resolver_add_nameservers(resolver->dnsbase, nameservers) != 0 ||
+                                      evdns_base_load_hosts(resolver->dnsbase, NULL) != 0)) {
+      evdns_base_free(resolver->dnsbase, 0);
+      resolver->dnsbase = NULL;
+    }
+  }
+  if (resolver->dnsbase == NULL) {
+    free(resolver);
+    return NULL;
+  }
+  return resolver;
+}
+
+static void mrb_http2_resolver_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+  mrb_http2_resolver_entry *entry = (mrb_http2_resolver_entry *)arg;
+  mrb_http2_resolver *resolver = entry->resolver;
+  const void *addr = NULL;
+
+  if (result == EVUTIL_EAI_CANCEL) {
+    // mrb_http2_resolver_free
+    return;
+  }
+  entry->req = NULL;
+  entry->resolving = 0;
+
+  if (result == 0 && res != NULL) {
+    if (res->ai_family == AF_INET) {
+      addr = &((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    } else if (res->ai_family == AF_INET6) {
+      addr = &((struct sockaddr_in6 *)res->ai_addr)->sin6_addr;
+    }
+  }
+  if (addr != NULL && evutil_inet_ntop(res->ai_family, addr, entry->addr, sizeof(entry->addr)) != NULL) {
+    entry->expires = mrb_http2_resolver_now(resolver) + resolver->positive_ttl;
+  } else {
+    entry->addr[0] = '\0';
+    entry->expires = mrb_http2_resolver_now(resolver) + resolver->negative_ttl;
+  }
+  if (res != NULL) {
+    evutil_freeaddrinfo(res);
+  }
+}
+
+static void mrb_http2_resolver_refresh(mrb_http2_resolver_entry *entry)
+{
+  struct evutil_addrinfo hints;
+  struct evdns_getaddrinfo_request *req;
+
+  if (entry->resolving) {
+    return;
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+  // the callback may run before evdns_getaddrinfo returns
+  entry->resolving = 1;
+  req = evdns_getaddrinfo(entry->resolver->dnsbase, entry->name, NULL, &hints, mrb_http2_resolver_cb, entry);
+  if (entry->resolving) {
+    entry->req = req;
+  }
+}
+
+static mrb_http2_resolver_entry *mrb_http2_resolver_entry_get(mrb_http2_resolver *resolver, const char *name)
+{
+  mrb_http2_resolver_entry *entry;
+
+  for (entry = resolver->entries; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+
+  entry = (mrb_http2_resolver_entry *)calloc(1, sizeof(mrb_http2_resolver_entry));
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->name = strdup(name);
+  entry->resolver = resolver;
+  entry->next = resolver->entries;
+  resolver->entries = entry;
+
+  return entry;
+}
+
+// the address to connect to name, the cached numeric address, or the name
+// itself resolved by dnsbase while the cache is refreshed, NULL when the
+// name is known not to resolve
+const char *mrb_http2_resolver_address(mrb_http2_resolver *resolver, const char *name)
+{
+  mrb_http2_resolver_entry *entry;
+  struct in6_addr addr;
+
+  if (mrb_http2_resolver_unix_path(name) != NULL) {
+    return name;
+  }
+  if (evutil_inet_pton(AF_INET, name, &addr) == 1 || evutil_inet_pton(AF_INET6, name, &addr) == 1) {
+    return name;
+  }
+  entry = mrb_http2_resolver_entry_get(resolver, name);
+  if (entry == NULL) {
+    return name;
+  }
+  if (entry->expires > mrb_http2_resolver_now(resolver)) {
+    if (entry->addr[0] == '\0') {
+      if (resolver->negative_hits != NULL) {
+        MRB_HTTP2_STAT_INC(*resolver->negative_hits);
+      }
+      return NULL;
+    }
+    if (resolver->hits != NULL) {
+      MRB_HTTP2_STAT_INC(*resolver->hits);
+    }
+    return entry->addr;
+  }
+  mrb_http2_resolver_refresh(entry);
+  return name;
+}
+
+void mrb_http2_resolver_free(mrb_http2_resolver *resolver)
+{
+  mrb_http2_resolver_entry *entry, *next;
+
+  for (entry = resolver->entries; entry != NULL; entry = next) {
+    next = entry->next;
+    if (entry->req != NULL) {
+      evdns_getaddrinfo_cancel(entry->req);
+    }
+    free(entry->name);
+    free(entry);
+  }
+  evdns_base_free(resolver->dnsbase, 0);
+  free(resolver);
+}
+
+// the socket path of a unix domain socket name, NULL for a host
+const char *mrb_http2_resolver_unix_path(const char *name)
+{
+  size_t len = sizeof(MRB_HTTP2_RESOLVER_UNIX_PREFIX) - 1;
+
+  if (strncmp(name, MRB_HTTP2_RESOLVER_UNIX_PREFIX, len) != 0 || name[len] == '\0') {
+    return NULL;
+  }
+  return name + len;
+}
+
+int mrb_http2_resolver_unix_sockaddr(const char *path, struct sockaddr_un *sun)
+{
+  size_t len = strlen(path);
+
+  if (len >= sizeof(sun->sun_path)) {
+    return -1;
+  }
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  memcpy(sun->sun_path, path, len + 1);
+  return 0;
+}
+
+// Host header to the upstream, a socket path is no authority
+void mrb_http2_resolver_authority(char *buf, size_t len, const char *name, int port)
+{
+  if (mrb_http2_resolver_unix_path(name) != NULL) {
+    snprintf(buf, len, "localhost");
+    return;
+  }
+  snprintf(buf, len, "%s:%d", name, port);
+}
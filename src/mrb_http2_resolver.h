@@ -0,0 +1,72 @@
+/*
+// mrb_http2_resolver.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_RESOLVER_H
+#define MRB_HTTP2_RESOLVER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+
+// an upstream name of "unix:/path/to.sock" is a unix domain socket
+#define MRB_HTTP2_RESOLVER_UNIX_PREFIX "unix:"
+
+// evhttp connects to a unix domain socket since libevent 2.2, HTTP/2
+// upstreams connect their own bufferevent on any version
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+#define MRB_HTTP2_RESOLVER_EVHTTP_UNIX 1
+#endif
+
+struct mrb_http2_resolver;
+
+typedef struct mrb_http2_resolver_entry {
+  struct mrb_http2_resolver_entry *next;
+  struct mrb_http2_resolver *resolver;
+  char *name;
+
+  // numeric address, empty when the name didn't resolve
+  char addr[INET6_ADDRSTRLEN];
+
+  // the address or the failure is valid until expires
+  time_t expires;
+
+  // lookup in flight
+  struct evdns_getaddrinfo_request *req;
+  unsigned int resolving : 1;
+} mrb_http2_resolver_entry;
+
+typedef struct mrb_http2_resolver {
+  struct event_base *evbase;
+
+  // passed to evhttp and bufferevent to resolve a name not cached yet
+  struct evdns_base *dnsbase;
+
+  mrb_http2_resolver_entry *entries;
+
+  // sec
+  unsigned int positive_ttl;
+  unsigned int negative_ttl;
+
+  // counted per lookup answered by the cache when not NULL
+  uint64_t *hits;
+  uint64_t *negative_hits;
+} mrb_http2_resolver;
+
+mrb_http2_resolver *mrb_http2_resolver_new(struct event_base *evbase, const char *nameservers,
+                                           unsigned int positive_ttl, unsigned int negative_ttl, uint64_t *hits,
+                                           uint64_t *negative_hits);
+const char *mrb_http2_resolver_address(mrb_http2_resolver *resolver, const char *name);
+void mrb_http2_resolver_free(mrb_http2_resolver *resolver);
+
+const char *mrb_http2_resolver_unix_path(const char *name);
+int mrb_http2_resolver_unix_sockaddr(const char *path, struct sockaddr_un *sun);
+void mrb_http2_resolver_authority(char *buf, size_t len, const char *name, int port);
+
+#endif
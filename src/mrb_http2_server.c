@@ -10,6 +10,17 @@
 #include "mrb_http2_ssl.h"
 #include "mrb_http2_error.c.h"
 #include "mrb_http2_worker.h"
+#include "mrb_http2_thread_pool.h"
+#include "mrb_http2_upstream_pool.h"
+#include "mrb_http2_upstream_group.h"
+#include "mrb_http2_upstream_h2.h"
+#include "mrb_http2_cache.h"
+#include "mrb_http2_collapse.h"
+#include "mrb_http2_resolver.h"
+#include "mrb_http2_breaker.h"
+#include "mrb_http2_upstream_tls.h"
+#include "mrb_http2_timer_wheel.h"
+#include "mrb_http2_slab.h"
 
 #include <event.h>
 #include <event2/event.h>
@@ -25,6 +36,8 @@
 #include "mruby/value.h"
 #include "mruby/string.h"
 #include "mruby/compile.h"
+#include "mruby/gc.h"
+#include "mruby/error.h"
 
 #include <sys/wait.h>
 #include <sys/resource.h>
@@ -35,6 +48,37 @@
 #define MRB_HTTP2_TLS_RECORD_SIZE 4096
 #define MRB_HTTP2_MAX_REQ_HEADER_SIZE 4096
 
+// stop reading the upstream response when the body buffered for a stream
+// exceeds HIGH, and restart when the client consumed it below LOW, and
+// the same for the request body buffered for the upstream connection
+#define MRB_HTTP2_UPSTREAM_BODY_HIGH_WATER (1 << 18)
+#define MRB_HTTP2_UPSTREAM_BODY_LOW_WATER (1 << 16)
+
+// a retry costs a token, each upstream request earns upstream_retry_budget
+// percent of one, and a worker saves up to MAX for a burst of failures
+#define MRB_HTTP2_UPSTREAM_RETRY_TOKEN 100
+#define MRB_HTTP2_UPSTREAM_RETRY_TOKENS_MAX (10 * MRB_HTTP2_UPSTREAM_RETRY_TOKEN)
+
+// the circuit of the upstream is open, replied 503 instead of 502
+#define MRB_HTTP2_UPSTREAM_CIRCUIT_OPEN 2
+
+// msec per tick of the timer wheel of the session timeouts
+#define MRB_HTTP2_TIMER_WHEEL_TICK 500
+
+// the timeout a session is waiting for, see session_timer_update
+typedef enum {
+  MRB_HTTP2_SESSION_TIMER_NONE,
+  MRB_HTTP2_SESSION_TIMER_HANDSHAKE,
+  MRB_HTTP2_SESSION_TIMER_IDLE,
+  MRB_HTTP2_SESSION_TIMER_HEADER,
+  MRB_HTTP2_SESSION_TIMER_WRITE
+} mrb_http2_session_timer_kind;
+
+// event priorities, all I/O events use the default (middle) priority
+// and idle work runs only when no I/O event is active
+#define MRB_HTTP2_EV_PRIORITIES 3
+#define MRB_HTTP2_EV_PRIORITY_IDLE 2
+
 typedef struct st_mrb_http2_iovec_t {
   char *base;
   size_t len;
@@ -46,6 +90,54 @@ typedef struct {
   mrb_http2_server_t *server;
   mrb_http2_request_rec *r;
   mrb_value self;
+
+  // idle gc scheduling
+  struct event *gc_step_ev;
+  struct event *gc_full_ev;
+  unsigned int gc_full_pending : 1;
+
+  // runs mruby scripts off the loop when handler_threads is set
+  mrb_http2_thread_pool *handler_pool;
+
+  // request records of the streams
+  mrb_http2_request_rec_pool rec_pool;
+
+  // keep-alive upstream connections shared by all sessions
+  mrb_http2_upstream_pool *upstream_pool;
+
+  // backends and health state of upstream_groups
+  mrb_http2_upstream_groups *upstream_groups;
+
+  // HTTP/2 upstream connections multiplexing the streams of all sessions
+  mrb_http2_upstream_h2_pool *upstream_h2_pool;
+
+  // upstream response cache when upstream_cache
+  mrb_http2_cache *cache;
+
+  // upstream requests in flight shared by upstream_collapse
+  mrb_http2_collapse *collapse;
+
+  // resolves upstream hosts on the loop, with the cache of the names
+  mrb_http2_resolver *resolver;
+
+  // circuits of upstream hosts, and the retry budget
+  mrb_http2_breaker *breaker;
+  unsigned int retry_tokens;
+
+  // client SSL_CTX and sessions of https upstreams
+  mrb_http2_upstream_tls *upstream_tls;
+
+  // timeouts of the sessions
+  mrb_http2_timer_wheel *timer_wheel;
+
+  // size-class allocator of the loop thread, nghttp2_mem of the sessions
+  mrb_http2_slab *slab;
+  nghttp2_mem nghttp2_mem;
+
+  // accepting stops while max_connections sessions are open
+  struct evconnlistener *listener;
+  unsigned int nsessions;
+  unsigned int accept_paused : 1;
 } app_context;
 
 typedef struct mrb_http2_request_body {
@@ -68,9 +160,75 @@ typedef struct http2_stream_data {
   int32_t stream_id;
   int fd;
   int64_t readleft;
+  // the static file added to the output as a segment, written with
+  // sendfile or mmap, and the offset of the next DATA frame in the body
+  struct evbuffer_file_segment *segment;
+  off_t offset;
+  // request record, bound to app_ctx->r and self while processing
+  mrb_http2_request_rec *r;
   nghttp2_nv nva[MRB_HTTP2_HEADER_MAX];
   size_t nvlen;
-  struct evhttp_request *upstream_req;
+
+  // upstream request in flight and the response body not sent yet
+  struct mrb_http2_upstream_client *upstream;
+  struct mrb_http2_upstream_h2_client *upstream_h2;
+  struct evbuffer *upstream_body;
+
+  // upstream requests sent again after a failure
+  unsigned int upstream_retries;
+
+  // upstream response body state, eof when the whole body was received,
+  // paused when reading from upstream is stopped by the high water, and
+  // deferred when the data provider waits for the next chunk
+  unsigned int upstream_eof : 1;
+  unsigned int upstream_paused : 1;
+  unsigned int upstream_deferred : 1;
+
+  // the logging phase of a proxied response runs when the stream closes,
+  // after the body was forwarded
+  unsigned int logging_deferred : 1;
+
+  // request with a body processed when its HEADERS arrived, the body is
+  // forwarded to upstream as it arrives when upload, otherwise the content
+  // phase runs at the end of the stream when content_deferred
+  unsigned int request_early : 1;
+  unsigned int content_deferred : 1;
+  unsigned int upload : 1;
+
+  // content_cb set for this request by the phases before content_deferred,
+  // other streams set their own until the body ends
+  mrb_value content_proc;
+
+  // counted in headers_pending of the session until the headers arrived
+  unsigned int headers_pending : 1;
+
+  // received DATA bytes not consumed yet, WINDOW_UPDATE is sent for them
+  // when consumed
+  size_t unconsumed;
+
+  // response cache key of a cacheable request, the stale entry revalidated
+  // by the upstream request, and the new entry filled by the response
+  char *cache_key;
+  struct mrb_http2_cache_entry *cache_entry;
+  struct mrb_http2_cache_entry *cache_fill;
+
+  // the response was served from the cache, the upstream body is dropped
+  unsigned int cache_served : 1;
+
+  // the flight of the upstream request led by the stream, and the link of
+  // a stream waiting for or following the response of another stream
+  struct mrb_http2_collapse_flight *collapse;
+  mrb_http2_collapse_waiter collapse_waiter;
+
+  // the session, the response of a collapsed stream is submitted by the
+  // callbacks of another stream
+  struct http2_session_data *session_data;
+
+  // mruby script running on a handler thread
+  struct mrb_http2_handler_job *handler_job;
+
+  // set_content_cb fiber waiting on the event loop
+  struct mrb_http2_async *async;
 } http2_stream_data;
 
 typedef struct http2_session_data {
@@ -80,16 +238,115 @@ typedef struct http2_session_data {
   nghttp2_session *session;
   char client_addr[NI_MAXHOST];
   mrb_http2_conn_rec *conn;
-  struct event_base *upstream_base;
-  struct evhttp_connection *upstream_conn;
+
+  // frames buffered in the output before nghttp2 is asked for more
+  size_t output_limit;
+
+  // TCP_CORK is set by tcp_nopush until the output of a batch was written
+  unsigned int corked : 1;
+
+  // handshake, idle, header or write timeout in the timer wheel, the
+  // write timeout restarts whenever a part of the output was written
+  mrb_http2_timer timer;
+  mrb_http2_session_timer_kind timer_kind;
+  struct evbuffer_cb_entry *output_cb;
+
+  // streams whose request headers are being received
+  unsigned int headers_pending;
+
+  // receive window grown by window_autotune, and the body consumed in the
+  // round trip of rtt usec since window_epoch
+  int32_t recv_window;
+  size_t window_consumed;
+  struct timeval window_epoch;
+  unsigned int rtt;
 } http2_session_data;
 
+// a mruby script dispatched to the handler threads, the thread uses the
+// request record of the stream until the job returns
+typedef struct mrb_http2_handler_job {
+  mrb_http2_thread_job job;
+  app_context *app_ctx;
+  http2_session_data *session_data;
+  http2_stream_data *stream_data;
+  mrb_http2_request_rec *r;
+
+  // the session may be closed while the script is running
+  mrb_http2_conn_rec conn;
+  char client_ip[NI_MAXHOST];
+
+  FILE *rfp;
+  int pipefd[2];
+
+  unsigned int budget_exceeded : 1;
+
+  // the stream was closed, only free the job at completion
+  unsigned int orphaned : 1;
+} mrb_http2_handler_job;
+
+// a set_content_cb fiber suspended by an async_* method
+typedef struct mrb_http2_async {
+  app_context *app_ctx;
+  http2_session_data *session_data;
+  http2_stream_data *stream_data;
+  // set while suspended, the pipe is closed when the fiber is dropped
+  mrb_http2_request_rec *r;
+  mrb_value fiber;
+  int pipefd[2];
+
+  // value returned from the async_* method when resumed
+  mrb_value result;
+
+  // pending operation
+  struct event *timer_ev;
+  struct evhttp_connection *http_conn;
+
+  unsigned int waiting : 1;
+} mrb_http2_async;
+
 struct mrb_http2_upstream_client {
   http2_stream_data *stream_data;
   http2_session_data *session_data;
   nghttp2_session *session;
   app_context *app_ctx;
-  struct evhttp_connection *conn;
+  struct evhttp_request *req;
+  mrb_http2_upstream_conn *conn;
+
+  // selected from an upstream group, and the time the request was sent
+  mrb_http2_upstream_backend *backend;
+  struct timeval start;
+
+  // circuit of the upstream, probe when the request probes it half open,
+  // and the connect or first byte timeout
+  mrb_http2_breaker_entry *circuit;
+  int probe;
+  struct event *timer;
+
+  // on the output buffer of the connection until the request was written
+  struct evbuffer_cb_entry *written;
+
+  unsigned int keepalive : 1;
+  unsigned int headers_sent : 1;
+  unsigned int connecting : 1;
+};
+
+// a stream proxied to an HTTP/2 upstream, the response headers were
+// submitted when stream_data->upstream_body was created
+struct mrb_http2_upstream_h2_client {
+  http2_stream_data *stream_data;
+  http2_session_data *session_data;
+  app_context *app_ctx;
+  mrb_http2_upstream_h2_stream *stream;
+
+  mrb_http2_upstream_backend *backend;
+  struct timeval start;
+  mrb_http2_breaker_entry *circuit;
+  int probe;
+  struct event *timer;
+
+  // final response status, 0 until received
+  int status;
+  unsigned int find_via : 1;
 };
 
 static void mrb_http2_large_buf_init(mrb_http2_large_buf *b)
@@ -197,34 +454,263 @@ static const mrb_http2_iovec_t alpn_proto[] = {MRB_HTTP2_ALPN_PROTOCOLS, {}};
 //
 
 static void fixup_status_header(mrb_state *mrb, mrb_http2_request_rec *r);
+static void set_status_record(mrb_http2_request_rec *r, int status);
+
+// execution budget of Ruby handlers for the current request, checked by
+// the code fetch hook which needs mruby built with the debug hook, see
+// mrbgem.rake
+#if defined(MRB_ENABLE_DEBUG_HOOK) || defined(MRB_USE_DEBUG_HOOK) || defined(ENABLE_DEBUG)
+#define MRB_HTTP2_USE_CODE_FETCH_HOOK 1
+#else
+#define MRB_HTTP2_USE_CODE_FETCH_HOOK 0
+#endif
+
+// check the clock once per (mask + 1) instructions
+#define MRB_HTTP2_BUDGET_CLOCK_MASK 1023
+
+typedef struct {
+  // limits of the request, 0 means no limit
+  uint64_t timeout;
+  uint64_t insns_max;
+
+  // monotonic usec when the running handler was entered and its deadline,
+  // and the instructions executed by the handlers of the request
+  uint64_t entered;
+  uint64_t deadline;
+  uint64_t insns;
+
+  unsigned int armed : 1;
+  unsigned int exceeded : 1;
+} mrb_http2_handler_budget;
+
+// thread local, handler threads arm their own budget
+static __thread mrb_http2_handler_budget handler_budget;
 
-static void callback_ruby_block(mrb_state *mrb, mrb_value self, unsigned int flag, const char *cbid,
-                                mruby_cb_list *list)
+#if MRB_HTTP2_USE_CODE_FETCH_HOOK
+static void mrb_http2_budget_hook(mrb_state *mrb, struct mrb_irep *irep, mrb_code *pc, mrb_value *regs)
 {
-  mrb_int ai = mrb_gc_arena_save(mrb);
-  mrb_value b;
-  mrb_sym s;
+  mrb_http2_handler_budget *b = &handler_budget;
+
+  b->insns++;
+  if (b->insns_max && b->insns > b->insns_max) {
+    b->exceeded = 1;
+  } else if (b->deadline && (b->insns & MRB_HTTP2_BUDGET_CLOCK_MASK) == 0 && mrb_http2_monotonic_usec() > b->deadline) {
+    b->exceeded = 1;
+  }
+  if (!b->exceeded) {
+    return;
+  }
+  // raise once, rescue and ensure of the handler run without the hook
+  mrb->code_fetch_hook = NULL;
+  mrb_raise(mrb, E_RUNTIME_ERROR, "handler execution budget exceeded");
+}
+#endif
 
-  if (!flag || !cbid) {
-    mrb_gc_arena_restore(mrb, ai);
+// the limits of the request, the hook runs only while a handler runs, see
+// mrb_http2_budget_enter
+static void mrb_http2_budget_start(mrb_state *mrb, mrb_http2_config_t *config)
+{
+  handler_budget.exceeded = 0;
+  if (config->handler_timeout <= 0 && config->handler_instruction_limit <= 0) {
     return;
   }
+  handler_budget.timeout = config->handler_timeout > 0 ? (uint64_t)config->handler_timeout * 1000 : 0;
+  handler_budget.insns_max = config->handler_instruction_limit > 0 ? config->handler_instruction_limit : 0;
+  handler_budget.armed = 1;
+}
 
-  s = mrb_intern_cstr(mrb, cbid);
-  b = mrb_iv_get(mrb, self, s);
-  TRACER;
-  if (!mrb_nil_p(b)) {
-    mrb_yield_argv(mrb, b, 0, NULL);
-    TRACER;
-    if (strcmp(cbid, "content_cb") == 0) {
-      TRACER;
-      mrb_iv_set(mrb, self, s, mrb_nil_value());
-      list->content_cb = NULL;
+// attach the hook to mrb running a handler of r with what is left of the
+// budget of r, a fiber is charged across its resumes
+static void mrb_http2_budget_enter(mrb_state *mrb, mrb_http2_request_rec *r)
+{
+  uint64_t timeout = handler_budget.timeout;
+
+  if (!handler_budget.armed || handler_budget.exceeded) {
+    return;
+  }
+  handler_budget.entered = mrb_http2_monotonic_usec();
+  handler_budget.deadline = 0;
+  if (timeout) {
+    handler_budget.deadline = handler_budget.entered + (r->handler_usec < timeout ? timeout - r->handler_usec : 0);
+  }
+  handler_budget.insns = r->handler_insns;
+#if MRB_HTTP2_USE_CODE_FETCH_HOOK
+  mrb->code_fetch_hook = mrb_http2_budget_hook;
+#endif
+}
+
+// charge the time and instructions of the handler to r
+static void mrb_http2_budget_leave(mrb_state *mrb, mrb_http2_request_rec *r)
+{
+#if MRB_HTTP2_USE_CODE_FETCH_HOOK
+  mrb->code_fetch_hook = NULL;
+#endif
+  if (!handler_budget.armed) {
+    return;
+  }
+  r->handler_usec += mrb_http2_monotonic_usec() - handler_budget.entered;
+  r->handler_insns = handler_budget.insns;
+}
+
+// returns 1 when the handler of the request ran out of its budget
+static int mrb_http2_budget_stop(mrb_state *mrb)
+{
+  handler_budget.armed = 0;
+  return handler_budget.exceeded;
+}
+
+static mrb_value mrb_http2_yield_body(mrb_state *mrb, mrb_value b)
+{
+  return mrb_yield_argv(mrb, b, 0, NULL);
+}
+
+// run the proc cached for the phase, a nil proc means no callback was set
+static void callback_ruby_block(mrb_state *mrb, mrb_http2_server_t *server, mrb_http2_request_rec *r,
+                                mrb_http2_server_phase phase)
+{
+  mrb_value b = server->cb_procs[phase];
+  mrb_value ret;
+  mrb_bool failed = FALSE;
+  mrb_int ai;
+  int gc_disabled = 0;
+
+  r->phase = phase;
+  if (mrb_nil_p(b)) {
+    return;
+  }
+
+  ai = mrb_gc_arena_save(mrb);
+
+  // hook phases are short, so keep gc pauses out of them and
+  // leave the collection to the idle gc steps
+  if (phase != MRB_HTTP2_SERVER_CONTENT && server->config->idle_gc && !mrb->gc.disabled) {
+    mrb->gc.disabled = TRUE;
+    gc_disabled = 1;
+  }
+
+  if (phase == MRB_HTTP2_SERVER_CONTENT) {
+    mrb_http2_budget_enter(mrb, r);
+  }
+  ret = mrb_protect(mrb, mrb_http2_yield_body, b, &failed);
+  if (phase == MRB_HTTP2_SERVER_CONTENT) {
+    mrb_http2_budget_leave(mrb, r);
+  }
+
+  if (gc_disabled) {
+    mrb->gc.disabled = FALSE;
+  }
+
+  // don't let an exception jump out of the event loop
+  if (failed) {
+    mrb->exc = mrb_obj_ptr(ret);
+  }
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    mrb->exc = NULL;
+    if (phase != MRB_HTTP2_SERVER_LOGGING) {
+      set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
     }
   }
+
+  // content_cb is set for each request in the previous phases
+  if (phase == MRB_HTTP2_SERVER_CONTENT) {
+    server->cb_procs[phase] = mrb_nil_value();
+  }
+  TRACER;
   mrb_gc_arena_restore(mrb, ai);
 }
 
+static void mrb_http2_gc_run(app_context *app_ctx, int full)
+{
+  mrb_state *mrb = app_ctx->server->mrb;
+  uint64_t start = mrb_http2_monotonic_usec();
+
+  if (full) {
+    mrb_full_gc(mrb);
+  } else {
+    mrb_incremental_gc(mrb);
+  }
+  if (app_ctx->server->config->server_status) {
+    mrb_http2_worker_gc_record(app_ctx->server->worker, mrb_http2_monotonic_usec() - start, full);
+  }
+}
+
+// run at the idle priority, so one gc step is done per loop iteration
+// in which no I/O event was active
+static void mrb_http2_gc_step_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  app_context *app_ctx = (app_context *)ptr;
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  TRACER;
+  mrb_http2_gc_run(app_ctx, 0);
+  if (mrb->gc.state != MRB_GC_STATE_ROOT) {
+    event_active(app_ctx->gc_step_ev, EV_TIMEOUT, 0);
+  }
+}
+
+static void mrb_http2_gc_full_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  app_context *app_ctx = (app_context *)ptr;
+
+  TRACER;
+  if (app_ctx->gc_full_pending) {
+    mrb_http2_gc_run(app_ctx, 1);
+    app_ctx->gc_full_pending = 0;
+  }
+}
+
+// called after each request, start gc steps when the heap reaches half
+// of the gc threshold and push back the full gc timer
+static void mrb_http2_gc_schedule(app_context *app_ctx)
+{
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  struct timeval tv;
+
+  if (!config->idle_gc) {
+    return;
+  }
+
+  if (mrb->gc.state != MRB_GC_STATE_ROOT || mrb->gc.live >= mrb->gc.threshold / 2) {
+    event_active(app_ctx->gc_step_ev, EV_TIMEOUT, 0);
+  }
+
+  app_ctx->gc_full_pending = 1;
+  tv.tv_sec = config->idle_gc_full_timeout / 1000;
+  tv.tv_usec = (config->idle_gc_full_timeout % 1000) * 1000;
+  event_add(app_ctx->gc_full_ev, &tv);
+}
+
+// bind the request record used by the loop and the Ruby methods of self,
+// returns the previously bound record
+static mrb_http2_request_rec *mrb_http2_request_rec_bind(app_context *app_ctx, mrb_http2_request_rec *r)
+{
+  mrb_http2_data_t *data = DATA_PTR(app_ctx->self);
+  mrb_http2_request_rec *prev = app_ctx->r;
+
+  app_ctx->r = r;
+  data->r = r;
+  return prev;
+}
+
+// return the record of a deleted stream to the pool
+static void mrb_http2_request_rec_release(app_context *app_ctx, mrb_http2_request_rec *r)
+{
+  if (r->write_large_buf != NULL) {
+    mrb_http2_large_buf_free(r->write_large_buf);
+    free(r->write_large_buf);
+    r->write_large_buf = NULL;
+  }
+  mrb_http2_request_rec_pool_put(app_ctx->server->mrb, &app_ctx->rec_pool, r);
+}
+
+static void mrb_http2_async_free(mrb_http2_async *async);
+static void upstream_attempt_cancel(mrb_http2_upstream_backend *backend, mrb_http2_breaker_entry *circuit,
+                                    int probe);
+static void upstream_written_remove(struct mrb_http2_upstream_client *c);
+void http_request_done(struct evhttp_request *req, void *user_data);
+
 static void mrb_http2_conn_rec_free(mrb_state *mrb, mrb_http2_conn_rec *conn)
 {
   TRACER;
@@ -263,6 +749,8 @@ static http2_stream_data *create_http2_stream_data(mrb_state *mrb, http2_session
   stream_data->stream_id = stream_id;
   stream_data->fd = -1;
   stream_data->readleft = 0;
+  stream_data->segment = NULL;
+  stream_data->offset = 0;
   stream_data->nvlen = 0;
   stream_data->request_body = NULL;
   stream_data->request_args = NULL;
@@ -272,28 +760,66 @@ static http2_stream_data *create_http2_stream_data(mrb_state *mrb, http2_session
   stream_data->method[0] = '\0';
   stream_data->scheme[0] = '\0';
   stream_data->authority[0] = '\0';
-  stream_data->upstream_req = NULL;
+  stream_data->upstream = NULL;
+  stream_data->upstream_h2 = NULL;
+  stream_data->upstream_body = NULL;
+  stream_data->upstream_retries = 0;
+  stream_data->upstream_eof = 0;
+  stream_data->upstream_paused = 0;
+  stream_data->upstream_deferred = 0;
+  stream_data->request_early = 0;
+  stream_data->content_deferred = 0;
+  stream_data->upload = 0;
+  stream_data->content_proc = mrb_nil_value();
+  stream_data->unconsumed = 0;
+  stream_data->cache_key = NULL;
+  stream_data->cache_entry = NULL;
+  stream_data->cache_fill = NULL;
+  stream_data->cache_served = 0;
+  stream_data->collapse = NULL;
+  stream_data->collapse_waiter.data = stream_data;
+  stream_data->session_data = session_data;
+  stream_data->r = mrb_http2_request_rec_pool_get(mrb, &session_data->app_ctx->rec_pool);
 
   add_stream(session_data, stream_data);
   if (config->server_status) {
-    server->worker->stream_requests_per_worker++;
-    server->worker->active_stream++;
+    MRB_HTTP2_STAT_INC(server->worker->stream_requests_per_worker);
+    MRB_HTTP2_STAT_INC(server->worker->active_stream);
   }
   return stream_data;
 }
 
-static void delete_http2_stream_data(mrb_state *mrb, http2_session_data *session_data, http2_stream_data *stream_data)
+static void delete_http2_stream_data(app_context *app_ctx, http2_stream_data *stream_data)
 {
+  mrb_state *mrb = app_ctx->server->mrb;
+
   TRACER;
+  // freed when the handler thread returns the job
+  if (stream_data->handler_job != NULL) {
+    stream_data->handler_job->orphaned = 1;
+    return;
+  }
+  // cancel the pending operation, the fiber is never resumed
+  if (stream_data->async != NULL) {
+    mrb_http2_async_free(stream_data->async);
+    stream_data->async = NULL;
+  }
   if (stream_data->fd != -1) {
     close(stream_data->fd);
   }
+  // the file is closed when the output wrote the last frame of it
+  if (stream_data->segment != NULL) {
+    evbuffer_file_segment_free(stream_data->segment);
+  }
   mrb_free(mrb, stream_data->unparsed_uri);
   mrb_free_unless_null(mrb, stream_data->percent_encode_uri);
   if (stream_data->request_args != NULL) {
     mrb_free(mrb, stream_data->request_path);
     mrb_free(mrb, stream_data->request_args);
   }
+  if (!mrb_nil_p(stream_data->content_proc)) {
+    mrb_gc_unregister(mrb, stream_data->content_proc);
+  }
   if (stream_data->request_body != NULL) {
     stream_data->request_body->len = 0;
     stream_data->request_body->pos = 0;
@@ -301,11 +827,48 @@ static void delete_http2_stream_data(mrb_state *mrb, http2_session_data *session
     mrb_free(mrb, stream_data->request_body->data);
     mrb_free(mrb, stream_data->request_body);
   }
-  if (stream_data->upstream_req != NULL) {
-    evhttp_request_free(stream_data->upstream_req);
+  // http_request_done isn't called for a cancelled request
+  if (stream_data->upstream != NULL) {
+    upstream_written_remove(stream_data->upstream);
+    if (stream_data->upstream->timer != NULL) {
+      event_free(stream_data->upstream->timer);
+    }
+    evhttp_cancel_request(stream_data->upstream->req);
+    mrb_http2_upstream_pool_put(stream_data->upstream->conn, stream_data->upstream->keepalive);
+    upstream_attempt_cancel(stream_data->upstream->backend, stream_data->upstream->circuit,
+                            stream_data->upstream->probe);
+    free(stream_data->upstream);
+  }
+  if (stream_data->upstream_h2 != NULL) {
+    if (stream_data->upstream_h2->timer != NULL) {
+      event_free(stream_data->upstream_h2->timer);
+    }
+    mrb_http2_upstream_h2_cancel(stream_data->upstream_h2->stream);
+    upstream_attempt_cancel(stream_data->upstream_h2->backend, stream_data->upstream_h2->circuit,
+                            stream_data->upstream_h2->probe);
+    free(stream_data->upstream_h2);
+  }
+  if (stream_data->upstream_body != NULL) {
+    evbuffer_free(stream_data->upstream_body);
+  }
+  // the streams attached to the flight go upstream alone or are reset
+  if (stream_data->collapse != NULL) {
+    mrb_http2_collapse_settle(stream_data->collapse);
   }
-  if (session_data->app_ctx->server->config->server_status) {
-    session_data->app_ctx->server->worker->active_stream--;
+  mrb_http2_collapse_unlink(&stream_data->collapse_waiter);
+  if (stream_data->cache_entry != NULL) {
+    mrb_http2_cache_entry_unref(stream_data->cache_entry);
+  }
+  if (stream_data->cache_fill != NULL) {
+    mrb_http2_cache_entry_unref(stream_data->cache_fill);
+  }
+  free(stream_data->cache_key);
+  if (stream_data->headers_pending) {
+    stream_data->session_data->headers_pending--;
+  }
+  mrb_http2_request_rec_release(app_ctx, stream_data->r);
+  if (app_ctx->server->config->server_status) {
+    MRB_HTTP2_STAT_DEC(app_ctx->server->worker->active_stream);
   }
   mrb_free(mrb, stream_data);
 }
@@ -331,116 +894,417 @@ static void delete_http2_session_data(http2_session_data *session_data)
       SSL_shutdown(ssl);
     }
   }
+  if (session_data->output_cb != NULL) {
+    evbuffer_remove_cb_entry(bufferevent_get_output(session_data->bev), session_data->output_cb);
+  }
   bufferevent_free(session_data->bev);
   for (stream_data = session_data->root.next; stream_data;) {
     http2_stream_data *next = stream_data->next;
-    delete_http2_stream_data(mrb, session_data, stream_data);
+    delete_http2_stream_data(session_data->app_ctx, stream_data);
     stream_data = next;
   }
-  if (session_data->upstream_base != NULL) {
-    event_base_free(session_data->upstream_base);
-  }
-  if (session_data->upstream_conn != NULL) {
-    evhttp_connection_free(session_data->upstream_conn);
-  }
   if (config->server_status) {
-    server->worker->connected_sessions--;
+    MRB_HTTP2_STAT_DEC(server->worker->connected_sessions);
+  }
+  mrb_http2_timer_del(session_data->app_ctx->timer_wheel, &session_data->timer);
+  // accept again below max_connections
+  session_data->app_ctx->nsessions--;
+  if (session_data->app_ctx->accept_paused &&
+      (mrb_int)session_data->app_ctx->nsessions < session_data->app_ctx->server->config->max_connections) {
+    evconnlistener_enable(session_data->app_ctx->listener);
+    session_data->app_ctx->accept_paused = 0;
   }
   mrb_http2_conn_rec_free(mrb, session_data->conn);
   mrb_free(mrb, session_data);
 }
 
-/* Serialize the frame and send (or buffer) the data to
-   bufferevent. */
-static int session_send(http2_session_data *session_data)
+static void session_timeout_cb(mrb_http2_timer *timer)
 {
-  int rv;
+  http2_session_data *session_data = (http2_session_data *)timer->data;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  mrb_http2_worker_t *worker = session_data->app_ctx->server->worker;
+  static const char *names[] = {"", "handshake", "idle", "header", "write"};
 
-  TRACER;
-  rv = nghttp2_session_send(session_data->session);
-  if (rv != 0) {
-    fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-    return -1;
+  if (config->debug) {
+    fprintf(stderr, "%s %s timeout\n", session_data->client_addr, names[session_data->timer_kind]);
   }
-  TRACER;
-  return 0;
+  if (config->server_status) {
+    switch (session_data->timer_kind) {
+    case MRB_HTTP2_SESSION_TIMER_HANDSHAKE:
+      MRB_HTTP2_STAT_INC(worker->handshake_timeouts);
+      break;
+    case MRB_HTTP2_SESSION_TIMER_IDLE:
+      MRB_HTTP2_STAT_INC(worker->idle_timeouts);
+      break;
+    case MRB_HTTP2_SESSION_TIMER_HEADER:
+      MRB_HTTP2_STAT_INC(worker->header_timeouts);
+      break;
+    case MRB_HTTP2_SESSION_TIMER_WRITE:
+      MRB_HTTP2_STAT_INC(worker->write_timeouts);
+      break;
+    default:
+      break;
+    }
+  }
+  delete_http2_session_data(session_data);
 }
 
-#define MRB_HTTP2_TLS_PENDING_SIZE 1300
-
-/* Read the data in the bufferevent and feed them into nghttp2 library
-   function. Invocation of nghttp2_session_mem_recv() may make
-   additional pending frames, so call session_send() at the end of the
-   function. */
-static int session_recv(http2_session_data *session_data)
+// arm the timeout of the state of the session: the TLS handshake, the
+// output not written, request headers not finished, or no stream at all,
+// a session waiting for its handlers or upstreams has none. the timer of
+// the restart kind starts again when the state didn't change
+static void session_timer_update(http2_session_data *session_data, mrb_http2_session_timer_kind restart)
 {
-  int rv;
-  struct evbuffer *input = bufferevent_get_input(session_data->bev);
-  size_t datalen = evbuffer_get_length(input);
-  unsigned char *data = evbuffer_pullup(input, -1);
-
-  TRACER;
-  if (session_data->app_ctx->server->config->debug) {
-    fprintf(stderr, "%s: datalen = %ld\n", __func__, datalen);
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  mrb_http2_session_timer_kind kind;
+  unsigned int msec = 0;
+
+  if (session_data->session == NULL) {
+    kind = MRB_HTTP2_SESSION_TIMER_HANDSHAKE;
+    msec = config->handshake_timeout;
+  } else if (evbuffer_get_length(bufferevent_get_output(session_data->bev)) > 0) {
+    kind = MRB_HTTP2_SESSION_TIMER_WRITE;
+    msec = config->write_timeout;
+  } else if (session_data->headers_pending > 0) {
+    kind = MRB_HTTP2_SESSION_TIMER_HEADER;
+    msec = config->header_timeout;
+  } else if (session_data->root.next == NULL) {
+    kind = MRB_HTTP2_SESSION_TIMER_IDLE;
+    msec = config->idle_timeout;
+  } else {
+    kind = MRB_HTTP2_SESSION_TIMER_NONE;
   }
-  rv = nghttp2_session_mem_recv(session_data->session, data, datalen);
-  if (rv < 0) {
-    fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-    return -1;
+
+  if (kind == session_data->timer_kind && kind != restart) {
+    return;
   }
-  evbuffer_drain(input, rv);
-  TRACER;
-  if (session_send(session_data) != 0) {
-    return -1;
+  session_data->timer_kind = kind;
+  if (msec > 0) {
+    mrb_http2_timer_add(session_data->app_ctx->timer_wheel, &session_data->timer, msec);
+  } else {
+    mrb_http2_timer_del(session_data->app_ctx->timer_wheel, &session_data->timer);
   }
-  TRACER;
-  return 0;
 }
 
-static ssize_t server_send_callback(nghttp2_session *session, const uint8_t *data, size_t length, int flags,
-                                    void *user_data)
+// a slow client still reading its output doesn't hit the write timeout
+static void session_output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
 {
-  http2_session_data *session_data = (http2_session_data *)user_data;
-
-  TRACER;
+  http2_session_data *session_data = (http2_session_data *)arg;
 
-  /* Avoid excessive buffering in server side. */
-  if (evbuffer_get_length(bufferevent_get_output(session_data->bev)) >= OUTPUT_WOULDBLOCK_THRESHOLD) {
-    return NGHTTP2_ERR_WOULDBLOCK;
-  }
-  if (session_data->app_ctx->server->config->debug) {
-    fprintf(stderr, "%s: datalen = %ld\n", __func__, length);
+  if (info->n_deleted > 0 && session_data->timer_kind == MRB_HTTP2_SESSION_TIMER_WRITE) {
+    session_timer_update(session_data, MRB_HTTP2_SESSION_TIMER_WRITE);
   }
-
-  bufferevent_write(session_data->bev, data, length);
-  TRACER;
-  return length;
 }
 
-/* Returns int value of hex string character |c| */
-static uint8_t hex_to_uint(uint8_t c)
+#define MRB_HTTP2_OUTPUT_LIMIT_MIN (1 << 14)
+#define MRB_HTTP2_OUTPUT_LIMIT_MAX (1 << 21)
+
+// size the frames buffered by the server to what the connection sends in
+// a round trip, cwnd * mss, while the kernel keeps tcp_notsent_lowat
+// unsent, frames stay in nghttp2 where a more urgent stream can overtake
+static void session_output_limit_update(http2_session_data *session_data)
 {
-  if ('0' <= c && c <= '9') {
-    return c - '0';
+#if defined(TCP_INFO) && defined(TCP_NOTSENT_LOWAT)
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+  size_t bdp;
+
+  // a negative tcp_notsent_lowat disables it as 0 does
+  if (session_data->app_ctx->server->config->tcp_notsent_lowat <= 0) {
+    return;
   }
-  if ('A' <= c && c <= 'F') {
-    return c - 'A' + 10;
+  if (getsockopt(bufferevent_getfd(session_data->bev), IPPROTO_TCP, TCP_INFO, &ti, &len) != 0 ||
+      ti.tcpi_snd_mss == 0) {
+    return;
   }
-  if ('a' <= c && c <= 'f') {
-    return c - 'a' + 10;
+  bdp = (size_t)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+  if (bdp < MRB_HTTP2_OUTPUT_LIMIT_MIN) {
+    bdp = MRB_HTTP2_OUTPUT_LIMIT_MIN;
+  } else if (bdp > MRB_HTTP2_OUTPUT_LIMIT_MAX) {
+    bdp = MRB_HTTP2_OUTPUT_LIMIT_MAX;
   }
-  return 0;
+  session_data->output_limit = bdp;
+  if (session_data->app_ctx->server->config->debug) {
+    fprintf(stderr, "%s: cwnd = %u, mss = %u, rtt = %uus, output_limit = %zu\n", __func__, ti.tcpi_snd_cwnd,
+            ti.tcpi_snd_mss, ti.tcpi_rtt, bdp);
+  }
+#endif
 }
 
-/* Decodes percent-encoded byte string |value| with length |valuelen|
-   and returns the decoded byte string in allocated buffer. The return
-   value is NULL terminated. The caller must free the returned
-   string. */
-static char *percent_decode(mrb_state *mrb, const uint8_t *value, size_t valuelen)
+// the round trip assumed until TCP_INFO measured one
+#define MRB_HTTP2_WINDOW_RTT_DEFAULT 100000
+
+// give back the window of the body of a stream, the bytes are counted to
+// estimate how much the connection takes per round trip
+static void session_consume(http2_session_data *session_data, int32_t stream_id, size_t len)
 {
-  char *res;
+  nghttp2_session_consume(session_data->session, stream_id, len);
+  session_data->window_consumed += len;
+}
 
-  TRACER;
+// double the receive windows while the body consumed in a round trip
+// reaches half of them, so the client isn't limited by the window, but
+// not when the body is waiting for a slower upstream
+static void session_window_update(http2_session_data *session_data)
+{
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  struct timeval now, elapsed;
+  uint64_t usec, bdp;
+  int32_t window;
+
+  if (!config->window_autotune || session_data->window_consumed == 0) {
+    return;
+  }
+  event_base_gettimeofday_cached(session_data->app_ctx->evbase, &now);
+  evutil_timersub(&now, &session_data->window_epoch, &elapsed);
+  usec = (uint64_t)elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+  if (usec < session_data->rtt) {
+    return;
+  }
+
+  bdp = (uint64_t)session_data->window_consumed * session_data->rtt / usec;
+  session_data->window_consumed = 0;
+  session_data->window_epoch = now;
+#ifdef TCP_INFO
+  {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    if (getsockopt(bufferevent_getfd(session_data->bev), IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && ti.tcpi_rtt > 0) {
+      session_data->rtt = ti.tcpi_rtt;
+    }
+  }
+#endif
+
+  if (bdp * 2 < (uint64_t)session_data->recv_window || session_data->recv_window >= config->window_max_size) {
+    return;
+  }
+  window = (int32_t)((int64_t)session_data->recv_window * 2 < config->window_max_size
+                         ? (int64_t)session_data->recv_window * 2
+                         : config->window_max_size);
+  if (nghttp2_session_set_local_window_size(session_data->session, NGHTTP2_FLAG_NONE, 0, window) != 0) {
+    return;
+  }
+  if (window > config->initial_window_size) {
+    nghttp2_settings_entry iv = {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, (uint32_t)window};
+    nghttp2_submit_settings(session_data->session, NGHTTP2_FLAG_NONE, &iv, 1);
+  }
+  if (config->debug) {
+    fprintf(stderr, "%s: rtt = %uus, bdp = %lu, window = %d\n", __func__, session_data->rtt, (unsigned long)bdp,
+            window);
+  }
+  session_data->recv_window = window;
+  if (config->server_status) {
+    MRB_HTTP2_STAT_INC(session_data->app_ctx->server->worker->window_grows);
+  }
+}
+
+static void session_cork(http2_session_data *session_data, int on)
+{
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+  int fd = bufferevent_getfd(session_data->bev);
+  int val = on;
+#endif
+
+  if (session_data->corked == (on ? 1 : 0)) {
+    return;
+  }
+  session_data->corked = on ? 1 : 0;
+#ifdef TCP_CORK
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, (char *)&val, sizeof(val));
+#endif
+#ifdef TCP_NOPUSH
+  setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, (char *)&val, sizeof(val));
+#endif
+}
+
+/* Serialize the frames and buffer them to bufferevent, which writes
+   the output of the loop iteration at once. */
+static int session_send(http2_session_data *session_data)
+{
+  struct evbuffer *output = bufferevent_get_output(session_data->bev);
+  const uint8_t *data;
+  ssize_t len;
+
+  TRACER;
+  // avoid excessive buffering in server side, the rest is sent by the
+  // write callback once the output was written
+  while (evbuffer_get_length(output) < session_data->output_limit) {
+    len = nghttp2_session_mem_send(session_data->session, &data);
+    if (len < 0) {
+      fprintf(stderr, "Fatal error: %s", nghttp2_strerror((int)len));
+      return -1;
+    }
+    if (len == 0) {
+      break;
+    }
+    if (session_data->app_ctx->server->config->debug) {
+      fprintf(stderr, "%s: datalen = %ld\n", __func__, len);
+    }
+    // data is valid until the next nghttp2_session_mem_send
+    if (evbuffer_add(output, data, len) != 0) {
+      return -1;
+    }
+  }
+  if (session_data->app_ctx->server->config->tcp_nopush && evbuffer_get_length(output) > 0) {
+    // full packets until the batch was written, see the write callback
+    session_cork(session_data, 1);
+  }
+  session_timer_update(session_data, MRB_HTTP2_SESSION_TIMER_NONE);
+  TRACER;
+  return 0;
+}
+
+// the payload of a DATA frame, a pipe is read straight into the output,
+// a static file is referenced as a segment and a proxied body is moved
+static int send_data_payload(http2_stream_data *stream_data, struct evbuffer *output, size_t length)
+{
+  int n;
+
+  if (stream_data->fd != -1) {
+    while (length > 0) {
+      n = evbuffer_read(output, stream_data->fd, length);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      length -= n;
+      stream_data->offset += n;
+    }
+    return 0;
+  }
+  if (stream_data->segment != NULL) {
+    if (evbuffer_add_file_segment(output, stream_data->segment, stream_data->offset, length) != 0) {
+      return -1;
+    }
+    stream_data->offset += length;
+    return 0;
+  }
+  return evbuffer_remove_buffer(stream_data->upstream_body, output, length) == (int)length ? 0 : -1;
+}
+
+// a DATA frame whose payload doesn't go through nghttp2, it's added to
+// the output without copying it into the frame buffer
+static int server_send_data_callback(nghttp2_session *session, nghttp2_frame *frame, const uint8_t *framehd,
+                                     size_t length, nghttp2_data_source *source, void *user_data)
+{
+  http2_session_data *session_data = (http2_session_data *)user_data;
+  http2_stream_data *stream_data = source->ptr;
+  struct evbuffer *output = bufferevent_get_output(session_data->bev);
+  static const uint8_t padding[256];
+  size_t padlen = frame->data.padlen;
+
+  // resumed by the write callback
+  if (evbuffer_get_length(output) >= session_data->output_limit) {
+    return NGHTTP2_ERR_WOULDBLOCK;
+  }
+  if (evbuffer_add(output, framehd, 9) != 0) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  if (padlen > 0) {
+    uint8_t padlen_field = (uint8_t)(padlen - 1);
+    if (evbuffer_add(output, &padlen_field, 1) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+  }
+  if (length > 0 && send_data_payload(stream_data, output, length) != 0) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  if (padlen > 1 && evbuffer_add(output, padding, padlen - 1) != 0) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return 0;
+}
+
+// send on the session from the loop, for a stream driven by the callbacks
+// of another stream, where a failed send can't delete the session
+static void session_send_later(http2_session_data *session_data)
+{
+  bufferevent_trigger(session_data->bev, EV_WRITE, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+}
+
+#define MRB_HTTP2_TLS_PENDING_SIZE 1300
+
+// bytes fed to nghttp2 per read callback, the rest is fed on the next loop
+// iteration so that one busy connection doesn't hold the worker
+#define MRB_HTTP2_RECV_BUDGET (256 * 1024)
+#define MRB_HTTP2_RECV_IOVECS 16
+
+/* Read the data in the bufferevent and feed them into nghttp2 library
+   function. Invocation of nghttp2_session_mem_recv() may make
+   additional pending frames, so call session_send() at the end of the
+   function. */
+static int session_recv(http2_session_data *session_data)
+{
+  ssize_t rv;
+  struct evbuffer *input = bufferevent_get_input(session_data->bev);
+  struct evbuffer_iovec v[MRB_HTTP2_RECV_IOVECS];
+  size_t budget = MRB_HTTP2_RECV_BUDGET;
+  int i, n;
+
+  TRACER;
+  if (session_data->app_ctx->server->config->debug) {
+    fprintf(stderr, "%s: datalen = %ld\n", __func__, evbuffer_get_length(input));
+  }
+  // feed the chains of input in place, evbuffer_pullup would copy them
+  // into one, and drain them after the pointers are no longer used
+  while (budget > 0 && (n = evbuffer_peek(input, budget, NULL, v, MRB_HTTP2_RECV_IOVECS)) > 0) {
+    size_t consumed = 0;
+
+    if (n > MRB_HTTP2_RECV_IOVECS) {
+      n = MRB_HTTP2_RECV_IOVECS;
+    }
+    for (i = 0; i < n && budget > 0; i++) {
+      size_t len = v[i].iov_len < budget ? v[i].iov_len : budget;
+
+      rv = nghttp2_session_mem_recv(session_data->session, v[i].iov_base, len);
+      if (rv < 0) {
+        fprintf(stderr, "Fatal error: %s", nghttp2_strerror((int)rv));
+        return -1;
+      }
+      consumed += rv;
+      budget -= len;
+    }
+    evbuffer_drain(input, consumed);
+  }
+  if (evbuffer_get_length(input) > 0) {
+    bufferevent_trigger(session_data->bev, EV_READ, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+  }
+  session_window_update(session_data);
+  TRACER;
+  if (session_send(session_data) != 0) {
+    return -1;
+  }
+  TRACER;
+  return 0;
+}
+
+/* Returns int value of hex string character |c| */
+static uint8_t hex_to_uint(uint8_t c)
+{
+  if ('0' <= c && c <= '9') {
+    return c - '0';
+  }
+  if ('A' <= c && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  if ('a' <= c && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return 0;
+}
+
+/* Decodes percent-encoded byte string |value| with length |valuelen|
+   and returns the decoded byte string in allocated buffer. The return
+   value is NULL terminated. The caller must free the returned
+   string. */
+static char *percent_decode(mrb_state *mrb, const uint8_t *value, size_t valuelen)
+{
+  char *res;
+
+  TRACER;
   res = (char *)mrb_malloc(mrb, valuelen + 1);
   if (valuelen > 3) {
     size_t i, j;
@@ -466,26 +1330,37 @@ static ssize_t upstream_read_callback(nghttp2_session *session, int32_t stream_i
                                       uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
 {
   ssize_t nread;
+  size_t left;
   http2_stream_data *stream_data = source->ptr;
-  struct evbuffer *upstream_buf;
 
-  if (stream_data->upstream_req == NULL) {
+  if (stream_data->upstream_body == NULL) {
     return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
   }
-  upstream_buf = evhttp_request_get_input_buffer(stream_data->upstream_req);
-  nread = evbuffer_remove(upstream_buf, buf, length);
-  TRACER;
-
-  if (nread == -1) {
-    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  // the payload is moved by server_send_data_callback
+  left = evbuffer_get_length(stream_data->upstream_body);
+  nread = left < length ? left : length;
+  left -= nread;
+  if (nread > 0) {
+    *data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
   }
+  TRACER;
 
-  stream_data->readleft -= nread;
-  if (nread == 0 || stream_data->readleft == 0) {
-    if (stream_data->readleft != 0) {
-      return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  if (stream_data->upstream_h2 != NULL && nread > 0) {
+    // open the upstream stream window as much as the client read
+    mrb_http2_upstream_h2_consume(stream_data->upstream_h2->stream, nread);
+  }
+  if (stream_data->upstream_paused && left < MRB_HTTP2_UPSTREAM_BODY_LOW_WATER) {
+    bufferevent_enable(evhttp_connection_get_bufferevent(stream_data->upstream->conn->evcon), EV_READ);
+    stream_data->upstream_paused = 0;
+  }
+  if (left == 0) {
+    if (stream_data->upstream_eof) {
+      *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    } else if (nread == 0) {
+      // resumed by http_request_chunk
+      stream_data->upstream_deferred = 1;
+      return NGHTTP2_ERR_DEFERRED;
     }
-    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
   }
   TRACER;
   return nread;
@@ -495,8 +1370,6 @@ static int send_upstream_response(app_context *app_ctx, nghttp2_session *session
                                   http2_stream_data *stream_data)
 {
   int rv;
-  mrb_state *mrb = app_ctx->server->mrb;
-  mrb_http2_request_rec *r = app_ctx->r;
   int i;
 
   nghttp2_data_provider data_prd;
@@ -513,19 +1386,10 @@ static int send_upstream_response(app_context *app_ctx, nghttp2_session *session
   rv = nghttp2_submit_response(session, stream_data->stream_id, nva, nvlen, &data_prd);
   if (rv != 0) {
     fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-    mrb_http2_request_rec_free(mrb, r);
     return -1;
   }
-  //
-  // "set_logging_cb" callback ruby block
-  //
-  if (app_ctx->server->config->callback) {
-    r->phase = MRB_HTTP2_SERVER_LOGGING;
-    callback_ruby_block(mrb, app_ctx->self, app_ctx->server->config->callback,
-                        app_ctx->server->config->cb_list->logging_cb, app_ctx->server->config->cb_list);
-  }
-
-  mrb_http2_request_rec_free(mrb, r);
+  // r is kept until the stream closes and released with the stream
+  stream_data->logging_deferred = 1;
   TRACER;
   return 0;
 }
@@ -568,20 +1432,26 @@ static ssize_t file_read_callback(nghttp2_session *session, int32_t stream_id, u
 {
   ssize_t nread;
   http2_stream_data *stream_data = source->ptr;
+  struct stat finfo;
 
-  while ((nread = read(stream_data->fd, buf, length)) == -1 && errno == EINTR)
-    ;
-  TRACER;
-
-  if (nread == -1) {
-    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  // a regular file is handed to the segment, which closes it, a pipe
+  // stays and is read by server_send_data_callback
+  if (stream_data->offset == 0 && stream_data->segment == NULL && stream_data->readleft > 0 &&
+      fstat(stream_data->fd, &finfo) == 0 && S_ISREG(finfo.st_mode)) {
+    stream_data->segment = evbuffer_file_segment_new(stream_data->fd, 0, stream_data->readleft, EVBUF_FS_CLOSE_ON_FREE);
+    if (stream_data->segment != NULL) {
+      stream_data->fd = -1;
+    }
   }
+  TRACER;
 
+  // the payload is added by server_send_data_callback
+  nread = stream_data->readleft < (int64_t)length ? stream_data->readleft : (ssize_t)length;
   stream_data->readleft -= nread;
-  if (nread == 0 || stream_data->readleft == 0) {
-    if (stream_data->readleft != 0) {
-      return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
-    }
+  if (nread > 0) {
+    *data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+  }
+  if (stream_data->readleft == 0) {
     *data_flags |= NGHTTP2_DATA_FLAG_EOF;
   }
   TRACER;
@@ -614,14 +1484,13 @@ static int send_response_large_buf(app_context *app_ctx, nghttp2_session *sessio
     mrb_http2_request_rec_free(mrb, r);
     return -1;
   }
+  // freed by large_buf_read_callback
+  r->write_large_buf = NULL;
+
   //
   // "set_logging_cb" callback ruby block
   //
-  if (app_ctx->server->config->callback) {
-    r->phase = MRB_HTTP2_SERVER_LOGGING;
-    callback_ruby_block(mrb, app_ctx->self, app_ctx->server->config->callback,
-                        app_ctx->server->config->cb_list->logging_cb, app_ctx->server->config->cb_list);
-  }
+  callback_ruby_block(mrb, app_ctx->server, r, MRB_HTTP2_SERVER_LOGGING);
 
   mrb_http2_request_rec_free(mrb, r);
   TRACER;
@@ -656,11 +1525,7 @@ static int send_response(app_context *app_ctx, nghttp2_session *session, nghttp2
   //
   // "set_logging_cb" callback ruby block
   //
-  if (app_ctx->server->config->callback) {
-    r->phase = MRB_HTTP2_SERVER_LOGGING;
-    callback_ruby_block(mrb, app_ctx->self, app_ctx->server->config->callback,
-                        app_ctx->server->config->cb_list->logging_cb, app_ctx->server->config->cb_list);
-  }
+  callback_ruby_block(mrb, app_ctx->server, r, MRB_HTTP2_SERVER_LOGGING);
 
   mrb_http2_request_rec_free(mrb, r);
   TRACER;
@@ -673,6 +1538,30 @@ static void set_status_record(mrb_http2_request_rec *r, int status)
   snprintf(r->status_line, 4, "%d", r->status);
 }
 
+// write all of buf to the pipe of a reply, returns the bytes written
+// which are short of len only when the pipe failed
+static size_t reply_pipe_write(int fd, const char *buf, size_t len)
+{
+  size_t written = 0;
+  ssize_t n;
+
+  while (written < len) {
+    n = write(fd, buf + written, len - written);
+    if (n > 0) {
+      written += n;
+    } else if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n == -1 && errno == EAGAIN) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      poll(&pfd, 1, -1);
+    } else {
+      fprintf(stderr, "can't write the reply to the pipe: %s\n", strerror(errno));
+      break;
+    }
+  }
+  return written;
+}
+
 static int error_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
 {
   mrb_http2_request_rec *r = app_ctx->r;
@@ -707,8 +1596,7 @@ static int error_reply(app_context *app_ctx, nghttp2_session *session, http2_str
   }
 
   msg = mrb_http2_error_message(r->status);
-  size = strlen(msg);
-  rv = write(pipefd[1], msg, size);
+  size = reply_pipe_write(pipefd[1], msg, strlen(msg));
 
   close(pipefd[1]);
   stream_data->fd = pipefd[0];
@@ -722,10 +1610,7 @@ static int error_reply(app_context *app_ctx, nghttp2_session *session, http2_str
   //
   // "set_fixups_cb" callback ruby block
   //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_FIXUPS;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
-  }
+  callback_ruby_block(mrb, app_ctx->server, r, MRB_HTTP2_SERVER_FIXUPS);
 
   TRACER;
   if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
@@ -736,20 +1621,22 @@ static int error_reply(app_context *app_ctx, nghttp2_session *session, http2_str
   return 0;
 }
 
+static void upstream_collapse_release(app_context *app_ctx, http2_stream_data *stream_data);
+
 static int upstream_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
 {
   mrb_http2_request_rec *r = app_ctx->r;
-  mrb_http2_config_t *config = app_ctx->server->config;
   mrb_state *mrb = app_ctx->server->mrb;
 
   TRACER;
+  // the streams waiting for the same response get it before fixups
+  if (stream_data->collapse != NULL && stream_data->collapse->joinable) {
+    upstream_collapse_release(app_ctx, stream_data);
+  }
   //
   // "set_fixups_cb" callback ruby block
   //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_FIXUPS;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
-  }
+  callback_ruby_block(mrb, app_ctx->server, r, MRB_HTTP2_SERVER_FIXUPS);
 
   if (send_upstream_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
     close(stream_data->fd);
@@ -759,2097 +1646,4815 @@ static int upstream_reply(app_context *app_ctx, nghttp2_session *session, http2_
   return 0;
 }
 
-void http_request_done(struct evhttp_request *req, void *user_data)
+// the stream is deleted in a callback of its upstream request, which
+// can't be cancelled there, so the request finishes without the stream
+static void upstream_client_orphan(struct mrb_http2_upstream_client *c)
 {
-  struct mrb_http2_upstream_client *c = user_data;
-  mrb_state *mrb = c->app_ctx->server->mrb;
-  mrb_http2_request_rec *r = c->app_ctx->r;
-  int find_via = 0;
+  http2_stream_data *stream_data = c->stream_data;
 
-  struct evkeyval *header;
-  struct evkeyvalq *input_headers;
+  if (stream_data->upstream_paused) {
+    bufferevent_enable(evhttp_connection_get_bufferevent(c->conn->evcon), EV_READ);
+    stream_data->upstream_paused = 0;
+  }
+  stream_data->upstream = NULL;
+  c->stream_data = NULL;
+}
 
-  if (req != NULL) {
-    input_headers = evhttp_request_get_input_headers(req);
-  } else {
-    c->stream_data->upstream_req = req;
-    event_base_loopexit(c->session_data->upstream_base, NULL);
-    return;
+static int upstream_hop_by_hop(const char *key)
+{
+  return strcasecmp("Connection", key) == 0 || strcasecmp("Transfer-Encoding", key) == 0 ||
+         strcasecmp("Keep-Alive", key) == 0 || strcasecmp("Proxy-Connection", key) == 0 ||
+         strcasecmp("Upgrade", key) == 0;
+}
+
+// copy an upstream response header into r->reshdrs without hop-by-hop
+// headers, return 1 for Via which is replaced by server_name
+static int upstream_response_header(app_context *app_ctx, mrb_http2_request_rec *r, const char *key,
+                                    const char *value)
+{
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  if (r->reshdrslen >= MRB_HTTP2_HEADER_MAX - 1) {
+    // keep a room for via
+    return 0;
   }
+  if (strcasecmp("Via", key) == 0) {
+    MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], key, app_ctx->server->config->server_name);
+    r->reshdrslen += 1;
+    return 1;
+  } else if (upstream_hop_by_hop(key)) {
+    // do nothing
+  } else if (strcasecmp("Location", key) == 0) {
+    char *buf;
+    // "+ 2" is to http[s] and the null terminator
+    buf = alloca(strlen(value) + strlen(r->authority) + 2);
+    memcpy(buf, value, strlen(value) + 1);
+    mrb_http2_strrep(buf, r->upstream->unparsed_host, r->authority);
+
+    // scheme checke
+    // TODO: http(front) <=> https(back) check
+    if (strlen(r->scheme) == 5 && memcmp(buf, r->scheme, strlen(r->scheme)) != 0) {
+      mrb_http2_strrep(buf, (char *)"http", r->scheme);
+    }
 
-  TRACER;
-  set_status_record(r, req->response_code);
-  fixup_status_header(mrb, r);
+    MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], key, buf);
+    r->reshdrslen += 1;
+  } else {
+    if (strcasecmp("Content-Length", key) == 0) {
+      snprintf(r->content_length, 64, "%s", value);
+    }
+    MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], key, value);
+    r->reshdrslen += 1;
+  }
+  return 0;
+}
 
-  TAILQ_FOREACH(header, input_headers, next)
-  {
-    if (memcmp("Via", header->key, sizeof("Via") - 1) == 0) {
-      MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], header->key, c->app_ctx->server->config->server_name);
-      r->reshdrslen += 1;
-      find_via = 1;
-    } else if (strlen(header->key) == sizeof("Connection") - 1 &&
-               memcmp("Connection", header->key, sizeof("Connection") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Transfer-Encoding") - 1 &&
-               memcmp("Transfer-Encoding", header->key, sizeof("Transfer-Encoding") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Keep-Alive") - 1 &&
-               memcmp("Keep-Alive", header->key, sizeof("Keep-Alive") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Proxy-Connection") - 1 &&
-               memcmp("Proxy-Connection", header->key, sizeof("Proxy-Connection") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Upgrade") - 1 &&
-               memcmp("Upgrade", header->key, sizeof("Upgrade") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Location") - 1 &&
-               memcmp("Location", header->key, sizeof("Location") - 1) == 0) {
-      char *buf;
-      // "+ 1" is to http[s]
-      buf = alloca(strlen(header->value) - strlen(r->upstream->unparsed_host) + strlen(r->authority) + 1);
-      memcpy(buf, header->value, strlen(header->value) + 1);
-      mrb_http2_strrep(buf, r->upstream->unparsed_host, r->authority);
-
-      // scheme checke
-      // TODO: http(front) <=> https(back) check
-      if (strlen(r->scheme) == 5 && memcmp(buf, r->scheme, strlen(r->scheme)) != 0) {
-        mrb_http2_strrep(buf, (char *)"http", r->scheme);
+// pick a backend of the group in C, no VM call per request, and fail
+// fast with MRB_HTTP2_UPSTREAM_CIRCUIT_OPEN while its circuit is open
+static int upstream_select_backend(app_context *app_ctx, mrb_http2_request_rec *r,
+                                   mrb_http2_upstream_backend **backend, struct timeval *start,
+                                   mrb_http2_breaker_entry **circuit, int *probe)
+{
+  *backend = NULL;
+  *circuit = NULL;
+  *probe = 0;
+  if (r->upstream->group >= 0) {
+    *backend = mrb_http2_upstream_group_select(&app_ctx->upstream_groups->groups[r->upstream->group]);
+    if (*backend == NULL) {
+      if (app_ctx->server->config->debug) {
+        fprintf(stderr, "no available server in upstream group %s\n",
+                app_ctx->server->config->upstream_groups[r->upstream->group].name);
       }
-
-      MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], header->key, buf);
-      r->reshdrslen += 1;
-    } else {
-      MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], header->key, header->value);
-      r->reshdrslen += 1;
+      return -1;
     }
+    free(r->upstream->host);
+    r->upstream->host = strdup((*backend)->host);
+    r->upstream->port = (*backend)->port;
+    r->upstream->tls = (*backend)->tls;
+    event_base_gettimeofday_cached(app_ctx->evbase, start);
   }
-  if (!find_via) {
-    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "via", c->app_ctx->server->config->server_name);
-    r->reshdrslen += 1;
+  if (app_ctx->breaker == NULL) {
+    return 0;
+  }
+  *circuit = mrb_http2_breaker_get(app_ctx->breaker, r->upstream->host, r->upstream->port);
+  if (*circuit != NULL && !mrb_http2_breaker_allow(*circuit, probe)) {
+    if (*backend != NULL) {
+      mrb_http2_upstream_backend_cancel(*backend);
+      *backend = NULL;
+    }
+    *circuit = NULL;
+    if (app_ctx->server->config->server_status) {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_breaker_rejects);
+    }
+    return MRB_HTTP2_UPSTREAM_CIRCUIT_OPEN;
   }
+  return 0;
+}
 
-  c->stream_data->readleft = req->body_size;
-  snprintf(r->content_length, 64, "%ld", req->body_size);
-  c->stream_data->upstream_req = req;
-  event_base_loopexit(c->session_data->upstream_base, NULL);
+// the outcome of an upstream request, status 0 when it got no response
+static void upstream_attempt_done(app_context *app_ctx, mrb_http2_upstream_backend *backend,
+                                  mrb_http2_breaker_entry *circuit, int probe, int status,
+                                  const struct timeval *start)
+{
+  mrb_http2_config_t *config = app_ctx->server->config;
 
-  TRACER;
+  if (backend != NULL && mrb_http2_upstream_backend_done(backend, status, start) && config->server_status) {
+    MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_ejections);
+  }
+  if (circuit != NULL && mrb_http2_breaker_done(circuit, probe, status == 0 || status >= 500) &&
+      config->server_status) {
+    MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_breaker_opens);
+  }
 }
 
-static int read_upstream_response(http2_session_data *session_data, app_context *app_ctx, nghttp2_session *session,
-                                  http2_stream_data *stream_data)
+// an upstream request ended without an outcome
+static void upstream_attempt_cancel(mrb_http2_upstream_backend *backend, mrb_http2_breaker_entry *circuit,
+                                    int probe)
 {
-  struct evhttp_request *req;
-  struct mrb_http2_upstream_client *c;
-  mrb_http2_request_rec *r = app_ctx->r;
-  mrb_state *mrb = app_ctx->server->mrb;
-  size_t len;
-  int i;
-  int method;
-  char *cookiebuf = NULL;
-  size_t cookiebuflen = 0;
-  size_t cookiebaselen = 0;
-  char root_path[] = "/";
-
-  TRACER;
-  if (session_data->upstream_base == NULL) {
-    session_data->upstream_base = event_base_new();
+  if (backend != NULL) {
+    mrb_http2_upstream_backend_cancel(backend);
   }
-  if (session_data->upstream_conn == NULL) {
-    session_data->upstream_conn =
-        evhttp_connection_base_new(session_data->upstream_base, NULL, r->upstream->host, r->upstream->port);
+  if (circuit != NULL) {
+    mrb_http2_breaker_cancel(circuit, probe);
   }
-  if (session_data->upstream_conn == NULL) {
-    fprintf(stderr, "evhttp_connection_base_new failed");
-    return -1;
+}
+
+static void upstream_retry_earn(app_context *app_ctx)
+{
+  app_ctx->retry_tokens += app_ctx->server->config->upstream_retry_budget;
+  if (app_ctx->retry_tokens > MRB_HTTP2_UPSTREAM_RETRY_TOKENS_MAX) {
+    app_ctx->retry_tokens = MRB_HTTP2_UPSTREAM_RETRY_TOKENS_MAX;
   }
+}
 
-  c = (struct mrb_http2_upstream_client *)alloca(sizeof(struct mrb_http2_upstream_client));
-  c->app_ctx = app_ctx;
-  c->stream_data = stream_data;
-  c->session = session;
-  c->session_data = session_data;
+// used for Host and Location rewriting, freed by request_rec_free
+static void upstream_set_unparsed_host(mrb_http2_request_rec *r)
+{
+  size_t len = strlen(r->upstream->host) + sizeof(":65525");
 
-  req = evhttp_request_new(http_request_done, c);
-  if (req == NULL) {
-    fprintf(stderr, "evhttp_request_new failed");
-    return -1;
-  }
-  evhttp_request_own(req);
+  // set again by a retry
+  free(r->upstream->unparsed_host);
+  r->upstream->unparsed_host = malloc(len);
+  mrb_http2_resolver_authority(r->upstream->unparsed_host, len, r->upstream->host, r->upstream->port);
+}
 
-  len = strlen(r->upstream->host) + sizeof(":65525");
-  r->upstream->unparsed_host = alloca(len);
-  snprintf(r->upstream->unparsed_host, len, "%s:%d", r->upstream->host, r->upstream->port);
-  r->upstream->unparsed_host[len] = '\0';
+//
+// upstream response cache
+//
 
-  evhttp_add_header(req->output_headers, "Host", r->upstream->unparsed_host);
-  req->major = r->upstream->proto_major;
-  req->minor = r->upstream->proto_minor;
-  if (!r->upstream->keepalive && r->upstream->proto_minor == 1) {
-    evhttp_add_header(req->output_headers, "Connection", "close");
+static time_t upstream_cache_now(app_context *app_ctx)
+{
+  struct timeval tv;
+
+  event_base_gettimeofday_cached(app_ctx->evbase, &tv);
+  return tv.tv_sec;
+}
+
+// whether a header has the token in its value
+static int upstream_nv_has(const nghttp2_nv *nva, size_t nvlen, const char *name, const char *token)
+{
+  size_t i, j, namelen = strlen(name), len = token != NULL ? strlen(token) : 0;
+
+  for (i = 0; i < nvlen; i++) {
+    const nghttp2_nv *nv = &nva[i];
+    if (nv->namelen != namelen || strncasecmp((const char *)nv->name, name, namelen) != 0) {
+      continue;
+    }
+    if (token == NULL) {
+      return 1;
+    }
+    for (j = 0; j + len <= nv->valuelen; j++) {
+      if (strncasecmp((const char *)nv->value + j, token, len) == 0) {
+        return 1;
+      }
+    }
   }
+  return 0;
+}
 
-  // r->reqhdr don't include HTTP/2 specified headders
-  for (i = 0; i < r->reqhdrlen; i++) {
-    char keybuf[MRB_HTTP2_MAX_REQ_HEADER_SIZE], valbuf[MRB_HTTP2_MAX_REQ_HEADER_SIZE];
-    size_t len;
+static int upstream_request_has(mrb_http2_request_rec *r, const char *name, const char *token)
+{
+  return upstream_nv_has(r->reqhdr, r->reqhdrlen, name, token);
+}
 
-    if (memcmp("cookie", r->reqhdr[i].name, 6) == 0) {
-      cookiebaselen = cookiebuflen;
-      cookiebuflen += r->reqhdr[i].valuelen + 2;
-      cookiebuf = mrb_realloc(mrb, cookiebuf, cookiebuflen);
-      memcpy(cookiebuf + cookiebaselen, r->reqhdr[i].value, r->reqhdr[i].valuelen);
-      memcpy(cookiebuf + cookiebaselen + r->reqhdr[i].valuelen, "; ", 2);
-    } else {
-      len = r->reqhdr[i].namelen;
-      // for null termination
-      if (len > MRB_HTTP2_MAX_REQ_HEADER_SIZE - 1)
-        len = MRB_HTTP2_MAX_REQ_HEADER_SIZE - 1;
-      memcpy(keybuf, r->reqhdr[i].name, len);
-      keybuf[len] = '\0';
+// the response depends on the validators of the client
+static int upstream_request_conditional(mrb_http2_request_rec *r)
+{
+  return upstream_request_has(r, "if-none-match", NULL) || upstream_request_has(r, "if-modified-since", NULL) ||
+         upstream_request_has(r, "if-match", NULL) || upstream_request_has(r, "if-unmodified-since", NULL) ||
+         upstream_request_has(r, "if-range", NULL);
+}
 
-      len = r->reqhdr[i].valuelen;
-      if (len > MRB_HTTP2_MAX_REQ_HEADER_SIZE - 1)
-        len = MRB_HTTP2_MAX_REQ_HEADER_SIZE - 1;
-      memcpy(valbuf, r->reqhdr[i].value, len);
-      valbuf[len] = '\0';
+// GET and HEAD requests without credentials can share a response, unless
+// bypassed by upstream_cache_bypass=
+static int upstream_shareable(mrb_http2_request_rec *r)
+{
+  if (r->upstream->cache_bypass || (strcmp(r->method, "GET") != 0 && strcmp(r->method, "HEAD") != 0)) {
+    return 0;
+  }
+  // responses to authorized requests are private
+  return !upstream_request_has(r, "authorization", NULL);
+}
 
-      evhttp_add_header(req->output_headers, keybuf, valbuf);
+// the key set by upstream_cache_key= or "host:port/uri" of the upstream
+// request, where a group is named with port 0, after prefix
+static char *upstream_request_key(app_context *app_ctx, mrb_http2_request_rec *r, const char *prefix)
+{
+  mrb_http2_config_t *config = app_ctx->server->config;
+  const char *host, *uri;
+  size_t len;
+  char *key;
+
+  if (r->upstream->cache_key != NULL) {
+    len = strlen(prefix) + strlen(r->upstream->cache_key) + 1;
+    key = malloc(len);
+    if (key != NULL) {
+      snprintf(key, len, "%s%s", prefix, r->upstream->cache_key);
     }
+    return key;
   }
-  if (cookiebuf != NULL) {
-    cookiebuf = mrb_realloc(mrb, cookiebuf, cookiebuflen + 1);
-    cookiebuf[cookiebuflen] = '\0';
-    evhttp_add_header(req->output_headers, "Cookie", cookiebuf);
-    mrb_free(mrb, cookiebuf);
+  host = r->upstream->group >= 0 ? config->upstream_groups[r->upstream->group].name : r->upstream->host;
+  uri = r->upstream->uri != NULL ? r->upstream->uri : "/";
+  len = strlen(prefix) + strlen(host) + strlen(uri) + sizeof(":65535");
+  key = malloc(len);
+  if (key != NULL) {
+    snprintf(key, len, "%s%s:%d%s", prefix, host, r->upstream->group >= 0 ? 0 : r->upstream->port, uri);
   }
+  return key;
+}
 
-  if (app_ctx->server->config->debug) {
-    int i = 0;
-    struct evkeyval *header;
-    struct evkeyvalq *output_headers = evhttp_request_get_output_headers(req);
-    fprintf(stderr, "== DBUEG: request header at proxy START\n");
-    TAILQ_FOREACH(header, output_headers, next)
-    {
-      fprintf(stderr, "%s: nva[%d]={name=%s, value=%s}\n", __func__, i, header->key, header->value);
-      i++;
-    }
-    fprintf(stderr, "== DBUEG: request header at proxy END\n");
+// the cache key of the request, NULL when the request bypasses the cache
+static char *upstream_cache_key(app_context *app_ctx, mrb_http2_request_rec *r)
+{
+  if (app_ctx->cache == NULL || !upstream_shareable(r) || upstream_request_has(r, "cache-control", "no-store")) {
+    return NULL;
   }
+  return upstream_request_key(app_ctx, r, "");
+}
 
-  // POST check
-  if (memcmp(r->method, "POST", 4) == 0) {
-    if (r->request_body != NULL) {
-      evbuffer_add(req->output_buffer, r->request_body, strlen(r->request_body));
-    }
-    method = EVHTTP_REQ_POST;
-    if (app_ctx->server->config->debug) {
-      fprintf(stderr, "== DEBUG: send POST method to upstream server\n");
-      fprintf(stderr, "== DEBUG: request body=%s\n", r->request_body);
-    }
-  } else {
-    method = EVHTTP_REQ_GET;
-    if (app_ctx->server->config->debug) {
-      fprintf(stderr, "== DEBUG: send GET method to upstream server\n");
-    }
+static void upstream_cache_body_cleanup(const void *data, size_t datalen, void *extra)
+{
+  mrb_http2_cache_entry_unref((mrb_http2_cache_entry *)extra);
+}
+
+// submit the cached response, the body is referenced from the entry
+static int upstream_cache_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data,
+                                mrb_http2_cache_entry *entry)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+  const char *name, *value;
+  size_t pos = 0;
+  char age[32];
+
+  if (stream_data->upstream_body != NULL) {
+    evbuffer_free(stream_data->upstream_body);
   }
-  if (r->upstream->uri == NULL) {
-    r->upstream->uri = root_path;
+  // drop the headers of a 304 or an error response
+  if (r->reshdrslen > 0) {
+    mrb_http2_free_nva(mrb, r->reshdrs, r->reshdrslen);
+    r->reshdrslen = 0;
   }
-
-  if (evhttp_make_request(session_data->upstream_conn, req, method, r->upstream->uri) == -1) {
-    evhttp_request_free(req);
-    fprintf(stderr, "evhttp_connection_base_new failed");
-    return -1;
+  set_status_record(r, entry->status);
+  fixup_status_header(mrb, r);
+  while (pos < entry->headers_len && r->reshdrslen < MRB_HTTP2_HEADER_MAX - 1) {
+    pos = mrb_http2_cache_pair_next(entry->headers, pos, &name, &value);
+    if (strcmp(name, "age") != 0) {
+      MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], name, value);
+      r->reshdrslen += 1;
+    }
   }
+  snprintf(age, sizeof(age), "%ld", (long)(upstream_cache_now(app_ctx) - entry->stored));
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "age", age);
+  r->reshdrslen += 1;
 
-  evhttp_connection_set_timeout(req->evcon, r->upstream->timeout);
-  event_base_dispatch(session_data->upstream_base);
-  if (stream_data->upstream_req == NULL) {
-    return -1;
+  stream_data->upstream_body = evbuffer_new();
+  if (strcmp(r->method, "HEAD") != 0 && entry->body_len > 0) {
+    entry->refs++;
+    evbuffer_add_reference(stream_data->upstream_body, entry->body, entry->body_len, upstream_cache_body_cleanup,
+                           entry);
+    if (app_ctx->server->config->server_status) {
+      MRB_HTTP2_STAT_ADD(app_ctx->server->worker->upstream_cache_hit_bytes, entry->body_len);
+    }
   }
-  TRACER;
+  stream_data->upstream_eof = 1;
+  stream_data->cache_served = 1;
 
-  return 0;
+  return upstream_reply(app_ctx, session, stream_data);
 }
 
-static int content_cb_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+static void upstream_cache_refresh(app_context *app_ctx, mrb_http2_request_rec *r, mrb_http2_cache_entry *entry);
+
+// look up the response of the request, return 0 when served from the
+// cache, 1 when the request goes upstream
+static int upstream_cache_lookup(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
 {
   mrb_http2_request_rec *r = app_ctx->r;
-  mrb_http2_config_t *config = app_ctx->server->config;
-  mrb_state *mrb = app_ctx->server->mrb;
-
+  mrb_http2_worker_t *worker = app_ctx->server->worker;
+  int server_status = app_ctx->server->config->server_status;
+  mrb_http2_cache_entry *entry;
+  mrb_http2_cache_state state;
   int rv;
-  int pipefd[2];
-  int64_t size;
 
-  TRACER;
-  rv = pipe(pipefd);
-  if (rv != 0) {
-    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
-    mrb_http2_request_rec_free(mrb, r);
-    if (rv != 0) {
-      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-      return -1;
+  if (stream_data->request_early) {
+    return 1;
+  }
+  stream_data->cache_key = upstream_cache_key(app_ctx, r);
+  if (stream_data->cache_key == NULL) {
+    return 1;
+  }
+  entry = mrb_http2_cache_lookup(app_ctx->cache, stream_data->cache_key, r->reqhdr, r->reqhdrlen);
+  if (entry == NULL) {
+    if (server_status) {
+      MRB_HTTP2_STAT_INC(worker->upstream_cache_misses);
     }
-    return 0;
+    return 1;
   }
-  r->write_large_buf = NULL;
-  r->write_fd = pipefd[1];
 
-  //
-  // "set_content" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_CONTENT;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->content_cb, config->cb_list);
+  state = mrb_http2_cache_entry_state(entry, upstream_cache_now(app_ctx));
+  if (upstream_request_has(r, "cache-control", "no-cache") || upstream_request_has(r, "cache-control", "max-age=0") ||
+      upstream_request_has(r, "pragma", "no-cache")) {
+    state = MRB_HTTP2_CACHE_STALE;
+  }
+  if (state == MRB_HTTP2_CACHE_FRESH || state == MRB_HTTP2_CACHE_STALE_WHILE_REVALIDATE) {
+    if (state == MRB_HTTP2_CACHE_STALE_WHILE_REVALIDATE) {
+      upstream_cache_refresh(app_ctx, r, entry);
+    }
+    if (server_status) {
+      if (state == MRB_HTTP2_CACHE_FRESH) {
+        MRB_HTTP2_STAT_INC(worker->upstream_cache_hits);
+      } else {
+        MRB_HTTP2_STAT_INC(worker->upstream_cache_stale);
+      }
+    }
+    rv = upstream_cache_reply(app_ctx, session, stream_data, entry);
+    mrb_http2_cache_entry_unref(entry);
+    return rv != 0 ? NGHTTP2_ERR_CALLBACK_FAILURE : 0;
   }
 
-  fixup_status_header(mrb, r);
-
-  // create headers for HTTP/2
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
-  r->reshdrslen += 1;
-
-  if (r->status >= 200 && r->status < 300) {
-    size = r->write_size;
-  } else {
-    const char *msg = mrb_http2_error_message(r->status);
-    size = strlen(msg);
-    rv = write(pipefd[1], msg, size);
+  if (server_status) {
+    MRB_HTTP2_STAT_INC(worker->upstream_cache_misses);
+  }
+  // the conditional request of the client goes upstream as is
+  if (upstream_request_conditional(r)) {
+    mrb_http2_cache_entry_unref(entry);
+    return 1;
   }
+  // revalidated with its validators, and served on an upstream error
+  stream_data->cache_entry = entry;
+  return 1;
+}
 
-  close(pipefd[1]);
-  if (r->write_large_buf != NULL) {
-    mrb_http2_large_buf_close(r->write_large_buf, pipefd[0]);
+// the stale entry can be served when upstream failed before the response
+static int upstream_cache_stale_if_error(app_context *app_ctx, http2_stream_data *stream_data)
+{
+  if (stream_data->cache_entry == NULL ||
+      mrb_http2_cache_entry_state(stream_data->cache_entry, upstream_cache_now(app_ctx)) == MRB_HTTP2_CACHE_STALE) {
+    return 0;
   }
-  stream_data->fd = pipefd[0];
-  stream_data->readleft = size;
-  TRACER;
+  if (app_ctx->server->config->server_status) {
+    MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_cache_stale);
+  }
+  return 1;
+}
 
-  // set content-length: max 10^64
-  snprintf(r->content_length, 64, "%ld", (long)size);
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
-  r->reshdrslen += 1;
+// called with the upstream response headers in r->reshdrs, serve the
+// cached response for a 304 of the revalidation or an error allowed by
+// stale-if-error, otherwise fill a new entry by the response, return 1
+// when served from the cache, -1 on error
+static int upstream_cache_response(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data,
+                                   int status)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_cache_entry *entry = stream_data->cache_entry;
+  time_t now;
 
-  //
-  // "set_fixups_cb" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_FIXUPS;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+  if (stream_data->cache_key == NULL) {
+    return 0;
   }
-  if (r->write_large_buf == NULL) {
-    TRACER;
-    if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-      close(pipefd[0]);
-      return -1;
+  now = upstream_cache_now(app_ctx);
+  if (entry != NULL) {
+    if (status == HTTP_NOT_MODIFIED) {
+      mrb_http2_cache_entry_update(app_ctx->cache, entry, r->reshdrs, r->reshdrslen, now);
+      if (app_ctx->server->config->server_status) {
+        MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_cache_revalidated);
+      }
+      return upstream_cache_reply(app_ctx, session, stream_data, entry) != 0 ? -1 : 1;
     }
-  } else {
-    TRACER;
-    if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-      close(pipefd[0]);
-      mrb_http2_large_buf_free(r->write_large_buf);
-      free(r->write_large_buf);
-      r->write_large_buf = NULL;
-      return -1;
+    if (status >= 500 && upstream_cache_stale_if_error(app_ctx, stream_data)) {
+      return upstream_cache_reply(app_ctx, session, stream_data, entry) != 0 ? -1 : 1;
     }
   }
-  TRACER;
+  if (strcmp(r->method, "GET") == 0) {
+    stream_data->cache_fill = mrb_http2_cache_entry_new(app_ctx->cache, stream_data->cache_key, status, r->reshdrs,
+                                                        r->reshdrslen, r->reqhdr, r->reqhdrlen, now);
+  }
   return 0;
 }
 
-static int mruby_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+static void upstream_cache_fill(app_context *app_ctx, http2_stream_data *stream_data, const void *data, size_t len)
 {
-  mrb_http2_request_rec *r = app_ctx->r;
-  mrb_http2_config_t *config = app_ctx->server->config;
-  mrb_state *mrb = app_ctx->server->mrb;
-
-  int rv;
-  int pipefd[2];
-  mrb_state *mrb_inner;
-  struct mrb_parser_state *p = NULL;
-  struct RProc *proc = NULL;
-  FILE *rfp;
-  mrbc_context *c;
-  int64_t size;
-
-  if (r->shared_mruby) {
-    // share one mrb_state
-    mrb_inner = mrb;
-  } else if (r->mruby) {
-    // when use new mrb_state
-    mrb_inner = mrb_open();
-  } else {
-    mrb_inner = mrb_open();
+  if (mrb_http2_cache_entry_append(app_ctx->cache, stream_data->cache_fill, data, len) != 0) {
+    mrb_http2_cache_entry_unref(stream_data->cache_fill);
+    stream_data->cache_fill = NULL;
   }
+}
 
-  rfp = fopen(r->filename, "r");
-  if (rfp == NULL) {
-    if (r->mruby) {
-      mrb_close(mrb_inner);
-    }
-    set_status_record(r, HTTP_NOT_FOUND);
-    if (error_reply(app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
+// the upstream request finished, store the filled entry when complete
+static void upstream_cache_finish(app_context *app_ctx, http2_stream_data *stream_data, int complete)
+{
+  if (stream_data->cache_fill != NULL) {
+    if (complete) {
+      if (app_ctx->server->config->server_status) {
+        MRB_HTTP2_STAT_ADD(app_ctx->server->worker->upstream_cache_stored_bytes, stream_data->cache_fill->body_len);
+      }
+      mrb_http2_cache_store(app_ctx->cache, stream_data->cache_fill);
+    } else {
+      mrb_http2_cache_entry_unref(stream_data->cache_fill);
     }
-    return 0;
+    stream_data->cache_fill = NULL;
   }
+  if (stream_data->cache_entry != NULL) {
+    mrb_http2_cache_entry_unref(stream_data->cache_entry);
+    stream_data->cache_entry = NULL;
+  }
+}
 
-  TRACER;
-  rv = pipe(pipefd);
-  if (rv != 0) {
-    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
-    mrb_http2_request_rec_free(mrb, r);
-    if (rv != 0) {
-      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-      return -1;
+// a background revalidation of stale-while-revalidate, not tied to a stream,
+// the new response is filled as it arrives and dropped over max_object_size
+struct mrb_http2_cache_refresh {
+  app_context *app_ctx;
+  mrb_http2_cache_entry *entry;
+  mrb_http2_cache_entry *fill;
+  mrb_http2_upstream_conn *conn;
+  mrb_http2_upstream_backend *backend;
+  struct timeval start;
+  mrb_http2_breaker_entry *circuit;
+  int probe;
+};
+
+static size_t upstream_cache_refresh_headers(struct evhttp_request *req, nghttp2_nv *nva)
+{
+  struct evkeyval *header;
+  size_t nvlen = 0;
+
+  TAILQ_FOREACH(header, evhttp_request_get_input_headers(req), next)
+  {
+    if (nvlen < MRB_HTTP2_HEADER_MAX && !upstream_hop_by_hop(header->key)) {
+      nva[nvlen].name = (uint8_t *)header->key;
+      nva[nvlen].namelen = strlen(header->key);
+      nva[nvlen].value = (uint8_t *)header->value;
+      nva[nvlen].valuelen = strlen(header->value);
+      nvlen++;
     }
+  }
+  return nvlen;
+}
+
+static int upstream_cache_refresh_header(struct evhttp_request *req, void *ptr)
+{
+  struct mrb_http2_cache_refresh *f = ptr;
+  app_context *app_ctx = f->app_ctx;
+  mrb_http2_cache_entry *entry = f->entry;
+  int status = evhttp_request_get_response_code(req);
+  nghttp2_nv nva[MRB_HTTP2_HEADER_MAX], vary[MRB_HTTP2_HEADER_MAX];
+  size_t nvlen, varylen = 0, pos = 0;
+
+  if (status == HTTP_NOT_MODIFIED || status <= 0 || status >= 500) {
     return 0;
   }
+  nvlen = upstream_cache_refresh_headers(req, nva);
+  // the variant of the stale entry
+  while (pos < entry->vary_len && varylen < MRB_HTTP2_HEADER_MAX) {
+    const char *name, *value;
+    pos = mrb_http2_cache_pair_next(entry->vary, pos, &name, &value);
+    vary[varylen].name = (uint8_t *)name;
+    vary[varylen].namelen = strlen(name);
+    vary[varylen].value = (uint8_t *)value;
+    vary[varylen].valuelen = strlen(value);
+    varylen++;
+  }
+  f->fill = mrb_http2_cache_entry_new(app_ctx->cache, entry->key, status, nva, nvlen, vary, varylen,
+                                      upstream_cache_now(app_ctx));
+  return 0;
+}
 
-  r->write_large_buf = NULL;
-  r->write_fd = pipefd[1];
-  c = mrbc_context_new(mrb_inner);
-  mrbc_filename(mrb_inner, c, r->filename);
-  p = mrb_parse_file(mrb_inner, rfp, c);
-  fclose(rfp);
-  proc = mrb_generate_code(mrb_inner, p);
-  mrb_pool_close(p->pool);
-  mrb_run(mrb_inner, proc, app_ctx->self);
+// evhttp drains the input buffer after the callback
+static void upstream_cache_refresh_chunk(struct evhttp_request *req, void *ptr)
+{
+  struct mrb_http2_cache_refresh *f = ptr;
+  struct evbuffer *input = evhttp_request_get_input_buffer(req);
+  size_t len = evbuffer_get_length(input);
 
-  if (mrb_inner->exc) {
-    mrb_print_error(mrb_inner);
-    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
-    mrb_inner->exc = 0;
-  } else {
-    set_status_record(r, HTTP_OK);
+  if (f->fill == NULL || len == 0) {
+    return;
   }
-  mrbc_context_free(mrb_inner, c);
+  if (mrb_http2_cache_entry_append(f->app_ctx->cache, f->fill, evbuffer_pullup(input, -1), len) != 0) {
+    mrb_http2_cache_entry_unref(f->fill);
+    f->fill = NULL;
+  }
+}
 
-  // when use new mrb_state
-  if (r->mruby) {
-    mrb_close(mrb_inner);
-  }
+static void upstream_cache_refresh_done(struct evhttp_request *req, void *ptr)
+{
+  struct mrb_http2_cache_refresh *f = ptr;
+  app_context *app_ctx = f->app_ctx;
+  mrb_http2_cache_entry *entry = f->entry;
+  int status = req == NULL ? 0 : evhttp_request_get_response_code(req);
+  nghttp2_nv nva[MRB_HTTP2_HEADER_MAX];
+  size_t nvlen;
 
-  fixup_status_header(mrb, r);
+  mrb_http2_upstream_pool_put(f->conn, req != NULL);
+  upstream_attempt_done(app_ctx, f->backend, f->circuit, f->probe, status, &f->start);
+  entry->revalidating = 0;
 
-  // create headers for HTTP/2
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
-  r->reshdrslen += 1;
-  if (r->status >= 200 && r->status < 300) {
-    size = r->write_size;
-  } else {
-    const char *msg = mrb_http2_error_message(r->status);
-    size = strlen(msg);
-    rv = write(pipefd[1], msg, size);
+  if (status == HTTP_NOT_MODIFIED) {
+    nvlen = upstream_cache_refresh_headers(req, nva);
+    mrb_http2_cache_entry_update(app_ctx->cache, entry, nva, nvlen, upstream_cache_now(app_ctx));
+    if (app_ctx->server->config->server_status) {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_cache_revalidated);
+    }
+  } else if (f->fill != NULL && status > 0 && status < 500) {
+    // the rest not passed to upstream_cache_refresh_chunk
+    upstream_cache_refresh_chunk(req, f);
+    if (f->fill != NULL) {
+      if (app_ctx->server->config->server_status) {
+        MRB_HTTP2_STAT_ADD(app_ctx->server->worker->upstream_cache_stored_bytes, f->fill->body_len);
+      }
+      mrb_http2_cache_store(app_ctx->cache, f->fill);
+      f->fill = NULL;
+    }
   }
-  TRACER;
-  close(pipefd[1]);
-  if (r->write_large_buf != NULL) {
-    mrb_http2_large_buf_close(r->write_large_buf, pipefd[0]);
+  if (f->fill != NULL) {
+    mrb_http2_cache_entry_unref(f->fill);
   }
-  stream_data->fd = pipefd[0];
-  stream_data->readleft = size;
-  TRACER;
+  mrb_http2_cache_entry_unref(entry);
+  free(f);
+}
 
-  // set content-length: max 10^64
-  snprintf(r->content_length, 64, "%ld", (long)size);
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
-  r->reshdrslen += 1;
+// revalidate the entry served stale, HTTP/1.x upstreams only, the entry of
+// an HTTP/2 upstream is revalidated by a request after the window
+static void upstream_cache_refresh(app_context *app_ctx, mrb_http2_request_rec *r, mrb_http2_cache_entry *entry)
+{
+  struct mrb_http2_cache_refresh *f;
+  struct evhttp_request *req;
+  struct evkeyvalq *headers;
+  mrb_http2_upstream_pool_result pool_result;
+  const char *name, *value;
+  char host[NI_MAXHOST + sizeof(":65535")];
+  size_t pos = 0;
 
-  //
-  // "set_fixups_cb" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_FIXUPS;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+  if (entry->revalidating || r->upstream->proto_major != 1) {
+    return;
   }
-
-  if (r->write_large_buf == NULL) {
-    TRACER;
-    if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-      close(pipefd[0]);
-      return -1;
-    }
-  } else {
-    if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-      close(pipefd[0]);
-      mrb_http2_large_buf_free(r->write_large_buf);
-      free(r->write_large_buf);
-      r->write_large_buf = NULL;
-      return -1;
-    }
+  f = (struct mrb_http2_cache_refresh *)calloc(1, sizeof(struct mrb_http2_cache_refresh));
+  if (f == NULL) {
+    return;
   }
-  TRACER;
-  return 0;
+  f->app_ctx = app_ctx;
+  if (upstream_select_backend(app_ctx, r, &f->backend, &f->start, &f->circuit, &f->probe) != 0) {
+    free(f);
+    return;
+  }
+  f->conn = mrb_http2_upstream_pool_get(app_ctx->upstream_pool, r->upstream->host, r->upstream->port, r->upstream->tls,
+                                        &pool_result);
+  if (f->conn == NULL) {
+    upstream_attempt_done(app_ctx, f->backend, f->circuit, f->probe, 0, &f->start);
+    free(f);
+    return;
+  }
+  req = evhttp_request_new(upstream_cache_refresh_done, f);
+  if (req == NULL) {
+    mrb_http2_upstream_pool_put(f->conn, 1);
+    upstream_attempt_cancel(f->backend, f->circuit, f->probe);
+    free(f);
+    return;
+  }
+  evhttp_request_set_header_cb(req, upstream_cache_refresh_header);
+  evhttp_request_set_chunked_cb(req, upstream_cache_refresh_chunk);
+  headers = evhttp_request_get_output_headers(req);
+  mrb_http2_resolver_authority(host, sizeof(host), r->upstream->host, r->upstream->port);
+  evhttp_add_header(headers, "Host", host);
+  while (pos < entry->vary_len) {
+    pos = mrb_http2_cache_pair_next(entry->vary, pos, &name, &value);
+    evhttp_add_header(headers, name, value);
+  }
+  if ((value = mrb_http2_cache_entry_header(entry, "etag")) != NULL) {
+    evhttp_add_header(headers, "If-None-Match", value);
+  }
+  if ((value = mrb_http2_cache_entry_header(entry, "last-modified")) != NULL) {
+    evhttp_add_header(headers, "If-Modified-Since", value);
+  }
+
+  evhttp_connection_set_timeout(f->conn->evcon, r->upstream->timeout);
+  if (evhttp_make_request(f->conn->evcon, req, EVHTTP_REQ_GET, r->upstream->uri != NULL ? r->upstream->uri : "/") ==
+      -1) {
+    // evhttp freed req
+    mrb_http2_upstream_pool_put(f->conn, 0);
+    upstream_attempt_done(app_ctx, f->backend, f->circuit, f->probe, 0, &f->start);
+    free(f);
+    return;
+  }
+  entry->refs++;
+  entry->revalidating = 1;
+  f->entry = entry;
 }
 
-/* Inspired by h2o header lookup.  https://github.com/h2o/h2o */
-/* Reference as nghttp2 header lookup.  https://github.com/nghttp2/nghttp2
- */
+//
+// upstream request collapsing
+//
 
-static int memeq(const void *a, const void *b, size_t n)
+static int read_upstream_response(http2_session_data *session_data, app_context *app_ctx, nghttp2_session *session,
+                                  http2_stream_data *stream_data);
+static int read_upstream_h2(http2_session_data *session_data, app_context *app_ctx, http2_stream_data *stream_data);
+
+// the key of the requests sharing an upstream response, NULL when the
+// response may depend on the client
+static char *upstream_collapse_key(app_context *app_ctx, http2_stream_data *stream_data)
 {
-  return memcmp(a, b, n) == 0;
+  mrb_http2_request_rec *r = app_ctx->r;
+  char prefix[sizeof(stream_data->method) + 1];
+
+  if (!upstream_shareable(r) || r->request_body != NULL || upstream_request_has(r, "cookie", NULL) ||
+      upstream_request_has(r, "range", NULL) || upstream_request_conditional(r)) {
+    return NULL;
+  }
+  snprintf(prefix, sizeof(prefix), "%s ", r->method);
+  return upstream_request_key(app_ctx, r, prefix);
 }
 
-#define streq(A, B, N) ((sizeof((A)) - 1) == (N) && memeq((A), (B), (N)))
+// attach the stream to the same upstream request in flight, return 0 when
+// attached, 1 when the stream goes upstream leading a new flight or alone
+static int upstream_collapse_join(app_context *app_ctx, http2_stream_data *stream_data)
+{
+  mrb_http2_collapse_flight *flight;
+  char *key;
 
-typedef enum {
-  NGHTTP2_TOKEN__AUTHORITY,
-  NGHTTP2_TOKEN__METHOD,
-  NGHTTP2_TOKEN__PATH,
-  NGHTTP2_TOKEN__SCHEME,
-  NGHTTP2_TOKEN_HOST,
-} nghttp2_token;
+  if (stream_data->request_early) {
+    return 1;
+  }
+  key = upstream_collapse_key(app_ctx, stream_data);
+  if (key == NULL) {
+    return 1;
+  }
+  flight = mrb_http2_collapse_find(app_ctx->collapse, key);
+  if (flight != NULL) {
+    mrb_http2_collapse_link(&flight->waiters, &stream_data->collapse_waiter);
+    if (app_ctx->server->config->server_status) {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_collapsed);
+    }
+    free(key);
+    return 0;
+  }
+  stream_data->collapse = mrb_http2_collapse_start(app_ctx->collapse, key, stream_data);
+  free(key);
+  return 1;
+}
 
-static int lookup_token(const uint8_t *name, size_t namelen)
+// value of a request header, NULL when not found
+static const nghttp2_nv *upstream_collapse_request_header(mrb_http2_request_rec *r, const char *name, size_t namelen)
 {
-  switch (namelen) {
-  case 5:
-    switch (name[namelen - 1]) {
-    case 'h':
-      if (streq(":pat", name, 4)) {
-        return NGHTTP2_TOKEN__PATH;
-      }
-      break;
+  size_t i;
+
+  for (i = 0; i < r->reqhdrlen; i++) {
+    if (r->reqhdr[i].namelen == namelen && strncasecmp((const char *)r->reqhdr[i].name, name, namelen) == 0) {
+      return &r->reqhdr[i];
     }
-    break;
-  case 7:
-    switch (name[namelen - 1]) {
-    case 'd':
-      if (streq(":metho", name, 6)) {
-        return NGHTTP2_TOKEN__METHOD;
+  }
+  return NULL;
+}
+
+// whether the response to the leader r is selected for the request of the
+// waiter too by the headers named in its vary
+static int upstream_collapse_vary_match(mrb_http2_request_rec *r, mrb_http2_request_rec *waiter)
+{
+  const nghttp2_nv *a, *b;
+  const char *p, *end, *name;
+  size_t i;
+
+  for (i = 0; i < r->reshdrslen; i++) {
+    if (r->reshdrs[i].namelen != 4 || strncasecmp((const char *)r->reshdrs[i].name, "vary", 4) != 0) {
+      continue;
+    }
+    p = (const char *)r->reshdrs[i].value;
+    end = p + r->reshdrs[i].valuelen;
+    while (p < end) {
+      while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+        p++;
       }
-      break;
-    case 'e':
-      if (streq(":schem", name, 6)) {
-        return NGHTTP2_TOKEN__SCHEME;
+      name = p;
+      while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+        p++;
       }
-      break;
-    }
-    break;
-  case 10:
-    switch (name[namelen - 1]) {
-    case 'y':
-      if (streq(":authorit", name, 9)) {
-        return NGHTTP2_TOKEN__AUTHORITY;
+      if (p == name) {
+        continue;
+      }
+      if (p - name == 1 && *name == '*') {
+        return 0;
+      }
+      a = upstream_collapse_request_header(r, name, p - name);
+      b = upstream_collapse_request_header(waiter, name, p - name);
+      if ((a == NULL) != (b == NULL) ||
+          (a != NULL && (a->valuelen != b->valuelen || memcmp(a->value, b->value, a->valuelen) != 0))) {
+        return 0;
       }
-      break;
     }
-    break;
   }
-  return -1;
+  return 1;
 }
 
-static int server_on_header_callback(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
-                                     size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags,
-                                     void *user_data)
+// send the waiter upstream alone, or reply the failure of the leader
+static void upstream_collapse_dispatch(app_context *app_ctx, http2_stream_data *stream_data, int failed)
 {
-  http2_session_data *session_data = (http2_session_data *)user_data;
-  mrb_state *mrb = session_data->app_ctx->server->mrb;
-  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  http2_session_data *session_data = stream_data->session_data;
+  mrb_http2_request_rec *r = stream_data->r;
+  mrb_http2_request_rec *prev;
+  int rv = -1;
+
+  prev = mrb_http2_request_rec_bind(app_ctx, r);
+  if (!failed) {
+    if (r->upstream->proto_major == 2) {
+      rv = read_upstream_h2(session_data, app_ctx, stream_data);
+    } else {
+      rv = read_upstream_response(session_data, app_ctx, session_data->session, stream_data);
+    }
+  }
+  if (rv != 0) {
+    if (upstream_cache_stale_if_error(app_ctx, stream_data)) {
+      rv = upstream_cache_reply(app_ctx, session_data->session, stream_data, stream_data->cache_entry);
+    } else {
+      set_status_record(r, rv == MRB_HTTP2_UPSTREAM_CIRCUIT_OPEN ? HTTP_SERVICE_UNAVAILABLE : HTTP_BAD_GATEWAY);
+      rv = error_reply(app_ctx, session_data->session, stream_data);
+    }
+    if (rv != 0) {
+      nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                                NGHTTP2_INTERNAL_ERROR);
+    }
+    upstream_cache_finish(app_ctx, stream_data, 0);
+  }
+  mrb_http2_request_rec_bind(app_ctx, prev);
+  session_send_later(session_data);
+}
 
-  http2_stream_data *stream_data;
-  nghttp2_nv nv;
+// the waiter gets the response headers of the leader bound to app_ctx->r,
+// and follows its body
+static void upstream_collapse_follow(app_context *app_ctx, http2_stream_data *leader, http2_stream_data *stream_data)
+{
+  mrb_state *mrb = app_ctx->server->mrb;
+  http2_session_data *session_data = stream_data->session_data;
+  mrb_http2_request_rec *r = stream_data->r;
+  mrb_http2_request_rec *prev;
+  size_t i;
 
-  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
-    return 0;
-  }
+  prev = mrb_http2_request_rec_bind(app_ctx, r);
+  if (r->reshdrslen > 0) {
+    mrb_http2_free_nva(mrb, r->reshdrs, r->reshdrslen);
+  }
+  for (i = 0; i < prev->reshdrslen; i++) {
+    mrb_http2_create_nv(mrb, &r->reshdrs[i], prev->reshdrs[i].name, prev->reshdrs[i].namelen, prev->reshdrs[i].value,
+                        prev->reshdrs[i].valuelen);
+  }
+  r->reshdrslen = prev->reshdrslen;
+  set_status_record(r, prev->status);
+  memcpy(r->content_length, prev->content_length, sizeof(r->content_length));
+
+  // the body of a response from the cache is there already, and shared
+  // with the entry by reference
+  stream_data->upstream_body = evbuffer_new();
+  evbuffer_add_buffer_reference(stream_data->upstream_body, leader->upstream_body);
+  stream_data->upstream_eof = leader->upstream_eof;
+  upstream_cache_finish(app_ctx, stream_data, 0);
+  if (!stream_data->upstream_eof) {
+    mrb_http2_collapse_link(&leader->collapse->followers, &stream_data->collapse_waiter);
+  }
+  if (upstream_reply(app_ctx, session_data->session, stream_data) != 0) {
+    mrb_http2_collapse_unlink(&stream_data->collapse_waiter);
+    nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                              NGHTTP2_INTERNAL_ERROR);
+  }
+  mrb_http2_request_rec_bind(app_ctx, prev);
+  session_send_later(session_data);
+}
 
-  stream_data = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
-  if (!stream_data) {
-    return 0;
+// called with the response headers of the leader before they are submitted,
+// the waiters selecting the same response follow it and the others go
+// upstream alone, so does every waiter when the response is private
+static void upstream_collapse_release(app_context *app_ctx, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_collapse_flight *flight = stream_data->collapse;
+  mrb_http2_collapse_waiter *w;
+  int shared;
+
+  mrb_http2_collapse_close(flight);
+  shared = !upstream_nv_has(r->reshdrs, r->reshdrslen, "set-cookie", NULL) &&
+           !upstream_nv_has(r->reshdrs, r->reshdrslen, "cache-control", "private") &&
+           !upstream_nv_has(r->reshdrs, r->reshdrslen, "cache-control", "no-store");
+  while ((w = mrb_http2_collapse_pop(&flight->waiters)) != NULL) {
+    http2_stream_data *waiter = w->data;
+    if (shared && upstream_collapse_vary_match(r, waiter->r)) {
+      upstream_collapse_follow(app_ctx, stream_data, waiter);
+    } else {
+      upstream_collapse_dispatch(app_ctx, waiter, 0);
+    }
   }
+}
 
-  if (session_data->app_ctx->server->config->debug) {
-    debug_header(__func__, name, namelen, value, valuelen);
+// pass a part of the response body of the leader to the followers, copied
+// once into a chunk referenced by their buffers
+static void upstream_collapse_body(http2_stream_data *stream_data, const void *data, size_t len)
+{
+  mrb_http2_collapse_flight *flight = stream_data->collapse;
+  mrb_http2_collapse_chunk *chunk;
+  mrb_http2_collapse_waiter *w;
+  http2_stream_data *follower;
+
+  if (flight == NULL || flight->followers.next == &flight->followers || len == 0) {
+    return;
+  }
+  chunk = mrb_http2_collapse_chunk_new(data, len);
+  if (chunk == NULL) {
+    return;
+  }
+  for (w = flight->followers.next; w != &flight->followers; w = w->next) {
+    follower = w->data;
+    mrb_http2_collapse_chunk_add(follower->upstream_body, chunk);
+    if (follower->upstream_deferred) {
+      follower->upstream_deferred = 0;
+      nghttp2_session_resume_data(follower->session_data->session, follower->stream_id);
+    }
+    session_send_later(follower->session_data);
   }
+  mrb_http2_collapse_chunk_unref(chunk);
+}
 
-  switch (lookup_token(name, namelen)) {
-    size_t j;
-  case NGHTTP2_TOKEN__AUTHORITY:
-    memcpy(stream_data->authority, value, valuelen);
-    stream_data->authority[valuelen] = '\0';
-    return 0;
+// the upstream request of the leader finished, the followers end with it
+// and the waiters left get its failure
+static void upstream_collapse_finish(http2_stream_data *stream_data, int complete)
+{
+  mrb_http2_collapse_flight *flight = stream_data->collapse;
 
-  case NGHTTP2_TOKEN__METHOD:
-    memcpy(stream_data->method, value, valuelen);
-    stream_data->method[valuelen] = '\0';
-    return 0;
+  if (flight == NULL) {
+    return;
+  }
+  flight->complete = complete;
+  flight->failed = flight->joinable;
+  stream_data->collapse = NULL;
+  mrb_http2_collapse_settle(flight);
+}
 
-  case NGHTTP2_TOKEN__SCHEME:
-    memcpy(stream_data->scheme, value, valuelen);
-    stream_data->scheme[valuelen] = '\0';
-    return 0;
+// called on the worker loop after the leader finished or was gone
+static void upstream_collapse_settle_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  mrb_http2_collapse_flight *flight = ptr;
+  app_context *app_ctx = flight->collapse->arg;
+  mrb_http2_collapse_waiter *w;
+  http2_stream_data *stream_data;
 
-  case NGHTTP2_TOKEN__PATH:
-    if (config->upstream) {
-      stream_data->percent_encode_uri = mrb_http2_strcopy(mrb, (const char *)value, valuelen);
-    }
-    stream_data->unparsed_uri = percent_decode(mrb, value, valuelen);
-    for (j = 0; j < valuelen && value[j] != '?'; ++j)
-      ;
-    if (j == valuelen) {
-      stream_data->request_args = NULL;
-      stream_data->request_path = stream_data->unparsed_uri;
+  while ((w = mrb_http2_collapse_pop(&flight->followers)) != NULL) {
+    stream_data = w->data;
+    if (flight->complete) {
+      stream_data->upstream_eof = 1;
+      if (stream_data->upstream_deferred) {
+        stream_data->upstream_deferred = 0;
+        nghttp2_session_resume_data(stream_data->session_data->session, stream_data->stream_id);
+      }
     } else {
-      stream_data->request_path = percent_decode(mrb, value, j);
-      stream_data->request_args = percent_decode(mrb, value + j, valuelen - j);
+      // the body was cut off, the client must not take it as complete
+      nghttp2_submit_rst_stream(stream_data->session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                                NGHTTP2_INTERNAL_ERROR);
     }
-    return 0;
-
-  default:
-    break;
+    session_send_later(stream_data->session_data);
+  }
+  while ((w = mrb_http2_collapse_pop(&flight->waiters)) != NULL) {
+    upstream_collapse_dispatch(app_ctx, w->data, flight->failed);
   }
+  mrb_http2_collapse_flight_free(flight);
+  mrb_http2_gc_schedule(app_ctx);
+}
 
-  // create nv and add stream_data->nva except for HTTP/2 specified headers
-  mrb_http2_create_nv(mrb, &nv, name, namelen, value, valuelen);
-  stream_data->nvlen = mrb_http2_add_nv(stream_data->nva, stream_data->nvlen, &nv);
+//
+// upstream retries and timeouts
+//
 
-  return 0;
+static int upstream_idempotent(const char *method)
+{
+  return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 || strcmp(method, "OPTIONS") == 0 ||
+         strcmp(method, "TRACE") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0;
 }
 
-static int server_on_begin_headers_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+// send the request which got no response upstream again when it's
+// idempotent, its body wasn't streamed and the retry budget allows,
+// r of the stream is bound, 0 when sent
+static int upstream_retry(app_context *app_ctx, http2_session_data *session_data, http2_stream_data *stream_data)
 {
-  http2_session_data *session_data = (http2_session_data *)user_data;
-
-  http2_stream_data *stream_data;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_http2_request_rec *r = stream_data->r;
 
-  TRACER;
-  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
-    return 0;
+  if (r->upstream == NULL || stream_data->upstream_retries >= config->upstream_retries ||
+      stream_data->request_early || stream_data->upload || !upstream_idempotent(r->method) ||
+      app_ctx->retry_tokens < MRB_HTTP2_UPSTREAM_RETRY_TOKEN) {
+    return -1;
   }
-  stream_data = create_http2_stream_data(session_data->app_ctx->server->mrb, session_data, frame->hd.stream_id);
-  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream_data);
-
-  TRACER;
-  return 0;
+  app_ctx->retry_tokens -= MRB_HTTP2_UPSTREAM_RETRY_TOKEN;
+  stream_data->upstream_retries++;
+  if (config->server_status) {
+    MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_retries);
+  }
+  if (r->upstream->proto_major == 2) {
+    return read_upstream_h2(session_data, app_ctx, stream_data);
+  }
+  return read_upstream_response(session_data, app_ctx, session_data->session, stream_data);
 }
 
-/* Minimum check for directory traversal. Returns nonzero if it is
-   safe. */
-static int check_path(const char *path)
+static void upstream_timer_add(struct event *timer, mrb_int msec)
 {
-  size_t len = strlen(path);
-  return path[0] == '/' && strchr(path, '\\') == NULL && strstr(path, "/../") == NULL && strstr(path, "/./") == NULL &&
-         (len < 3 || memcmp(path + len - 3, "/..", 3) != 0) && (len < 2 || memcmp(path + len - 2, "/.", 2) != 0);
+  struct timeval tv;
+
+  tv.tv_sec = msec / 1000;
+  tv.tv_usec = (msec % 1000) * 1000;
+  evtimer_add(timer, &tv);
 }
 
-static void fixup_status_header(mrb_state *mrb, mrb_http2_request_rec *r)
+static int upstream_connected(struct bufferevent *bev)
 {
-  int i = mrb_http2_get_nv_id(r->reshdrs, r->reshdrslen, ":status");
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  evutil_socket_t fd = bufferevent_getfd(bev);
 
-  if (r->reshdrslen == 0) {
-    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], ":status", r->status_line);
-    r->reshdrslen += 1;
-    return;
-  }
+  return fd != -1 && getpeername(fd, (struct sockaddr *)&ss, &len) == 0;
+}
 
-  if (i == MRB_HTTP2_HEADER_NOT_FOUND && r->reshdrslen > 0) {
-    mrb_http2_create_nv(mrb, &r->reshdrs[r->reshdrslen], r->reshdrs[0].name, r->reshdrs[0].namelen, r->reshdrs[0].value,
-                        r->reshdrs[0].valuelen);
-    r->reshdrslen += 1;
-    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[0], ":status", r->status_line);
-  } else if (i > 0) {
-    mrb_http2_create_nv(mrb, &r->reshdrs[r->reshdrslen], r->reshdrs[0].name, r->reshdrs[0].namelen, r->reshdrs[0].value,
-                        r->reshdrs[0].valuelen);
-    r->reshdrslen += 1;
-    mrb_http2_create_nv(mrb, &r->reshdrs[0], r->reshdrs[i].name, r->reshdrs[i].namelen, r->reshdrs[i].value,
-                        r->reshdrs[i].valuelen);
+static void upstream_written_remove(struct mrb_http2_upstream_client *c)
+{
+  if (c->written != NULL) {
+    evbuffer_remove_cb_entry(bufferevent_get_output(evhttp_connection_get_bufferevent(c->conn->evcon)), c->written);
+    c->written = NULL;
   }
 }
 
-static int mrb_http2_send_custom_response(app_context *app_ctx, nghttp2_session *session,
-                                          http2_stream_data *stream_data)
+// the request left the output buffer of the connection, the first byte
+// timeout starts now
+static void upstream_written_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
 {
+  struct mrb_http2_upstream_client *c = arg;
+  mrb_http2_config_t *config = c->app_ctx->server->config;
 
-  mrb_http2_request_rec *r = app_ctx->r;
-  mrb_http2_config_t *config = app_ctx->server->config;
-  mrb_state *mrb = app_ctx->server->mrb;
-
-  if (r->status == 0) {
-    set_status_record(r, HTTP_OK);
+  // evhttp drains the output buffer when it resets the connection too
+  if (info->n_deleted == 0 || evbuffer_get_length(buf) > 0 ||
+      !upstream_connected(evhttp_connection_get_bufferevent(c->conn->evcon))) {
+    return;
   }
+  upstream_written_remove(c);
+  c->connecting = 0;
+  if (config->upstream_first_byte_timeout > 0) {
+    upstream_timer_add(c->timer, config->upstream_first_byte_timeout);
+  } else {
+    evtimer_del(c->timer);
+  }
+}
 
-  fixup_status_header(mrb, r);
-
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", app_ctx->server->config->server_name);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
-  r->reshdrslen += 1;
+// evhttp only has the idle timeout, the connect timeout expires first on
+// a new connection, then the first byte timeout since the request was
+// written
+static void upstream_timeout_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  struct mrb_http2_upstream_client *c = ptr;
+  app_context *app_ctx = c->app_ctx;
 
-  //
-  // "set_fixups_cb" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_FIXUPS;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+  // connected in time, the request is still being written
+  if (c->connecting && upstream_connected(evhttp_connection_get_bufferevent(c->conn->evcon))) {
+    c->connecting = 0;
+    return;
   }
-
-  if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-    close(stream_data->fd);
-    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  if (app_ctx->server->config->server_status) {
+    MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_timeouts);
   }
-  return 0;
+  // evhttp resets the connection of a cancelled request and doesn't call
+  // http_request_done, fail the attempt as a request without response
+  upstream_written_remove(c);
+  evhttp_cancel_request(c->req);
+  c->keepalive = 0;
+  http_request_done(NULL, c);
 }
 
-static int mrb_http2_send_200_response(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+// a request queued behind another one on the connection has the idle
+// timeout only
+static void upstream_timer_start(struct mrb_http2_upstream_client *c, mrb_http2_upstream_pool_result pool_result)
 {
+  mrb_http2_config_t *config = c->app_ctx->server->config;
 
-  mrb_http2_request_rec *r = app_ctx->r;
-  nghttp2_nv hdrs[] = {MAKE_NV(":status", "200"), MAKE_NV_CS("server", app_ctx->server->config->server_name),
-                       MAKE_NV_CS("date", r->date), MAKE_NV_CS("content-length", r->content_length),
-                       MAKE_NV_CS("last-modified", r->last_modified)};
-
-  r->status = 200;
-
-  if (send_response(app_ctx, session, hdrs, ARRLEN(hdrs), stream_data) != 0) {
-    close(stream_data->fd);
-    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  if (pool_result == MRB_HTTP2_UPSTREAM_POOL_WAIT) {
+    return;
+  }
+  c->connecting = pool_result == MRB_HTTP2_UPSTREAM_POOL_CONNECT && config->upstream_connect_timeout > 0;
+  if (!c->connecting && config->upstream_first_byte_timeout == 0) {
+    return;
+  }
+  c->timer = evtimer_new(c->app_ctx->evbase, upstream_timeout_cb, c);
+  if (c->timer == NULL) {
+    c->connecting = 0;
+    return;
+  }
+  if (config->upstream_first_byte_timeout > 0) {
+    c->written = evbuffer_add_cb(bufferevent_get_output(evhttp_connection_get_bufferevent(c->conn->evcon)),
+                                 upstream_written_cb, c);
+  }
+  if (c->connecting) {
+    upstream_timer_add(c->timer, config->upstream_connect_timeout);
   }
-  return 0;
 }
 
-static int mrb_http2_process_request(nghttp2_session *session, http2_session_data *session_data,
-                                     http2_stream_data *stream_data)
+// called on the worker loop when the upstream response headers arrived,
+// submit the response headers and stream the body by http_request_chunk
+static int http_request_header(struct evhttp_request *req, void *user_data)
 {
-  int fd;
-  struct stat finfo;
-  time_t now = time(NULL);
-  mrb_http2_request_rec *r = session_data->app_ctx->r;
-  mrb_http2_config_t *config = session_data->app_ctx->server->config;
-  mrb_state *mrb = session_data->app_ctx->server->mrb;
+  struct mrb_http2_upstream_client *c = user_data;
+  app_context *app_ctx = c->app_ctx;
+  http2_session_data *session_data = c->session_data;
+  http2_stream_data *stream_data = c->stream_data;
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_request_rec *r = stream_data->r;
+  mrb_http2_request_rec *prev;
+  int find_via = 0;
+  int rv;
 
-  //
-  // Request process phase
-  //
+  struct evkeyval *header;
+  struct evkeyvalq *input_headers;
 
-  // cached time string created strftime()
-  // create r->date for error_reply
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_READ_REQUEST;
-  }
-  if (now != r->prev_req_time) {
-    r->prev_req_time = now;
-    set_http_date_str(&now, r->date);
+  TRACER;
+  // the first byte arrived, evhttp times out an idle response
+  upstream_written_remove(c);
+  if (c->timer != NULL) {
+    evtimer_del(c->timer);
   }
+  prev = mrb_http2_request_rec_bind(app_ctx, r);
+  input_headers = evhttp_request_get_input_headers(req);
 
-  // get connection record
-  r->conn = session_data->conn;
-
-  // get requset header table and table length
-  r->reqhdr = stream_data->nva;
-  r->reqhdrlen = stream_data->nvlen;
+  set_status_record(r, req->response_code);
+  fixup_status_header(mrb, r);
 
-  if (config->debug) {
-    int i;
-    for (i = 0; i < stream_data->nvlen; i++) {
-      debug_header(__func__, stream_data->nva[i].name, stream_data->nva[i].namelen, stream_data->nva[i].value,
-                   stream_data->nva[i].valuelen);
+  TAILQ_FOREACH(header, input_headers, next)
+  {
+    if (upstream_response_header(app_ctx, r, header->key, header->value) == 1) {
+      find_via = 1;
     }
   }
-
-  TRACER;
-  if (!stream_data->request_path) {
-    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
-    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
-    return 0;
+  if (!find_via) {
+    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "via", app_ctx->server->config->server_name);
+    r->reshdrslen += 1;
   }
-  if (config->debug) {
-    fprintf(stderr, "from %s to %s %s %s\n", session_data->client_addr, stream_data->authority, stream_data->method,
-            stream_data->request_path);
+
+  rv = upstream_cache_response(app_ctx, session_data->session, stream_data, req->response_code);
+  if (rv == 0) {
+    stream_data->upstream_body = evbuffer_new();
+    rv = upstream_reply(app_ctx, session_data->session, stream_data);
+  } else if (rv == 1) {
+    rv = 0;
   }
-  TRACER;
-  if (!check_path(stream_data->request_path)) {
-    if (config->debug) {
-      fprintf(stderr, "%s invalid request_path: %s\n", session_data->client_addr, stream_data->request_path);
-    }
-    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
-    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
-    return 0;
+  mrb_http2_request_rec_bind(app_ctx, prev);
+  if (rv != 0) {
+    // http_request_done replies 502
+    return -1;
   }
+  c->headers_sent = 1;
 
-  // r-> will free at request_rec_free
-  r->filename = mrb_http2_strcat(mrb, config->document_root, stream_data->request_path);
+  if (session_send(session_data) != 0) {
+    upstream_client_orphan(c);
+    delete_http2_session_data(session_data);
+    return -1;
+  }
+  TRACER;
+  return 0;
+}
 
-  r->authority = stream_data->authority;
-  r->scheme = stream_data->scheme;
-  r->method = stream_data->method;
-  r->unparsed_uri = stream_data->unparsed_uri;
-  r->percent_encode_uri = stream_data->percent_encode_uri;
-  r->uri = stream_data->request_path;
-  r->args = stream_data->request_args;
-  r->response_type = MRB_HTTP2_RESPONSE_TYPE_NONE;
+// called on the worker loop when a part of the upstream response body
+// arrived, stop reading from upstream while the client is slow
+static void http_request_chunk(struct evhttp_request *req, void *user_data)
+{
+  struct mrb_http2_upstream_client *c = user_data;
+  http2_session_data *session_data = c->session_data;
+  http2_stream_data *stream_data = c->stream_data;
 
-  if (stream_data->request_body != NULL) {
-    r->request_body = stream_data->request_body->data;
-  } else {
-    r->request_body = NULL;
+  TRACER;
+  // evhttp drains the input buffer
+  if (stream_data == NULL || stream_data->cache_served) {
+    return;
   }
+  if (stream_data->cache_fill != NULL || stream_data->collapse != NULL) {
+    struct evbuffer *input = evhttp_request_get_input_buffer(req);
+    size_t len = evbuffer_get_length(input);
+    unsigned char *data = evbuffer_pullup(input, -1);
 
-  if (config->debug) {
-    fprintf(stderr, "=== process request information start ===\n");
-    fprintf(stderr, "percent_encode_uri: %s\n", r->percent_encode_uri);
-    fprintf(stderr, "unparsed_uri: %s\n", r->unparsed_uri);
-    fprintf(stderr, "uri: %s\n", r->uri);
-    fprintf(stderr, "request_body: %s\n", r->request_body);
-    fprintf(stderr, "args: %s\n", r->args);
-    fprintf(stderr, "filename: %s\n", r->filename);
-    fprintf(stderr, "hostname: %s\n", r->authority);
-    fprintf(stderr, "scheme: %s\n", r->scheme);
-    fprintf(stderr, "method: %s\n", r->method);
-    fprintf(stderr, "client_addr: %s\n", session_data->client_addr);
-    fprintf(stderr, "document_root: %s\n", config->document_root);
-    fprintf(stderr, "=== process request information end ===\n");
+    if (stream_data->cache_fill != NULL) {
+      upstream_cache_fill(c->app_ctx, stream_data, data, len);
+    }
+    upstream_collapse_body(stream_data, data, len);
   }
-
-  //
-  // "set_map_to_storage" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_MAP_TO_STORAGE;
-    callback_ruby_block(mrb, session_data->app_ctx->self, config->callback, config->cb_list->map_to_storage_cb,
-                        config->cb_list);
+  evbuffer_add_buffer(stream_data->upstream_body, evhttp_request_get_input_buffer(req));
+  if (!stream_data->upstream_paused &&
+      evbuffer_get_length(stream_data->upstream_body) >= MRB_HTTP2_UPSTREAM_BODY_HIGH_WATER) {
+    bufferevent_disable(evhttp_connection_get_bufferevent(c->conn->evcon), EV_READ);
+    stream_data->upstream_paused = 1;
   }
-
-  if (config->debug) {
-    fprintf(stderr, "%s %s is mapped to %s\n", session_data->client_addr, r->uri, r->filename);
+  if (stream_data->upstream_deferred) {
+    stream_data->upstream_deferred = 0;
+    nghttp2_session_resume_data(session_data->session, stream_data->stream_id);
   }
-
-  //
-  // "set_access_checker" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_ACCESS_CHECKER;
-    callback_ruby_block(mrb, session_data->app_ctx->self, config->callback, config->cb_list->access_checker_cb,
-                        config->cb_list);
+  if (session_send(session_data) != 0) {
+    upstream_client_orphan(c);
+    delete_http2_session_data(session_data);
   }
+  TRACER;
+}
 
-  // check whether set status or not on access_checker callback
-  if (r->status && r->status != HTTP_OK) {
-    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
-    return 0;
+// called on the worker loop when the upstream response was received or
+// the request failed, then finish or reset the response of the stream
+void http_request_done(struct evhttp_request *req, void *user_data)
+{
+  struct mrb_http2_upstream_client *c = user_data;
+  app_context *app_ctx = c->app_ctx;
+  http2_session_data *session_data = c->session_data;
+  http2_stream_data *stream_data = c->stream_data;
+  mrb_http2_request_rec *r;
+  mrb_http2_request_rec *prev;
+  int headers_sent = c->headers_sent;
+  int status = req == NULL ? 0 : evhttp_request_get_response_code(req);
+  int rv = 0;
+
+  TRACER;
+  upstream_written_remove(c);
+  if (c->timer != NULL) {
+    event_free(c->timer);
+    c->timer = NULL;
+  }
+  if (stream_data != NULL && stream_data->upstream_paused) {
+    bufferevent_enable(evhttp_connection_get_bufferevent(c->conn->evcon), EV_READ);
+    stream_data->upstream_paused = 0;
+  }
+  mrb_http2_upstream_pool_put(c->conn, c->keepalive);
+  if (stream_data == NULL) {
+    upstream_attempt_cancel(c->backend, c->circuit, c->probe);
+  } else {
+    upstream_attempt_done(app_ctx, c->backend, c->circuit, c->probe, status, &c->start);
+  }
+  free(c);
+  if (stream_data == NULL) {
+    return;
   }
+  stream_data->upstream = NULL;
+  r = stream_data->r;
+  prev = mrb_http2_request_rec_bind(app_ctx, r);
 
-  // check proxy config
-  if (config->upstream && r->upstream && r->upstream->host) {
-    if (config->debug) {
-      fprintf(stderr, "found upstream: server:%s:%d uri:%s\n", r->upstream->host, r->upstream->port, r->upstream->uri);
+  if (!headers_sent) {
+    if (app_ctx->server->config->debug && r->upstream != NULL) {
+      fprintf(stderr, "upstream %s:%d failed\n", r->upstream->host, r->upstream->port);
     }
-    if (read_upstream_response(session_data, session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    // no response at all, the next attempt finishes the stream
+    if (status == 0 && (rv = upstream_retry(app_ctx, session_data, stream_data)) == 0) {
+      mrb_http2_request_rec_bind(app_ctx, prev);
+      return;
     }
-
-    if (upstream_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    if (upstream_cache_stale_if_error(app_ctx, stream_data)) {
+      rv = upstream_cache_reply(app_ctx, session_data->session, stream_data, stream_data->cache_entry);
+    } else {
+      set_status_record(r, rv == MRB_HTTP2_UPSTREAM_CIRCUIT_OPEN ? HTTP_SERVICE_UNAVAILABLE : HTTP_BAD_GATEWAY);
+      rv = error_reply(app_ctx, session_data->session, stream_data);
+    }
+  } else if (req == NULL && !stream_data->cache_served) {
+    // the body was cut off, the client must not take it as complete
+    rv = nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                                   NGHTTP2_INTERNAL_ERROR);
+  } else {
+    stream_data->upstream_eof = 1;
+    if (stream_data->upstream_deferred) {
+      stream_data->upstream_deferred = 0;
+      nghttp2_session_resume_data(session_data->session, stream_data->stream_id);
     }
-    return 0;
   }
+  upstream_cache_finish(app_ctx, stream_data, headers_sent && req != NULL);
+  upstream_collapse_finish(stream_data, headers_sent && req != NULL);
 
-  // run mruby script
-  if (r->mruby || r->shared_mruby) {
-    set_status_record(r, HTTP_OK);
-    if (mruby_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
-    return 0;
+  mrb_http2_request_rec_bind(app_ctx, prev);
+  if (rv != 0 || session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
   }
+  mrb_http2_gc_schedule(app_ctx);
+  TRACER;
+}
 
-  // hook content_cb
-  if (config->callback && config->cb_list->content_cb) {
-    set_status_record(r, HTTP_OK);
-    if (content_cb_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
-    return 0;
+static int upstream_method(const char *method)
+{
+  if (strcmp(method, "GET") == 0) {
+    return EVHTTP_REQ_GET;
+  } else if (strcmp(method, "POST") == 0) {
+    return EVHTTP_REQ_POST;
+  } else if (strcmp(method, "HEAD") == 0) {
+    return EVHTTP_REQ_HEAD;
+  } else if (strcmp(method, "PUT") == 0) {
+    return EVHTTP_REQ_PUT;
+  } else if (strcmp(method, "DELETE") == 0) {
+    return EVHTTP_REQ_DELETE;
+  } else if (strcmp(method, "OPTIONS") == 0) {
+    return EVHTTP_REQ_OPTIONS;
+  } else if (strcmp(method, "TRACE") == 0) {
+    return EVHTTP_REQ_TRACE;
+  } else if (strcmp(method, "CONNECT") == 0) {
+    return EVHTTP_REQ_CONNECT;
+  } else if (strcmp(method, "PATCH") == 0) {
+    return EVHTTP_REQ_PATCH;
   }
+  return -1;
+}
 
-  // static contents response
-  fd = open(r->filename, O_RDONLY);
+// send the request to upstream, return 1 when the request body should be
+// buffered and sent at the end of the stream instead of streaming it
+static int read_upstream_response(http2_session_data *session_data, app_context *app_ctx, nghttp2_session *session,
+                                  http2_stream_data *stream_data)
+{
+  struct evhttp_request *req;
+  struct mrb_http2_upstream_client *c;
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+  int i;
+  int method;
+  char *cookiebuf = NULL;
+  size_t cookiebuflen = 0;
+  size_t cookiebaselen = 0;
+  static char root_path[] = "/";
+  mrb_http2_upstream_pool_result pool_result;
+  int rv;
 
   TRACER;
-  if (fd == -1) {
-    set_status_record(r, HTTP_NOT_FOUND);
-    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
-    return 0;
+  method = upstream_method(r->method);
+  if (method == -1) {
+    return -1;
+  }
+  // evhttp writes the whole request before reading the response and has
+  // no way to stream a body, so it's buffered up to
+  // MRB_HTTP2_MAX_POST_DATA_SIZE and sent at the end of the stream, only
+  // HTTP/2 upstreams get it streamed
+  if (stream_data->request_early) {
+    return 1;
+  }
+  c = (struct mrb_http2_upstream_client *)malloc(sizeof(struct mrb_http2_upstream_client));
+  if (c == NULL) {
+    return -1;
+  }
+  memset(c, 0, sizeof(struct mrb_http2_upstream_client));
+  c->app_ctx = app_ctx;
+  c->stream_data = stream_data;
+  c->session = session;
+  c->session_data = session_data;
+  c->keepalive = r->upstream->keepalive;
+  rv = upstream_select_backend(app_ctx, r, &c->backend, &c->start, &c->circuit, &c->probe);
+  if (rv != 0) {
+    free(c);
+    return rv;
   }
 
-  stream_data->fd = fd;
-  // set_status_record(r, HTTP_OK);
-
-  TRACER;
-  if (fstat(fd, &finfo) != 0) {
-    set_status_record(r, HTTP_NOT_FOUND);
-    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
+  c->conn = mrb_http2_upstream_pool_get(app_ctx->upstream_pool, r->upstream->host, r->upstream->port, r->upstream->tls,
+                                        &pool_result);
+  if (c->conn == NULL) {
+    fprintf(stderr, "evhttp_connection_base_new failed");
+    upstream_attempt_done(app_ctx, c->backend, c->circuit, c->probe, 0, &c->start);
+    free(c);
+    return -1;
+  }
+  if (app_ctx->server->config->server_status) {
+    if (pool_result == MRB_HTTP2_UPSTREAM_POOL_HIT) {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_conn_hits);
+    } else if (pool_result == MRB_HTTP2_UPSTREAM_POOL_CONNECT) {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_conn_connects);
+    } else {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->upstream_conn_waits);
     }
-    return 0;
   }
-  r->finfo = &finfo;
 
-  // cached time string created strftime()
-  if (r->finfo->st_mtime != r->prev_last_modified) {
-    r->prev_last_modified = r->finfo->st_mtime;
-    set_http_date_str(&r->finfo->st_mtime, r->last_modified);
+  req = evhttp_request_new(http_request_done, c);
+  if (req == NULL) {
+    fprintf(stderr, "evhttp_request_new failed");
+    mrb_http2_upstream_pool_put(c->conn, c->keepalive);
+    upstream_attempt_cancel(c->backend, c->circuit, c->probe);
+    free(c);
+    return -1;
   }
+  c->req = req;
+  c->headers_sent = 0;
+  evhttp_request_set_header_cb(req, http_request_header);
+  evhttp_request_set_chunked_cb(req, http_request_chunk);
 
-  // set content-length: max 10^64
-  snprintf(r->content_length, 64, "%ld", (long)r->finfo->st_size);
-  stream_data->readleft = r->finfo->st_size;
-
-  TRACER;
-  if (!config->callback && r->reshdrslen == 0) {
-    r->response_type = MRB_HTTP2_RESPONSE_STATIC;
-    return mrb_http2_send_200_response(session_data->app_ctx, session, stream_data);
-  } else {
-    return mrb_http2_send_custom_response(session_data->app_ctx, session, stream_data);
+  upstream_set_unparsed_host(r);
+  evhttp_add_header(req->output_headers, "Host", r->upstream->unparsed_host);
+  req->major = r->upstream->proto_major;
+  req->minor = r->upstream->proto_minor;
+  if (!r->upstream->keepalive && r->upstream->proto_minor == 1) {
+    evhttp_add_header(req->output_headers, "Connection", "close");
   }
-}
 
-static int server_on_frame_recv_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
-{
-  http2_session_data *session_data = (http2_session_data *)user_data;
-  http2_stream_data *stream_data;
+  // r->reqhdr don't include HTTP/2 specified headders
+  for (i = 0; i < r->reqhdrlen; i++) {
+    char keybuf[MRB_HTTP2_MAX_REQ_HEADER_SIZE], valbuf[MRB_HTTP2_MAX_REQ_HEADER_SIZE];
+    size_t len;
 
-  TRACER;
-  switch (frame->hd.type) {
-  case NGHTTP2_DATA:
-  case NGHTTP2_HEADERS:
-    /* Check that the client request has finished */
-    if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
-      stream_data = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
-      /* For DATA and HEADERS frame, this callback may be called after
-         on_stream_close_callback. Check that stream still alive. */
-      if (!stream_data) {
-        return 0;
-      }
+    if (memcmp("cookie", r->reqhdr[i].name, 6) == 0) {
+      cookiebaselen = cookiebuflen;
+      cookiebuflen += r->reqhdr[i].valuelen + 2;
+      cookiebuf = mrb_realloc(mrb, cookiebuf, cookiebuflen);
+      memcpy(cookiebuf + cookiebaselen, r->reqhdr[i].value, r->reqhdr[i].valuelen);
+      memcpy(cookiebuf + cookiebaselen + r->reqhdr[i].valuelen, "; ", 2);
+    } else {
+      len = r->reqhdr[i].namelen;
+      // for null termination
+      if (len > MRB_HTTP2_MAX_REQ_HEADER_SIZE - 1)
+        len = MRB_HTTP2_MAX_REQ_HEADER_SIZE - 1;
+      memcpy(keybuf, r->reqhdr[i].name, len);
+      keybuf[len] = '\0';
+
+      len = r->reqhdr[i].valuelen;
+      if (len > MRB_HTTP2_MAX_REQ_HEADER_SIZE - 1)
+        len = MRB_HTTP2_MAX_REQ_HEADER_SIZE - 1;
+      memcpy(valbuf, r->reqhdr[i].value, len);
+      valbuf[len] = '\0';
 
-      return mrb_http2_process_request(session, session_data, stream_data);
+      evhttp_add_header(req->output_headers, keybuf, valbuf);
     }
-    break;
-  default:
-    break;
   }
+  if (cookiebuf != NULL) {
+    cookiebuf = mrb_realloc(mrb, cookiebuf, cookiebuflen + 1);
+    cookiebuf[cookiebuflen] = '\0';
+    evhttp_add_header(req->output_headers, "Cookie", cookiebuf);
+    mrb_free(mrb, cookiebuf);
+  }
+  // revalidate the stale response in the cache
+  if (stream_data->cache_entry != NULL) {
+    const char *validator;
+    if ((validator = mrb_http2_cache_entry_header(stream_data->cache_entry, "etag")) != NULL) {
+      evhttp_add_header(req->output_headers, "If-None-Match", validator);
+    }
+    if ((validator = mrb_http2_cache_entry_header(stream_data->cache_entry, "last-modified")) != NULL) {
+      evhttp_add_header(req->output_headers, "If-Modified-Since", validator);
+    }
+  }
+
+  if (app_ctx->server->config->debug) {
+    int i = 0;
+    struct evkeyval *header;
+    struct evkeyvalq *output_headers = evhttp_request_get_output_headers(req);
+    fprintf(stderr, "== DBUEG: request header at proxy START\n");
+    TAILQ_FOREACH(header, output_headers, next)
+    {
+      fprintf(stderr, "%s: nva[%d]={name=%s, value=%s}\n", __func__, i, header->key, header->value);
+      i++;
+    }
+    fprintf(stderr, "== DBUEG: request header at proxy END\n");
+  }
+
+  if (r->request_body != NULL) {
+    evbuffer_add(req->output_buffer, r->request_body, r->request_body_len);
+    if (evhttp_find_header(req->output_headers, "Content-Length") == NULL) {
+      char size[32];
+      snprintf(size, sizeof(size), "%ld", (long)r->request_body_len);
+      evhttp_add_header(req->output_headers, "Content-Length", size);
+    }
+  }
+  if (app_ctx->server->config->debug) {
+    fprintf(stderr, "== DEBUG: send %s method to upstream server\n", r->method);
+  }
+  evhttp_connection_set_timeout(c->conn->evcon, r->upstream->timeout);
+  if (evhttp_make_request(c->conn->evcon, req, method, r->upstream->uri != NULL ? r->upstream->uri : root_path) ==
+      -1) {
+    // evhttp freed req
+    fprintf(stderr, "evhttp_make_request failed");
+    mrb_http2_upstream_pool_put(c->conn, 0);
+    upstream_attempt_done(app_ctx, c->backend, c->circuit, c->probe, 0, &c->start);
+    free(c);
+    return -1;
+  }
+  upstream_timer_start(c, pool_result);
+  if (stream_data->upstream_retries == 0) {
+    upstream_retry_earn(app_ctx);
+  }
+
+  stream_data->upstream = c;
+  TRACER;
 
   return 0;
 }
 
-#define MRB_HTTP2_MAX_POST_DATA_SIZE 1 << 24
+// called on the worker loop by the HTTP/2 upstream session of the stream
 
-static int server_on_data_chunk_recv_callback(nghttp2_session *session, uint8_t flags, int32_t stream_id,
-                                              const uint8_t *data, size_t len, void *user_data)
+static void upstream_h2_on_header(void *arg, const uint8_t *name, size_t namelen, const uint8_t *value,
+                                  size_t valuelen)
 {
-  http2_session_data *session_data = (http2_session_data *)user_data;
-  http2_stream_data *stream_data = nghttp2_session_get_stream_user_data(session, stream_id);
-  mrb_state *mrb = session_data->app_ctx->server->mrb;
+  struct mrb_http2_upstream_h2_client *h = arg;
+  mrb_http2_request_rec *r = h->stream_data->r;
+
+  if (namelen == sizeof(":status") - 1 && memcmp(":status", name, namelen) == 0) {
+    h->status = atoi((const char *)value);
+    set_status_record(r, h->status);
+    fixup_status_header(h->app_ctx->server->mrb, r);
+  } else if (namelen > 0 && name[0] != ':') {
+    if (upstream_response_header(h->app_ctx, r, (const char *)name, (const char *)value) == 1) {
+      h->find_via = 1;
+    }
+  }
+}
+
+static int upstream_h2_on_headers_done(void *arg)
+{
+  struct mrb_http2_upstream_h2_client *h = arg;
+  app_context *app_ctx = h->app_ctx;
+  http2_session_data *session_data = h->session_data;
+  http2_stream_data *stream_data = h->stream_data;
+  mrb_http2_request_rec *r = stream_data->r;
+  mrb_http2_request_rec *prev;
   int rv;
 
-  if (session_data->app_ctx->server->config->debug) {
-    fprintf(stderr, "%s: datalen = %ld\n", __func__, len);
+  TRACER;
+  if (h->timer != NULL) {
+    evtimer_del(h->timer);
+  }
+  prev = mrb_http2_request_rec_bind(app_ctx, r);
+  if (!h->find_via) {
+    MRB_HTTP2_CREATE_NV_LIT_CS(app_ctx->server->mrb, &r->reshdrs[r->reshdrslen], "via",
+                               app_ctx->server->config->server_name);
+    r->reshdrslen += 1;
   }
 
-  // TODO: buffering and stored file or memory, currently store len byte
-  // when callback only once
-  if (stream_data->request_body == NULL) {
-    stream_data->request_body = mrb_malloc(mrb, sizeof(mrb_http2_request_body));
-    memset(stream_data->request_body, 0, sizeof(mrb_http2_request_body));
+  rv = upstream_cache_response(app_ctx, session_data->session, stream_data, h->status);
+  if (rv == 0) {
+    stream_data->upstream_body = evbuffer_new();
+    rv = upstream_reply(app_ctx, session_data->session, stream_data);
+  } else if (rv == 1) {
+    rv = 0;
   }
-  if (stream_data->request_body->last) {
-    fprintf(stderr, "request_body length reached MRB_HTTP2_MAX_POST_DATA_SIZE");
-    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
-    if (rv != 0) {
-      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
-    return 0;
-  } else {
-    char *pos;
-    stream_data->request_body->len += len;
-    if (stream_data->request_body->len >= MRB_HTTP2_MAX_POST_DATA_SIZE) {
-      fprintf(stderr, "post data length(%ld) exceed "
-                      "MRB_HTTP2_MAX_POST_DATA_SIZE(%d)\n",
-              (long)stream_data->request_body->len, MRB_HTTP2_MAX_POST_DATA_SIZE);
-      stream_data->request_body->len = MRB_HTTP2_MAX_POST_DATA_SIZE;
-      stream_data->request_body->last = 1;
-      rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
-      if (rv != 0) {
-        fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-        return NGHTTP2_ERR_CALLBACK_FAILURE;
-      }
-      return 0;
+  mrb_http2_request_rec_bind(app_ctx, prev);
+  if (rv != 0) {
+    // upstream_h2_on_close replies 502
+    if (stream_data->upstream_body != NULL) {
+      evbuffer_free(stream_data->upstream_body);
+      stream_data->upstream_body = NULL;
     }
-    stream_data->request_body->data =
-        mrb_realloc(mrb, stream_data->request_body->data, stream_data->request_body->len + 1);
-    pos = stream_data->request_body->data;
-    pos += stream_data->request_body->pos;
-    memcpy(pos, data, stream_data->request_body->len - stream_data->request_body->pos);
-    stream_data->request_body->pos += len;
-    stream_data->request_body->data[stream_data->request_body->len] = '\0';
+    stream_data->upstream_eof = 0;
+    stream_data->cache_served = 0;
+    return -1;
   }
 
+  if (session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
+  }
+  TRACER;
   return 0;
 }
 
-static int server_on_stream_close_callback(nghttp2_session *session, int32_t stream_id, nghttp2_error_code error_code,
-                                           void *user_data)
+static void upstream_h2_on_data(void *arg, const uint8_t *data, size_t len)
 {
-  http2_session_data *session_data = (http2_session_data *)user_data;
-  mrb_state *mrb = session_data->app_ctx->server->mrb;
-  http2_stream_data *stream_data;
+  struct mrb_http2_upstream_h2_client *h = arg;
+  http2_session_data *session_data = h->session_data;
+  http2_stream_data *stream_data = h->stream_data;
 
   TRACER;
-  stream_data = nghttp2_session_get_stream_user_data(session, stream_id);
-  if (!stream_data) {
-    return 0;
+  // the stream is being reset, or the response was served from the cache
+  if (stream_data->upstream_body == NULL || stream_data->cache_served) {
+    mrb_http2_upstream_h2_consume(h->stream, len);
+    return;
+  }
+  if (stream_data->cache_fill != NULL) {
+    upstream_cache_fill(h->app_ctx, stream_data, data, len);
+  }
+  upstream_collapse_body(stream_data, data, len);
+  // the upstream stream window bounds the buffered body, no need to pause
+  evbuffer_add(stream_data->upstream_body, data, len);
+  if (stream_data->upstream_deferred) {
+    stream_data->upstream_deferred = 0;
+    nghttp2_session_resume_data(session_data->session, stream_data->stream_id);
+  }
+  if (session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
   }
-  remove_stream(session_data, stream_data);
-  delete_http2_stream_data(mrb, session_data, stream_data);
-  TRACER;
-  return 0;
 }
 
-static ssize_t fixed_data_source_length_callback(nghttp2_session *session, uint8_t frame_type, int32_t stream_id,
-                                                 int32_t session_remote_window_size, int32_t stream_remote_window_size,
-                                                 uint32_t remote_max_frame_size, void *user_data)
+// the request body was written to upstream, let the client send more
+static void upstream_h2_on_body_sent(void *arg, size_t len)
 {
-  return MRB_HTTP2_READ_LENGTH_MAX;
+  struct mrb_http2_upstream_h2_client *h = arg;
+  http2_session_data *session_data = h->session_data;
+  http2_stream_data *stream_data = h->stream_data;
+
+  if (len > stream_data->unconsumed) {
+    len = stream_data->unconsumed;
+  }
+  if (len == 0) {
+    return;
+  }
+  session_consume(session_data, stream_data->stream_id, len);
+  stream_data->unconsumed -= len;
+  if (session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
+  }
 }
 
-static void mrb_http2_server_session_init(http2_session_data *session_data)
+static void upstream_h2_on_close(void *arg, uint32_t error_code)
 {
-  nghttp2_session_callbacks *callbacks;
+  struct mrb_http2_upstream_h2_client *h = arg;
+  app_context *app_ctx = h->app_ctx;
+  http2_session_data *session_data = h->session_data;
+  http2_stream_data *stream_data = h->stream_data;
+  mrb_http2_request_rec *r = stream_data->r;
+  mrb_http2_request_rec *prev;
+  int status;
+  int rv = 0;
 
   TRACER;
+  if (h->timer != NULL) {
+    event_free(h->timer);
+  }
+  upstream_attempt_done(app_ctx, h->backend, h->circuit, h->probe, error_code == NGHTTP2_NO_ERROR ? h->status : 0,
+                        &h->start);
+  status = h->status;
+  stream_data->upstream_h2 = NULL;
+  free(h);
+
+  prev = mrb_http2_request_rec_bind(app_ctx, r);
+  if (stream_data->upstream_body == NULL) {
+    if (app_ctx->server->config->debug && r->upstream != NULL) {
+      fprintf(stderr, "upstream %s:%d failed\n", r->upstream->host, r->upstream->port);
+    }
+    // reset before the response headers, the next attempt finishes the stream
+    if (status == 0 && error_code != NGHTTP2_NO_ERROR &&
+        (rv = upstream_retry(app_ctx, session_data, stream_data)) == 0) {
+      mrb_http2_request_rec_bind(app_ctx, prev);
+      return;
+    }
+    if (upstream_cache_stale_if_error(app_ctx, stream_data)) {
+      rv = upstream_cache_reply(app_ctx, session_data->session, stream_data, stream_data->cache_entry);
+    } else {
+      set_status_record(r, rv == MRB_HTTP2_UPSTREAM_CIRCUIT_OPEN ? HTTP_SERVICE_UNAVAILABLE : HTTP_BAD_GATEWAY);
+      rv = error_reply(app_ctx, session_data->session, stream_data);
+    }
+  } else if (error_code != NGHTTP2_NO_ERROR && !stream_data->cache_served) {
+    // the body was cut off, the client must not take it as complete
+    rv = nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                                   NGHTTP2_INTERNAL_ERROR);
+  } else {
+    stream_data->upstream_eof = 1;
+    if (stream_data->upstream_deferred) {
+      stream_data->upstream_deferred = 0;
+      nghttp2_session_resume_data(session_data->session, stream_data->stream_id);
+    }
+  }
+  upstream_cache_finish(app_ctx, stream_data, error_code == NGHTTP2_NO_ERROR);
+  upstream_collapse_finish(stream_data, error_code == NGHTTP2_NO_ERROR);
 
-  nghttp2_session_callbacks_new(&callbacks);
-
-  nghttp2_session_callbacks_set_send_callback(callbacks, server_send_callback);
-  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, server_on_frame_recv_callback);
-  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, server_on_data_chunk_recv_callback);
-  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, server_on_stream_close_callback);
-  nghttp2_session_callbacks_set_on_header_callback(callbacks, server_on_header_callback);
-  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, server_on_begin_headers_callback);
-  nghttp2_session_callbacks_set_data_source_read_length_callback(callbacks, fixed_data_source_length_callback);
-
-  nghttp2_session_server_new(&session_data->session, callbacks, session_data);
-  nghttp2_session_callbacks_del(callbacks);
+  mrb_http2_request_rec_bind(app_ctx, prev);
+  if (rv != 0 || session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
+  }
+  mrb_http2_gc_schedule(app_ctx);
+  TRACER;
 }
 
-/* Send HTTP/2.0 client connection header, which includes 24 bytes
-   magic octets and SETTINGS frame */
-static int send_server_connection_header(http2_session_data *session_data)
+// no response headers in upstream_first_byte_timeout, the stream is reset
+// and closed by upstream_h2_on_close
+static void upstream_h2_timeout_cb(evutil_socket_t fd, short events, void *ptr)
 {
-  nghttp2_settings_entry iv[2] = {{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100},
-                                  {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, ((1 << 18) - 1)}};
-  int rv;
+  struct mrb_http2_upstream_h2_client *h = ptr;
 
-  rv = nghttp2_submit_settings(session_data->session, NGHTTP2_FLAG_NONE, iv, ARRLEN(iv));
-  TRACER;
-  if (rv != 0) {
-    fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-    return -1;
+  if (h->app_ctx->server->config->server_status) {
+    MRB_HTTP2_STAT_INC(h->app_ctx->server->worker->upstream_timeouts);
   }
-  TRACER;
-  return 0;
+  mrb_http2_upstream_h2_reset(h->stream);
 }
 
-#define MRB_HTTP2_SSL_BUFSIZE 16384
-
-static SSL *mrb_http2_create_ssl(mrb_state *mrb, SSL_CTX *ssl_ctx)
+// the first byte timeout starts once the request was sent, the connect
+// timeout is of the upstream connection
+static void upstream_h2_on_request_sent(void *arg)
 {
-  SSL *ssl;
+  struct mrb_http2_upstream_h2_client *h = arg;
+  app_context *app_ctx = h->app_ctx;
 
-  if (ssl_ctx == NULL) {
-    return NULL;
+  // an early response may arrive while the body is still sent
+  if (h->status != 0 || app_ctx->server->config->upstream_first_byte_timeout == 0) {
+    return;
   }
-  ssl = SSL_new(ssl_ctx);
-
-  TRACER;
-  if (!ssl) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not create SSL/TLS session object: %S",
-               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  h->timer = evtimer_new(app_ctx->evbase, upstream_h2_timeout_cb, h);
+  if (h->timer != NULL) {
+    upstream_timer_add(h->timer, app_ctx->server->config->upstream_first_byte_timeout);
   }
-
-  TRACER;
-  return ssl;
 }
 
-static mrb_http2_conn_rec *mrb_http2_conn_rec_init(mrb_state *mrb, mrb_http2_config_t *config)
+static const mrb_http2_upstream_h2_callbacks upstream_h2_callbacks = {
+    upstream_h2_on_header, upstream_h2_on_headers_done, upstream_h2_on_data, upstream_h2_on_body_sent,
+    upstream_h2_on_request_sent, upstream_h2_on_close};
+
+// send the request as a stream of a multiplexed HTTP/2 upstream connection,
+// the request body is streamed as it arrives when request_early
+static int read_upstream_h2(http2_session_data *session_data, app_context *app_ctx, http2_stream_data *stream_data)
 {
-  mrb_http2_conn_rec *conn;
+  struct mrb_http2_upstream_h2_client *h;
+  mrb_http2_request_rec *r = app_ctx->r;
+  nghttp2_nv nva[MRB_HTTP2_HEADER_MAX + 6];
+  const char *validator;
+  const char *scheme;
+  const char *path;
+  size_t nvlen = 0;
+  int i;
+  int upload = stream_data->request_early;
+  int rv;
+  static char root_path[] = "/";
 
-  if (!config->connection_record) {
-    return NULL;
+  TRACER;
+  h = (struct mrb_http2_upstream_h2_client *)calloc(1, sizeof(struct mrb_http2_upstream_h2_client));
+  if (h == NULL) {
+    return -1;
   }
-  conn = (mrb_http2_conn_rec *)mrb_malloc(mrb, sizeof(mrb_http2_conn_rec));
-  memset(conn, 0, sizeof(mrb_http2_conn_rec));
+  h->app_ctx = app_ctx;
+  h->session_data = session_data;
+  h->stream_data = stream_data;
+  rv = upstream_select_backend(app_ctx, r, &h->backend, &h->start, &h->circuit, &h->probe);
+  if (rv != 0) {
+    free(h);
+    return rv;
+  }
+  upstream_set_unparsed_host(r);
+  path = r->upstream->uri != NULL ? r->upstream->uri : root_path;
 
-  conn->client_ip = NULL;
+  nva[nvlen++] = (nghttp2_nv)MAKE_NV_CS(":method", r->method);
+  scheme = r->upstream->tls ? "https" : "http";
+  nva[nvlen++] = (nghttp2_nv)MAKE_NV_CS(":scheme", scheme);
+  nva[nvlen++] = (nghttp2_nv)MAKE_NV_CS(":authority", r->upstream->unparsed_host);
+  nva[nvlen++] = (nghttp2_nv)MAKE_NV_CS(":path", path);
 
-  return conn;
+  // r->reqhdr don't include HTTP/2 specified headders, and drop the
+  // connection specific ones which are invalid in HTTP/2
+  for (i = 0; i < r->reqhdrlen; i++) {
+    const char *name = (const char *)r->reqhdr[i].name;
+    size_t namelen = r->reqhdr[i].namelen;
+
+    if ((namelen == sizeof("connection") - 1 && memcmp("connection", name, namelen) == 0) ||
+        (namelen == sizeof("keep-alive") - 1 && memcmp("keep-alive", name, namelen) == 0) ||
+        (namelen == sizeof("proxy-connection") - 1 && memcmp("proxy-connection", name, namelen) == 0) ||
+        (namelen == sizeof("transfer-encoding") - 1 && memcmp("transfer-encoding", name, namelen) == 0) ||
+        (namelen == sizeof("upgrade") - 1 && memcmp("upgrade", name, namelen) == 0) ||
+        (namelen == sizeof("host") - 1 && memcmp("host", name, namelen) == 0) ||
+        (namelen == sizeof("expect") - 1 && memcmp("expect", name, namelen) == 0)) {
+      continue;
+    }
+    nva[nvlen++] = r->reqhdr[i];
+  }
+  // revalidate the stale response in the cache
+  if (stream_data->cache_entry != NULL) {
+    if ((validator = mrb_http2_cache_entry_header(stream_data->cache_entry, "etag")) != NULL) {
+      nva[nvlen++] = (nghttp2_nv)MAKE_NV_CS("if-none-match", validator);
+    }
+    if ((validator = mrb_http2_cache_entry_header(stream_data->cache_entry, "last-modified")) != NULL) {
+      nva[nvlen++] = (nghttp2_nv)MAKE_NV_CS("if-modified-since", validator);
+    }
+  }
+
+  if (app_ctx->server->config->debug) {
+    for (i = 0; i < nvlen; i++) {
+      debug_header(__func__, nva[i].name, nva[i].namelen, nva[i].value, nva[i].valuelen);
+    }
+  }
+
+  h->stream = mrb_http2_upstream_h2_submit(app_ctx->upstream_h2_pool, r->upstream->host, r->upstream->port,
+                                           r->upstream->tls, nva, nvlen, upload || r->request_body != NULL,
+                                           &upstream_h2_callbacks, h);
+  if (h->stream == NULL) {
+    upstream_attempt_done(app_ctx, h->backend, h->circuit, h->probe, 0, &h->start);
+    free(h);
+    return -1;
+  }
+  if (stream_data->upstream_retries == 0) {
+    upstream_retry_earn(app_ctx);
+  }
+  if (upload) {
+    // the body follows as the DATA frames arrive
+    stream_data->upload = 1;
+  } else if (r->request_body != NULL) {
+    mrb_http2_upstream_h2_write(h->stream, (const uint8_t *)r->request_body, r->request_body_len);
+    mrb_http2_upstream_h2_end(h->stream);
+  }
+  if (app_ctx->server->config->debug) {
+    fprintf(stderr, "== DEBUG: send %s method to HTTP/2 upstream server%s\n", r->method,
+            upload ? " streaming body" : "");
+  }
+
+  stream_data->upstream_h2 = h;
+  TRACER;
+
+  return 0;
 }
 
-static void tune_packet_buffer(struct bufferevent *bev, mrb_http2_config_t *config)
+// submit the response of set_content_cb written to pipefd
+static int content_cb_reply_send(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data,
+                                 int *pipefd)
 {
-  if (config->write_packet_buffer_limit_size > 0) {
-    bufferevent_setwatermark(bev, EV_WRITE, 0, config->write_packet_buffer_limit_size);
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_state *mrb = app_ctx->server->mrb;
+  int64_t size;
+
+  fixup_status_header(mrb, r);
+
+  // create headers for HTTP/2
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
+  r->reshdrslen += 1;
+
+  if (r->status >= 200 && r->status < 300) {
+    size = r->write_size;
+  } else {
+    const char *msg = mrb_http2_error_message(r->status);
+    size = reply_pipe_write(pipefd[1], msg, strlen(msg));
   }
 
-  if (config->write_packet_buffer_expand_size > 0) {
-    evbuffer_expand(bev->output, config->write_packet_buffer_expand_size);
+  close(pipefd[1]);
+  if (r->write_large_buf != NULL) {
+    mrb_http2_large_buf_close(r->write_large_buf, pipefd[0]);
   }
+  stream_data->fd = pipefd[0];
+  stream_data->readleft = size;
+  TRACER;
 
-  // TODO: need read_packet_buffer_expand_size ?
-  // evbuffer_expand(session_data->bev->input, 4096);
+  // set content-length: max 10^64
+  snprintf(r->content_length, 64, "%ld", (long)size);
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+  r->reshdrslen += 1;
+
+  //
+  // "set_fixups_cb" callback ruby block
+  //
+  callback_ruby_block(mrb, app_ctx->server, r, MRB_HTTP2_SERVER_FIXUPS);
+  if (r->write_large_buf == NULL) {
+    TRACER;
+    if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+      close(pipefd[0]);
+      return -1;
+    }
+  } else {
+    TRACER;
+    if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+      close(pipefd[0]);
+      mrb_http2_large_buf_free(r->write_large_buf);
+      free(r->write_large_buf);
+      r->write_large_buf = NULL;
+      return -1;
+    }
+  }
+  TRACER;
+  return 0;
 }
 
-#if MRB_HTTP2_USE_ALPN
-static bool check_selected_proto(const unsigned char *proto, unsigned int len)
+//
+// async handler, set_content_cb runs in a fiber which is suspended by the
+// async_* methods and resumed from the event loop
+//
+
+// the fiber running on this thread, only set while resuming
+static __thread mrb_http2_async *current_async;
+
+static void mrb_http2_async_free(mrb_http2_async *async)
 {
-  if (sizeof(MRB_HTTP2_H2_PROTO) == len && memcmp(MRB_HTTP2_H2_PROTO, proto, len) == 0)
-    return true;
-  if (sizeof(MRB_HTTP2_H2_16_PROTO) == len && memcmp(MRB_HTTP2_H2_16_PROTO, proto, len) == 0)
-    return true;
-  if (sizeof(MRB_HTTP2_H2_14_PROTO) == len && memcmp(MRB_HTTP2_H2_14_PROTO, proto, len) == 0)
-    return true;
+  mrb_state *mrb = async->app_ctx->server->mrb;
 
-  return false;
+  if (async->timer_ev != NULL) {
+    event_free(async->timer_ev);
+  }
+  if (async->http_conn != NULL) {
+    evhttp_connection_free(async->http_conn);
+  }
+  if (async->r != NULL) {
+    close(async->pipefd[0]);
+    close(async->pipefd[1]);
+  }
+  mrb_gc_unregister(mrb, async->fiber);
+  free(async);
 }
-#endif
 
-#if MRB_HTTP2_USE_ALPN
-static bool check_http2_npn_or_alpn(SSL *ssl)
+static mrb_value mrb_http2_async_resume_body(mrb_state *mrb, mrb_value fiber)
 {
-  const unsigned char *next_proto = NULL;
-  unsigned int next_proto_len = 0;
+  return mrb_fiber_resume(mrb, fiber, 1, &current_async->result);
+}
 
-  SSL_get0_next_proto_negotiated(ssl, &next_proto, &next_proto_len);
+// resume the fiber with val, returns 1 while the fiber waits on an async
+// method and 0 when it finished
+static int mrb_http2_async_resume(mrb_http2_async *async, mrb_value val)
+{
+  app_context *app_ctx = async->app_ctx;
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_value ret;
+  mrb_bool failed = FALSE;
+
+  async->waiting = 0;
+  async->result = val;
+  current_async = async;
+  mrb_http2_budget_enter(mrb, r);
+  ret = mrb_protect(mrb, mrb_http2_async_resume_body, async->fiber, &failed);
+  mrb_http2_budget_leave(mrb, r);
+  current_async = NULL;
+
+  if (failed) {
+    mrb->exc = mrb_obj_ptr(ret);
+  }
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    mrb->exc = NULL;
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    return 0;
+  }
+  if (async->waiting) {
+    return 1;
+  }
+  if (mrb_test(mrb_fiber_alive_p(mrb, async->fiber))) {
+    fprintf(stderr, "set_content_cb yielded without an async method, aborted with 503\n");
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+  }
+  return 0;
+}
 
-  if (next_proto == NULL)
-    SSL_get0_alpn_selected(ssl, &next_proto, &next_proto_len);
+// run set_content_cb in a new fiber, returns 1 when the fiber was suspended
+// and the response is submitted by mrb_http2_async_wakeup
+static int mrb_http2_async_start(app_context *app_ctx, http2_session_data *session_data,
+                                 http2_stream_data *stream_data, int *pipefd)
+{
+  mrb_http2_server_t *server = app_ctx->server;
+  mrb_state *mrb = server->mrb;
+  mrb_http2_async *async;
+  mrb_value b = server->cb_procs[MRB_HTTP2_SERVER_CONTENT];
+  int ai = mrb_gc_arena_save(mrb);
+  int rv;
 
-  if (next_proto == NULL || !check_selected_proto(next_proto, next_proto_len))
-    return true;
+  app_ctx->r->phase = MRB_HTTP2_SERVER_CONTENT;
+  // content_cb is set for each request in the previous phases
+  server->cb_procs[MRB_HTTP2_SERVER_CONTENT] = mrb_nil_value();
 
-  /* one more check */
-  if (!check_http2_npn_or_alpn(ssl))
-    return false;
+  async = (mrb_http2_async *)malloc(sizeof(mrb_http2_async));
+  if (async == NULL) {
+    set_status_record(app_ctx->r, HTTP_SERVICE_UNAVAILABLE);
+    return 0;
+  }
+  memset(async, 0, sizeof(mrb_http2_async));
+  async->app_ctx = app_ctx;
+  async->session_data = session_data;
+  async->stream_data = stream_data;
+  async->pipefd[0] = pipefd[0];
+  async->pipefd[1] = pipefd[1];
+  async->fiber = mrb_funcall_with_block(mrb, mrb_obj_value(mrb_class_get(mrb, "Fiber")), mrb_intern_lit(mrb, "new"), 0,
+                                        NULL, b);
+  mrb_gc_register(mrb, async->fiber);
+
+  rv = mrb_http2_async_resume(async, mrb_nil_value());
+  mrb_gc_arena_restore(mrb, ai);
+  if (!rv) {
+    mrb_http2_async_free(async);
+    return 0;
+  }
 
-  return true;
+  async->r = app_ctx->r;
+  stream_data->async = async;
+  TRACER;
+  return 1;
 }
-#endif
 
-static http2_session_data *create_http2_session_data(mrb_state *mrb, app_context *app_ctx, int fd,
-                                                     struct sockaddr *addr, int addrlen)
+// called from the event loop when the operation the fiber waits on finished
+static void mrb_http2_async_wakeup(mrb_http2_async *async, mrb_value val)
 {
+  app_context *app_ctx = async->app_ctx;
+  http2_session_data *session_data = async->session_data;
+  http2_stream_data *stream_data = async->stream_data;
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_request_rec *prev;
   int rv;
-  http2_session_data *session_data;
-  SSL *ssl;
-  // char host[NI_MAXHOST];
-  int val = 1;
-  mrb_http2_server_t *server = app_ctx->server;
-  mrb_http2_config_t *config = app_ctx->server->config;
 
   TRACER;
-  ssl = mrb_http2_create_ssl(mrb, app_ctx->ssl_ctx);
+  prev = mrb_http2_request_rec_bind(app_ctx, async->r);
+
+  mrb_http2_budget_start(mrb, app_ctx->server->config);
+  rv = mrb_http2_async_resume(async, val);
+  if (mrb_http2_budget_stop(mrb)) {
+    fprintf(stderr, "%s %s %s: handler exceeded execution budget, aborted with 503\n", session_data->client_addr,
+            stream_data->method, stream_data->request_path);
+    if (app_ctx->server->config->server_status) {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->handler_budget_exceeded);
+    }
+  }
+  if (rv) {
+    mrb_http2_request_rec_bind(app_ctx, prev);
+    return;
+  }
 
-  session_data = (http2_session_data *)mrb_malloc(mrb, sizeof(http2_session_data));
-  memset(session_data, 0, sizeof(http2_session_data));
+  rv = content_cb_reply_send(app_ctx, session_data->session, stream_data, async->pipefd);
+  mrb_http2_request_rec_bind(app_ctx, prev);
 
-  session_data->app_ctx = app_ctx;
-  // return NULL when connection_record option diabled
-  session_data->conn = mrb_http2_conn_rec_init(mrb, config);
+  async->r = NULL;
+  stream_data->async = NULL;
+  mrb_http2_async_free(async);
 
-  if (config->tcp_nopush) {
-#ifdef TCP_CORK
-    setsockopt(fd, IPPROTO_TCP, TCP_CORK, (char *)&val, sizeof(val));
-#endif
+  if (rv != 0 || session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
+  }
+  mrb_http2_gc_schedule(app_ctx);
+}
 
-#ifdef TCP_NOPUSH
-    setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, (char *)&val, sizeof(val));
-#endif
+static mrb_http2_async *mrb_http2_async_current(mrb_state *mrb)
+{
+  if (current_async == NULL || current_async->waiting) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "async methods can be used only in set_content_cb with async_handler");
   }
+  return current_async;
+}
 
-  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+static void mrb_http2_async_timer_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  mrb_http2_async_wakeup((mrb_http2_async *)ptr, mrb_nil_value());
+}
 
-  TRACER;
-  session_data->bev = bufferevent_socket_new(app_ctx->evbase, fd, BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
+static void mrb_http2_async_http_done(struct evhttp_request *req, void *ptr)
+{
+  mrb_http2_async *async = (mrb_http2_async *)ptr;
+  mrb_state *mrb = async->app_ctx->server->mrb;
+  mrb_value result = mrb_nil_value();
+  int ai = mrb_gc_arena_save(mrb);
 
-  tune_packet_buffer(session_data->bev, config);
+  // the connection is freed on completion
+  async->http_conn = NULL;
 
-  if (ssl) {
-    TRACER;
+  if (req != NULL && evhttp_request_get_response_code(req) != 0) {
+    struct evbuffer *buf = evhttp_request_get_input_buffer(req);
+    size_t len = evbuffer_get_length(buf);
 
-#if MRB_HTTP2_USE_ALPN
-    if (!check_http2_npn_or_alpn(ssl))
-      return NULL;
-#endif
+    result = mrb_ary_new_capa(mrb, 2);
+    mrb_ary_push(mrb, result, mrb_fixnum_value(evhttp_request_get_response_code(req)));
+    mrb_ary_push(mrb, result, mrb_str_new(mrb, (const char *)evbuffer_pullup(buf, -1), len));
+  }
+  mrb_http2_async_wakeup(async, result);
+  mrb_gc_arena_restore(mrb, ai);
+}
 
-    session_data->bev =
-        bufferevent_openssl_filter_new(app_ctx->evbase, session_data->bev, ssl, BUFFEREVENT_SSL_ACCEPTING,
-                                       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+// s.async_sleep(msec)
+static mrb_value mrb_http2_server_async_sleep(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_async *async = mrb_http2_async_current(mrb);
+  mrb_int msec;
+  struct timeval tv;
+
+  mrb_get_args(mrb, "i", &msec);
+
+  if (async->timer_ev == NULL) {
+    async->timer_ev = evtimer_new(async->app_ctx->evbase, mrb_http2_async_timer_cb, async);
   }
+  tv.tv_sec = msec / 1000;
+  tv.tv_usec = (msec % 1000) * 1000;
+  evtimer_add(async->timer_ev, &tv);
 
-  bufferevent_enable(session_data->bev, EV_READ | EV_WRITE);
+  async->waiting = 1;
+  return mrb_fiber_yield(mrb, 0, NULL);
+}
 
-  rv =
-      getnameinfo(addr, addrlen, session_data->client_addr, sizeof(session_data->client_addr), NULL, 0, NI_NUMERICHOST);
-  if (rv != 0) {
-    memcpy(session_data->client_addr, "(unknown)", sizeof("(unknown)"));
+// s.async_http_get(host, port, path[, timeout_sec]) => [status, body] or nil
+static mrb_value mrb_http2_server_async_http_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_async *async = mrb_http2_async_current(mrb);
+  struct evhttp_request *req;
+  char *host, *path;
+  const char *address;
+  mrb_int port, timeout = 30;
+
+  mrb_get_args(mrb, "ziz|i", &host, &port, &path, &timeout);
+
+  address = mrb_http2_resolver_address(async->app_ctx->resolver, host);
+  if (address == NULL) {
+    // the host is known not to resolve
+    return mrb_nil_value();
   }
-  if (session_data->conn) {
-    session_data->conn->client_ip = session_data->client_addr;
+  async->http_conn =
+      mrb_http2_upstream_evcon_new(async->app_ctx->evbase, async->app_ctx->resolver->dnsbase, address, port, NULL);
+  if (async->http_conn == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "evhttp_connection_base_new failed");
   }
-  session_data->upstream_base = NULL;
-  session_data->upstream_conn = NULL;
+  evhttp_connection_set_timeout(async->http_conn, timeout);
 
-  if (config->server_status) {
-    server->worker->session_requests_per_worker++;
-    server->worker->connected_sessions++;
+  req = evhttp_request_new(mrb_http2_async_http_done, async);
+  if (req == NULL) {
+    evhttp_connection_free(async->http_conn);
+    async->http_conn = NULL;
+    mrb_raise(mrb, E_RUNTIME_ERROR, "evhttp_request_new failed");
   }
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Host",
+                    mrb_http2_resolver_unix_path(host) != NULL ? "localhost" : host);
 
-  return session_data;
+  if (evhttp_make_request(async->http_conn, req, EVHTTP_REQ_GET, path) == -1) {
+    evhttp_connection_free(async->http_conn);
+    async->http_conn = NULL;
+    mrb_raise(mrb, E_RUNTIME_ERROR, "evhttp_make_request failed");
+  }
+  evhttp_connection_free_on_completion(async->http_conn);
+
+  async->waiting = 1;
+  return mrb_fiber_yield(mrb, 0, NULL);
 }
 
-/* readcb for bufferevent after client connection header was
-   checked. */
-static void mrb_http2_server_readcb(struct bufferevent *bev, void *ptr)
+static int content_cb_reply(app_context *app_ctx, http2_session_data *session_data, http2_stream_data *stream_data)
 {
-  http2_session_data *session_data = (http2_session_data *)ptr;
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+  nghttp2_session *session = session_data->session;
+
+  int rv;
+  int pipefd[2];
 
   TRACER;
-  if (session_data->app_ctx->server->config->tls) {
-    // if tls, use session_recv2 and tls_session_send
-    if (session_recv(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+  rv = pipe(pipefd);
+  if (rv != 0) {
+    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
+    mrb_http2_request_rec_free(mrb, r);
+    if (rv != 0) {
+      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+      return -1;
     }
-  } else {
-    if (session_recv(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+    return 0;
+  }
+  r->write_large_buf = NULL;
+  r->write_fd = pipefd[1];
+
+  //
+  // "set_content" callback ruby block
+  //
+  if (app_ctx->server->config->async_handler) {
+    if (mrb_http2_async_start(app_ctx, session_data, stream_data, pipefd)) {
+      return 0;
     }
+  } else {
+    callback_ruby_block(mrb, app_ctx->server, r, MRB_HTTP2_SERVER_CONTENT);
   }
+
+  return content_cb_reply_send(app_ctx, session, stream_data, pipefd);
 }
 
-static void mrb_http2_server_writecb(struct bufferevent *bev, void *ptr)
+// run the script of r->filename on self, the output is written to r->write_fd
+static void mruby_run_script(mrb_state *mrb, mrb_value self, mrb_http2_request_rec *r, FILE *rfp,
+                             mrb_http2_slab *slab)
 {
-  http2_session_data *session_data = (http2_session_data *)ptr;
+  mrb_state *mrb_inner;
+  struct mrb_parser_state *p = NULL;
+  struct RProc *proc = NULL;
+  mrbc_context *c;
 
-  TRACER;
-  if (evbuffer_get_length(bufferevent_get_output(bev)) > 0) {
-    return;
+  if (r->shared_mruby) {
+    // share one mrb_state
+    mrb_inner = mrb;
+  } else {
+    // when use new mrb_state, on the slab of the calling thread if any
+    mrb_inner = slab != NULL ? mrb_open_allocf(mrb_http2_slab_allocf, slab) : mrb_open();
+  }
+
+  c = mrbc_context_new(mrb_inner);
+  mrbc_filename(mrb_inner, c, r->filename);
+  p = mrb_parse_file(mrb_inner, rfp, c);
+  fclose(rfp);
+  proc = mrb_generate_code(mrb_inner, p);
+  mrb_pool_close(p->pool);
+  mrb_http2_budget_enter(mrb_inner, r);
+  mrb_run(mrb_inner, proc, self);
+  mrb_http2_budget_leave(mrb_inner, r);
+
+  if (mrb_inner->exc) {
+    mrb_print_error(mrb_inner);
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    mrb_inner->exc = 0;
+  } else {
+    set_status_record(r, HTTP_OK);
+  }
+  mrbc_context_free(mrb_inner, c);
+
+  // when use new mrb_state
+  if (mrb_inner != mrb) {
+    mrb_close(mrb_inner);
+  }
+}
+
+// submit the response of the script written to pipefd
+static int mruby_reply_send(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data,
+                            int *pipefd)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_state *mrb = app_ctx->server->mrb;
+  int64_t size;
+
+  fixup_status_header(mrb, r);
+
+  // create headers for HTTP/2
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
+  r->reshdrslen += 1;
+  if (r->status >= 200 && r->status < 300) {
+    size = r->write_size;
+  } else {
+    const char *msg = mrb_http2_error_message(r->status);
+    size = reply_pipe_write(pipefd[1], msg, strlen(msg));
   }
   TRACER;
-  if (nghttp2_session_want_read(session_data->session) == 0 && nghttp2_session_want_write(session_data->session) == 0) {
-    delete_http2_session_data(session_data);
-    return;
+  close(pipefd[1]);
+  if (r->write_large_buf != NULL) {
+    mrb_http2_large_buf_close(r->write_large_buf, pipefd[0]);
   }
+  stream_data->fd = pipefd[0];
+  stream_data->readleft = size;
   TRACER;
-  if (session_data->app_ctx->server->config->tls) {
-    if (session_send(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+
+  // set content-length: max 10^64
+  snprintf(r->content_length, 64, "%ld", (long)size);
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+  r->reshdrslen += 1;
+
+  //
+  // "set_fixups_cb" callback ruby block
+  //
+  callback_ruby_block(mrb, app_ctx->server, r, MRB_HTTP2_SERVER_FIXUPS);
+
+  if (r->write_large_buf == NULL) {
+    TRACER;
+    if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+      close(pipefd[0]);
+      return -1;
     }
   } else {
-    if (session_send(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+    if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+      close(pipefd[0]);
+      mrb_http2_large_buf_free(r->write_large_buf);
+      free(r->write_large_buf);
+      r->write_large_buf = NULL;
+      return -1;
     }
   }
   TRACER;
+  return 0;
 }
 
-/* eventcb for bufferevent */
-static void mrb_http2_server_eventcb(struct bufferevent *bev, short events, void *ptr)
+// pass the request record to a handler thread and give the loop a new one,
+// the response is submitted by mrb_http2_handler_done
+static int mruby_reply_dispatch(app_context *app_ctx, http2_session_data *session_data,
+                                http2_stream_data *stream_data, FILE *rfp, int *pipefd)
 {
-  http2_session_data *session_data = (http2_session_data *)ptr;
-  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  mrb_http2_handler_job *job;
+  mrb_http2_request_rec *r = app_ctx->r;
 
-  TRACER;
-  if (events & BEV_EVENT_CONNECTED) {
-    if (config->debug) {
-      fprintf(stderr, "%s connected\n", session_data->client_addr);
-    }
-    if (config->tls) {
-      mrb_http2_server_session_init(session_data);
-      if (send_server_connection_header(session_data) != 0) {
-        delete_http2_session_data(session_data);
-        return;
-      }
-    }
-    return;
+  job = (mrb_http2_handler_job *)malloc(sizeof(mrb_http2_handler_job));
+  if (job == NULL) {
+    return -1;
   }
-  if (config->debug) {
-    if (events & BEV_EVENT_EOF) {
-      fprintf(stderr, "%s EOF\n", session_data->client_addr);
-    } else if (events & BEV_EVENT_ERROR) {
-      fprintf(stderr, "%s network error\n", session_data->client_addr);
-    } else if (events & BEV_EVENT_TIMEOUT) {
-      fprintf(stderr, "%s timeout\n", session_data->client_addr);
-    }
+  memset(job, 0, sizeof(mrb_http2_handler_job));
+  job->app_ctx = app_ctx;
+  job->session_data = session_data;
+  job->stream_data = stream_data;
+  job->r = r;
+  job->rfp = rfp;
+  job->pipefd[0] = pipefd[0];
+  job->pipefd[1] = pipefd[1];
+
+  if (r->conn != NULL) {
+    snprintf(job->client_ip, sizeof(job->client_ip), "%s", r->conn->client_ip);
+    job->conn.client_ip = job->client_ip;
+    r->conn = &job->conn;
   }
+
+  stream_data->handler_job = job;
+  mrb_http2_thread_pool_push(app_ctx->handler_pool, &job->job);
   TRACER;
-  delete_http2_session_data(session_data);
+  return 0;
 }
 
-static void mrb_http2_acceptcb(struct evconnlistener *listener, int fd, struct sockaddr *addr, int addrlen, void *ptr)
+static int mruby_reply(app_context *app_ctx, http2_session_data *session_data, http2_stream_data *stream_data)
 {
-  app_context *app_ctx = (app_context *)ptr;
-  http2_session_data *session_data;
+  mrb_http2_request_rec *r = app_ctx->r;
   mrb_state *mrb = app_ctx->server->mrb;
+  nghttp2_session *session = session_data->session;
+
+  int rv;
+  int pipefd[2];
+  FILE *rfp;
+
+  rfp = fopen(r->filename, "r");
+  if (rfp == NULL) {
+    set_status_record(r, HTTP_NOT_FOUND);
+    if (error_reply(app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
 
   TRACER;
-  session_data = create_http2_session_data(mrb, app_ctx, fd, addr, addrlen);
-  if (session_data->bev == NULL) {
-    // accept socket failed
-    delete_http2_session_data(session_data);
-    return;
+  rv = pipe(pipefd);
+  if (rv != 0) {
+    fclose(rfp);
+    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
+    mrb_http2_request_rec_free(mrb, r);
+    if (rv != 0) {
+      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+      return -1;
+    }
+    return 0;
   }
-  bufferevent_setcb(session_data->bev, mrb_http2_server_readcb, mrb_http2_server_writecb, mrb_http2_server_eventcb,
-                    session_data);
-  if (!app_ctx->server->config->tls) {
-    bufferevent_enable(session_data->bev, EV_READ | EV_WRITE);
-    mrb_http2_server_session_init(session_data);
-    if (send_server_connection_header(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+
+  r->write_large_buf = NULL;
+  r->write_fd = pipefd[1];
+
+  if (app_ctx->handler_pool != NULL) {
+    if (mruby_reply_dispatch(app_ctx, session_data, stream_data, rfp, pipefd) == 0) {
+      return 0;
     }
+    fprintf(stderr, "can't dispatch %s to handler threads, run on the loop\n", r->filename);
   }
-  // don't call eventcb when createing bufferevent_socket_new, not tls
-  // bufferevent_socket_connect(session_data->bev, NULL, 0);
+
+  mruby_run_script(mrb, app_ctx->self, r, rfp, app_ctx->server->config->mruby_slab_allocator ? app_ctx->slab : NULL);
+
+  return mruby_reply_send(app_ctx, session, stream_data, pipefd);
 }
 
-static void set_dhparams(mrb_state *mrb, mrb_http2_config_t *config, SSL_CTX *ssl_ctx)
+//
+// handler threads, each thread runs scripts on its own mrb_state
+//
+
+typedef struct {
+  mrb_state *mrb;
+  // a slab per thread, not counted in the worker stats
+  mrb_http2_slab *slab;
+  mrb_http2_server_t server;
+  mrb_http2_data_t data;
+  mrb_value self;
+} mrb_http2_handler_thread;
+
+// the server context is owned by the loop, so don't free it from a thread
+static const struct mrb_data_type mrb_http2_handler_thread_type = {
+    "mrb_http2_server_t", NULL,
+};
+
+static void *mrb_http2_handler_thread_init(void *arg)
 {
-  DH *dh;
-  BIO *bio = BIO_new_file(config->dh_params_file, "r");
+  app_context *app_ctx = (app_context *)arg;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_http2_handler_thread *t;
+  struct RClass *server_class;
+  int i;
 
-  if (bio == NULL) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "dh_params_file open failed: %S", mrb_str_new_cstr(mrb, config->dh_params_file));
+  t = (mrb_http2_handler_thread *)malloc(sizeof(mrb_http2_handler_thread));
+  if (t == NULL) {
+    return NULL;
+  }
+  t->slab = NULL;
+  if (config->mruby_slab_allocator) {
+    t->slab = mrb_http2_slab_new(NULL);
+    if (t->slab == NULL) {
+      free(t);
+      return NULL;
+    }
+    t->mrb = mrb_open_allocf(mrb_http2_slab_allocf, t->slab);
+  } else {
+    t->mrb = mrb_open();
+  }
+  if (t->mrb == NULL) {
+    if (t->slab != NULL) {
+      mrb_http2_slab_free_all(t->slab);
+    }
+    free(t);
+    return NULL;
   }
 
-  dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
-  BIO_free(bio);
+  // share config and worker stats with the loop, not the phase callbacks
+  t->server = *app_ctx->server;
+  t->server.mrb = t->mrb;
+  for (i = 0; i < MRB_HTTP2_SERVER_PHASE_MAX; i++) {
+    t->server.cb_procs[i] = mrb_nil_value();
+  }
+  t->data.s = &t->server;
+  t->data.r = NULL;
 
-  if (dh == NULL) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "dh_params_file read failed: %S", mrb_str_new_cstr(mrb, config->dh_params_file));
+  server_class = mrb_class_get_under(t->mrb, mrb_module_get(t->mrb, "HTTP2"), "Server");
+  t->self = mrb_obj_value(mrb_data_object_alloc(t->mrb, server_class, &t->data, &mrb_http2_handler_thread_type));
+  mrb_gc_register(t->mrb, t->self);
+
+  if (config->handler_thread_preload != NULL) {
+    FILE *fp = fopen(config->handler_thread_preload, "r");
+    if (fp == NULL) {
+      fprintf(stderr, "can't open handler_thread_preload: %s\n", config->handler_thread_preload);
+    } else {
+      mrb_load_file(t->mrb, fp);
+      fclose(fp);
+      if (t->mrb->exc) {
+        mrb_print_error(t->mrb);
+        t->mrb->exc = NULL;
+      }
+    }
   }
 
-  SSL_CTX_set_tmp_dh(ssl_ctx, dh);
-  DH_free(dh);
+  return t;
 }
 
-static int npn_advertise_cb(SSL *s, const unsigned char **data, unsigned int *len, void *proto)
+static void mrb_http2_handler_thread_run(void *ptr, mrb_http2_thread_job *job)
 {
-  *data = proto;
-  *len = (unsigned int)strlen(proto);
-  return SSL_TLSEXT_ERR_OK;
+  mrb_http2_handler_thread *t = (mrb_http2_handler_thread *)ptr;
+  mrb_http2_handler_job *hjob = (mrb_http2_handler_job *)job;
+
+  if (t == NULL) {
+    fclose(hjob->rfp);
+    set_status_record(hjob->r, HTTP_SERVICE_UNAVAILABLE);
+    return;
+  }
+
+  t->data.r = hjob->r;
+  mrb_http2_budget_start(t->mrb, t->server.config);
+  mruby_run_script(t->mrb, t->self, hjob->r, hjob->rfp, t->slab);
+  hjob->budget_exceeded = mrb_http2_budget_stop(t->mrb);
+  t->data.r = NULL;
 }
 
-/* ref: h2o/lib/common/socket.c */
-#if MRB_HTTP2_USE_ALPN
-static int alpn_select_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *_in,
-                          unsigned int inlen, void *_protos)
+static void mrb_http2_handler_thread_final(void *ptr)
 {
-  const mrb_http2_iovec_t *protos = _protos;
-  size_t i;
-
-  for (i = 0; protos[i].len != 0; ++i) {
-    const unsigned char *in = _in, *in_end = in + inlen;
-    while (in != in_end) {
-      size_t cand_len = *in++;
-      if (in_end - in < cand_len) {
-        return SSL_TLSEXT_ERR_NOACK;
-      }
-      if (cand_len == protos[i].len && memcmp(in, protos[i].base, cand_len) == 0) {
-        *out = (const unsigned char *)protos[i].base;
-        *outlen = (unsigned char)protos[i].len;
+  mrb_http2_handler_thread *t = (mrb_http2_handler_thread *)ptr;
 
-        return SSL_TLSEXT_ERR_OK;
-      }
-      in += cand_len;
-    }
+  if (t == NULL) {
+    return;
   }
-
-  return SSL_TLSEXT_ERR_NOACK;
+  mrb_close(t->mrb);
+  if (t->slab != NULL) {
+    mrb_http2_slab_free_all(t->slab);
+  }
+  free(t);
 }
-#endif
 
-static SSL_CTX *mrb_http2_create_ssl_ctx(mrb_state *mrb, mrb_http2_config_t *config, const char *key_file,
-                                         const char *cert_file)
+// called on the loop when a handler thread finished the script
+static void mrb_http2_handler_done(mrb_http2_thread_job *job, void *arg)
 {
-  const unsigned char sid_ctx[] = "mruby-http2";
-  SSL_CTX *ssl_ctx;
-  EC_KEY *ecdh;
-
-  SSL_load_error_strings();
-  SSL_library_init();
-  OpenSSL_add_all_algorithms();
+  app_context *app_ctx = (app_context *)arg;
+  mrb_http2_handler_job *hjob = (mrb_http2_handler_job *)job;
+  http2_session_data *session_data = hjob->session_data;
+  http2_stream_data *stream_data = hjob->stream_data;
+  mrb_http2_request_rec *prev;
+  int rv;
 
-  ssl_ctx = SSL_CTX_new(SSLv23_server_method());
   TRACER;
-  if (!ssl_ctx) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not create SSL/TLS context: %S",
-               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  stream_data->handler_job = NULL;
+
+  // the pool stopped before a thread took the script
+  if (job->cancelled) {
+    fclose(hjob->rfp);
+    set_status_record(hjob->r, HTTP_SERVICE_UNAVAILABLE);
   }
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_COMPRESSION);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_SINGLE_ECDH_USE);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 
-  // in reference to nghttp2
-  if (SSL_CTX_set_cipher_list(ssl_ctx, DEFAULT_CIPHER_LIST) == 0) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "SSL_CTX_set_cipher_list failed: %S",
-               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  if (hjob->orphaned) {
+    close(hjob->pipefd[0]);
+    close(hjob->pipefd[1]);
+    free(hjob);
+    delete_http2_stream_data(app_ctx, stream_data);
+    return;
   }
-  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
-  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
-  SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
-  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
 
-  ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-  if (!ecdh) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "EC_KEY_new_by_curv_name failed: %S",
-               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  if (hjob->budget_exceeded) {
+    fprintf(stderr, "%s %s %s: handler exceeded execution budget, aborted with 503\n", session_data->client_addr,
+            stream_data->method, stream_data->request_path);
+    if (app_ctx->server->config->server_status) {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->handler_budget_exceeded);
+    }
   }
-  SSL_CTX_set_tmp_ecdh(ssl_ctx, ecdh);
-  EC_KEY_free(ecdh);
 
-  if (config->dh_params_file) {
-    set_dhparams(mrb, config, ssl_ctx);
-  }
+  // the fixups and logging phases see the record of this stream
+  prev = mrb_http2_request_rec_bind(app_ctx, hjob->r);
+  rv = mruby_reply_send(app_ctx, session_data->session, stream_data, hjob->pipefd);
+  mrb_http2_request_rec_bind(app_ctx, prev);
+  free(hjob);
 
-  if (SSL_CTX_use_PrivateKey_file(ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not read private key file %S", mrb_str_new_cstr(mrb, key_file));
-  }
-  if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_file) != 1) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not read certificate file %S", mrb_str_new_cstr(mrb, cert_file));
+  if (rv != 0 || session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
   }
-  SSL_CTX_set_next_protos_advertised_cb(ssl_ctx, npn_advertise_cb, (void *)npn_proto);
-#if MRB_HTTP2_USE_ALPN
-  SSL_CTX_set_alpn_select_cb(ssl_ctx, alpn_select_cb, (void *)alpn_proto);
-#endif
-  TRACER;
-  return ssl_ctx;
+  mrb_http2_gc_schedule(app_ctx);
 }
 
-static void init_app_context(app_context *actx, SSL_CTX *ssl_ctx, struct event_base *evbase)
+/* Inspired by h2o header lookup.  https://github.com/h2o/h2o */
+/* Reference as nghttp2 header lookup.  https://github.com/nghttp2/nghttp2
+ */
+
+static int memeq(const void *a, const void *b, size_t n)
 {
-  memset(actx, 0, sizeof(app_context));
-  actx->ssl_ctx = ssl_ctx;
-  actx->evbase = evbase;
+  return memcmp(a, b, n) == 0;
 }
 
-static void set_run_user(mrb_state *mrb, mrb_http2_config_t *config)
-{
-  uid_t cur_uid = getuid();
+#define streq(A, B, N) ((sizeof((A)) - 1) == (N) && memeq((A), (B), (N)))
 
-  if (config->run_user == NULL && cur_uid != 0) {
-    mrb_warn(mrb, "don't set run_user, so run with uid=%S\n", mrb_fixnum_value(cur_uid));
-    return;
-  } else if (config->run_user == NULL && cur_uid == 0) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not run with root,"
-                                    " Set 'run_user => user_name' instead of root in config");
+typedef enum {
+  NGHTTP2_TOKEN__AUTHORITY,
+  NGHTTP2_TOKEN__METHOD,
+  NGHTTP2_TOKEN__PATH,
+  NGHTTP2_TOKEN__SCHEME,
+  NGHTTP2_TOKEN_HOST,
+} nghttp2_token;
+
+static int lookup_token(const uint8_t *name, size_t namelen)
+{
+  switch (namelen) {
+  case 5:
+    switch (name[namelen - 1]) {
+    case 'h':
+      if (streq(":pat", name, 4)) {
+        return NGHTTP2_TOKEN__PATH;
+      }
+      break;
+    }
+    break;
+  case 7:
+    switch (name[namelen - 1]) {
+    case 'd':
+      if (streq(":metho", name, 6)) {
+        return NGHTTP2_TOKEN__METHOD;
+      }
+      break;
+    case 'e':
+      if (streq(":schem", name, 6)) {
+        return NGHTTP2_TOKEN__SCHEME;
+      }
+      break;
+    }
+    break;
+  case 10:
+    switch (name[namelen - 1]) {
+    case 'y':
+      if (streq(":authorit", name, 9)) {
+        return NGHTTP2_TOKEN__AUTHORITY;
+      }
+      break;
+    }
+    break;
   }
+  return -1;
+}
 
-  config->run_uid = mrb_http2_get_uid(mrb, config->run_user);
+static int server_on_header_callback(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+                                     size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags,
+                                     void *user_data)
+{
+  http2_session_data *session_data = (http2_session_data *)user_data;
+  mrb_state *mrb = session_data->app_ctx->server->mrb;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
 
-  if (config->run_uid == 0) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not run with root,"
-                                    " Set 'run_user => user_name' instead of root in config");
+  http2_stream_data *stream_data;
+  nghttp2_nv nv;
+
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
   }
 
-  // TODO: add config->run_gid
-  // setgid :run_user for now
-  if (setgid(config->run_uid)) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not set gid: %S", mrb_fixnum_value(config->run_uid));
+  stream_data = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (!stream_data) {
+    return 0;
   }
 
-  if (setuid(config->run_uid)) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not set user: %S"
-                                     " If running server with specific user, "
-                                     "run server with root at first",
-               mrb_str_new_cstr(mrb, config->run_user));
+  if (session_data->app_ctx->server->config->debug) {
+    debug_header(__func__, name, namelen, value, valuelen);
+  }
+
+  switch (lookup_token(name, namelen)) {
+    size_t j;
+  case NGHTTP2_TOKEN__AUTHORITY:
+    memcpy(stream_data->authority, value, valuelen);
+    stream_data->authority[valuelen] = '\0';
+    return 0;
+
+  case NGHTTP2_TOKEN__METHOD:
+    memcpy(stream_data->method, value, valuelen);
+    stream_data->method[valuelen] = '\0';
+    return 0;
+
+  case NGHTTP2_TOKEN__SCHEME:
+    memcpy(stream_data->scheme, value, valuelen);
+    stream_data->scheme[valuelen] = '\0';
+    return 0;
+
+  case NGHTTP2_TOKEN__PATH:
+    if (config->upstream) {
+      stream_data->percent_encode_uri = mrb_http2_strcopy(mrb, (const char *)value, valuelen);
+    }
+    stream_data->unparsed_uri = percent_decode(mrb, value, valuelen);
+    for (j = 0; j < valuelen && value[j] != '?'; ++j)
+      ;
+    if (j == valuelen) {
+      stream_data->request_args = NULL;
+      stream_data->request_path = stream_data->unparsed_uri;
+    } else {
+      stream_data->request_path = percent_decode(mrb, value, j);
+      stream_data->request_args = percent_decode(mrb, value + j, valuelen - j);
+    }
+    return 0;
+
+  default:
+    break;
   }
+
+  // create nv and add stream_data->nva except for HTTP/2 specified headers
+  mrb_http2_create_nv(mrb, &nv, name, namelen, value, valuelen);
+  stream_data->nvlen = mrb_http2_add_nv(stream_data->nva, stream_data->nvlen, &nv);
+
+  return 0;
 }
 
-static void mrb_start_listen(struct event_base *evbase, mrb_http2_config_t *config, app_context *app_ctx)
+static int server_on_begin_headers_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
 {
-  int rv;
-  struct addrinfo hints;
-  struct addrinfo *res, *rp;
-  mrb_state *mrb = app_ctx->server->mrb;
+  http2_session_data *session_data = (http2_session_data *)user_data;
 
-  TRACER;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-#ifdef AI_ADDRCONFIG
-  hints.ai_flags |= AI_ADDRCONFIG;
-#endif
+  http2_stream_data *stream_data;
 
-  rv = getaddrinfo(config->server_host, config->service, &hints, &res);
-  if (rv != 0) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "getaddrinfo failed");
+  TRACER;
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
   }
+  stream_data = create_http2_stream_data(session_data->app_ctx->server->mrb, session_data, frame->hd.stream_id);
+  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream_data);
+  stream_data->headers_pending = 1;
+  session_data->headers_pending++;
+
   TRACER;
-  for (rp = res; rp; rp = rp->ai_next) {
-    struct evconnlistener *listener;
-    if (config->worker > 0) {
-      evutil_socket_t fd;
-      int on = 1;
-      fd = socket(rp->ai_family, SOCK_STREAM, IPPROTO_TCP);
-      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
-      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
-#if defined(__linux__) && defined(SO_REUSEPORT)
-      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
-#endif
-      evutil_make_socket_nonblocking(fd);
+  return 0;
+}
 
-      if (bind(fd, (struct sockaddr *)rp->ai_addr, rp->ai_addrlen) < 0) {
-        mrb_raise(mrb, E_RUNTIME_ERROR, "Could not bind, "
-                                        "don't support SO_REUSEPORT? So, can't use worker mode");
-      }
-      listener =
-          evconnlistener_new(evbase, mrb_http2_acceptcb, app_ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, fd);
-    } else {
-      listener = evconnlistener_new_bind(evbase, mrb_http2_acceptcb, app_ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
-                                         -1, rp->ai_addr, rp->ai_addrlen);
-    }
+/* Minimum check for directory traversal. Returns nonzero if it is
+   safe. */
+static int check_path(const char *path)
+{
+  size_t len = strlen(path);
+  return path[0] == '/' && strchr(path, '\\') == NULL && strstr(path, "/../") == NULL && strstr(path, "/./") == NULL &&
+         (len < 3 || memcmp(path + len - 3, "/..", 3) != 0) && (len < 2 || memcmp(path + len - 2, "/.", 2) != 0);
+}
 
-    if (listener) {
-      freeaddrinfo(res);
-      set_run_user(mrb, config);
-      return;
-    }
+static void fixup_status_header(mrb_state *mrb, mrb_http2_request_rec *r)
+{
+  int i = mrb_http2_get_nv_id(r->reshdrs, r->reshdrslen, ":status");
+
+  if (r->reshdrslen == 0) {
+    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], ":status", r->status_line);
+    r->reshdrslen += 1;
+    return;
+  }
+
+  if (i == MRB_HTTP2_HEADER_NOT_FOUND && r->reshdrslen > 0) {
+    mrb_http2_create_nv(mrb, &r->reshdrs[r->reshdrslen], r->reshdrs[0].name, r->reshdrs[0].namelen, r->reshdrs[0].value,
+                        r->reshdrs[0].valuelen);
+    r->reshdrslen += 1;
+    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[0], ":status", r->status_line);
+  } else if (i > 0) {
+    mrb_http2_create_nv(mrb, &r->reshdrs[r->reshdrslen], r->reshdrs[0].name, r->reshdrs[0].namelen, r->reshdrs[0].value,
+                        r->reshdrs[0].valuelen);
+    r->reshdrslen += 1;
+    mrb_http2_create_nv(mrb, &r->reshdrs[0], r->reshdrs[i].name, r->reshdrs[i].namelen, r->reshdrs[i].value,
+                        r->reshdrs[i].valuelen);
+  }
+}
+
+static int mrb_http2_send_custom_response(app_context *app_ctx, nghttp2_session *session,
+                                          http2_stream_data *stream_data)
+{
+
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  if (r->status == 0) {
+    set_status_record(r, HTTP_OK);
+  }
+
+  fixup_status_header(mrb, r);
+
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", app_ctx->server->config->server_name);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
+  r->reshdrslen += 1;
+
+  //
+  // "set_fixups_cb" callback ruby block
+  //
+  callback_ruby_block(mrb, app_ctx->server, r, MRB_HTTP2_SERVER_FIXUPS);
+
+  if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+    close(stream_data->fd);
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return 0;
+}
+
+static int mrb_http2_send_200_response(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+{
+
+  mrb_http2_request_rec *r = app_ctx->r;
+  nghttp2_nv hdrs[] = {MAKE_NV(":status", "200"), MAKE_NV_CS("server", app_ctx->server->config->server_name),
+                       MAKE_NV_CS("date", r->date), MAKE_NV_CS("content-length", r->content_length),
+                       MAKE_NV_CS("last-modified", r->last_modified)};
+
+  r->status = 200;
+
+  if (send_response(app_ctx, session, hdrs, ARRLEN(hdrs), stream_data) != 0) {
+    close(stream_data->fd);
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return 0;
+}
+
+static void set_request_body(mrb_http2_request_rec *r, http2_stream_data *stream_data)
+{
+  if (stream_data->request_body != NULL) {
+    r->request_body = stream_data->request_body->data;
+    r->request_body_len = stream_data->request_body->len;
+  } else {
+    r->request_body = NULL;
+    r->request_body_len = 0;
+  }
+}
+
+// RFC 9218 priorities of static contents by the extension of the file,
+// others stay at the default u=3 without incremental
+static const struct {
+  const char *ext;
+  uint32_t urgency;
+  int inc;
+} mrb_http2_priority_defaults[] = {
+    // render blocking
+    {".html", 0, 0}, {".htm", 0, 0}, {".css", 0, 0},
+    {".js", 1, 0}, {".mjs", 1, 0},
+    {".woff2", 2, 0}, {".woff", 2, 0}, {".ttf", 2, 0}, {".otf", 2, 0},
+    {".json", 2, 0}, {".xml", 2, 0},
+    // shown as they arrive
+    {".png", 5, 1}, {".jpg", 5, 1}, {".jpeg", 5, 1}, {".gif", 5, 1}, {".webp", 5, 1}, {".avif", 5, 1},
+    {".svg", 5, 1}, {".ico", 5, 1},
+    {".mp4", 6, 1}, {".webm", 6, 1}, {".mp3", 6, 1}, {".ogg", 6, 1}, {".pdf", 6, 1},
+    // downloads
+    {".zip", 7, 0}, {".gz", 7, 0}, {".tar", 7, 0}, {".iso", 7, 0},
+};
+
+// the priority header or PRIORITY_UPDATE of the client takes precedence
+static void stream_priority_default(http2_session_data *session_data, http2_stream_data *stream_data,
+                                    mrb_http2_request_rec *r)
+{
+  const char *ext;
+  nghttp2_extpri extpri;
+  int i;
+
+  if (!session_data->app_ctx->server->config->extensible_priorities ||
+      mrb_http2_get_nv_id(r->reqhdr, r->reqhdrlen, "priority") != MRB_HTTP2_HEADER_NOT_FOUND) {
+    return;
+  }
+  ext = strrchr(r->filename, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL) {
+    return;
+  }
+  for (i = 0; i < ARRLEN(mrb_http2_priority_defaults); i++) {
+    if (strcasecmp(ext, mrb_http2_priority_defaults[i].ext) == 0) {
+      extpri.urgency = mrb_http2_priority_defaults[i].urgency;
+      extpri.inc = mrb_http2_priority_defaults[i].inc;
+      nghttp2_session_change_extpri_stream_priority(session_data->session, stream_data->stream_id, &extpri, 0);
+      return;
+    }
+  }
+}
+
+// content phase after the access checker, deferred to the end of the
+// stream unless the request body is forwarded to upstream
+static int mrb_http2_process_content(nghttp2_session *session, http2_session_data *session_data,
+                                     http2_stream_data *stream_data)
+{
+  int fd;
+  int rv;
+  struct stat finfo;
+  mrb_http2_request_rec *r = session_data->app_ctx->r;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+
+  // check proxy config
+  if (config->upstream && r->upstream && (r->upstream->host || r->upstream->group >= 0)) {
+    if (config->debug) {
+      fprintf(stderr, "found upstream: server:%s:%d uri:%s\n", r->upstream->host, r->upstream->port, r->upstream->uri);
+    }
+    if (session_data->app_ctx->cache != NULL) {
+      rv = upstream_cache_lookup(session_data->app_ctx, session, stream_data);
+      if (rv != 1) {
+        return rv;
+      }
+    }
+    // the response is submitted by the callbacks of the leader when attached
+    if (session_data->app_ctx->collapse != NULL && upstream_collapse_join(session_data->app_ctx, stream_data) == 0) {
+      return 0;
+    }
+    // the response is submitted by http_request_header and http_request_done,
+    // or by the callbacks of the HTTP/2 upstream session
+    if (r->upstream->proto_major == 2) {
+      rv = read_upstream_h2(session_data, session_data->app_ctx, stream_data);
+    } else {
+      rv = read_upstream_response(session_data, session_data->app_ctx, session, stream_data);
+    }
+    if (rv == 1) {
+      stream_data->content_deferred = 1;
+      return 0;
+    }
+    if (rv != 0) {
+      upstream_collapse_finish(stream_data, 0);
+      set_status_record(r, rv == MRB_HTTP2_UPSTREAM_CIRCUIT_OPEN ? HTTP_SERVICE_UNAVAILABLE : HTTP_BAD_GATEWAY);
+      if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+      }
+    }
+    return 0;
+  }
+
+  // other contents run with the whole request body
+  if (stream_data->request_early) {
+    mrb_http2_server_t *server = session_data->app_ctx->server;
+    stream_data->content_proc = server->cb_procs[MRB_HTTP2_SERVER_CONTENT];
+    if (!mrb_nil_p(stream_data->content_proc)) {
+      mrb_gc_register(server->mrb, stream_data->content_proc);
+      server->cb_procs[MRB_HTTP2_SERVER_CONTENT] = mrb_nil_value();
+    }
+    stream_data->content_deferred = 1;
+    return 0;
+  }
+
+  // run mruby script
+  if (r->mruby || r->shared_mruby) {
+    set_status_record(r, HTTP_OK);
+    if (mruby_reply(session_data->app_ctx, session_data, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  // hook content_cb
+  if (!mrb_nil_p(session_data->app_ctx->server->cb_procs[MRB_HTTP2_SERVER_CONTENT])) {
+    set_status_record(r, HTTP_OK);
+    if (content_cb_reply(session_data->app_ctx, session_data, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  // static contents response
+  fd = open(r->filename, O_RDONLY);
+
+  TRACER;
+  if (fd == -1) {
+    set_status_record(r, HTTP_NOT_FOUND);
+    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  stream_data->fd = fd;
+  stream_priority_default(session_data, stream_data, r);
+  // set_status_record(r, HTTP_OK);
+
+  TRACER;
+  if (fstat(fd, &finfo) != 0) {
+    set_status_record(r, HTTP_NOT_FOUND);
+    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+  r->finfo = &finfo;
+
+  // cached time string created strftime()
+  if (r->finfo->st_mtime != r->prev_last_modified) {
+    r->prev_last_modified = r->finfo->st_mtime;
+    set_http_date_str(&r->finfo->st_mtime, r->last_modified);
+  }
+
+  // set content-length: max 10^64
+  snprintf(r->content_length, 64, "%ld", (long)r->finfo->st_size);
+  stream_data->readleft = r->finfo->st_size;
+
+  TRACER;
+  if (!config->callback && r->reshdrslen == 0) {
+    r->response_type = MRB_HTTP2_RESPONSE_STATIC;
+    return mrb_http2_send_200_response(session_data->app_ctx, session, stream_data);
+  } else {
+    return mrb_http2_send_custom_response(session_data->app_ctx, session, stream_data);
+  }
+}
+
+static int mrb_http2_process_request(nghttp2_session *session, http2_session_data *session_data,
+                                     http2_stream_data *stream_data)
+{
+  time_t now = time(NULL);
+  mrb_http2_request_rec *r = session_data->app_ctx->r;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  mrb_state *mrb = session_data->app_ctx->server->mrb;
+  size_t rootlen;
+
+  //
+  // Request process phase
+  //
+
+  // cached time string created strftime()
+  // create r->date for error_reply
+  if (config->callback) {
+    r->phase = MRB_HTTP2_SERVER_READ_REQUEST;
+  }
+  if (now != r->prev_req_time) {
+    r->prev_req_time = now;
+    set_http_date_str(&now, r->date);
+  }
+
+  // get connection record
+  r->conn = session_data->conn;
+
+  // get requset header table and table length
+  r->reqhdr = stream_data->nva;
+  r->reqhdrlen = stream_data->nvlen;
+
+  if (config->debug) {
+    int i;
+    for (i = 0; i < stream_data->nvlen; i++) {
+      debug_header(__func__, stream_data->nva[i].name, stream_data->nva[i].namelen, stream_data->nva[i].value,
+                   stream_data->nva[i].valuelen);
+    }
+  }
+
+  TRACER;
+  if (!stream_data->request_path) {
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+  if (config->debug) {
+    fprintf(stderr, "from %s to %s %s %s\n", session_data->client_addr, stream_data->authority, stream_data->method,
+            stream_data->request_path);
+  }
+  TRACER;
+  if (!check_path(stream_data->request_path)) {
+    if (config->debug) {
+      fprintf(stderr, "%s invalid request_path: %s\n", session_data->client_addr, stream_data->request_path);
+    }
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  // r-> will free at request_rec_free
+  rootlen = strlen(config->document_root);
+  r->filename = malloc(rootlen + strlen(stream_data->request_path) + 1);
+  memcpy(r->filename, config->document_root, rootlen);
+  strcpy(r->filename + rootlen, stream_data->request_path);
+
+  r->authority = stream_data->authority;
+  r->scheme = stream_data->scheme;
+  r->method = stream_data->method;
+  r->unparsed_uri = stream_data->unparsed_uri;
+  r->percent_encode_uri = stream_data->percent_encode_uri;
+  r->uri = stream_data->request_path;
+  r->args = stream_data->request_args;
+  r->response_type = MRB_HTTP2_RESPONSE_TYPE_NONE;
+
+  set_request_body(r, stream_data);
+
+  if (config->debug) {
+    fprintf(stderr, "=== process request information start ===\n");
+    fprintf(stderr, "percent_encode_uri: %s\n", r->percent_encode_uri);
+    fprintf(stderr, "unparsed_uri: %s\n", r->unparsed_uri);
+    fprintf(stderr, "uri: %s\n", r->uri);
+    fprintf(stderr, "request_body: %s\n", r->request_body);
+    fprintf(stderr, "args: %s\n", r->args);
+    fprintf(stderr, "filename: %s\n", r->filename);
+    fprintf(stderr, "hostname: %s\n", r->authority);
+    fprintf(stderr, "scheme: %s\n", r->scheme);
+    fprintf(stderr, "method: %s\n", r->method);
+    fprintf(stderr, "client_addr: %s\n", session_data->client_addr);
+    fprintf(stderr, "document_root: %s\n", config->document_root);
+    fprintf(stderr, "=== process request information end ===\n");
+  }
+
+  //
+  // "set_map_to_storage" callback ruby block
+  //
+  callback_ruby_block(mrb, session_data->app_ctx->server, r, MRB_HTTP2_SERVER_MAP_TO_STORAGE);
+
+  if (config->debug) {
+    fprintf(stderr, "%s %s is mapped to %s\n", session_data->client_addr, r->uri, r->filename);
+  }
+
+  //
+  // "set_access_checker" callback ruby block
+  //
+  callback_ruby_block(mrb, session_data->app_ctx->server, r, MRB_HTTP2_SERVER_ACCESS_CHECKER);
+
+  // check whether set status or not on access_checker callback
+  if (r->status && r->status != HTTP_OK) {
+    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  return mrb_http2_process_content(session, session_data, stream_data);
+}
+
+static int server_on_frame_recv_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+  http2_session_data *session_data = (http2_session_data *)user_data;
+  http2_stream_data *stream_data;
+  mrb_http2_request_rec *prev;
+  int rv;
+
+  TRACER;
+  switch (frame->hd.type) {
+  case NGHTTP2_DATA:
+  case NGHTTP2_HEADERS:
+    stream_data = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    /* For DATA and HEADERS frame, this callback may be called after
+       on_stream_close_callback. Check that stream still alive. */
+    if (!stream_data) {
+      return 0;
+    }
+    if (frame->hd.type == NGHTTP2_HEADERS && stream_data->headers_pending) {
+      stream_data->headers_pending = 0;
+      session_data->headers_pending--;
+    }
+    /* Check that the client request has finished */
+    if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+      if (stream_data->upload) {
+        // the body was forwarded as it arrived
+        if (stream_data->upstream_h2 != NULL) {
+          mrb_http2_upstream_h2_end(stream_data->upstream_h2->stream);
+        }
+        return 0;
+      }
+      if (stream_data->request_early && !stream_data->content_deferred) {
+        // replied before the body
+        return 0;
+      }
+    } else if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST &&
+               session_data->app_ctx->server->config->upstream &&
+               !session_data->app_ctx->server->config->upstream_request_buffering) {
+      // route a request with a body now, so upstream gets the body as it arrives
+      stream_data->request_early = 1;
+    } else {
+      return 0;
+    }
+
+    prev = mrb_http2_request_rec_bind(session_data->app_ctx, stream_data->r);
+    mrb_http2_budget_start(session_data->app_ctx->server->mrb, session_data->app_ctx->server->config);
+    if (stream_data->content_deferred) {
+      mrb_http2_server_t *server = session_data->app_ctx->server;
+      stream_data->request_early = 0;
+      stream_data->content_deferred = 0;
+      // run the content_cb of this request, not the last one set, it stays
+      // registered to gc until the stream is deleted
+      server->cb_procs[MRB_HTTP2_SERVER_CONTENT] = stream_data->content_proc;
+      set_request_body(stream_data->r, stream_data);
+      rv = mrb_http2_process_content(session, session_data, stream_data);
+    } else {
+      rv = mrb_http2_process_request(session, session_data, stream_data);
+    }
+    if (mrb_http2_budget_stop(session_data->app_ctx->server->mrb)) {
+      fprintf(stderr, "%s %s %s: handler exceeded execution budget, aborted with 503\n", session_data->client_addr,
+              stream_data->method, stream_data->request_path);
+      if (session_data->app_ctx->server->config->server_status) {
+        MRB_HTTP2_STAT_INC(session_data->app_ctx->server->worker->handler_budget_exceeded);
+      }
+    }
+    mrb_http2_request_rec_bind(session_data->app_ctx, prev);
+    mrb_http2_gc_schedule(session_data->app_ctx);
+    return rv;
+  case NGHTTP2_PRIORITY_UPDATE:
+    // applied to the stream by nghttp2
+    if (session_data->app_ctx->server->config->server_status) {
+      MRB_HTTP2_STAT_INC(session_data->app_ctx->server->worker->priority_updates);
+    }
+    break;
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+#define MRB_HTTP2_MAX_POST_DATA_SIZE 1 << 24
+
+static int server_on_data_chunk_recv_callback(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                                              const uint8_t *data, size_t len, void *user_data)
+{
+  http2_session_data *session_data = (http2_session_data *)user_data;
+  http2_stream_data *stream_data = nghttp2_session_get_stream_user_data(session, stream_id);
+  mrb_state *mrb = session_data->app_ctx->server->mrb;
+  int rv;
+
+  if (session_data->app_ctx->server->config->debug) {
+    fprintf(stderr, "%s: datalen = %ld\n", __func__, len);
+  }
+
+  if (stream_data->upload) {
+    if (stream_data->upstream_h2 != NULL) {
+      // consumed by upstream_h2_on_body_sent
+      stream_data->unconsumed += len;
+      mrb_http2_upstream_h2_write(stream_data->upstream_h2->stream, data, len);
+    } else {
+      // the upstream response was finished, drop the rest
+      session_consume(session_data, stream_id, len);
+    }
+    return 0;
+  }
+  session_consume(session_data, stream_id, len);
+
+  // TODO: buffering and stored file or memory, currently store len byte
+  // when callback only once
+  if (stream_data->request_body == NULL) {
+    stream_data->request_body = mrb_malloc(mrb, sizeof(mrb_http2_request_body));
+    memset(stream_data->request_body, 0, sizeof(mrb_http2_request_body));
+  }
+  if (stream_data->request_body->last) {
+    fprintf(stderr, "request_body length reached MRB_HTTP2_MAX_POST_DATA_SIZE");
+    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
+    if (rv != 0) {
+      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  } else {
+    char *pos;
+    stream_data->request_body->len += len;
+    if (stream_data->request_body->len >= MRB_HTTP2_MAX_POST_DATA_SIZE) {
+      fprintf(stderr, "post data length(%ld) exceed "
+                      "MRB_HTTP2_MAX_POST_DATA_SIZE(%d)\n",
+              (long)stream_data->request_body->len, MRB_HTTP2_MAX_POST_DATA_SIZE);
+      stream_data->request_body->len = MRB_HTTP2_MAX_POST_DATA_SIZE;
+      stream_data->request_body->last = 1;
+      rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
+      if (rv != 0) {
+        fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+      }
+      return 0;
+    }
+    stream_data->request_body->data =
+        mrb_realloc(mrb, stream_data->request_body->data, stream_data->request_body->len + 1);
+    pos = stream_data->request_body->data;
+    pos += stream_data->request_body->pos;
+    memcpy(pos, data, stream_data->request_body->len - stream_data->request_body->pos);
+    stream_data->request_body->pos += len;
+    stream_data->request_body->data[stream_data->request_body->len] = '\0';
+  }
+
+  return 0;
+}
+
+static int server_on_stream_close_callback(nghttp2_session *session, int32_t stream_id, nghttp2_error_code error_code,
+                                           void *user_data)
+{
+  http2_session_data *session_data = (http2_session_data *)user_data;
+  http2_stream_data *stream_data;
+
+  TRACER;
+  stream_data = nghttp2_session_get_stream_user_data(session, stream_id);
+  if (!stream_data) {
+    return 0;
+  }
+  // give back the window of the body not forwarded
+  if (stream_data->unconsumed > 0) {
+    nghttp2_session_consume_connection(session, stream_data->unconsumed);
+  }
+  //
+  // "set_logging_cb" callback ruby block of a proxied response
+  //
+  if (stream_data->logging_deferred) {
+    app_context *app_ctx = session_data->app_ctx;
+    mrb_http2_request_rec *prev = mrb_http2_request_rec_bind(app_ctx, stream_data->r);
+    callback_ruby_block(app_ctx->server->mrb, app_ctx->server, stream_data->r, MRB_HTTP2_SERVER_LOGGING);
+    mrb_http2_request_rec_bind(app_ctx, prev);
+  }
+  remove_stream(session_data, stream_data);
+  delete_http2_stream_data(session_data->app_ctx, stream_data);
+  TRACER;
+  return 0;
+}
+
+static ssize_t fixed_data_source_length_callback(nghttp2_session *session, uint8_t frame_type, int32_t stream_id,
+                                                 int32_t session_remote_window_size, int32_t stream_remote_window_size,
+                                                 uint32_t remote_max_frame_size, void *user_data)
+{
+  return MRB_HTTP2_READ_LENGTH_MAX;
+}
+
+static void mrb_http2_server_session_init(http2_session_data *session_data)
+{
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_option *option;
+  app_context *app_ctx = session_data->app_ctx;
+
+  TRACER;
+
+  nghttp2_session_callbacks_new(&callbacks);
+
+  nghttp2_session_callbacks_set_send_data_callback(callbacks, server_send_data_callback);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, server_on_frame_recv_callback);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, server_on_data_chunk_recv_callback);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, server_on_stream_close_callback);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, server_on_header_callback);
+  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, server_on_begin_headers_callback);
+  nghttp2_session_callbacks_set_data_source_read_length_callback(callbacks, fixed_data_source_length_callback);
+
+  // WINDOW_UPDATE is sent when the received body was consumed, so that
+  // the body forwarded to upstream is flow controlled by the upstream
+  nghttp2_option_new(&option);
+  nghttp2_option_set_no_auto_window_update(option, 1);
+  // the priority tree of RFC 7540 for clients not sending
+  // SETTINGS_NO_RFC7540_PRIORITIES
+  nghttp2_option_set_server_fallback_rfc7540_priorities(option, 1);
+  // PRIORITY_UPDATE is ignored as an unknown frame unless it is a builtin
+  // extension of the session
+  if (app_ctx->server->config->extensible_priorities) {
+    nghttp2_option_set_builtin_recv_extension_type(option, NGHTTP2_PRIORITY_UPDATE);
+  }
+
+  // the frames and streams of the session are allocated from the slab
+  nghttp2_session_server_new3(&session_data->session, callbacks, session_data, option,
+                              app_ctx->server->config->slab_allocator ? &app_ctx->nghttp2_mem : NULL);
+  nghttp2_session_callbacks_del(callbacks);
+  nghttp2_option_del(option);
+}
+
+/* Send HTTP/2.0 client connection header, which includes 24 bytes
+   magic octets and SETTINGS frame */
+static int send_server_connection_header(http2_session_data *session_data)
+{
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  nghttp2_settings_entry iv[6];
+  size_t niv = 0;
+  int rv;
+
+  iv[niv].settings_id = NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  iv[niv++].value = config->max_concurrent_streams;
+  iv[niv].settings_id = NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+  iv[niv++].value = config->initial_window_size;
+  // the others only when they differ from the defaults of the protocol
+  if (config->max_frame_size != MRB_HTTP2_CONFIG_MAX_FRAME_SIZE_MIN) {
+    iv[niv].settings_id = NGHTTP2_SETTINGS_MAX_FRAME_SIZE;
+    iv[niv++].value = config->max_frame_size;
+  }
+  if (config->header_table_size != NGHTTP2_DEFAULT_HEADER_TABLE_SIZE) {
+    iv[niv].settings_id = NGHTTP2_SETTINGS_HEADER_TABLE_SIZE;
+    iv[niv++].value = config->header_table_size;
+  }
+  if (config->max_header_list_size > 0) {
+    iv[niv].settings_id = NGHTTP2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    iv[niv++].value = config->max_header_list_size;
+  }
+  // streams are scheduled by RFC 9218 urgency and incremental
+  if (config->extensible_priorities) {
+    iv[niv].settings_id = NGHTTP2_SETTINGS_NO_RFC7540_PRIORITIES;
+    iv[niv++].value = 1;
+  }
+
+  rv = nghttp2_submit_settings(session_data->session, NGHTTP2_FLAG_NONE, iv, niv);
+  TRACER;
+  if (rv != 0) {
+    fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+    return -1;
+  }
+
+  // the connection window is 65535 until enlarged by WINDOW_UPDATE
+  session_data->recv_window = NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE;
+  if (config->connection_window_size > NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE) {
+    rv = nghttp2_session_set_local_window_size(session_data->session, NGHTTP2_FLAG_NONE, 0,
+                                               config->connection_window_size);
+    if (rv != 0) {
+      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+      return -1;
+    }
+    session_data->recv_window = config->connection_window_size;
+  }
+  if (session_data->recv_window < config->initial_window_size) {
+    session_data->recv_window = config->initial_window_size;
+  }
+  session_data->rtt = MRB_HTTP2_WINDOW_RTT_DEFAULT;
+  event_base_gettimeofday_cached(session_data->app_ctx->evbase, &session_data->window_epoch);
+  TRACER;
+  return 0;
+}
+
+#define MRB_HTTP2_SSL_BUFSIZE 16384
+
+static SSL *mrb_http2_create_ssl(mrb_state *mrb, SSL_CTX *ssl_ctx)
+{
+  SSL *ssl;
+
+  if (ssl_ctx == NULL) {
+    return NULL;
+  }
+  ssl = SSL_new(ssl_ctx);
+
+  TRACER;
+  if (!ssl) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not create SSL/TLS session object: %S",
+               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  }
+
+  TRACER;
+  return ssl;
+}
+
+static mrb_http2_conn_rec *mrb_http2_conn_rec_init(mrb_state *mrb, mrb_http2_config_t *config)
+{
+  mrb_http2_conn_rec *conn;
+
+  if (!config->connection_record) {
+    return NULL;
+  }
+  conn = (mrb_http2_conn_rec *)mrb_malloc(mrb, sizeof(mrb_http2_conn_rec));
+  memset(conn, 0, sizeof(mrb_http2_conn_rec));
+
+  conn->client_ip = NULL;
+
+  return conn;
+}
+
+static void tune_packet_buffer(struct bufferevent *bev, mrb_http2_config_t *config)
+{
+  if (config->write_packet_buffer_limit_size > 0) {
+    bufferevent_setwatermark(bev, EV_WRITE, 0, config->write_packet_buffer_limit_size);
+  }
+
+  if (config->write_packet_buffer_expand_size > 0) {
+    evbuffer_expand(bev->output, config->write_packet_buffer_expand_size);
+  }
+
+  // TODO: need read_packet_buffer_expand_size ?
+  // evbuffer_expand(session_data->bev->input, 4096);
+}
+
+#if MRB_HTTP2_USE_ALPN
+static bool check_selected_proto(const unsigned char *proto, unsigned int len)
+{
+  if (sizeof(MRB_HTTP2_H2_PROTO) == len && memcmp(MRB_HTTP2_H2_PROTO, proto, len) == 0)
+    return true;
+  if (sizeof(MRB_HTTP2_H2_16_PROTO) == len && memcmp(MRB_HTTP2_H2_16_PROTO, proto, len) == 0)
+    return true;
+  if (sizeof(MRB_HTTP2_H2_14_PROTO) == len && memcmp(MRB_HTTP2_H2_14_PROTO, proto, len) == 0)
+    return true;
+
+  return false;
+}
+#endif
+
+#if MRB_HTTP2_USE_ALPN
+static bool check_http2_npn_or_alpn(SSL *ssl)
+{
+  const unsigned char *next_proto = NULL;
+  unsigned int next_proto_len = 0;
+
+  SSL_get0_next_proto_negotiated(ssl, &next_proto, &next_proto_len);
+
+  if (next_proto == NULL)
+    SSL_get0_alpn_selected(ssl, &next_proto, &next_proto_len);
+
+  if (next_proto == NULL || !check_selected_proto(next_proto, next_proto_len))
+    return true;
+
+  /* one more check */
+  if (!check_http2_npn_or_alpn(ssl))
+    return false;
+
+  return true;
+}
+#endif
+
+static http2_session_data *create_http2_session_data(mrb_state *mrb, app_context *app_ctx, int fd,
+                                                     struct sockaddr *addr, int addrlen)
+{
+  int rv;
+  http2_session_data *session_data;
+  SSL *ssl;
+  // char host[NI_MAXHOST];
+  int val = 1;
+  mrb_http2_server_t *server = app_ctx->server;
+  mrb_http2_config_t *config = app_ctx->server->config;
+
+  TRACER;
+  ssl = mrb_http2_create_ssl(mrb, app_ctx->ssl_ctx);
+
+  session_data = (http2_session_data *)mrb_malloc(mrb, sizeof(http2_session_data));
+  memset(session_data, 0, sizeof(http2_session_data));
+
+  session_data->app_ctx = app_ctx;
+  mrb_http2_timer_init(&session_data->timer, session_timeout_cb, session_data);
+  app_ctx->nsessions++;
+  session_data->output_limit = OUTPUT_WOULDBLOCK_THRESHOLD;
+#ifdef TCP_NOTSENT_LOWAT
+  if (config->tcp_notsent_lowat > 0) {
+    int lowat = config->tcp_notsent_lowat;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *)&lowat, sizeof(lowat));
+    session_data->output_limit = MRB_HTTP2_OUTPUT_LIMIT_MIN;
+  }
+#endif
+  // return NULL when connection_record option diabled
+  session_data->conn = mrb_http2_conn_rec_init(mrb, config);
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+
+  TRACER;
+  session_data->bev = bufferevent_socket_new(app_ctx->evbase, fd, BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
+
+  tune_packet_buffer(session_data->bev, config);
+
+  if (ssl) {
+    TRACER;
+
+#if MRB_HTTP2_USE_ALPN
+    if (!check_http2_npn_or_alpn(ssl))
+      return NULL;
+#endif
+
+    session_data->bev =
+        bufferevent_openssl_filter_new(app_ctx->evbase, session_data->bev, ssl, BUFFEREVENT_SSL_ACCEPTING,
+                                       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  }
+
+  bufferevent_enable(session_data->bev, EV_READ | EV_WRITE);
+
+  rv =
+      getnameinfo(addr, addrlen, session_data->client_addr, sizeof(session_data->client_addr), NULL, 0, NI_NUMERICHOST);
+  if (rv != 0) {
+    memcpy(session_data->client_addr, "(unknown)", sizeof("(unknown)"));
+  }
+  if (session_data->conn) {
+    session_data->conn->client_ip = session_data->client_addr;
+  }
+
+  if (config->server_status) {
+    MRB_HTTP2_STAT_INC(server->worker->session_requests_per_worker);
+    MRB_HTTP2_STAT_INC(server->worker->connected_sessions);
+  }
+  // the handshake timeout until the session starts
+  session_timer_update(session_data, MRB_HTTP2_SESSION_TIMER_NONE);
+
+  return session_data;
+}
+
+/* readcb for bufferevent after client connection header was
+   checked. */
+static void mrb_http2_server_readcb(struct bufferevent *bev, void *ptr)
+{
+  http2_session_data *session_data = (http2_session_data *)ptr;
+
+  TRACER;
+  if (session_data->app_ctx->server->config->tls) {
+    // if tls, use session_recv2 and tls_session_send
+    if (session_recv(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  } else {
+    if (session_recv(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  }
+  session_timer_update(session_data, MRB_HTTP2_SESSION_TIMER_IDLE);
+}
+
+static void mrb_http2_server_writecb(struct bufferevent *bev, void *ptr)
+{
+  http2_session_data *session_data = (http2_session_data *)ptr;
+
+  TRACER;
+  if (evbuffer_get_length(bufferevent_get_output(bev)) > 0) {
+    return;
+  }
+  // push the last partial packet of the batch
+  if (session_data->corked) {
+    session_cork(session_data, 0);
+  }
+  session_output_limit_update(session_data);
+  session_timer_update(session_data, MRB_HTTP2_SESSION_TIMER_WRITE);
+  TRACER;
+  if (nghttp2_session_want_read(session_data->session) == 0 && nghttp2_session_want_write(session_data->session) == 0) {
+    delete_http2_session_data(session_data);
+    return;
+  }
+  TRACER;
+  if (session_data->app_ctx->server->config->tls) {
+    if (session_send(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  } else {
+    if (session_send(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  }
+  TRACER;
+}
+
+/* eventcb for bufferevent */
+static void mrb_http2_server_eventcb(struct bufferevent *bev, short events, void *ptr)
+{
+  http2_session_data *session_data = (http2_session_data *)ptr;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+
+  TRACER;
+  if (events & BEV_EVENT_CONNECTED) {
+    if (config->debug) {
+      fprintf(stderr, "%s connected\n", session_data->client_addr);
+    }
+    if (config->tls) {
+      mrb_http2_server_session_init(session_data);
+      if (send_server_connection_header(session_data) != 0) {
+        delete_http2_session_data(session_data);
+        return;
+      }
+    }
+    return;
+  }
+  if (config->debug) {
+    if (events & BEV_EVENT_EOF) {
+      fprintf(stderr, "%s EOF\n", session_data->client_addr);
+    } else if (events & BEV_EVENT_ERROR) {
+      fprintf(stderr, "%s network error\n", session_data->client_addr);
+    } else if (events & BEV_EVENT_TIMEOUT) {
+      fprintf(stderr, "%s timeout\n", session_data->client_addr);
+    }
+  }
+  TRACER;
+  delete_http2_session_data(session_data);
+}
+
+static void mrb_http2_acceptcb(struct evconnlistener *listener, int fd, struct sockaddr *addr, int addrlen, void *ptr)
+{
+  app_context *app_ctx = (app_context *)ptr;
+  http2_session_data *session_data;
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  TRACER;
+  session_data = create_http2_session_data(mrb, app_ctx, fd, addr, addrlen);
+  // leave the next connections in the backlog until a session closed
+  if (app_ctx->server->config->max_connections > 0 &&
+      (mrb_int)app_ctx->nsessions >= app_ctx->server->config->max_connections) {
+    evconnlistener_disable(listener);
+    app_ctx->accept_paused = 1;
+    if (app_ctx->server->config->server_status) {
+      MRB_HTTP2_STAT_INC(app_ctx->server->worker->accept_pauses);
+    }
+  }
+  if (session_data->bev == NULL) {
+    // accept socket failed
+    delete_http2_session_data(session_data);
+    return;
+  }
+  bufferevent_setcb(session_data->bev, mrb_http2_server_readcb, mrb_http2_server_writecb, mrb_http2_server_eventcb,
+                    session_data);
+  if (app_ctx->server->config->write_timeout > 0) {
+    session_data->output_cb =
+        evbuffer_add_cb(bufferevent_get_output(session_data->bev), session_output_cb, session_data);
+  }
+  if (!app_ctx->server->config->tls) {
+    bufferevent_enable(session_data->bev, EV_READ | EV_WRITE);
+    mrb_http2_server_session_init(session_data);
+    if (send_server_connection_header(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  }
+  // don't call eventcb when createing bufferevent_socket_new, not tls
+  // bufferevent_socket_connect(session_data->bev, NULL, 0);
+}
+
+static void set_dhparams(mrb_state *mrb, mrb_http2_config_t *config, SSL_CTX *ssl_ctx)
+{
+  DH *dh;
+  BIO *bio = BIO_new_file(config->dh_params_file, "r");
+
+  if (bio == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "dh_params_file open failed: %S", mrb_str_new_cstr(mrb, config->dh_params_file));
+  }
+
+  dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+  BIO_free(bio);
+
+  if (dh == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "dh_params_file read failed: %S", mrb_str_new_cstr(mrb, config->dh_params_file));
+  }
+
+  SSL_CTX_set_tmp_dh(ssl_ctx, dh);
+  DH_free(dh);
+}
+
+static int npn_advertise_cb(SSL *s, const unsigned char **data, unsigned int *len, void *proto)
+{
+  *data = proto;
+  *len = (unsigned int)strlen(proto);
+  return SSL_TLSEXT_ERR_OK;
+}
+
+/* ref: h2o/lib/common/socket.c */
+#if MRB_HTTP2_USE_ALPN
+static int alpn_select_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *_in,
+                          unsigned int inlen, void *_protos)
+{
+  const mrb_http2_iovec_t *protos = _protos;
+  size_t i;
+
+  for (i = 0; protos[i].len != 0; ++i) {
+    const unsigned char *in = _in, *in_end = in + inlen;
+    while (in != in_end) {
+      size_t cand_len = *in++;
+      if (in_end - in < cand_len) {
+        return SSL_TLSEXT_ERR_NOACK;
+      }
+      if (cand_len == protos[i].len && memcmp(in, protos[i].base, cand_len) == 0) {
+        *out = (const unsigned char *)protos[i].base;
+        *outlen = (unsigned char)protos[i].len;
+
+        return SSL_TLSEXT_ERR_OK;
+      }
+      in += cand_len;
+    }
+  }
+
+  return SSL_TLSEXT_ERR_NOACK;
+}
+#endif
+
+static SSL_CTX *mrb_http2_create_ssl_ctx(mrb_state *mrb, mrb_http2_config_t *config, const char *key_file,
+                                         const char *cert_file)
+{
+  const unsigned char sid_ctx[] = "mruby-http2";
+  SSL_CTX *ssl_ctx;
+  EC_KEY *ecdh;
+
+  SSL_load_error_strings();
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
+
+  ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+  TRACER;
+  if (!ssl_ctx) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not create SSL/TLS context: %S",
+               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  }
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_COMPRESSION);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_SINGLE_ECDH_USE);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+  // in reference to nghttp2
+  if (SSL_CTX_set_cipher_list(ssl_ctx, DEFAULT_CIPHER_LIST) == 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "SSL_CTX_set_cipher_list failed: %S",
+               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  }
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+  SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+
+  ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  if (!ecdh) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "EC_KEY_new_by_curv_name failed: %S",
+               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  }
+  SSL_CTX_set_tmp_ecdh(ssl_ctx, ecdh);
+  EC_KEY_free(ecdh);
+
+  if (config->dh_params_file) {
+    set_dhparams(mrb, config, ssl_ctx);
+  }
+
+  if (SSL_CTX_use_PrivateKey_file(ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not read private key file %S", mrb_str_new_cstr(mrb, key_file));
+  }
+  if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_file) != 1) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not read certificate file %S", mrb_str_new_cstr(mrb, cert_file));
+  }
+  SSL_CTX_set_next_protos_advertised_cb(ssl_ctx, npn_advertise_cb, (void *)npn_proto);
+#if MRB_HTTP2_USE_ALPN
+  SSL_CTX_set_alpn_select_cb(ssl_ctx, alpn_select_cb, (void *)alpn_proto);
+#endif
+  TRACER;
+  return ssl_ctx;
+}
+
+static void init_app_context(app_context *actx, SSL_CTX *ssl_ctx, struct event_base *evbase)
+{
+  memset(actx, 0, sizeof(app_context));
+  actx->ssl_ctx = ssl_ctx;
+  actx->evbase = evbase;
+}
+
+static void set_run_user(mrb_state *mrb, mrb_http2_config_t *config)
+{
+  uid_t cur_uid = getuid();
+
+  if (config->run_user == NULL && cur_uid != 0) {
+    mrb_warn(mrb, "don't set run_user, so run with uid=%S\n", mrb_fixnum_value(cur_uid));
+    return;
+  } else if (config->run_user == NULL && cur_uid == 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not run with root,"
+                                    " Set 'run_user => user_name' instead of root in config");
+  }
+
+  config->run_uid = mrb_http2_get_uid(mrb, config->run_user);
+
+  if (config->run_uid == 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not run with root,"
+                                    " Set 'run_user => user_name' instead of root in config");
+  }
+
+  // TODO: add config->run_gid
+  // setgid :run_user for now
+  if (setgid(config->run_uid)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not set gid: %S", mrb_fixnum_value(config->run_uid));
+  }
+
+  if (setuid(config->run_uid)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not set user: %S"
+                                     " If running server with specific user, "
+                                     "run server with root at first",
+               mrb_str_new_cstr(mrb, config->run_user));
+  }
+}
+
+static void mrb_start_listen(struct event_base *evbase, mrb_http2_config_t *config, app_context *app_ctx)
+{
+  int rv;
+  struct addrinfo hints;
+  struct addrinfo *res, *rp;
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  TRACER;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+#ifdef AI_ADDRCONFIG
+  hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+
+  rv = getaddrinfo(config->server_host, config->service, &hints, &res);
+  if (rv != 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "getaddrinfo failed");
+  }
+  TRACER;
+  for (rp = res; rp; rp = rp->ai_next) {
+    struct evconnlistener *listener;
+    if (config->worker > 0) {
+      evutil_socket_t fd;
+      int on = 1;
+      fd = socket(rp->ai_family, SOCK_STREAM, IPPROTO_TCP);
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+#if defined(__linux__) && defined(SO_REUSEPORT)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
+#endif
+      evutil_make_socket_nonblocking(fd);
+
+      if (bind(fd, (struct sockaddr *)rp->ai_addr, rp->ai_addrlen) < 0) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Could not bind, "
+                                        "don't support SO_REUSEPORT? So, can't use worker mode");
+      }
+      listener =
+          evconnlistener_new(evbase, mrb_http2_acceptcb, app_ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, fd);
+    } else {
+      listener = evconnlistener_new_bind(evbase, mrb_http2_acceptcb, app_ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
+                                         -1, rp->ai_addr, rp->ai_addrlen);
+    }
+
+    if (listener) {
+      app_ctx->listener = listener;
+      freeaddrinfo(res);
+      set_run_user(mrb, config);
+      return;
+    }
+  }
+  mrb_raise(mrb, E_RUNTIME_ERROR, "Could not start listener");
+}
+
+static void mrb_http2_worker_run(mrb_state *mrb, mrb_value self, mrb_http2_server_t *server, mrb_http2_request_rec *r,
+                                 app_context *app_ctx)
+{
+
+  SSL_CTX *ssl_ctx = NULL;
+  struct event_base *evbase;
+
+  if (server->config->tls) {
+    ssl_ctx = mrb_http2_create_ssl_ctx(mrb, server->config, server->config->key, server->config->cert);
+  }
+
+  server->worker = mrb_http2_worker_init(mrb);
+
+  evbase = event_base_new();
+  event_base_priority_init(evbase, MRB_HTTP2_EV_PRIORITIES);
+
+  init_app_context(app_ctx, ssl_ctx, evbase);
+  app_ctx->server = server;
+  app_ctx->r = r;
+  app_ctx->self = self;
+
+  if (server->config->idle_gc) {
+    app_ctx->gc_step_ev = event_new(evbase, -1, 0, mrb_http2_gc_step_cb, app_ctx);
+    event_priority_set(app_ctx->gc_step_ev, MRB_HTTP2_EV_PRIORITY_IDLE);
+    app_ctx->gc_full_ev = evtimer_new(evbase, mrb_http2_gc_full_cb, app_ctx);
+    event_priority_set(app_ctx->gc_full_ev, MRB_HTTP2_EV_PRIORITY_IDLE);
+  }
+
+  if (server->config->slab_allocator || server->config->mruby_slab_allocator) {
+    app_ctx->slab = mrb_http2_slab_new(server->config->server_status ? &server->worker->slab : NULL);
+    if (app_ctx->slab == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Could not create slab allocator");
+    }
+    mrb_http2_slab_nghttp2_mem(app_ctx->slab, &app_ctx->nghttp2_mem);
+  }
+
+  app_ctx->timer_wheel = mrb_http2_timer_wheel_new(evbase, MRB_HTTP2_TIMER_WHEEL_TICK);
+  if (app_ctx->timer_wheel == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not create timer wheel");
+  }
+
+  TRACER;
+  mrb_start_listen(evbase, server->config, app_ctx);
+
+  if (server->config->upstream || server->config->async_handler) {
+    app_ctx->resolver = mrb_http2_resolver_new(
+        evbase, server->config->dns_nameservers, server->config->dns_positive_ttl, server->config->dns_negative_ttl,
+        server->config->server_status ? &server->worker->dns_cache_hits : NULL,
+        server->config->server_status ? &server->worker->dns_cache_negative_hits : NULL);
+    if (app_ctx->resolver == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Could not create dns resolver");
+    }
+  }
+  if (server->config->upstream) {
+    app_ctx->upstream_tls = mrb_http2_upstream_tls_new(
+        server->config->upstream_tls_ca_file, server->config->upstream_tls_verify,
+        server->config->upstream_tls_session_cache,
+        server->config->server_status ? &server->worker->upstream_tls_handshakes : NULL,
+        server->config->server_status ? &server->worker->upstream_tls_resumptions : NULL);
+    if (app_ctx->upstream_tls == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Could not create upstream tls context");
+    }
+    app_ctx->upstream_pool = mrb_http2_upstream_pool_new(evbase, app_ctx->resolver, app_ctx->upstream_tls,
+                                                         server->config->upstream_keepalive_max_idle,
+                                                         server->config->upstream_max_connections,
+                                                         server->config->upstream_keepalive_timeout);
+    app_ctx->upstream_h2_pool = mrb_http2_upstream_h2_pool_new(evbase, app_ctx->resolver, app_ctx->upstream_tls,
+                                                               server->config->upstream_h2_max_connections,
+                                                               server->config->upstream_keepalive_timeout,
+                                                               server->config->upstream_connect_timeout);
+    if (server->config->upstream_breaker_threshold > 0) {
+      app_ctx->breaker = mrb_http2_breaker_new(evbase, server->config->upstream_breaker_threshold,
+                                               server->config->upstream_breaker_min_requests,
+                                               server->config->upstream_breaker_window,
+                                               server->config->upstream_breaker_open_time);
+      if (app_ctx->breaker == NULL) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Could not create upstream breaker");
+      }
+    }
+    app_ctx->retry_tokens = MRB_HTTP2_UPSTREAM_RETRY_TOKENS_MAX;
+    if (server->config->upstream_cache) {
+      app_ctx->cache = mrb_http2_cache_new(server->config->upstream_cache_memory_size,
+                                           server->config->upstream_cache_max_object_size,
+                                           server->config->upstream_cache_dir, server->config->upstream_cache_disk_slots);
+      if (app_ctx->cache == NULL) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Could not create upstream cache");
+      }
+    }
+    if (server->config->upstream_collapse) {
+      app_ctx->collapse = mrb_http2_collapse_new(evbase, upstream_collapse_settle_cb, app_ctx);
+      if (app_ctx->collapse == NULL) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Could not create upstream collapse");
+      }
+    }
+    if (server->config->upstream_groups_len > 0) {
+      app_ctx->upstream_groups = mrb_http2_upstream_groups_new(evbase, app_ctx->resolver->dnsbase,
+                                                               app_ctx->upstream_tls, server->config->upstream_groups,
+                                                               server->config->upstream_groups_len);
+      if (app_ctx->upstream_groups == NULL) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Could not create upstream groups");
+      }
+    }
+  }
+
+  // threads are created after fork and set_run_user
+  if (server->config->handler_threads > 0) {
+    app_ctx->handler_pool = mrb_http2_thread_pool_new(
+        evbase, server->config->handler_threads, mrb_http2_handler_thread_init, mrb_http2_handler_thread_run,
+        mrb_http2_handler_thread_final, mrb_http2_handler_done, app_ctx);
+    if (app_ctx->handler_pool == NULL) {
+      fprintf(stderr, "Could not create handler threads, run mruby scripts on the loop\n");
+    }
+  }
+
+  event_base_loop(app_ctx->evbase, 0);
+  if (app_ctx->handler_pool != NULL) {
+    mrb_http2_thread_pool_free(app_ctx->handler_pool);
+  }
+  mrb_http2_request_rec_pool_free(mrb, &app_ctx->rec_pool);
+  if (app_ctx->upstream_pool != NULL) {
+    mrb_http2_upstream_pool_free(app_ctx->upstream_pool);
+  }
+  if (app_ctx->upstream_h2_pool != NULL) {
+    mrb_http2_upstream_h2_pool_free(app_ctx->upstream_h2_pool);
+  }
+  if (app_ctx->cache != NULL) {
+    mrb_http2_cache_free(app_ctx->cache);
+  }
+  if (app_ctx->collapse != NULL) {
+    mrb_http2_collapse_free(app_ctx->collapse);
+  }
+  if (app_ctx->upstream_groups != NULL) {
+    mrb_http2_upstream_groups_free(app_ctx->upstream_groups);
+  }
+  if (app_ctx->breaker != NULL) {
+    mrb_http2_breaker_free(app_ctx->breaker);
+  }
+  // after the connections using its sessions
+  if (app_ctx->upstream_tls != NULL) {
+    mrb_http2_upstream_tls_free(app_ctx->upstream_tls);
+  }
+  mrb_http2_timer_wheel_free(app_ctx->timer_wheel);
+  // after the connections using its evdns_base
+  if (app_ctx->resolver != NULL) {
+    mrb_http2_resolver_free(app_ctx->resolver);
+  }
+  if (server->config->idle_gc) {
+    event_free(app_ctx->gc_step_ev);
+    event_free(app_ctx->gc_full_ev);
+  }
+  event_base_free(app_ctx->evbase);
+  if (server->config->tls) {
+    SSL_CTX_free(app_ctx->ssl_ctx);
+  }
+  // the sessions still open are not used after the loop
+  if (app_ctx->slab != NULL) {
+    mrb_http2_slab_free_all(app_ctx->slab);
+  }
+  TRACER;
+}
+
+static int pid[MRB_HTTP2_WORKER_MAX];
+static int prepare_kill = 0;
+
+static void killall_worker(int flags)
+{
+  int i;
+  prepare_kill = 1;
+  for (i = 0; pid[i] != -1; i++) {
+    kill(pid[i], SIGTERM);
+  }
+}
+
+static mrb_value mrb_http2_server_run(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  app_context app_ctx;
+  struct sigaction act;
+  mrb_http2_config_t *config = data->s->config;
+  memset(&act, 0, sizeof(struct sigaction));
+
+  if (config->worker > 0) {
+    int i, status;
+    for (i = 0; i < config->worker && (pid[i] = fork()) > 0; i++)
+      ;
+
+    if (i == config->worker) {
+      pid[i] = -1;
+      while (1) {
+        int wpid;
+        act.sa_handler = killall_worker;
+        sigaction(SIGTERM, &act, NULL);
+        wpid = wait(&status);
+        // monitoring workers
+        if (prepare_kill) {
+          // send term signal to master process
+          // preparing killall worker
+          return self;
+        } else {
+          if (config->debug) {
+            fprintf(stderr, "worker(%d) is down\n", wpid);
+          }
+          for (i = 0; i < config->worker; i++) {
+            if (wpid == pid[i]) {
+              pid[i] = fork();
+              break;
+            }
+          }
+          if (pid[i] == 0) {
+            act.sa_handler = SIG_DFL;
+            sigaction(SIGTERM, &act, NULL);
+            mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
+          } else {
+            if (config->debug) {
+              fprintf(stderr, "worker[%d](%d) restart\n", i, pid[i]);
+            }
+          }
+        }
+      }
+    } else if (pid[i] == 0) {
+      mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
+    }
+  } else {
+    mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
+  }
+
+  return self;
+}
+
+// procs are referenced from an instance variable of self for GC and
+// cached in server->cb_procs for dispatching without a symbol lookup
+static mrb_value mrb_http2_server_set_phase_cb(mrb_state *mrb, mrb_value self, mrb_http2_server_phase phase,
+                                               const char *cbid)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_value b;
+
+  mrb_get_args(mrb, "&", &b);
+  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, cbid), b);
+  if (data->s->config->callback) {
+    data->s->cb_procs[phase] = b;
+  }
+
+  return b;
+}
+
+static mrb_value mrb_http2_server_set_map_to_storage_cb(mrb_state *mrb, mrb_value self)
+{
+  return mrb_http2_server_set_phase_cb(mrb, self, MRB_HTTP2_SERVER_MAP_TO_STORAGE, "map_to_storage_cb");
+}
+
+static mrb_value mrb_http2_server_set_access_checker_cb(mrb_state *mrb, mrb_value self)
+{
+  return mrb_http2_server_set_phase_cb(mrb, self, MRB_HTTP2_SERVER_ACCESS_CHECKER, "access_checker_cb");
+}
+
+static mrb_value mrb_http2_server_set_fixups_cb(mrb_state *mrb, mrb_value self)
+{
+  return mrb_http2_server_set_phase_cb(mrb, self, MRB_HTTP2_SERVER_FIXUPS, "fixups_cb");
+}
+
+static mrb_value mrb_http2_server_set_content_cb(mrb_state *mrb, mrb_value self)
+{
+  return mrb_http2_server_set_phase_cb(mrb, self, MRB_HTTP2_SERVER_CONTENT, "content_cb");
+}
+
+static mrb_value mrb_http2_server_set_logging_cb(mrb_state *mrb, mrb_value self)
+{
+  return mrb_http2_server_set_phase_cb(mrb, self, MRB_HTTP2_SERVER_LOGGING, "logging_cb");
+}
+
+static void tune_rlimit(mrb_state *mrb, mrb_http2_config_t *config)
+{
+  struct rlimit r_cfg;
+
+  if (config->rlimit_nofile == 0) {
+    return;
+  }
+
+  if (config->rlimit_nofile < 0) {
+    fprintf(stderr, "don't tune rlmit, rlimit_nofile=%d need positive fixnum\n", config->rlimit_nofile);
+    return;
+  }
+
+  if (getuid() != 0) {
+    fprintf(stderr, "don't tune rlmit, run with root at first. then change"
+                    " privilege to 'run_user' value was set in config\n");
+    return;
+  }
+
+  r_cfg.rlim_cur = config->rlimit_nofile;
+  r_cfg.rlim_max = config->rlimit_nofile;
+
+  if (setrlimit(RLIMIT_NOFILE, &r_cfg) != 0) {
+    int err = errno;
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "tune_rlimit failed: %S", mrb_str_new_cstr(mrb, strerror(err)));
+  }
+  fprintf(stderr, "tune RLIMIT_NOFILE to %d\n", config->rlimit_nofile);
+}
+
+static mrb_value mrb_http2_server_init(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_server_t *server;
+  struct sigaction act;
+  mrb_value args;
+  int i;
+  mrb_http2_data_t *data = (mrb_http2_data_t *)mrb_malloc(mrb, sizeof(mrb_http2_data_t));
+  memset(data, 0, sizeof(mrb_http2_data_t));
+
+  memset(&act, 0, sizeof(struct sigaction));
+  act.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &act, NULL);
+
+  mrb_get_args(mrb, "H", &args);
+
+  // server context
+  server = (mrb_http2_server_t *)mrb_malloc(mrb, sizeof(mrb_http2_server_t));
+  memset(server, 0, sizeof(mrb_http2_server_t));
+  server->args = args;
+  server->mrb = mrb;
+  for (i = 0; i < MRB_HTTP2_SERVER_PHASE_MAX; i++) {
+    server->cb_procs[i] = mrb_nil_value();
+  }
+
+  mrb_gc_protect(mrb, server->args);
+  server->config = mrb_http2_s_config_init(mrb, server->args);
+
+  data->s = server;
+  data->r = mrb_http2_request_rec_init(mrb);
+
+  tune_rlimit(mrb, server->config);
+
+#if !MRB_HTTP2_USE_CODE_FETCH_HOOK
+  if (server->config->handler_timeout > 0 || server->config->handler_instruction_limit > 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "handler_timeout and handler_instruction_limit need mruby built with "
+                                    "MRB_ENABLE_DEBUG_HOOK");
+  }
+#endif
+
+  DATA_TYPE(self) = &mrb_http2_server_type;
+  DATA_PTR(self) = data;
+  TRACER;
+
+  if (server->config->daemon) {
+    if (daemon(0, 0) == -1) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "daemonize failed");
+    }
+  }
+
+  return self;
+}
+
+static mrb_value mrb_http2_req_obj(mrb_state *mrb, mrb_value self)
+{
+  // return mrb_http2_class_obj(mrb, self, "request_class_obj", "Request");
+  return self;
+}
+
+static mrb_value mrb_http2_conn_obj(mrb_state *mrb, mrb_value self)
+{
+  // return mrb_http2_class_obj(mrb, self, "request_class_obj", "Request");
+  return self;
+}
+
+static mrb_value mrb_http2_server_filename(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  return mrb_str_new_cstr(mrb, r->filename);
+}
+
+static mrb_value mrb_http2_server_set_filename(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  char *filename;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &filename, &len);
+  free(r->filename);
+
+  r->filename = strcopy(filename, len);
+
+  return self;
+}
+
+static mrb_value mrb_http2_server_uri(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  return mrb_str_new_cstr(mrb, r->uri);
+}
+
+static mrb_value mrb_http2_server_unparsed_uri(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  return mrb_str_new_cstr(mrb, r->unparsed_uri);
+}
+
+static mrb_value mrb_http2_server_percent_encode_uri(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  return mrb_str_new_cstr(mrb, r->percent_encode_uri);
+}
+
+static mrb_value mrb_http2_server_args(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  return mrb_str_new_cstr(mrb, r->args);
+}
+
+static mrb_value mrb_http2_server_method(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  return mrb_str_new_cstr(mrb, r->method);
+}
+
+static mrb_value mrb_http2_server_authority(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  return mrb_str_new_cstr(mrb, r->authority);
+}
+
+static mrb_value mrb_http2_server_scheme(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  return mrb_str_new_cstr(mrb, r->scheme);
+}
+
+static mrb_value mrb_http2_server_body(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  if (r->request_body == NULL) {
+    return mrb_nil_value();
+  } else {
+    return mrb_str_new(mrb, r->request_body, r->request_body_len);
+  }
+}
+
+static mrb_value mrb_http2_server_document_root(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_config_t *config = data->s->config;
+
+  return mrb_str_new_cstr(mrb, config->document_root);
+}
+
+static mrb_value mrb_http2_server_client_ip(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  if (!r->conn) {
+    return mrb_nil_value();
+  }
+  return mrb_str_new_cstr(mrb, r->conn->client_ip);
+}
+
+static mrb_value mrb_http2_server_user_agent(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  int i;
+
+  if (!data->r->reqhdr) {
+    return mrb_nil_value();
+  }
+
+  i = mrb_http2_get_nv_id(r->reqhdr, r->reqhdrlen, "user-agent");
+  if (i == MRB_HTTP2_HEADER_NOT_FOUND) {
+    return mrb_nil_value();
+  }
+
+  return mrb_str_new(mrb, (char *)r->reqhdr[i].value, r->reqhdr[i].valuelen);
+}
+
+static mrb_value mrb_http2_server_status(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+
+  return mrb_fixnum_value(data->r->status);
+}
+
+static mrb_value mrb_http2_server_date(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+
+  return mrb_str_new_cstr(mrb, data->r->date);
+}
+
+static mrb_value mrb_http2_server_content_length(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+
+  return mrb_fixnum_value(atoi(data->r->content_length));
+}
+
+static void mrb_http2_upstream_init(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  r->upstream = (mrb_http2_upstream *)malloc(sizeof(mrb_http2_upstream));
+  memset(r->upstream, 0, sizeof(mrb_http2_upstream));
+
+  r->upstream->uri = NULL;
+  r->upstream->host = NULL;
+  r->upstream->port = 80;
+  r->upstream->timeout = 600;
+  r->upstream->proto_major = 1;
+  r->upstream->proto_minor = 1;
+  r->upstream->keepalive = 1;
+  r->upstream->group = -1;
+}
+
+static mrb_value mrb_http2_server_set_upstream_proto_major(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  mrb_int major;
+
+  mrb_get_args(mrb, "i", &major);
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
+  }
+  // HTTP/2 upstreams are spoken over cleartext with prior knowledge, or
+  // negotiated by ALPN with an https upstream
+  if (major != 1 && major != 2) {
+    major = 1;
+  }
+  r->upstream->proto_major = (int)major;
+
+  return mrb_fixnum_value(r->upstream->proto_major);
+}
+
+static mrb_value mrb_http2_server_set_upstream_proto_minor(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  mrb_int minor;
+
+  mrb_get_args(mrb, "i", &minor);
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
+  }
+  // Now support HTTP/1.0 or HTTP/1.1
+  // TODO: support HTTP/2
+  if (minor != 0 && minor != 1) {
+    // defulat HTTP/1.1
+    minor = 1;
   }
-  mrb_raise(mrb, E_RUNTIME_ERROR, "Could not start listener");
+  r->upstream->proto_minor = (int)minor;
+
+  return mrb_fixnum_value(r->upstream->proto_minor);
 }
 
-static void mrb_http2_worker_run(mrb_state *mrb, mrb_value self, mrb_http2_server_t *server, mrb_http2_request_rec *r,
-                                 app_context *app_ctx)
+static mrb_value mrb_http2_server_set_upstream_keepalive(mrb_state *mrb, mrb_value self)
 {
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  mrb_value keepalive;
 
-  SSL_CTX *ssl_ctx = NULL;
-  struct event_base *evbase;
-
-  if (server->config->tls) {
-    ssl_ctx = mrb_http2_create_ssl_ctx(mrb, server->config, server->config->key, server->config->cert);
+  mrb_get_args(mrb, "o", &keepalive);
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
   }
+  r->upstream->keepalive = mrb_bool(keepalive);
 
-  server->worker = mrb_http2_worker_init(mrb);
-
-  evbase = event_base_new();
+  return keepalive;
+}
 
-  init_app_context(app_ctx, ssl_ctx, evbase);
-  app_ctx->server = server;
-  app_ctx->r = r;
-  app_ctx->self = self;
+static mrb_value mrb_http2_server_set_upstream_cache_key(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  char *key;
 
-  TRACER;
-  mrb_start_listen(evbase, server->config, app_ctx);
-  event_base_loop(app_ctx->evbase, 0);
-  event_base_free(app_ctx->evbase);
-  if (server->config->tls) {
-    SSL_CTX_free(app_ctx->ssl_ctx);
+  mrb_get_args(mrb, "z", &key);
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
   }
-  TRACER;
-}
+  free(r->upstream->cache_key);
+  r->upstream->cache_key = strdup(key);
 
-static int pid[MRB_HTTP2_WORKER_MAX];
-static int prepare_kill = 0;
+  return self;
+}
 
-static void killall_worker(int flags)
+static mrb_value mrb_http2_server_set_upstream_cache_bypass(mrb_state *mrb, mrb_value self)
 {
-  int i;
-  prepare_kill = 1;
-  for (i = 0; pid[i] != -1; i++) {
-    kill(pid[i], SIGTERM);
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  mrb_value bypass;
+
+  mrb_get_args(mrb, "o", &bypass);
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
   }
+  r->upstream->cache_bypass = mrb_bool(bypass);
+
+  return bypass;
 }
 
-static mrb_value mrb_http2_server_run(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_set_upstream_timeout(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  app_context app_ctx;
-  struct sigaction act;
-  mrb_http2_config_t *config = data->s->config;
-  memset(&act, 0, sizeof(struct sigaction));
-
-  if (config->worker > 0) {
-    int i, status;
-    for (i = 0; i < config->worker && (pid[i] = fork()) > 0; i++)
-      ;
+  mrb_http2_request_rec *r = data->r;
+  mrb_int timeout;
 
-    if (i == config->worker) {
-      pid[i] = -1;
-      while (1) {
-        int wpid;
-        act.sa_handler = killall_worker;
-        sigaction(SIGTERM, &act, NULL);
-        wpid = wait(&status);
-        // monitoring workers
-        if (prepare_kill) {
-          // send term signal to master process
-          // preparing killall worker
-          return self;
-        } else {
-          if (config->debug) {
-            fprintf(stderr, "worker(%d) is down\n", wpid);
-          }
-          for (i = 0; i < config->worker; i++) {
-            if (wpid == pid[i]) {
-              pid[i] = fork();
-              break;
-            }
-          }
-          if (pid[i] == 0) {
-            act.sa_handler = SIG_DFL;
-            sigaction(SIGTERM, &act, NULL);
-            mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
-          } else {
-            if (config->debug) {
-              fprintf(stderr, "worker[%d](%d) restart\n", i, pid[i]);
-            }
-          }
-        }
-      }
-    } else if (pid[i] == 0) {
-      mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
-    }
-  } else {
-    mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
+  mrb_get_args(mrb, "i", &timeout);
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
   }
+  r->upstream->timeout = (int)timeout;
 
-  return self;
+  return mrb_fixnum_value(timeout);
 }
 
-static mrb_value mrb_http2_server_set_map_to_storage_cb(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_port(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mruby_cb_list *list = data->s->config->cb_list;
-  mrb_value b;
-  const char *cbid = "map_to_storage_cb";
-
-  mrb_get_args(mrb, "&", &b);
-  mrb_gc_protect(mrb, b);
-  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, cbid), b);
-  list->map_to_storage_cb = cbid;
+  mrb_http2_request_rec *r = data->r;
 
-  return b;
+  if (!r->upstream) {
+    return mrb_nil_value();
+  }
+  return mrb_fixnum_value(r->upstream->port);
 }
 
-static mrb_value mrb_http2_server_set_access_checker_cb(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_set_upstream_port(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mruby_cb_list *list = data->s->config->cb_list;
-  mrb_value b;
-  const char *cbid = "access_checker_cb";
+  mrb_http2_request_rec *r = data->r;
+  mrb_int port;
 
-  mrb_get_args(mrb, "&", &b);
-  mrb_gc_protect(mrb, b);
-  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, cbid), b);
-  list->access_checker_cb = cbid;
+  mrb_get_args(mrb, "i", &port);
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
+  }
+  r->upstream->port = (int)port;
 
-  return b;
+  return self;
 }
 
-static mrb_value mrb_http2_server_set_fixups_cb(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_host(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mruby_cb_list *list = data->s->config->cb_list;
-  mrb_value b;
-  const char *cbid = "fixups_cb";
-
-  mrb_get_args(mrb, "&", &b);
-  mrb_gc_protect(mrb, b);
-  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, cbid), b);
-  list->fixups_cb = cbid;
+  mrb_http2_request_rec *r = data->r;
 
-  return b;
+  if (!r->upstream) {
+    return mrb_nil_value();
+  }
+  return mrb_str_new_cstr(mrb, r->upstream->host);
 }
 
-static mrb_value mrb_http2_server_set_content_cb(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_set_upstream_host(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mruby_cb_list *list = data->s->config->cb_list;
-  mrb_value b;
-  const char *cbid = "content_cb";
+  mrb_http2_request_rec *r = data->r;
+  char *host;
 
-  mrb_get_args(mrb, "&", &b);
-  // mrb_gc_protect(mrb, b);
-  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, cbid), b);
-  list->content_cb = cbid;
-  TRACER;
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
+  }
 
-  return b;
+  mrb_get_args(mrb, "z", &host);
+  // r->upstream->host = mrb_http2_strcopy(mrb, host, len);
+  free(r->upstream->host);
+  r->upstream->host = strdup(host);
+
+  return self;
 }
 
-static mrb_value mrb_http2_server_set_logging_cb(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_scheme(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mruby_cb_list *list = data->s->config->cb_list;
-  mrb_value b;
-  const char *cbid = "logging_cb";
-
-  mrb_get_args(mrb, "&", &b);
-  mrb_gc_protect(mrb, b);
-  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, cbid), b);
-  list->logging_cb = cbid;
+  mrb_http2_request_rec *r = data->r;
 
-  return b;
+  if (!r->upstream) {
+    return mrb_nil_value();
+  }
+  return mrb_str_new_cstr(mrb, r->upstream->tls ? "https" : "http");
 }
 
-static void tune_rlimit(mrb_state *mrb, mrb_http2_config_t *config)
+static mrb_value mrb_http2_server_set_upstream_scheme(mrb_state *mrb, mrb_value self)
 {
-  struct rlimit r_cfg;
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  char *scheme;
 
-  if (config->rlimit_nofile == 0) {
-    return;
+  mrb_get_args(mrb, "z", &scheme);
+  if (strcmp(scheme, "http") != 0 && strcmp(scheme, "https") != 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid upstream scheme: %S", mrb_str_new_cstr(mrb, scheme));
   }
-
-  if (config->rlimit_nofile < 0) {
-    fprintf(stderr, "don't tune rlmit, rlimit_nofile=%d need positive fixnum\n", config->rlimit_nofile);
-    return;
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
   }
+  // the port is set by upstream_port=, 80 unless set
+  r->upstream->tls = strcmp(scheme, "https") == 0;
 
-  if (getuid() != 0) {
-    fprintf(stderr, "don't tune rlmit, run with root at first. then change"
-                    " privilege to 'run_user' value was set in config\n");
-    return;
-  }
+  return self;
+}
 
-  r_cfg.rlim_cur = config->rlimit_nofile;
-  r_cfg.rlim_max = config->rlimit_nofile;
+static mrb_value mrb_http2_server_upstream_group(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
 
-  if (setrlimit(RLIMIT_NOFILE, &r_cfg) != 0) {
-    int err = errno;
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "tune_rlimit failed: %S", mrb_str_new_cstr(mrb, strerror(err)));
+  if (!r->upstream || r->upstream->group < 0) {
+    return mrb_nil_value();
   }
-  fprintf(stderr, "tune RLIMIT_NOFILE to %d\n", config->rlimit_nofile);
+  return mrb_str_new_cstr(mrb, data->s->config->upstream_groups[r->upstream->group].name);
 }
 
-static mrb_value mrb_http2_server_init(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_set_upstream_group(mrb_state *mrb, mrb_value self)
 {
-  mrb_http2_server_t *server;
-  struct sigaction act;
-  mrb_value args;
-  mrb_http2_data_t *data = (mrb_http2_data_t *)mrb_malloc(mrb, sizeof(mrb_http2_data_t));
-  memset(data, 0, sizeof(mrb_http2_data_t));
-
-  memset(&act, 0, sizeof(struct sigaction));
-  act.sa_handler = SIG_IGN;
-  sigaction(SIGPIPE, &act, NULL);
-
-  mrb_get_args(mrb, "H", &args);
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  char *name;
+  int group;
 
-  // server context
-  server = (mrb_http2_server_t *)mrb_malloc(mrb, sizeof(mrb_http2_server_t));
-  memset(server, 0, sizeof(mrb_http2_server_t));
-  server->args = args;
-  server->mrb = mrb;
+  mrb_get_args(mrb, "z", &name);
+  group = mrb_http2_config_upstream_group_index(data->s->config, name);
+  if (group < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "upstream group not found: %S", mrb_str_new_cstr(mrb, name));
+  }
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
+  }
+  r->upstream->group = group;
 
-  mrb_gc_protect(mrb, server->args);
-  server->config = mrb_http2_s_config_init(mrb, server->args);
+  return self;
+}
 
-  data->s = server;
-  data->r = mrb_http2_request_rec_init(mrb);
+static mrb_value mrb_http2_server_upstream_uri(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
 
-  tune_rlimit(mrb, server->config);
+  if (!r->upstream) {
+    return mrb_nil_value();
+  }
+  return mrb_str_new_cstr(mrb, r->upstream->uri);
+}
 
-  DATA_TYPE(self) = &mrb_http2_server_type;
-  DATA_PTR(self) = data;
-  TRACER;
+static mrb_value mrb_http2_server_set_upstream_uri(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  char *uri;
 
-  if (server->config->daemon) {
-    if (daemon(0, 0) == -1) {
-      mrb_raise(mrb, E_RUNTIME_ERROR, "daemonize failed");
-    }
+  mrb_get_args(mrb, "z", &uri);
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
   }
+  // read again by retries and collapsed requests after the string is gone
+  free(r->upstream->uri);
+  r->upstream->uri = strdup(uri);
 
   return self;
 }
 
-static mrb_value mrb_http2_req_obj(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_total_stream_requests(mrb_state *mrb, mrb_value self)
 {
-  // return mrb_http2_class_obj(mrb, self, "request_class_obj", "Request");
-  return self;
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
+
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->stream_requests_per_worker));
 }
 
-static mrb_value mrb_http2_conn_obj(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_total_session_requests(mrb_state *mrb, mrb_value self)
 {
-  // return mrb_http2_class_obj(mrb, self, "request_class_obj", "Request");
-  return self;
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
+
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->session_requests_per_worker));
 }
 
-static mrb_value mrb_http2_server_filename(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_connected_sessions(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, r->filename);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->connected_sessions));
 }
 
-static mrb_value mrb_http2_server_set_filename(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_active_stream(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  char *filename;
-  mrb_int len;
-  mrb_get_args(mrb, "s", &filename, &len);
-  mrb_free(mrb, r->filename);
-
-  r->filename = mrb_http2_strcopy(mrb, filename, len);
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return self;
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->active_stream));
 }
 
-static mrb_value mrb_http2_server_uri(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_handler_budget_exceeded(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, r->uri);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->handler_budget_exceeded));
 }
 
-static mrb_value mrb_http2_server_unparsed_uri(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_conn_hits(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, r->unparsed_uri);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_conn_hits));
 }
 
-static mrb_value mrb_http2_server_percent_encode_uri(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_conn_connects(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, r->percent_encode_uri);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_conn_connects));
 }
 
-static mrb_value mrb_http2_server_args(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_conn_waits(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, r->args);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_conn_waits));
 }
 
-static mrb_value mrb_http2_server_method(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_ejections(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, r->method);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_ejections));
 }
 
-static mrb_value mrb_http2_server_authority(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_cache_hits(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, r->authority);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_cache_hits));
 }
 
-static mrb_value mrb_http2_server_scheme(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_cache_stale(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, r->scheme);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_cache_stale));
 }
 
-static mrb_value mrb_http2_server_body(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_cache_revalidated(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  if (r->request_body == NULL) {
-    return mrb_nil_value();
-  } else {
-    return mrb_str_new_cstr(mrb, r->request_body);
-  }
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_cache_revalidated));
 }
 
-static mrb_value mrb_http2_server_document_root(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_cache_misses(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_config_t *config = data->s->config;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, config->document_root);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_cache_misses));
 }
 
-static mrb_value mrb_http2_server_client_ip(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_cache_hit_bytes(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  if (!r->conn) {
-    return mrb_nil_value();
-  }
-  return mrb_str_new_cstr(mrb, r->conn->client_ip);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_cache_hit_bytes));
 }
 
-static mrb_value mrb_http2_server_user_agent(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_cache_stored_bytes(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  int i;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  if (!data->r->reqhdr) {
-    return mrb_nil_value();
-  }
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_cache_stored_bytes));
+}
 
-  i = mrb_http2_get_nv_id(r->reqhdr, r->reqhdrlen, "user-agent");
-  if (i == MRB_HTTP2_HEADER_NOT_FOUND) {
-    return mrb_nil_value();
-  }
+static mrb_value mrb_http2_server_upstream_collapsed(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new(mrb, (char *)r->reqhdr[i].value, r->reqhdr[i].valuelen);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_collapsed));
 }
 
-static mrb_value mrb_http2_server_status(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_timeouts(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(data->r->status);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_timeouts));
 }
 
-static mrb_value mrb_http2_server_date(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_retries(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_str_new_cstr(mrb, data->r->date);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_retries));
 }
 
-static mrb_value mrb_http2_server_content_length(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_breaker_opens(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(atoi(data->r->content_length));
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_breaker_opens));
 }
 
-static void mrb_http2_upstream_init(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_breaker_rejects(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-
-  r->upstream = (mrb_http2_upstream *)mrb_malloc(mrb, sizeof(mrb_http2_upstream));
-  memset(r->upstream, 0, sizeof(mrb_http2_upstream));
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  r->upstream->uri = NULL;
-  r->upstream->host = NULL;
-  r->upstream->port = 80;
-  r->upstream->timeout = 600;
-  r->upstream->proto_major = 1;
-  r->upstream->proto_minor = 1;
-  r->upstream->keepalive = 1;
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_breaker_rejects));
 }
 
-static mrb_value mrb_http2_server_set_upstream_proto_major(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_tls_handshakes(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  mrb_int major;
-
-  mrb_get_args(mrb, "i", &major);
-  if (!r->upstream) {
-    mrb_http2_upstream_init(mrb, self);
-  }
-  // Now support HTTP/1.x only
-  // TODO: support HTTP/2
-  // r->upstream->proto_major = (int)major;
-  r->upstream->proto_major = 1;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(r->upstream->proto_major);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_tls_handshakes));
 }
 
-static mrb_value mrb_http2_server_set_upstream_proto_minor(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_upstream_tls_resumptions(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  mrb_int minor;
-
-  mrb_get_args(mrb, "i", &minor);
-  if (!r->upstream) {
-    mrb_http2_upstream_init(mrb, self);
-  }
-  // Now support HTTP/1.0 or HTTP/1.1
-  // TODO: support HTTP/2
-  if (minor != 0 && minor != 1) {
-    // defulat HTTP/1.1
-    minor = 1;
-  }
-  r->upstream->proto_minor = (int)minor;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(r->upstream->proto_minor);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->upstream_tls_resumptions));
 }
 
-static mrb_value mrb_http2_server_set_upstream_keepalive(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_dns_cache_hits(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  mrb_value keepalive;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  mrb_get_args(mrb, "o", &keepalive);
-  if (!r->upstream) {
-    mrb_http2_upstream_init(mrb, self);
-  }
-  r->upstream->keepalive = mrb_bool(keepalive);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->dns_cache_hits));
+}
 
-  return keepalive;
+static mrb_value mrb_http2_server_dns_cache_negative_hits(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
+
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->dns_cache_negative_hits));
 }
 
-static mrb_value mrb_http2_server_set_upstream_timeout(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_handshake_timeouts(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  mrb_int timeout;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  mrb_get_args(mrb, "i", &timeout);
-  if (!r->upstream) {
-    mrb_http2_upstream_init(mrb, self);
-  }
-  r->upstream->timeout = (int)timeout;
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->handshake_timeouts));
+}
 
-  return mrb_fixnum_value(timeout);
+static mrb_value mrb_http2_server_idle_timeouts(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
+
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->idle_timeouts));
 }
 
-static mrb_value mrb_http2_server_upstream_port(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_header_timeouts(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  if (!r->upstream) {
-    return mrb_nil_value();
-  }
-  return mrb_fixnum_value(r->upstream->port);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->header_timeouts));
 }
 
-static mrb_value mrb_http2_server_set_upstream_port(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_write_timeouts(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  mrb_int port;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  mrb_get_args(mrb, "i", &port);
-  if (!r->upstream) {
-    mrb_http2_upstream_init(mrb, self);
-  }
-  r->upstream->port = (int)port;
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->write_timeouts));
+}
 
-  return self;
+static mrb_value mrb_http2_server_accept_pauses(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
+
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->accept_pauses));
 }
 
-static mrb_value mrb_http2_server_upstream_host(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_priority_updates(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  if (!r->upstream) {
-    return mrb_nil_value();
-  }
-  return mrb_str_new_cstr(mrb, r->upstream->host);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->priority_updates));
 }
 
-static mrb_value mrb_http2_server_set_upstream_host(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_window_grows(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  char *host;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  if (!r->upstream) {
-    mrb_http2_upstream_init(mrb, self);
-  }
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->window_grows));
+}
 
-  mrb_get_args(mrb, "z", &host);
-  // r->upstream->host = mrb_http2_strcopy(mrb, host, len);
-  r->upstream->host = strdup(host);
+static mrb_value mrb_http2_server_slab_bytes(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  return self;
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->slab.bytes));
 }
 
-static mrb_value mrb_http2_server_upstream_uri(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_slab_held_bytes(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
+  mrb_http2_worker_t *worker = data->s->worker;
 
-  if (!r->upstream) {
-    return mrb_nil_value();
-  }
-  return mrb_str_new_cstr(mrb, r->upstream->uri);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->slab.held_bytes));
 }
 
-static mrb_value mrb_http2_server_set_upstream_uri(mrb_state *mrb, mrb_value self)
+// [[chunk size, live objects], ..., [nil, live large objects]]
+static mrb_value mrb_http2_server_slab_live_objects(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
-  mrb_http2_request_rec *r = data->r;
-  char *uri;
+  mrb_http2_worker_t *worker = data->s->worker;
+  mrb_value ary = mrb_ary_new(mrb);
+  int i;
 
-  mrb_get_args(mrb, "z", &uri);
-  if (!r->upstream) {
-    mrb_http2_upstream_init(mrb, self);
+  for (i = 0; i <= MRB_HTTP2_SLAB_CLASSES; i++) {
+    mrb_value pair = mrb_ary_new(mrb);
+    mrb_ary_push(mrb, pair, i < MRB_HTTP2_SLAB_CLASSES ? mrb_fixnum_value(1 << (i + MRB_HTTP2_SLAB_MIN_SHIFT))
+                                                      : mrb_nil_value());
+    mrb_ary_push(mrb, pair, mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->slab.live[i])));
+    mrb_ary_push(mrb, ary, pair);
   }
-  r->upstream->uri = uri;
 
-  return self;
+  return ary;
 }
 
-static mrb_value mrb_http2_server_total_stream_requests(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_gc_count(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(worker->stream_requests_per_worker);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->gc_step_count) + MRB_HTTP2_STAT_GET(worker->gc_full_count));
 }
 
-static mrb_value mrb_http2_server_total_session_requests(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_gc_full_count(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(worker->session_requests_per_worker);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->gc_full_count));
 }
 
-static mrb_value mrb_http2_server_connected_sessions(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_gc_time(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(worker->connected_sessions);
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->gc_time));
 }
 
-static mrb_value mrb_http2_server_active_stream(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_http2_server_gc_pause_max(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_worker_t *worker = data->s->worker;
+
+  return mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->gc_pause_max));
+}
+
+// [[upper bound usec, count], ..., [nil, count]]
+static mrb_value mrb_http2_server_gc_pause_distribution(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_worker_t *worker = data->s->worker;
+  static const uint64_t buckets[] = MRB_HTTP2_GC_PAUSE_BUCKETS;
+  mrb_value ary = mrb_ary_new(mrb);
+  int i;
+
+  for (i = 0; i < MRB_HTTP2_GC_PAUSE_HIST_LEN; i++) {
+    mrb_value pair = mrb_ary_new(mrb);
+    mrb_ary_push(mrb, pair, i < ARRLEN(buckets) ? mrb_fixnum_value(buckets[i]) : mrb_nil_value());
+    mrb_ary_push(mrb, pair, mrb_fixnum_value(MRB_HTTP2_STAT_GET(worker->gc_pause_hist[i])));
+    mrb_ary_push(mrb, ary, pair);
+  }
 
-  return mrb_fixnum_value(worker->active_stream);
+  return ary;
 }
 
 static mrb_value mrb_http2_server_enable_mruby(mrb_state *mrb, mrb_value self)
@@ -2960,7 +6565,7 @@ static mrb_value mrb_http2_get_class_obj(mrb_state *mrb, mrb_value self, const c
     obj_class = (struct RClass *)mrb_class_ptr(
         mrb_const_get(mrb, mrb_obj_value(http2_class), mrb_intern_cstr(mrb, class_name)));
     obj = mrb_obj_new(mrb, obj_class, 0, NULL);
-    DATA_TYPE(obj) = &mrb_http2_server_type;
+    DATA_TYPE(obj) = DATA_TYPE(self);
     DATA_PTR(obj) = DATA_PTR(self);
     mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, obj_id), obj);
   }
@@ -3045,6 +6650,7 @@ static mrb_value mrb_http2_set_reshdrs(mrb_state *mrb, mrb_value self)
     MRB_HTTP2_CREATE_NV_OBJ(mrb, &r->reshdrs[r->reshdrslen], key, val);
     r->reshdrslen += 1;
   } else {
+    mrb_http2_free_nva(mrb, &r->reshdrs[i], 1);
     MRB_HTTP2_CREATE_NV_OBJ(mrb, &r->reshdrs[i], key, val);
   }
 
@@ -3108,10 +6714,17 @@ void mrb_http2_server_class_init(mrb_state *mrb, struct RClass *http2)
   mrb_define_method(mrb, server, "upstream_proto_major=", mrb_http2_server_set_upstream_proto_major, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_proto_minor=", mrb_http2_server_set_upstream_proto_minor, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_timeout=", mrb_http2_server_set_upstream_timeout, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "upstream_cache_key=", mrb_http2_server_set_upstream_cache_key, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "upstream_cache_bypass=", mrb_http2_server_set_upstream_cache_bypass,
+                    MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_host", mrb_http2_server_upstream_host, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "upstream_host=", mrb_http2_server_set_upstream_host, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_port", mrb_http2_server_upstream_port, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "upstream_port=", mrb_http2_server_set_upstream_port, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "upstream_scheme", mrb_http2_server_upstream_scheme, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_scheme=", mrb_http2_server_set_upstream_scheme, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "upstream_group", mrb_http2_server_upstream_group, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_group=", mrb_http2_server_set_upstream_group, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_uri", mrb_http2_server_upstream_uri, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "upstream_uri=", mrb_http2_server_set_upstream_uri, MRB_ARGS_REQ(1));
 
@@ -3121,6 +6734,50 @@ void mrb_http2_server_class_init(mrb_state *mrb, struct RClass *http2)
   mrb_define_method(mrb, server, "connected_sessions", mrb_http2_server_connected_sessions, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "active_session", mrb_http2_server_connected_sessions, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "active_stream", mrb_http2_server_active_stream, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "handler_budget_exceeded", mrb_http2_server_handler_budget_exceeded,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_conn_hits", mrb_http2_server_upstream_conn_hits, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_conn_connects", mrb_http2_server_upstream_conn_connects, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_conn_waits", mrb_http2_server_upstream_conn_waits, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_ejections", mrb_http2_server_upstream_ejections, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_cache_hits", mrb_http2_server_upstream_cache_hits, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_cache_stale", mrb_http2_server_upstream_cache_stale, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_cache_revalidated", mrb_http2_server_upstream_cache_revalidated,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_cache_misses", mrb_http2_server_upstream_cache_misses, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_cache_hit_bytes", mrb_http2_server_upstream_cache_hit_bytes,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_cache_stored_bytes", mrb_http2_server_upstream_cache_stored_bytes,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_collapsed", mrb_http2_server_upstream_collapsed, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_timeouts", mrb_http2_server_upstream_timeouts, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_retries", mrb_http2_server_upstream_retries, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_breaker_opens", mrb_http2_server_upstream_breaker_opens,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_breaker_rejects", mrb_http2_server_upstream_breaker_rejects,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_tls_handshakes", mrb_http2_server_upstream_tls_handshakes,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "upstream_tls_resumptions", mrb_http2_server_upstream_tls_resumptions,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "dns_cache_hits", mrb_http2_server_dns_cache_hits, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "dns_cache_negative_hits", mrb_http2_server_dns_cache_negative_hits,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "handshake_timeouts", mrb_http2_server_handshake_timeouts, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "idle_timeouts", mrb_http2_server_idle_timeouts, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "header_timeouts", mrb_http2_server_header_timeouts, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "write_timeouts", mrb_http2_server_write_timeouts, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "accept_pauses", mrb_http2_server_accept_pauses, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "priority_updates", mrb_http2_server_priority_updates, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "window_grows", mrb_http2_server_window_grows, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "slab_bytes", mrb_http2_server_slab_bytes, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "slab_held_bytes", mrb_http2_server_slab_held_bytes, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "slab_live_objects", mrb_http2_server_slab_live_objects, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "gc_count", mrb_http2_server_gc_count, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "gc_full_count", mrb_http2_server_gc_full_count, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "gc_time", mrb_http2_server_gc_time, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "gc_pause_max", mrb_http2_server_gc_pause_max, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "gc_pause_distribution", mrb_http2_server_gc_pause_distribution, MRB_ARGS_NONE());
 
   // methods for mruby script
   mrb_define_method(mrb, server, "enable_mruby", mrb_http2_server_enable_mruby, MRB_ARGS_NONE());
@@ -3128,5 +6785,9 @@ void mrb_http2_server_class_init(mrb_state *mrb, struct RClass *http2)
   mrb_define_method(mrb, server, "rputs", mrb_http2_server_rputs, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "echo", mrb_http2_server_echo, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "set_status", mrb_http2_server_set_status, MRB_ARGS_REQ(1));
+
+  // async methods for set_content_cb with async_handler
+  mrb_define_method(mrb, server, "async_sleep", mrb_http2_server_async_sleep, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "async_http_get", mrb_http2_server_async_http_get, MRB_ARGS_ARG(3, 1));
   DONE;
 }
@@ -10,6 +10,7 @@
 #include "mruby.h"
 #include "mrb_http2_config.h"
 #include "mrb_http2_worker.h"
+#include "mrb_http2_request.h"
 
 #define MRB_HTTP2_READ_LENGTH_MAX ((1 << 16) - 1)
 
@@ -19,8 +20,8 @@ typedef struct {
   mrb_http2_config_t *config;
   mrb_state *mrb;
 
-  // callback Ruby block hash table
-  mrb_value cb_hash;
+  // callback Ruby blocks indexed by request phase, nil when not set
+  mrb_value cb_procs[MRB_HTTP2_SERVER_PHASE_MAX];
 
   mrb_http2_worker_t *worker;
 } mrb_http2_server_t;
@@ -0,0 +1,229 @@
+/*
+// mrb_http2_slab.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_slab.h"
+
+#define MRB_HTTP2_SLAB_CHUNK_SIZE(cls) ((size_t)1 << ((cls) + MRB_HTTP2_SLAB_MIN_SHIFT))
+
+mrb_http2_slab *mrb_http2_slab_new(mrb_http2_slab_stats *stats)
+{
+  mrb_http2_slab *slab;
+
+  slab = (mrb_http2_slab *)calloc(1, sizeof(mrb_http2_slab));
+  if (slab == NULL) {
+    return NULL;
+  }
+  slab->stats = stats;
+  return slab;
+}
+
+// live chunks of the slab must not be used after this
+void mrb_http2_slab_free_all(mrb_http2_slab *slab)
+{
+  mrb_http2_slab_page *page, *next;
+
+  for (page = slab->pages; page != NULL; page = next) {
+    next = page->next;
+    if (slab->stats != NULL) {
+      MRB_HTTP2_STAT_SUB(slab->stats->held_bytes, sizeof(mrb_http2_slab_page) + MRB_HTTP2_SLAB_PAGE_SIZE);
+    }
+    free(page);
+  }
+  free(slab);
+}
+
+static size_t mrb_http2_slab_class(size_t size)
+{
+  size_t cls = 0;
+
+  size += sizeof(mrb_http2_slab_header);
+  while (cls < MRB_HTTP2_SLAB_CLASSES && MRB_HTTP2_SLAB_CHUNK_SIZE(cls) < size) {
+    cls++;
+  }
+  return cls;
+}
+
+// carve a new page into the free list of cls
+static int mrb_http2_slab_grow(mrb_http2_slab *slab, size_t cls)
+{
+  mrb_http2_slab_page *page;
+  size_t chunk_size = MRB_HTTP2_SLAB_CHUNK_SIZE(cls);
+  char *p;
+  size_t i;
+
+  page = (mrb_http2_slab_page *)malloc(sizeof(mrb_http2_slab_page) + MRB_HTTP2_SLAB_PAGE_SIZE);
+  if (page == NULL) {
+    return -1;
+  }
+  page->cls = cls;
+  page->next = slab->pages;
+  slab->pages = page;
+
+  p = (char *)(page + 1);
+  for (i = 0; i + chunk_size <= MRB_HTTP2_SLAB_PAGE_SIZE; i += chunk_size) {
+    mrb_http2_slab_chunk *chunk = (mrb_http2_slab_chunk *)(p + i);
+    chunk->next = slab->free[cls];
+    slab->free[cls] = chunk;
+  }
+  if (slab->stats != NULL) {
+    MRB_HTTP2_STAT_ADD(slab->stats->held_bytes, sizeof(mrb_http2_slab_page) + MRB_HTTP2_SLAB_PAGE_SIZE);
+  }
+  return 0;
+}
+
+void *mrb_http2_slab_malloc(mrb_http2_slab *slab, size_t size)
+{
+  mrb_http2_slab_header *h;
+  size_t cls = mrb_http2_slab_class(size);
+
+  if (cls == MRB_HTTP2_SLAB_CLASSES) {
+    h = (mrb_http2_slab_header *)malloc(sizeof(mrb_http2_slab_header) + size);
+    if (h == NULL) {
+      return NULL;
+    }
+    if (slab->stats != NULL) {
+      MRB_HTTP2_STAT_ADD(slab->stats->held_bytes, sizeof(mrb_http2_slab_header) + size);
+    }
+  } else {
+    if (slab->free[cls] == NULL && mrb_http2_slab_grow(slab, cls) != 0) {
+      return NULL;
+    }
+    h = (mrb_http2_slab_header *)slab->free[cls];
+    slab->free[cls] = slab->free[cls]->next;
+  }
+  h->cls = cls;
+  h->size = size;
+  if (slab->stats != NULL) {
+    MRB_HTTP2_STAT_ADD(slab->stats->bytes, size);
+    MRB_HTTP2_STAT_INC(slab->stats->live[cls]);
+  }
+  return h + 1;
+}
+
+void *mrb_http2_slab_calloc(mrb_http2_slab *slab, size_t nmemb, size_t size)
+{
+  void *p;
+
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    return NULL;
+  }
+  p = mrb_http2_slab_malloc(slab, nmemb * size);
+  if (p != NULL) {
+    memset(p, 0, nmemb * size);
+  }
+  return p;
+}
+
+void mrb_http2_slab_free(mrb_http2_slab *slab, void *ptr)
+{
+  mrb_http2_slab_header *h;
+  mrb_http2_slab_chunk *chunk;
+  size_t cls;
+
+  if (ptr == NULL) {
+    return;
+  }
+  h = (mrb_http2_slab_header *)ptr - 1;
+  if (slab->stats != NULL) {
+    MRB_HTTP2_STAT_SUB(slab->stats->bytes, h->size);
+    MRB_HTTP2_STAT_DEC(slab->stats->live[h->cls]);
+  }
+  if (h->cls == MRB_HTTP2_SLAB_CLASSES) {
+    if (slab->stats != NULL) {
+      MRB_HTTP2_STAT_SUB(slab->stats->held_bytes, sizeof(mrb_http2_slab_header) + h->size);
+    }
+    free(h);
+    return;
+  }
+  // the chunk overwrites the header
+  cls = h->cls;
+  chunk = (mrb_http2_slab_chunk *)h;
+  chunk->next = slab->free[cls];
+  slab->free[cls] = chunk;
+}
+
+void *mrb_http2_slab_realloc(mrb_http2_slab *slab, void *ptr, size_t size)
+{
+  mrb_http2_slab_header *h;
+  size_t cls;
+  void *p;
+
+  if (ptr == NULL) {
+    return mrb_http2_slab_malloc(slab, size);
+  }
+  h = (mrb_http2_slab_header *)ptr - 1;
+  cls = mrb_http2_slab_class(size);
+
+  // still fits the chunk, or stays large
+  if (cls == h->cls && cls < MRB_HTTP2_SLAB_CLASSES) {
+    if (slab->stats != NULL) {
+      MRB_HTTP2_STAT_ADD(slab->stats->bytes, size - h->size);
+    }
+    h->size = size;
+    return ptr;
+  }
+  if (cls == MRB_HTTP2_SLAB_CLASSES && h->cls == MRB_HTTP2_SLAB_CLASSES) {
+    size_t old = h->size;
+
+    h = (mrb_http2_slab_header *)realloc(h, sizeof(mrb_http2_slab_header) + size);
+    if (h == NULL) {
+      return NULL;
+    }
+    h->size = size;
+    if (slab->stats != NULL) {
+      MRB_HTTP2_STAT_ADD(slab->stats->bytes, size - old);
+      MRB_HTTP2_STAT_ADD(slab->stats->held_bytes, size - old);
+    }
+    return h + 1;
+  }
+
+  p = mrb_http2_slab_malloc(slab, size);
+  if (p == NULL) {
+    return NULL;
+  }
+  memcpy(p, ptr, h->size < size ? h->size : size);
+  mrb_http2_slab_free(slab, ptr);
+  return p;
+}
+
+static void *mrb_http2_slab_nghttp2_malloc(size_t size, void *mem_user_data)
+{
+  return mrb_http2_slab_malloc((mrb_http2_slab *)mem_user_data, size);
+}
+
+static void mrb_http2_slab_nghttp2_free(void *ptr, void *mem_user_data)
+{
+  mrb_http2_slab_free((mrb_http2_slab *)mem_user_data, ptr);
+}
+
+static void *mrb_http2_slab_nghttp2_calloc(size_t nmemb, size_t size, void *mem_user_data)
+{
+  return mrb_http2_slab_calloc((mrb_http2_slab *)mem_user_data, nmemb, size);
+}
+
+static void *mrb_http2_slab_nghttp2_realloc(void *ptr, size_t size, void *mem_user_data)
+{
+  return mrb_http2_slab_realloc((mrb_http2_slab *)mem_user_data, ptr, size);
+}
+
+void mrb_http2_slab_nghttp2_mem(mrb_http2_slab *slab, nghttp2_mem *mem)
+{
+  mem->mem_user_data = slab;
+  mem->malloc = mrb_http2_slab_nghttp2_malloc;
+  mem->free = mrb_http2_slab_nghttp2_free;
+  mem->calloc = mrb_http2_slab_nghttp2_calloc;
+  mem->realloc = mrb_http2_slab_nghttp2_realloc;
+}
+
+// mrb_allocf, size 0 frees p
+void *mrb_http2_slab_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  if (size == 0) {
+    mrb_http2_slab_free((mrb_http2_slab *)ud, p);
+    return NULL;
+  }
+  return mrb_http2_slab_realloc((mrb_http2_slab *)ud, p, size);
+}
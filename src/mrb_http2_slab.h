@@ -0,0 +1,66 @@
+/*
+// mrb_http2_slab.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_SLAB_H
+#define MRB_HTTP2_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <nghttp2/nghttp2.h>
+#include "mruby.h"
+
+// chunks of 32 << class bytes including the header, larger allocations
+// are passed to malloc
+#define MRB_HTTP2_SLAB_CLASSES 9
+#define MRB_HTTP2_SLAB_MIN_SHIFT 5
+#define MRB_HTTP2_SLAB_PAGE_SIZE (64 * 1024)
+
+// allocations of a slab, live[MRB_HTTP2_SLAB_CLASSES] counts the large ones
+typedef struct mrb_http2_slab_stats {
+  // requested by the live allocations, and taken from malloc
+  uint64_t bytes;
+  uint64_t held_bytes;
+  uint64_t live[MRB_HTTP2_SLAB_CLASSES + 1];
+} mrb_http2_slab_stats;
+
+// before each allocation, the class and the requested size
+typedef struct mrb_http2_slab_header {
+  size_t cls;
+  size_t size;
+} mrb_http2_slab_header;
+
+typedef struct mrb_http2_slab_chunk {
+  struct mrb_http2_slab_chunk *next;
+} mrb_http2_slab_chunk;
+
+typedef struct mrb_http2_slab_page {
+  struct mrb_http2_slab_page *next;
+  size_t cls;
+} mrb_http2_slab_page;
+
+// size-class allocator of one thread, freed chunks are kept for the same
+// class and pages are returned when the slab is freed
+typedef struct mrb_http2_slab {
+  mrb_http2_slab_chunk *free[MRB_HTTP2_SLAB_CLASSES];
+  mrb_http2_slab_page *pages;
+
+  // counted when not NULL
+  mrb_http2_slab_stats *stats;
+} mrb_http2_slab;
+
+mrb_http2_slab *mrb_http2_slab_new(mrb_http2_slab_stats *stats);
+void mrb_http2_slab_free_all(mrb_http2_slab *slab);
+
+void *mrb_http2_slab_malloc(mrb_http2_slab *slab, size_t size);
+void *mrb_http2_slab_calloc(mrb_http2_slab *slab, size_t nmemb, size_t size);
+void *mrb_http2_slab_realloc(mrb_http2_slab *slab, void *ptr, size_t size);
+void mrb_http2_slab_free(mrb_http2_slab *slab, void *ptr);
+
+// nghttp2_session_server_new3 and mrb_open_allocf on a slab
+void mrb_http2_slab_nghttp2_mem(mrb_http2_slab *slab, nghttp2_mem *mem);
+void *mrb_http2_slab_allocf(mrb_state *mrb, void *p, size_t size, void *ud);
+
+#endif
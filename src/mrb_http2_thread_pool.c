@@ -0,0 +1,160 @@
+/*
+// mrb_http2_thread_pool.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_thread_pool.h"
+
+#include <event2/util.h>
+
+static void *mrb_http2_thread_main(void *ptr)
+{
+  mrb_http2_thread_pool *pool = (mrb_http2_thread_pool *)ptr;
+  mrb_http2_thread_job *job;
+  void *thread_ctx = NULL;
+  ssize_t rv;
+
+  if (pool->init != NULL) {
+    thread_ctx = pool->init(pool->arg);
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head == NULL && !pool->stop) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    job = pool->head;
+    pool->head = job->next;
+    if (pool->head == NULL) {
+      pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    job->next = NULL;
+    pool->run(thread_ctx, job);
+
+    // pointer size write is atomic for a pipe
+    while ((rv = write(pool->notify_fd[1], &job, sizeof(job))) == -1 && errno == EINTR)
+      ;
+  }
+
+  if (pool->final != NULL) {
+    pool->final(thread_ctx);
+  }
+  return NULL;
+}
+
+static void mrb_http2_thread_pool_notify_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  mrb_http2_thread_pool *pool = (mrb_http2_thread_pool *)ptr;
+  mrb_http2_thread_job *jobs[64];
+  ssize_t nread;
+  size_t i;
+
+  while ((nread = read(fd, jobs, sizeof(jobs))) > 0) {
+    for (i = 0; i < nread / sizeof(jobs[0]); i++) {
+      pool->done(jobs[i], pool->arg);
+    }
+  }
+}
+
+mrb_http2_thread_pool *mrb_http2_thread_pool_new(struct event_base *evbase, unsigned int nthreads,
+                                                 mrb_http2_thread_init_func init, mrb_http2_thread_run_func run,
+                                                 mrb_http2_thread_final_func final, mrb_http2_thread_done_func done,
+                                                 void *arg)
+{
+  mrb_http2_thread_pool *pool;
+  unsigned int i;
+
+  pool = (mrb_http2_thread_pool *)malloc(sizeof(mrb_http2_thread_pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  memset(pool, 0, sizeof(mrb_http2_thread_pool));
+
+  if (pipe(pool->notify_fd) != 0) {
+    free(pool);
+    return NULL;
+  }
+  evutil_make_socket_nonblocking(pool->notify_fd[0]);
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->init = init;
+  pool->run = run;
+  pool->final = final;
+  pool->done = done;
+  pool->arg = arg;
+
+  pool->notify_ev = event_new(evbase, pool->notify_fd[0], EV_READ | EV_PERSIST, mrb_http2_thread_pool_notify_cb, pool);
+  event_add(pool->notify_ev, NULL);
+
+  pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+  for (i = 0; pool->threads != NULL && i < nthreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, mrb_http2_thread_main, pool) != 0) {
+      break;
+    }
+  }
+  pool->nthreads = i;
+
+  // no thread to run jobs, the caller runs them itself
+  if (pool->nthreads == 0) {
+    mrb_http2_thread_pool_free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void mrb_http2_thread_pool_push(mrb_http2_thread_pool *pool, mrb_http2_thread_job *job)
+{
+  job->next = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail == NULL) {
+    pool->head = job;
+  } else {
+    pool->tail->next = job;
+  }
+  pool->tail = job;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// finished jobs not yet seen by the loop get the done callback, and jobs
+// not yet run get it with cancelled set
+void mrb_http2_thread_pool_free(mrb_http2_thread_pool *pool)
+{
+  mrb_http2_thread_job *job;
+  unsigned int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  mrb_http2_thread_pool_notify_cb(pool->notify_fd[0], EV_READ, pool);
+  while ((job = pool->head) != NULL) {
+    pool->head = job->next;
+    job->next = NULL;
+    job->cancelled = 1;
+    pool->done(job, pool->arg);
+  }
+  pool->tail = NULL;
+
+  event_free(pool->notify_ev);
+  close(pool->notify_fd[0]);
+  close(pool->notify_fd[1]);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  free(pool->threads);
+  free(pool);
+}
@@ -0,0 +1,64 @@
+/*
+// mrb_http2_thread_pool.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_THREAD_POOL_H
+#define MRB_HTTP2_THREAD_POOL_H
+
+#include <pthread.h>
+#include <event2/event.h>
+
+// embed as the first member of a job struct
+typedef struct mrb_http2_thread_job {
+  struct mrb_http2_thread_job *next;
+
+  // the pool stopped before the job was run
+  unsigned int cancelled : 1;
+} mrb_http2_thread_job;
+
+// called in each thread, returns the thread context
+typedef void *(*mrb_http2_thread_init_func)(void *arg);
+
+// called in a thread for each job
+typedef void (*mrb_http2_thread_run_func)(void *thread_ctx, mrb_http2_thread_job *job);
+
+// called in the thread when the pool stops
+typedef void (*mrb_http2_thread_final_func)(void *thread_ctx);
+
+// called on the event loop thread after run finished, or when the pool is
+// freed with the job still queued
+typedef void (*mrb_http2_thread_done_func)(mrb_http2_thread_job *job, void *arg);
+
+typedef struct {
+  pthread_t *threads;
+  unsigned int nthreads;
+
+  // pending jobs
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  mrb_http2_thread_job *head;
+  mrb_http2_thread_job *tail;
+
+  // finished jobs are written to notify_fd[1] and read on the loop
+  int notify_fd[2];
+  struct event *notify_ev;
+
+  mrb_http2_thread_init_func init;
+  mrb_http2_thread_run_func run;
+  mrb_http2_thread_final_func final;
+  mrb_http2_thread_done_func done;
+  void *arg;
+
+  unsigned int stop : 1;
+} mrb_http2_thread_pool;
+
+mrb_http2_thread_pool *mrb_http2_thread_pool_new(struct event_base *evbase, unsigned int nthreads,
+                                                 mrb_http2_thread_init_func init, mrb_http2_thread_run_func run,
+                                                 mrb_http2_thread_final_func final, mrb_http2_thread_done_func done,
+                                                 void *arg);
+void mrb_http2_thread_pool_push(mrb_http2_thread_pool *pool, mrb_http2_thread_job *job);
+void mrb_http2_thread_pool_free(mrb_http2_thread_pool *pool);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+// mrb_http2_timer_wheel.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_timer_wheel.h"
+
+static void mrb_http2_timer_link(mrb_http2_timer *head, mrb_http2_timer *timer)
+{
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static void mrb_http2_timer_unlink(mrb_http2_timer *timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = NULL;
+}
+
+static void mrb_http2_timer_wheel_tick_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  mrb_http2_timer_wheel *wheel = (mrb_http2_timer_wheel *)ptr;
+  mrb_http2_timer expired, *head, *timer, *next;
+
+  wheel->now++;
+  head = &wheel->slots[wheel->now % MRB_HTTP2_TIMER_WHEEL_SLOTS];
+
+  // the callbacks may delete or add any timer, so the expired ones are
+  // moved out of the slot first, and deleted from this list as well
+  expired.prev = expired.next = &expired;
+  for (timer = head->next; timer != head; timer = next) {
+    next = timer->next;
+    if (timer->expires <= wheel->now) {
+      mrb_http2_timer_unlink(timer);
+      mrb_http2_timer_link(&expired, timer);
+    }
+  }
+  while ((timer = expired.next) != &expired) {
+    mrb_http2_timer_unlink(timer);
+    wheel->ntimers--;
+    timer->cb(timer);
+  }
+
+  if (wheel->ntimers == 0) {
+    event_del(wheel->tick_ev);
+  }
+}
+
+mrb_http2_timer_wheel *mrb_http2_timer_wheel_new(struct event_base *evbase, unsigned int tick)
+{
+  mrb_http2_timer_wheel *wheel;
+  unsigned int i;
+
+  wheel = (mrb_http2_timer_wheel *)calloc(1, sizeof(mrb_http2_timer_wheel));
+  if (wheel == NULL) {
+    return NULL;
+  }
+  wheel->tick_ev = event_new(evbase, -1, EV_PERSIST, mrb_http2_timer_wheel_tick_cb, wheel);
+  if (wheel->tick_ev == NULL) {
+    free(wheel);
+    return NULL;
+  }
+  wheel->tick = tick > 0 ? tick : 1;
+  for (i = 0; i < MRB_HTTP2_TIMER_WHEEL_SLOTS; i++) {
+    wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+  }
+  return wheel;
+}
+
+// pending timers are left to their owners
+void mrb_http2_timer_wheel_free(mrb_http2_timer_wheel *wheel)
+{
+  event_free(wheel->tick_ev);
+  free(wheel);
+}
+
+void mrb_http2_timer_init(mrb_http2_timer *timer, mrb_http2_timer_cb cb, void *data)
+{
+  timer->prev = timer->next = NULL;
+  timer->expires = 0;
+  timer->cb = cb;
+  timer->data = data;
+}
+
+// call cb after msec rounded up to the tick, again from now when pending
+void mrb_http2_timer_add(mrb_http2_timer_wheel *wheel, mrb_http2_timer *timer, unsigned int msec)
+{
+  uint64_t ticks = (msec + wheel->tick - 1) / wheel->tick;
+
+  mrb_http2_timer_del(wheel, timer);
+  timer->expires = wheel->now + (ticks > 0 ? ticks : 1);
+  mrb_http2_timer_link(&wheel->slots[timer->expires % MRB_HTTP2_TIMER_WHEEL_SLOTS], timer);
+
+  if (wheel->ntimers++ == 0) {
+    struct timeval tv;
+
+    tv.tv_sec = wheel->tick / 1000;
+    tv.tv_usec = (wheel->tick % 1000) * 1000;
+    event_add(wheel->tick_ev, &tv);
+  }
+}
+
+void mrb_http2_timer_del(mrb_http2_timer_wheel *wheel, mrb_http2_timer *timer)
+{
+  if (!mrb_http2_timer_pending(timer)) {
+    return;
+  }
+  mrb_http2_timer_unlink(timer);
+  wheel->ntimers--;
+}
@@ -0,0 +1,51 @@
+/*
+// mrb_http2_timer_wheel.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_TIMER_WHEEL_H
+#define MRB_HTTP2_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+// a round of the wheel is SLOTS ticks, longer timers stay in their slot
+// for more rounds
+#define MRB_HTTP2_TIMER_WHEEL_SLOTS 256
+
+struct mrb_http2_timer;
+
+typedef void (*mrb_http2_timer_cb)(struct mrb_http2_timer *timer);
+
+// embedded in the owner, linked while pending
+typedef struct mrb_http2_timer {
+  struct mrb_http2_timer *prev, *next;
+  uint64_t expires;
+  mrb_http2_timer_cb cb;
+  void *data;
+} mrb_http2_timer;
+
+// timers of a worker driven by one event ticking while any is pending,
+// instead of one event per timer
+typedef struct mrb_http2_timer_wheel {
+  struct event *tick_ev;
+
+  // msec per tick, and ticks elapsed while timers were pending
+  unsigned int tick;
+  uint64_t now;
+
+  unsigned int ntimers;
+  mrb_http2_timer slots[MRB_HTTP2_TIMER_WHEEL_SLOTS];
+} mrb_http2_timer_wheel;
+
+mrb_http2_timer_wheel *mrb_http2_timer_wheel_new(struct event_base *evbase, unsigned int tick);
+void mrb_http2_timer_wheel_free(mrb_http2_timer_wheel *wheel);
+
+void mrb_http2_timer_init(mrb_http2_timer *timer, mrb_http2_timer_cb cb, void *data);
+void mrb_http2_timer_add(mrb_http2_timer_wheel *wheel, mrb_http2_timer *timer, unsigned int msec);
+void mrb_http2_timer_del(mrb_http2_timer_wheel *wheel, mrb_http2_timer *timer);
+
+#define mrb_http2_timer_pending(timer) ((timer)->next != NULL)
+
+#endif
@@ -9,6 +9,39 @@
 
 #include "mruby.h"
 
+typedef enum {
+  MRB_HTTP2_UPSTREAM_LB_ROUND_ROBIN,
+  MRB_HTTP2_UPSTREAM_LB_WEIGHTED,
+  MRB_HTTP2_UPSTREAM_LB_LEAST_CONN,
+  MRB_HTTP2_UPSTREAM_LB_EWMA
+} mrb_http2_upstream_lb_policy;
+
+typedef struct {
+  char *host;
+  int port;
+  unsigned int weight;
+
+  // :scheme => "https"
+  unsigned int tls : 1;
+} mrb_http2_upstream_server_conf;
+
+// named upstream group from :upstream_groups config
+typedef struct {
+  char *name;
+  mrb_http2_upstream_lb_policy policy;
+  mrb_http2_upstream_server_conf *servers;
+  unsigned int nservers;
+
+  // active health check, disabled when path is NULL, interval msec
+  char *health_check_path;
+  unsigned int health_check_interval;
+
+  // passive health check, eject a server for fail_timeout msec after
+  // max_fails consecutive connection errors or 5xx responses
+  unsigned int max_fails;
+  unsigned int fail_timeout;
+} mrb_http2_upstream_group_conf;
+
 typedef struct {
   // 127.0.0.1
   char *host;
@@ -22,14 +55,24 @@ typedef struct {
   // upstream uri like "/css/base.css"
   char *uri;
 
-  // connection timeout
+  // sec the HTTP/1 upstream connection may be idle
   unsigned int timeout;
 
   // upstream protocol HTTP/1.1 or HTTP/1.0
   unsigned int proto_major;
   unsigned int proto_minor;
 
+  // index of mrb_http2_config_t.upstream_groups, -1 means host and port
+  int group;
+
+  // response cache key instead of the upstream and uri, and skip the cache
+  char *cache_key;
+  unsigned int cache_bypass : 1;
+
   unsigned int keepalive : 1;
+
+  // https upstream by upstream_scheme=
+  unsigned int tls : 1;
 } mrb_http2_upstream;
 
 #endif
@@ -0,0 +1,340 @@
+/*
+// mrb_http2_upstream_group.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_upstream_group.h"
+#include "mrb_http2_upstream_pool.h"
+
+// weight of a new latency sample is 1 / (1 << MRB_HTTP2_UPSTREAM_EWMA_SHIFT)
+#define MRB_HTTP2_UPSTREAM_EWMA_SHIFT 2
+
+static void mrb_http2_upstream_now(mrb_http2_upstream_group *group, struct timeval *tv)
+{
+  event_base_gettimeofday_cached(group->evbase, tv);
+}
+
+static int mrb_http2_upstream_backend_available(mrb_http2_upstream_backend *b, const struct timeval *now)
+{
+  return b->healthy && !evutil_timercmp(now, &b->down_until, <);
+}
+
+static mrb_http2_upstream_backend *mrb_http2_upstream_select_rr(mrb_http2_upstream_group *group,
+                                                                const struct timeval *now)
+{
+  unsigned int i;
+
+  for (i = 0; i < group->nbackends; i++) {
+    mrb_http2_upstream_backend *b = &group->backends[group->rr++ % group->nbackends];
+    if (mrb_http2_upstream_backend_available(b, now)) {
+      return b;
+    }
+  }
+  return NULL;
+}
+
+// smooth weighted round robin, spreads the picks of heavy servers
+static mrb_http2_upstream_backend *mrb_http2_upstream_select_weighted(mrb_http2_upstream_group *group,
+                                                                      const struct timeval *now)
+{
+  mrb_http2_upstream_backend *best = NULL;
+  int total = 0;
+  unsigned int i;
+
+  for (i = 0; i < group->nbackends; i++) {
+    mrb_http2_upstream_backend *b = &group->backends[i];
+    if (!mrb_http2_upstream_backend_available(b, now)) {
+      continue;
+    }
+    b->current_weight += b->weight;
+    total += b->weight;
+    if (best == NULL || b->current_weight > best->current_weight) {
+      best = b;
+    }
+  }
+  if (best != NULL) {
+    best->current_weight -= total;
+  }
+  return best;
+}
+
+// least outstanding requests per weight, or least ewma latency scaled by
+// outstanding requests, and start from the rr cursor to break ties
+static mrb_http2_upstream_backend *mrb_http2_upstream_select_least(mrb_http2_upstream_group *group,
+                                                                   const struct timeval *now, int ewma)
+{
+  mrb_http2_upstream_backend *best = NULL;
+  int64_t best_score = 0;
+  unsigned int i, start = group->rr++;
+
+  for (i = 0; i < group->nbackends; i++) {
+    mrb_http2_upstream_backend *b = &group->backends[(start + i) % group->nbackends];
+    int64_t score;
+
+    if (!mrb_http2_upstream_backend_available(b, now)) {
+      continue;
+    }
+    if (ewma) {
+      score = (b->ewma + 1) * (b->outstanding + 1) / b->weight;
+    } else {
+      score = ((int64_t)b->outstanding << 16) / b->weight;
+    }
+    if (best == NULL || score < best_score) {
+      best = b;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+mrb_http2_upstream_backend *mrb_http2_upstream_group_select(mrb_http2_upstream_group *group)
+{
+  mrb_http2_upstream_backend *b;
+  struct timeval now;
+
+  mrb_http2_upstream_now(group, &now);
+  switch (group->conf->policy) {
+  case MRB_HTTP2_UPSTREAM_LB_WEIGHTED:
+    b = mrb_http2_upstream_select_weighted(group, &now);
+    break;
+  case MRB_HTTP2_UPSTREAM_LB_LEAST_CONN:
+    b = mrb_http2_upstream_select_least(group, &now, 0);
+    break;
+  case MRB_HTTP2_UPSTREAM_LB_EWMA:
+    b = mrb_http2_upstream_select_least(group, &now, 1);
+    break;
+  default:
+    b = mrb_http2_upstream_select_rr(group, &now);
+    break;
+  }
+  if (b != NULL) {
+    b->outstanding++;
+  }
+  return b;
+}
+
+// account the finished request, status 0 means the connection failed,
+// return 1 when the backend was ejected by this failure
+int mrb_http2_upstream_backend_done(mrb_http2_upstream_backend *b, int status, const struct timeval *start)
+{
+  mrb_http2_upstream_group *group = b->group;
+  struct timeval now, d;
+  int64_t rtt;
+
+  b->outstanding--;
+  mrb_http2_upstream_now(group, &now);
+
+  if (status == 0 || status >= 500) {
+    b->fails++;
+    if (group->conf->max_fails > 0 && b->fails == group->conf->max_fails) {
+      d.tv_sec = group->conf->fail_timeout / 1000;
+      d.tv_usec = (group->conf->fail_timeout % 1000) * 1000;
+      evutil_timeradd(&now, &d, &b->down_until);
+      b->fails = 0;
+      return 1;
+    }
+    return 0;
+  }
+
+  b->fails = 0;
+  evutil_timersub(&now, start, &d);
+  rtt = (int64_t)d.tv_sec * 1000000 + d.tv_usec;
+  if (b->ewma == 0) {
+    b->ewma = rtt;
+  } else {
+    b->ewma += (rtt - b->ewma) >> MRB_HTTP2_UPSTREAM_EWMA_SHIFT;
+  }
+  return 0;
+}
+
+// the request was cancelled with the stream, no health accounting
+void mrb_http2_upstream_backend_cancel(mrb_http2_upstream_backend *b)
+{
+  b->outstanding--;
+}
+
+static void mrb_http2_upstream_probe_done(struct evhttp_request *req, void *ptr)
+{
+  mrb_http2_upstream_backend *b = (mrb_http2_upstream_backend *)ptr;
+  int code = req == NULL ? 0 : evhttp_request_get_response_code(req);
+
+  b->probing = 0;
+  b->healthy = code >= 200 && code < 400;
+  if (b->healthy) {
+    // a passing probe brings an ejected server back early
+    evutil_timerclear(&b->down_until);
+    b->fails = 0;
+  }
+}
+
+// resolved by evdns on each connect, not to block the loop, and over TLS
+// to an https server with a new SSL resuming the session of the last probe
+static struct evhttp_connection *mrb_http2_upstream_probe_conn_new(mrb_http2_upstream_backend *b)
+{
+  mrb_http2_upstream_group *group = b->group;
+  struct evhttp_connection *evcon;
+  SSL *ssl = NULL;
+  unsigned int interval = group->conf->health_check_interval / 1000;
+
+  if (b->tls) {
+    if (group->tls == NULL) {
+      return NULL;
+    }
+    ssl = mrb_http2_upstream_tls_ssl_new(group->tls, b->host, b->port, MRB_HTTP2_UPSTREAM_TLS_ALPN_HTTP1,
+                                         sizeof(MRB_HTTP2_UPSTREAM_TLS_ALPN_HTTP1) - 1);
+    if (ssl == NULL) {
+      return NULL;
+    }
+  }
+  evcon = mrb_http2_upstream_evcon_new(group->evbase, group->dnsbase, b->host, b->port, ssl);
+  if (evcon != NULL) {
+    // a probe must finish before the next one, at least 1 sec
+    evhttp_connection_set_timeout(evcon, interval > 0 ? interval : 1);
+  }
+  return evcon;
+}
+
+static void mrb_http2_upstream_probe_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  mrb_http2_upstream_group *group = (mrb_http2_upstream_group *)ptr;
+  unsigned int i;
+
+  for (i = 0; i < group->nbackends; i++) {
+    mrb_http2_upstream_backend *b = &group->backends[i];
+    struct evhttp_request *req;
+    char host[NI_MAXHOST + sizeof(":65535")];
+
+    if (b->probing) {
+      continue;
+    }
+    // the SSL of a TLS connection can't connect again
+    if (b->tls) {
+      if (b->probe_conn != NULL) {
+        evhttp_connection_free(b->probe_conn);
+      }
+      b->probe_conn = mrb_http2_upstream_probe_conn_new(b);
+      if (b->probe_conn == NULL) {
+        b->healthy = 0;
+        continue;
+      }
+    }
+    req = evhttp_request_new(mrb_http2_upstream_probe_done, b);
+    if (req == NULL) {
+      continue;
+    }
+    mrb_http2_resolver_authority(host, sizeof(host), b->host, b->port);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Host", host);
+    if (evhttp_make_request(b->probe_conn, req, EVHTTP_REQ_GET, group->conf->health_check_path) == -1) {
+      // evhttp freed req
+      b->healthy = 0;
+      continue;
+    }
+    b->probing = 1;
+  }
+}
+
+static int mrb_http2_upstream_group_init(mrb_http2_upstream_group *group, struct event_base *evbase,
+                                         struct evdns_base *dnsbase, mrb_http2_upstream_tls *tls,
+                                         const mrb_http2_upstream_group_conf *conf)
+{
+  unsigned int i;
+
+  group->conf = conf;
+  group->evbase = evbase;
+  group->dnsbase = dnsbase;
+  group->tls = tls;
+  group->nbackends = conf->nservers;
+  group->backends = (mrb_http2_upstream_backend *)calloc(conf->nservers, sizeof(mrb_http2_upstream_backend));
+  if (group->backends == NULL) {
+    return -1;
+  }
+  for (i = 0; i < conf->nservers; i++) {
+    mrb_http2_upstream_backend *b = &group->backends[i];
+    b->group = group;
+    b->host = conf->servers[i].host;
+    b->port = conf->servers[i].port;
+    b->weight = conf->servers[i].weight;
+    b->tls = conf->servers[i].tls;
+    b->healthy = 1;
+  }
+
+  if (conf->health_check_path != NULL && conf->health_check_interval > 0) {
+    struct timeval tv;
+
+    tv.tv_sec = conf->health_check_interval / 1000;
+    tv.tv_usec = (conf->health_check_interval % 1000) * 1000;
+    for (i = 0; i < conf->nservers; i++) {
+      mrb_http2_upstream_backend *b = &group->backends[i];
+      // connected per probe over TLS
+      if (b->tls) {
+        continue;
+      }
+      b->probe_conn = mrb_http2_upstream_probe_conn_new(b);
+      if (b->probe_conn == NULL) {
+        return -1;
+      }
+    }
+    group->probe_ev = event_new(evbase, -1, EV_PERSIST, mrb_http2_upstream_probe_cb, group);
+    event_add(group->probe_ev, &tv);
+  }
+
+  return 0;
+}
+
+static void mrb_http2_upstream_group_cleanup(mrb_http2_upstream_group *group)
+{
+  unsigned int i;
+
+  if (group->probe_ev != NULL) {
+    event_free(group->probe_ev);
+  }
+  if (group->backends == NULL) {
+    return;
+  }
+  for (i = 0; i < group->nbackends; i++) {
+    if (group->backends[i].probe_conn != NULL) {
+      evhttp_connection_free(group->backends[i].probe_conn);
+    }
+  }
+  free(group->backends);
+}
+
+mrb_http2_upstream_groups *mrb_http2_upstream_groups_new(struct event_base *evbase, struct evdns_base *dnsbase,
+                                                         mrb_http2_upstream_tls *tls,
+                                                         const mrb_http2_upstream_group_conf *confs, unsigned int len)
+{
+  mrb_http2_upstream_groups *groups;
+  unsigned int i;
+
+  groups = (mrb_http2_upstream_groups *)malloc(sizeof(mrb_http2_upstream_groups));
+  if (groups == NULL) {
+    return NULL;
+  }
+  groups->len = len;
+  groups->groups = (mrb_http2_upstream_group *)calloc(len, sizeof(mrb_http2_upstream_group));
+  if (groups->groups == NULL) {
+    free(groups);
+    return NULL;
+  }
+  for (i = 0; i < len; i++) {
+    if (mrb_http2_upstream_group_init(&groups->groups[i], evbase, dnsbase, tls, &confs[i]) != 0) {
+      groups->len = i + 1;
+      mrb_http2_upstream_groups_free(groups);
+      return NULL;
+    }
+  }
+
+  return groups;
+}
+
+void mrb_http2_upstream_groups_free(mrb_http2_upstream_groups *groups)
+{
+  unsigned int i;
+
+  for (i = 0; i < groups->len; i++) {
+    mrb_http2_upstream_group_cleanup(&groups->groups[i]);
+  }
+  free(groups->groups);
+  free(groups);
+}
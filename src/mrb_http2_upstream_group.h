@@ -0,0 +1,70 @@
+/*
+// mrb_http2_upstream_group.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_UPSTREAM_GROUP_H
+#define MRB_HTTP2_UPSTREAM_GROUP_H
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/dns.h>
+
+#include "mrb_http2_upstream.h"
+#include "mrb_http2_upstream_tls.h"
+
+struct mrb_http2_upstream_group;
+
+typedef struct mrb_http2_upstream_backend {
+  struct mrb_http2_upstream_group *group;
+  const char *host;
+  int port;
+  int weight;
+  int tls;
+
+  // smooth weighted round robin state
+  int current_weight;
+
+  // requests sent and not finished yet
+  unsigned int outstanding;
+
+  // latency ewma of successful responses in usec, 0 until measured
+  int64_t ewma;
+
+  // passive health check, ejected until down_until
+  unsigned int fails;
+  struct timeval down_until;
+
+  // active health check
+  struct evhttp_connection *probe_conn;
+  unsigned int healthy : 1;
+  unsigned int probing : 1;
+} mrb_http2_upstream_backend;
+
+typedef struct mrb_http2_upstream_group {
+  const mrb_http2_upstream_group_conf *conf;
+  struct event_base *evbase;
+  struct evdns_base *dnsbase;
+  mrb_http2_upstream_tls *tls;
+  mrb_http2_upstream_backend *backends;
+  unsigned int nbackends;
+  unsigned int rr;
+  struct event *probe_ev;
+} mrb_http2_upstream_group;
+
+// groups of a worker, same index as mrb_http2_config_t.upstream_groups
+typedef struct {
+  mrb_http2_upstream_group *groups;
+  unsigned int len;
+} mrb_http2_upstream_groups;
+
+mrb_http2_upstream_groups *mrb_http2_upstream_groups_new(struct event_base *evbase, struct evdns_base *dnsbase,
+                                                         mrb_http2_upstream_tls *tls,
+                                                         const mrb_http2_upstream_group_conf *confs, unsigned int len);
+mrb_http2_upstream_backend *mrb_http2_upstream_group_select(mrb_http2_upstream_group *group);
+int mrb_http2_upstream_backend_done(mrb_http2_upstream_backend *backend, int status, const struct timeval *start);
+void mrb_http2_upstream_backend_cancel(mrb_http2_upstream_backend *backend);
+void mrb_http2_upstream_groups_free(mrb_http2_upstream_groups *groups);
+
+#endif
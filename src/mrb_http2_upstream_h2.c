@@ -0,0 +1,623 @@
+/*
+// mrb_http2_upstream_h2.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_upstream_h2.h"
+
+#include <event2/bufferevent_ssl.h>
+
+// windows announced to upstream, the stream window is opened again when
+// the response body was sent to the client by mrb_http2_upstream_h2_consume
+#define MRB_HTTP2_UPSTREAM_H2_STREAM_WINDOW ((1 << 18) - 1)
+#define MRB_HTTP2_UPSTREAM_H2_CONN_WINDOW ((1 << 24) - 1)
+
+static void mrb_http2_upstream_h2_schedule(mrb_http2_upstream_h2_conn *conn)
+{
+  event_active(conn->send_ev, 0, 0);
+}
+
+static void mrb_http2_upstream_h2_stream_free(mrb_http2_upstream_h2_stream *stream)
+{
+  mrb_http2_upstream_h2_conn *conn = stream->conn;
+
+  if (stream->prev != NULL) {
+    stream->prev->next = stream->next;
+  } else {
+    conn->streams = stream->next;
+  }
+  if (stream->next != NULL) {
+    stream->next->prev = stream->prev;
+  }
+  conn->nstreams--;
+  if (stream->body != NULL) {
+    evbuffer_free(stream->body);
+  }
+  free(stream);
+}
+
+// close the connection, streams are closed with on_close when notify
+static void mrb_http2_upstream_h2_conn_free(mrb_http2_upstream_h2_conn *conn, int notify)
+{
+  mrb_http2_upstream_h2_host *host = conn->host;
+  mrb_http2_upstream_h2_conn **p;
+  mrb_http2_upstream_h2_stream *stream;
+
+  for (p = &host->conns; *p != NULL; p = &(*p)->next) {
+    if (*p == conn) {
+      *p = conn->next;
+      host->nconns--;
+      break;
+    }
+  }
+
+  // on_close may cancel other streams of this connection
+  while ((stream = conn->streams) != NULL) {
+    if (notify && stream->cb != NULL) {
+      stream->cb->on_close(stream->arg, NGHTTP2_INTERNAL_ERROR);
+    }
+    mrb_http2_upstream_h2_stream_free(stream);
+  }
+
+  nghttp2_session_del(conn->session);
+  bufferevent_free(conn->bev);
+  event_free(conn->send_ev);
+  event_free(conn->idle_ev);
+  free(conn);
+}
+
+static void mrb_http2_upstream_h2_send(mrb_http2_upstream_h2_conn *conn)
+{
+  int rv;
+
+  rv = nghttp2_session_send(conn->session);
+  if (rv != 0) {
+    fprintf(stderr, "upstream %s:%d: %s\n", conn->host->name, conn->host->port, nghttp2_strerror(rv));
+    mrb_http2_upstream_h2_conn_free(conn, 1);
+    return;
+  }
+  if (nghttp2_session_want_read(conn->session) == 0 && nghttp2_session_want_write(conn->session) == 0 &&
+      evbuffer_get_length(bufferevent_get_output(conn->bev)) == 0) {
+    mrb_http2_upstream_h2_conn_free(conn, 1);
+  }
+}
+
+static ssize_t mrb_http2_upstream_h2_send_callback(nghttp2_session *session, const uint8_t *data, size_t length,
+                                                   int flags, void *user_data)
+{
+  mrb_http2_upstream_h2_conn *conn = (mrb_http2_upstream_h2_conn *)user_data;
+
+  // resumed by the write callback
+  if (evbuffer_get_length(bufferevent_get_output(conn->bev)) >= OUTPUT_WOULDBLOCK_THRESHOLD) {
+    return NGHTTP2_ERR_WOULDBLOCK;
+  }
+  bufferevent_write(conn->bev, data, length);
+  return length;
+}
+
+static int mrb_http2_upstream_h2_on_header_callback(nghttp2_session *session, const nghttp2_frame *frame,
+                                                    const uint8_t *name, size_t namelen, const uint8_t *value,
+                                                    size_t valuelen, uint8_t flags, void *user_data)
+{
+  mrb_http2_upstream_h2_stream *stream;
+
+  if (frame->hd.type != NGHTTP2_HEADERS) {
+    return 0;
+  }
+  stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  // trailers are dropped
+  if (stream == NULL || stream->cb == NULL || stream->headers_done) {
+    return 0;
+  }
+  if (namelen == sizeof(":status") - 1 && memcmp(":status", name, namelen) == 0 && value[0] == '1') {
+    stream->interim = 1;
+  }
+  if (!stream->interim) {
+    stream->cb->on_header(stream->arg, name, namelen, value, valuelen);
+  }
+  return 0;
+}
+
+static int mrb_http2_upstream_h2_on_frame_recv_callback(nghttp2_session *session, const nghttp2_frame *frame,
+                                                        void *user_data)
+{
+  mrb_http2_upstream_h2_conn *conn = (mrb_http2_upstream_h2_conn *)user_data;
+  mrb_http2_upstream_h2_stream *stream;
+
+  switch (frame->hd.type) {
+  case NGHTTP2_HEADERS:
+    stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (stream == NULL || stream->headers_done) {
+      break;
+    }
+    if (stream->interim) {
+      // the final response follows
+      stream->interim = 0;
+      break;
+    }
+    stream->headers_done = 1;
+    if (stream->cb != NULL && stream->cb->on_headers_done(stream->arg) != 0) {
+      nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, frame->hd.stream_id, NGHTTP2_INTERNAL_ERROR);
+    }
+    break;
+  case NGHTTP2_GOAWAY:
+    conn->draining = 1;
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+static int mrb_http2_upstream_h2_on_frame_send_callback(nghttp2_session *session, const nghttp2_frame *frame,
+                                                        void *user_data)
+{
+  mrb_http2_upstream_h2_stream *stream;
+
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) ||
+      !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+    return 0;
+  }
+  stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (stream != NULL && stream->cb != NULL) {
+    stream->cb->on_request_sent(stream->arg);
+  }
+  return 0;
+}
+
+static int mrb_http2_upstream_h2_on_data_chunk_recv_callback(nghttp2_session *session, uint8_t flags,
+                                                             int32_t stream_id, const uint8_t *data, size_t len,
+                                                             void *user_data)
+{
+  mrb_http2_upstream_h2_stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+
+  if (stream == NULL || stream->cb == NULL) {
+    nghttp2_session_consume(session, stream_id, len);
+    return 0;
+  }
+  stream->unconsumed += len;
+  stream->cb->on_data(stream->arg, data, len);
+  return 0;
+}
+
+// a connection without streams closes by the idle timeout, or at once
+// when draining, the session can't be deleted in its callback
+static void mrb_http2_upstream_h2_idle(mrb_http2_upstream_h2_conn *conn)
+{
+  struct timeval tv;
+
+  tv.tv_sec = conn->draining ? 0 : conn->host->pool->idle_timeout / 1000;
+  tv.tv_usec = conn->draining ? 0 : (conn->host->pool->idle_timeout % 1000) * 1000;
+  evtimer_add(conn->idle_ev, &tv);
+}
+
+static int mrb_http2_upstream_h2_on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
+                                                          uint32_t error_code, void *user_data)
+{
+  mrb_http2_upstream_h2_conn *conn = (mrb_http2_upstream_h2_conn *)user_data;
+  mrb_http2_upstream_h2_stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+
+  if (stream == NULL) {
+    return 0;
+  }
+  if (stream->cb != NULL) {
+    stream->cb->on_close(stream->arg, error_code);
+  }
+  // the body buffered for the client no longer holds the connection window
+  if (stream->unconsumed > 0) {
+    nghttp2_session_consume_connection(session, stream->unconsumed);
+  }
+  mrb_http2_upstream_h2_stream_free(stream);
+
+  if (conn->nstreams == 0) {
+    mrb_http2_upstream_h2_idle(conn);
+  }
+  return 0;
+}
+
+static ssize_t mrb_http2_upstream_h2_body_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf,
+                                                        size_t length, uint32_t *data_flags,
+                                                        nghttp2_data_source *source, void *user_data)
+{
+  mrb_http2_upstream_h2_stream *stream = source->ptr;
+  int nread;
+
+  nread = evbuffer_remove(stream->body, buf, length);
+  if (nread == -1) {
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+  if (nread > 0 && stream->cb != NULL) {
+    stream->cb->on_body_sent(stream->arg, nread);
+  }
+  if (evbuffer_get_length(stream->body) == 0) {
+    if (stream->body_eof) {
+      *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    } else if (nread == 0) {
+      // resumed by mrb_http2_upstream_h2_write
+      stream->deferred = 1;
+      return NGHTTP2_ERR_DEFERRED;
+    }
+  }
+  return nread;
+}
+
+static void mrb_http2_upstream_h2_readcb(struct bufferevent *bev, void *ptr)
+{
+  mrb_http2_upstream_h2_conn *conn = (mrb_http2_upstream_h2_conn *)ptr;
+  struct evbuffer *input = bufferevent_get_input(bev);
+  struct evbuffer_iovec v[16];
+  ssize_t readlen;
+  size_t consumed;
+  int i, n;
+
+  // the chains of input in place, not copied into one by evbuffer_pullup
+  while ((n = evbuffer_peek(input, -1, NULL, v, ARRLEN(v))) > 0) {
+    if (n > (int)ARRLEN(v)) {
+      n = ARRLEN(v);
+    }
+    consumed = 0;
+    for (i = 0; i < n; i++) {
+      readlen = nghttp2_session_mem_recv(conn->session, v[i].iov_base, v[i].iov_len);
+      if (readlen < 0) {
+        fprintf(stderr, "upstream %s:%d: %s\n", conn->host->name, conn->host->port, nghttp2_strerror((int)readlen));
+        mrb_http2_upstream_h2_conn_free(conn, 1);
+        return;
+      }
+      consumed += readlen;
+    }
+    evbuffer_drain(input, consumed);
+  }
+  mrb_http2_upstream_h2_send(conn);
+}
+
+static void mrb_http2_upstream_h2_writecb(struct bufferevent *bev, void *ptr)
+{
+  mrb_http2_upstream_h2_conn *conn = (mrb_http2_upstream_h2_conn *)ptr;
+
+  if (nghttp2_session_want_write(conn->session)) {
+    mrb_http2_upstream_h2_send(conn);
+  }
+}
+
+static void mrb_http2_upstream_h2_eventcb(struct bufferevent *bev, short events, void *ptr)
+{
+  mrb_http2_upstream_h2_conn *conn = (mrb_http2_upstream_h2_conn *)ptr;
+
+  if (events & BEV_EVENT_CONNECTED) {
+    int val = 1;
+
+    // connected after the TLS handshake, which must have selected h2
+    if (conn->host->tls) {
+      const unsigned char *proto = NULL;
+      unsigned int protolen = 0;
+
+      SSL_get0_alpn_selected(bufferevent_openssl_get_ssl(bev), &proto, &protolen);
+      if (protolen != 2 || memcmp(proto, "h2", 2) != 0) {
+        fprintf(stderr, "upstream %s:%d: h2 not negotiated\n", conn->host->name, conn->host->port);
+        mrb_http2_upstream_h2_conn_free(conn, 1);
+        return;
+      }
+    }
+    // the write timeout was the connect timeout
+    bufferevent_set_timeouts(bev, NULL, NULL);
+    setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+    mrb_http2_upstream_h2_send(conn);
+    return;
+  }
+  mrb_http2_upstream_h2_conn_free(conn, 1);
+}
+
+static void mrb_http2_upstream_h2_send_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  mrb_http2_upstream_h2_send((mrb_http2_upstream_h2_conn *)ptr);
+}
+
+static void mrb_http2_upstream_h2_idle_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  mrb_http2_upstream_h2_conn *conn = (mrb_http2_upstream_h2_conn *)ptr;
+
+  if (conn->nstreams == 0) {
+    mrb_http2_upstream_h2_conn_free(conn, 0);
+  }
+}
+
+static mrb_http2_upstream_h2_conn *mrb_http2_upstream_h2_conn_new(mrb_http2_upstream_h2_host *host)
+{
+  mrb_http2_upstream_h2_conn *conn;
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_option *option;
+  nghttp2_settings_entry iv[2] = {{NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+                                  {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, MRB_HTTP2_UPSTREAM_H2_STREAM_WINDOW}};
+  struct event_base *evbase = host->pool->evbase;
+  mrb_http2_resolver *resolver = host->pool->resolver;
+  const char *address, *path = mrb_http2_resolver_unix_path(host->name);
+  struct sockaddr_un sun;
+  int rv;
+
+  if (path != NULL && mrb_http2_resolver_unix_sockaddr(path, &sun) != 0) {
+    return NULL;
+  }
+  // a cached address, or the name resolved by evdns while connecting
+  address = mrb_http2_resolver_address(resolver, host->name);
+  if (address == NULL) {
+    return NULL;
+  }
+  conn = (mrb_http2_upstream_h2_conn *)calloc(1, sizeof(mrb_http2_upstream_h2_conn));
+  if (conn == NULL) {
+    return NULL;
+  }
+  conn->host = host;
+  if (host->tls) {
+    // verified against and resuming the session of the name, not the address
+    SSL *ssl = mrb_http2_upstream_tls_ssl_new(host->pool->tls, host->name, host->port, MRB_HTTP2_UPSTREAM_TLS_ALPN_H2,
+                                              sizeof(MRB_HTTP2_UPSTREAM_TLS_ALPN_H2) - 1);
+    if (ssl == NULL) {
+      free(conn);
+      return NULL;
+    }
+    conn->bev = bufferevent_openssl_socket_new(evbase, -1, ssl, BUFFEREVENT_SSL_CONNECTING,
+                                               BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    if (conn->bev == NULL) {
+      SSL_free(ssl);
+    } else {
+      bufferevent_openssl_set_allow_dirty_shutdown(conn->bev, 1);
+    }
+  } else {
+    conn->bev = bufferevent_socket_new(evbase, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  }
+  if (conn->bev == NULL) {
+    free(conn);
+    return NULL;
+  }
+
+  nghttp2_session_callbacks_new(&callbacks);
+  nghttp2_session_callbacks_set_send_callback(callbacks, mrb_http2_upstream_h2_send_callback);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, mrb_http2_upstream_h2_on_header_callback);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, mrb_http2_upstream_h2_on_frame_recv_callback);
+  nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, mrb_http2_upstream_h2_on_frame_send_callback);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+                                                            mrb_http2_upstream_h2_on_data_chunk_recv_callback);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, mrb_http2_upstream_h2_on_stream_close_callback);
+
+  // the stream window follows the client reading the response
+  nghttp2_option_new(&option);
+  nghttp2_option_set_no_auto_window_update(option, 1);
+
+  nghttp2_session_client_new2(&conn->session, callbacks, conn, option);
+  nghttp2_session_callbacks_del(callbacks);
+  nghttp2_option_del(option);
+
+  nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, iv, ARRLEN(iv));
+  nghttp2_session_set_local_window_size(conn->session, NGHTTP2_FLAG_NONE, 0, MRB_HTTP2_UPSTREAM_H2_CONN_WINDOW);
+
+  conn->send_ev = event_new(evbase, -1, 0, mrb_http2_upstream_h2_send_cb, conn);
+  conn->idle_ev = evtimer_new(evbase, mrb_http2_upstream_h2_idle_cb, conn);
+
+  bufferevent_setcb(conn->bev, mrb_http2_upstream_h2_readcb, mrb_http2_upstream_h2_writecb,
+                    mrb_http2_upstream_h2_eventcb, conn);
+  bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+  if (host->pool->connect_timeout > 0) {
+    struct timeval tv;
+
+    tv.tv_sec = host->pool->connect_timeout / 1000;
+    tv.tv_usec = (host->pool->connect_timeout % 1000) * 1000;
+    bufferevent_set_timeouts(conn->bev, NULL, &tv);
+  }
+  if (path != NULL) {
+    rv = bufferevent_socket_connect(conn->bev, (struct sockaddr *)&sun, sizeof(sun));
+  } else {
+    rv = bufferevent_socket_connect_hostname(conn->bev, resolver->dnsbase, AF_UNSPEC, address, host->port);
+  }
+  if (rv != 0) {
+    nghttp2_session_del(conn->session);
+    bufferevent_free(conn->bev);
+    event_free(conn->send_ev);
+    event_free(conn->idle_ev);
+    free(conn);
+    return NULL;
+  }
+
+  conn->next = host->conns;
+  host->conns = conn;
+  host->nconns++;
+
+  return conn;
+}
+
+static mrb_http2_upstream_h2_host *mrb_http2_upstream_h2_host_get(mrb_http2_upstream_h2_pool *pool,
+                                                                  const char *name, int port, int tls)
+{
+  mrb_http2_upstream_h2_host *host;
+
+  for (host = pool->hosts; host != NULL; host = host->next) {
+    if (host->port == port && host->tls == tls && strcmp(host->name, name) == 0) {
+      return host;
+    }
+  }
+
+  host = (mrb_http2_upstream_h2_host *)calloc(1, sizeof(mrb_http2_upstream_h2_host));
+  if (host == NULL) {
+    return NULL;
+  }
+  host->name = strdup(name);
+  host->port = port;
+  host->tls = tls;
+  host->pool = pool;
+  host->next = pool->hosts;
+  pool->hosts = host;
+
+  return host;
+}
+
+// multiplex on the least busy connection, and open a new one only when
+// all connections reached the concurrent streams limit of upstream
+static mrb_http2_upstream_h2_conn *mrb_http2_upstream_h2_conn_get(mrb_http2_upstream_h2_host *host)
+{
+  mrb_http2_upstream_h2_conn *conn, *best = NULL;
+
+  for (conn = host->conns; conn != NULL; conn = conn->next) {
+    if (conn->draining) {
+      continue;
+    }
+    if (best == NULL || conn->nstreams < best->nstreams) {
+      best = conn;
+    }
+  }
+  if (best != NULL &&
+      (best->nstreams < nghttp2_session_get_remote_settings(best->session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS) ||
+       (host->pool->max_conns > 0 && host->nconns >= host->pool->max_conns))) {
+    return best;
+  }
+
+  conn = mrb_http2_upstream_h2_conn_new(host);
+  return conn != NULL ? conn : best;
+}
+
+mrb_http2_upstream_h2_pool *mrb_http2_upstream_h2_pool_new(struct event_base *evbase, mrb_http2_resolver *resolver,
+                                                           mrb_http2_upstream_tls *tls, unsigned int max_conns,
+                                                           unsigned int idle_timeout, unsigned int connect_timeout)
+{
+  mrb_http2_upstream_h2_pool *pool;
+
+  pool = (mrb_http2_upstream_h2_pool *)calloc(1, sizeof(mrb_http2_upstream_h2_pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->evbase = evbase;
+  pool->resolver = resolver;
+  pool->tls = tls;
+  pool->max_conns = max_conns;
+  pool->idle_timeout = idle_timeout;
+  pool->connect_timeout = connect_timeout;
+
+  return pool;
+}
+
+mrb_http2_upstream_h2_stream *mrb_http2_upstream_h2_submit(mrb_http2_upstream_h2_pool *pool, const char *name,
+                                                           int port, int tls, const nghttp2_nv *nva, size_t nvlen,
+                                                           int has_body, const mrb_http2_upstream_h2_callbacks *cb,
+                                                           void *arg)
+{
+  mrb_http2_upstream_h2_host *host;
+  mrb_http2_upstream_h2_conn *conn;
+  mrb_http2_upstream_h2_stream *stream;
+  nghttp2_data_provider data_prd;
+
+  if (tls && pool->tls == NULL) {
+    return NULL;
+  }
+  host = mrb_http2_upstream_h2_host_get(pool, name, port, tls);
+  if (host == NULL) {
+    return NULL;
+  }
+  conn = mrb_http2_upstream_h2_conn_get(host);
+  if (conn == NULL) {
+    return NULL;
+  }
+
+  stream = (mrb_http2_upstream_h2_stream *)calloc(1, sizeof(mrb_http2_upstream_h2_stream));
+  if (stream == NULL) {
+    // a new connection has no stream to close it
+    if (conn->nstreams == 0) {
+      mrb_http2_upstream_h2_idle(conn);
+    }
+    return NULL;
+  }
+  stream->conn = conn;
+  stream->cb = cb;
+  stream->arg = arg;
+  if (has_body) {
+    stream->body = evbuffer_new();
+    data_prd.source.ptr = stream;
+    data_prd.read_callback = mrb_http2_upstream_h2_body_read_callback;
+  }
+
+  stream->stream_id = nghttp2_submit_request(conn->session, NULL, nva, nvlen, has_body ? &data_prd : NULL, stream);
+  if (stream->stream_id < 0) {
+    fprintf(stderr, "upstream %s:%d: %s\n", name, port, nghttp2_strerror(stream->stream_id));
+    if (stream->body != NULL) {
+      evbuffer_free(stream->body);
+    }
+    free(stream);
+    if (conn->nstreams == 0) {
+      mrb_http2_upstream_h2_idle(conn);
+    }
+    return NULL;
+  }
+
+  stream->next = conn->streams;
+  if (conn->streams != NULL) {
+    conn->streams->prev = stream;
+  }
+  conn->streams = stream;
+  conn->nstreams++;
+  evtimer_del(conn->idle_ev);
+  mrb_http2_upstream_h2_schedule(conn);
+
+  return stream;
+}
+
+void mrb_http2_upstream_h2_write(mrb_http2_upstream_h2_stream *stream, const uint8_t *data, size_t len)
+{
+  evbuffer_add(stream->body, data, len);
+  if (stream->deferred) {
+    stream->deferred = 0;
+    nghttp2_session_resume_data(stream->conn->session, stream->stream_id);
+  }
+  mrb_http2_upstream_h2_schedule(stream->conn);
+}
+
+void mrb_http2_upstream_h2_end(mrb_http2_upstream_h2_stream *stream)
+{
+  stream->body_eof = 1;
+  if (stream->deferred) {
+    stream->deferred = 0;
+    nghttp2_session_resume_data(stream->conn->session, stream->stream_id);
+  }
+  mrb_http2_upstream_h2_schedule(stream->conn);
+}
+
+void mrb_http2_upstream_h2_consume(mrb_http2_upstream_h2_stream *stream, size_t len)
+{
+  if (len > stream->unconsumed) {
+    len = stream->unconsumed;
+  }
+  stream->unconsumed -= len;
+  nghttp2_session_consume(stream->conn->session, stream->stream_id, len);
+  mrb_http2_upstream_h2_schedule(stream->conn);
+}
+
+// no more callbacks, the stream is freed when upstream closed it
+void mrb_http2_upstream_h2_cancel(mrb_http2_upstream_h2_stream *stream)
+{
+  stream->cb = NULL;
+  if (stream->unconsumed > 0) {
+    nghttp2_session_consume(stream->conn->session, stream->stream_id, stream->unconsumed);
+    stream->unconsumed = 0;
+  }
+  nghttp2_submit_rst_stream(stream->conn->session, NGHTTP2_FLAG_NONE, stream->stream_id, NGHTTP2_CANCEL);
+  mrb_http2_upstream_h2_schedule(stream->conn);
+}
+
+// reset the stream, which is closed by on_close with NGHTTP2_CANCEL
+void mrb_http2_upstream_h2_reset(mrb_http2_upstream_h2_stream *stream)
+{
+  nghttp2_submit_rst_stream(stream->conn->session, NGHTTP2_FLAG_NONE, stream->stream_id, NGHTTP2_CANCEL);
+  mrb_http2_upstream_h2_schedule(stream->conn);
+}
+
+void mrb_http2_upstream_h2_pool_free(mrb_http2_upstream_h2_pool *pool)
+{
+  mrb_http2_upstream_h2_host *host, *next;
+
+  for (host = pool->hosts; host != NULL; host = next) {
+    next = host->next;
+    while (host->conns != NULL) {
+      mrb_http2_upstream_h2_conn_free(host->conns, 0);
+    }
+    free(host->name);
+    free(host);
+  }
+  free(pool);
+}
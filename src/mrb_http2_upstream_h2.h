@@ -0,0 +1,126 @@
+/*
+// mrb_http2_upstream_h2.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_UPSTREAM_H2_H
+#define MRB_HTTP2_UPSTREAM_H2_H
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <nghttp2/nghttp2.h>
+
+#include "mrb_http2_resolver.h"
+#include "mrb_http2_upstream_tls.h"
+
+struct mrb_http2_upstream_h2_conn;
+
+// called on the worker loop, never inside the mrb_http2_upstream_h2_*
+// functions, so the callee can submit and send on the client session
+typedef struct {
+  // a response header including :status, name and value are NULL-terminated
+  void (*on_header)(void *arg, const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen);
+
+  // all response headers were received, return -1 to reset the stream
+  int (*on_headers_done)(void *arg);
+
+  // a part of the response body, pass the length to _consume when sent
+  void (*on_data)(void *arg, const uint8_t *data, size_t len);
+
+  // the request body written to upstream, the client can send more
+  void (*on_body_sent)(void *arg, size_t len);
+
+  // the whole request was sent, END_STREAM included
+  void (*on_request_sent)(void *arg);
+
+  // the stream was closed, error_code is NGHTTP2_NO_ERROR when the
+  // response completed, the stream is freed after this callback
+  void (*on_close)(void *arg, uint32_t error_code);
+} mrb_http2_upstream_h2_callbacks;
+
+typedef struct mrb_http2_upstream_h2_stream {
+  struct mrb_http2_upstream_h2_stream *prev, *next;
+  struct mrb_http2_upstream_h2_conn *conn;
+  int32_t stream_id;
+
+  // NULL after cancelled
+  const mrb_http2_upstream_h2_callbacks *cb;
+  void *arg;
+
+  // request body not sent yet, NULL when the request has no body
+  struct evbuffer *body;
+
+  // response body received and not consumed yet
+  size_t unconsumed;
+
+  unsigned int body_eof : 1;
+  unsigned int deferred : 1;
+
+  // skipping a 1xx response, and the final response headers were received
+  unsigned int interim : 1;
+  unsigned int headers_done : 1;
+} mrb_http2_upstream_h2_stream;
+
+struct mrb_http2_upstream_h2_host;
+
+typedef struct mrb_http2_upstream_h2_conn {
+  struct mrb_http2_upstream_h2_conn *next;
+  struct mrb_http2_upstream_h2_host *host;
+  struct bufferevent *bev;
+  nghttp2_session *session;
+  mrb_http2_upstream_h2_stream *streams;
+
+  // sends the frames submitted since the last loop iteration
+  struct event *send_ev;
+
+  // closes the connection without streams after the idle timeout
+  struct event *idle_ev;
+
+  unsigned int nstreams;
+
+  // no new streams after GOAWAY
+  unsigned int draining : 1;
+} mrb_http2_upstream_h2_conn;
+
+// connections to one host:port, over TLS negotiating h2 by ALPN when tls
+typedef struct mrb_http2_upstream_h2_host {
+  struct mrb_http2_upstream_h2_host *next;
+  struct mrb_http2_upstream_h2_pool *pool;
+  char *name;
+  int port;
+  int tls;
+  mrb_http2_upstream_h2_conn *conns;
+  unsigned int nconns;
+} mrb_http2_upstream_h2_host;
+
+typedef struct mrb_http2_upstream_h2_pool {
+  struct event_base *evbase;
+  mrb_http2_resolver *resolver;
+  mrb_http2_upstream_tls *tls;
+  mrb_http2_upstream_h2_host *hosts;
+
+  // connections per host:port
+  unsigned int max_conns;
+
+  // msec, connect_timeout 0 means none
+  unsigned int idle_timeout;
+  unsigned int connect_timeout;
+} mrb_http2_upstream_h2_pool;
+
+mrb_http2_upstream_h2_pool *mrb_http2_upstream_h2_pool_new(struct event_base *evbase, mrb_http2_resolver *resolver,
+                                                           mrb_http2_upstream_tls *tls, unsigned int max_conns,
+                                                           unsigned int idle_timeout, unsigned int connect_timeout);
+mrb_http2_upstream_h2_stream *mrb_http2_upstream_h2_submit(mrb_http2_upstream_h2_pool *pool, const char *name,
+                                                           int port, int tls, const nghttp2_nv *nva, size_t nvlen,
+                                                           int has_body, const mrb_http2_upstream_h2_callbacks *cb,
+                                                           void *arg);
+void mrb_http2_upstream_h2_write(mrb_http2_upstream_h2_stream *stream, const uint8_t *data, size_t len);
+void mrb_http2_upstream_h2_end(mrb_http2_upstream_h2_stream *stream);
+void mrb_http2_upstream_h2_consume(mrb_http2_upstream_h2_stream *stream, size_t len);
+void mrb_http2_upstream_h2_cancel(mrb_http2_upstream_h2_stream *stream);
+void mrb_http2_upstream_h2_reset(mrb_http2_upstream_h2_stream *stream);
+void mrb_http2_upstream_h2_pool_free(mrb_http2_upstream_h2_pool *pool);
+
+#endif
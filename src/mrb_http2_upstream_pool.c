@@ -0,0 +1,267 @@
+/*
+// mrb_http2_upstream_pool.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_upstream_pool.h"
+
+#include <event2/bufferevent_ssl.h>
+
+// an evhttp connection to the address, or to the socket of a unix domain
+// socket name with MRB_HTTP2_RESOLVER_EVHTTP_UNIX, over TLS by ssl when
+// not NULL, the connection owns ssl even when it failed
+struct evhttp_connection *mrb_http2_upstream_evcon_new(struct event_base *evbase, struct evdns_base *dnsbase,
+                                                       const char *address, int port, SSL *ssl)
+{
+  const char *path = mrb_http2_resolver_unix_path(address);
+  struct bufferevent *bev = NULL;
+  struct evhttp_connection *evcon;
+
+#ifndef MRB_HTTP2_RESOLVER_EVHTTP_UNIX
+  if (path != NULL) {
+    fprintf(stderr, "upstream %s: HTTP/1.x over a unix domain socket needs libevent 2.2\n", address);
+    if (ssl != NULL) {
+      SSL_free(ssl);
+    }
+    return NULL;
+  }
+#endif
+  if (ssl != NULL) {
+    bev = bufferevent_openssl_socket_new(evbase, -1, ssl, BUFFEREVENT_SSL_CONNECTING,
+                                         BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    if (bev == NULL) {
+      SSL_free(ssl);
+      return NULL;
+    }
+    // upstreams often close without close_notify
+    bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+  }
+  if (path == NULL) {
+    evcon = evhttp_connection_base_bufferevent_new(evbase, dnsbase, bev, address, port);
+  } else {
+#ifdef MRB_HTTP2_RESOLVER_EVHTTP_UNIX
+    evcon = evhttp_connection_base_bufferevent_unix_new(evbase, bev, path);
+#else
+    evcon = NULL;
+#endif
+  }
+  if (evcon == NULL && bev != NULL) {
+    bufferevent_free(bev);
+  }
+  return evcon;
+}
+
+static void mrb_http2_upstream_closecb(struct evhttp_connection *evcon, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  conn->closed = 1;
+}
+
+static void mrb_http2_upstream_conn_free(mrb_http2_upstream_conn *conn)
+{
+  mrb_http2_upstream_host *host = conn->host;
+  mrb_http2_upstream_conn **p;
+
+  for (p = &host->conns; *p != NULL; p = &(*p)->next) {
+    if (*p == conn) {
+      *p = conn->next;
+      break;
+    }
+  }
+  host->nconns--;
+
+  event_free(conn->idle_ev);
+  evhttp_connection_free(conn->evcon);
+  free(conn);
+}
+
+static void mrb_http2_upstream_idle_cb(evutil_socket_t fd, short events, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  conn->host->nidle--;
+  mrb_http2_upstream_conn_free(conn);
+}
+
+static mrb_http2_upstream_conn *mrb_http2_upstream_conn_new(mrb_http2_upstream_host *host)
+{
+  mrb_http2_upstream_conn *conn;
+  mrb_http2_resolver *resolver = host->pool->resolver;
+  const char *address;
+  SSL *ssl = NULL;
+
+  // a cached address, or the name resolved by evdns while connecting
+  address = mrb_http2_resolver_address(resolver, host->name);
+  if (address == NULL) {
+    return NULL;
+  }
+  conn = (mrb_http2_upstream_conn *)malloc(sizeof(mrb_http2_upstream_conn));
+  if (conn == NULL) {
+    return NULL;
+  }
+  memset(conn, 0, sizeof(mrb_http2_upstream_conn));
+
+  if (host->tls) {
+    // verified against and resuming the session of the name, not the address
+    ssl = mrb_http2_upstream_tls_ssl_new(host->pool->tls, host->name, host->port,
+                                         MRB_HTTP2_UPSTREAM_TLS_ALPN_HTTP1,
+                                         sizeof(MRB_HTTP2_UPSTREAM_TLS_ALPN_HTTP1) - 1);
+    if (ssl == NULL) {
+      free(conn);
+      return NULL;
+    }
+  }
+  conn->evcon = mrb_http2_upstream_evcon_new(host->pool->evbase, resolver->dnsbase, address, host->port, ssl);
+  if (conn->evcon == NULL) {
+    free(conn);
+    return NULL;
+  }
+  if (host->tls) {
+    evhttp_connection_set_closecb(conn->evcon, mrb_http2_upstream_closecb, conn);
+  }
+  conn->idle_ev = evtimer_new(host->pool->evbase, mrb_http2_upstream_idle_cb, conn);
+  conn->host = host;
+  conn->next = host->conns;
+  host->conns = conn;
+  host->nconns++;
+
+  return conn;
+}
+
+static mrb_http2_upstream_host *mrb_http2_upstream_host_get(mrb_http2_upstream_pool *pool, const char *name, int port,
+                                                            int tls)
+{
+  mrb_http2_upstream_host *host;
+
+  for (host = pool->hosts; host != NULL; host = host->next) {
+    if (host->port == port && host->tls == tls && strcmp(host->name, name) == 0) {
+      return host;
+    }
+  }
+
+  host = (mrb_http2_upstream_host *)malloc(sizeof(mrb_http2_upstream_host));
+  if (host == NULL) {
+    return NULL;
+  }
+  memset(host, 0, sizeof(mrb_http2_upstream_host));
+  host->name = strdup(name);
+  host->port = port;
+  host->tls = tls;
+  host->pool = pool;
+  host->next = pool->hosts;
+  pool->hosts = host;
+
+  return host;
+}
+
+mrb_http2_upstream_pool *mrb_http2_upstream_pool_new(struct event_base *evbase, mrb_http2_resolver *resolver,
+                                                     mrb_http2_upstream_tls *tls, unsigned int max_idle,
+                                                     unsigned int max_conns, unsigned int idle_timeout)
+{
+  mrb_http2_upstream_pool *pool;
+
+  pool = (mrb_http2_upstream_pool *)malloc(sizeof(mrb_http2_upstream_pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  memset(pool, 0, sizeof(mrb_http2_upstream_pool));
+  pool->evbase = evbase;
+  pool->resolver = resolver;
+  pool->tls = tls;
+  pool->max_idle = max_idle;
+  pool->max_conns = max_conns;
+  pool->idle_timeout = idle_timeout;
+
+  return pool;
+}
+
+// returns a connection to queue one request on, give it back with
+// mrb_http2_upstream_pool_put when the request finished or was cancelled,
+// tls connects to an https upstream
+mrb_http2_upstream_conn *mrb_http2_upstream_pool_get(mrb_http2_upstream_pool *pool, const char *name, int port,
+                                                     int tls, mrb_http2_upstream_pool_result *result)
+{
+  mrb_http2_upstream_host *host;
+  mrb_http2_upstream_conn *conn, *next, *least = NULL;
+
+  if (tls && pool->tls == NULL) {
+    return NULL;
+  }
+  host = mrb_http2_upstream_host_get(pool, name, port, tls);
+  if (host == NULL) {
+    return NULL;
+  }
+
+  for (conn = host->conns; conn != NULL; conn = next) {
+    next = conn->next;
+    if (conn->inflight == 0 && conn->closed) {
+      // closed by upstream while idle, a new connection resumes its session
+      host->nidle--;
+      mrb_http2_upstream_conn_free(conn);
+      continue;
+    }
+    if (conn->inflight == 0) {
+      evtimer_del(conn->idle_ev);
+      host->nidle--;
+      conn->inflight++;
+      *result = MRB_HTTP2_UPSTREAM_POOL_HIT;
+      return conn;
+    }
+    if (!conn->closed && (least == NULL || conn->inflight < least->inflight)) {
+      least = conn;
+    }
+  }
+
+  if (least != NULL && pool->max_conns > 0 && host->nconns >= pool->max_conns) {
+    least->inflight++;
+    *result = MRB_HTTP2_UPSTREAM_POOL_WAIT;
+    return least;
+  }
+
+  conn = mrb_http2_upstream_conn_new(host);
+  if (conn == NULL) {
+    return NULL;
+  }
+  conn->inflight++;
+  *result = MRB_HTTP2_UPSTREAM_POOL_CONNECT;
+  return conn;
+}
+
+// can be called from the request callback of evcon
+void mrb_http2_upstream_pool_put(mrb_http2_upstream_conn *conn, int keepalive)
+{
+  mrb_http2_upstream_host *host = conn->host;
+  struct timeval tv;
+
+  conn->inflight--;
+  if (conn->inflight > 0) {
+    return;
+  }
+
+  if (!keepalive || conn->closed || host->nidle >= host->pool->max_idle) {
+    mrb_http2_upstream_conn_free(conn);
+    return;
+  }
+
+  host->nidle++;
+  tv.tv_sec = host->pool->idle_timeout / 1000;
+  tv.tv_usec = (host->pool->idle_timeout % 1000) * 1000;
+  evtimer_add(conn->idle_ev, &tv);
+}
+
+void mrb_http2_upstream_pool_free(mrb_http2_upstream_pool *pool)
+{
+  mrb_http2_upstream_host *host, *next_host;
+
+  for (host = pool->hosts; host != NULL; host = next_host) {
+    next_host = host->next;
+    while (host->conns != NULL) {
+      mrb_http2_upstream_conn_free(host->conns);
+    }
+    free(host->name);
+    free(host);
+  }
+  free(pool);
+}
@@ -0,0 +1,79 @@
+/*
+// mrb_http2_upstream_pool.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_UPSTREAM_POOL_H
+#define MRB_HTTP2_UPSTREAM_POOL_H
+
+#include <event2/event.h>
+#include <event2/http.h>
+
+#include "mrb_http2_resolver.h"
+#include "mrb_http2_upstream_tls.h"
+
+struct mrb_http2_upstream_host;
+
+typedef struct mrb_http2_upstream_conn {
+  struct mrb_http2_upstream_conn *next;
+  struct mrb_http2_upstream_host *host;
+  struct evhttp_connection *evcon;
+
+  // closes the connection after the idle timeout
+  struct event *idle_ev;
+
+  // the number of requests queued on evcon
+  unsigned int inflight;
+
+  // a TLS connection can't connect again with its SSL once closed
+  unsigned int closed : 1;
+} mrb_http2_upstream_conn;
+
+// connections to one host:port, over TLS to an https upstream
+typedef struct mrb_http2_upstream_host {
+  struct mrb_http2_upstream_host *next;
+  struct mrb_http2_upstream_pool *pool;
+  char *name;
+  int port;
+  int tls;
+  mrb_http2_upstream_conn *conns;
+  unsigned int nconns;
+  unsigned int nidle;
+} mrb_http2_upstream_host;
+
+typedef struct mrb_http2_upstream_pool {
+  struct event_base *evbase;
+  mrb_http2_resolver *resolver;
+  mrb_http2_upstream_tls *tls;
+  mrb_http2_upstream_host *hosts;
+
+  // limits per host:port, max_conns 0 means unlimited
+  unsigned int max_idle;
+  unsigned int max_conns;
+
+  // msec
+  unsigned int idle_timeout;
+} mrb_http2_upstream_pool;
+
+typedef enum {
+  // reused an idle connection
+  MRB_HTTP2_UPSTREAM_POOL_HIT,
+  // opened a new connection
+  MRB_HTTP2_UPSTREAM_POOL_CONNECT,
+  // queued on a busy connection because of max_conns
+  MRB_HTTP2_UPSTREAM_POOL_WAIT
+} mrb_http2_upstream_pool_result;
+
+mrb_http2_upstream_pool *mrb_http2_upstream_pool_new(struct event_base *evbase, mrb_http2_resolver *resolver,
+                                                     mrb_http2_upstream_tls *tls, unsigned int max_idle,
+                                                     unsigned int max_conns, unsigned int idle_timeout);
+mrb_http2_upstream_conn *mrb_http2_upstream_pool_get(mrb_http2_upstream_pool *pool, const char *name, int port,
+                                                     int tls, mrb_http2_upstream_pool_result *result);
+void mrb_http2_upstream_pool_put(mrb_http2_upstream_conn *conn, int keepalive);
+void mrb_http2_upstream_pool_free(mrb_http2_upstream_pool *pool);
+
+struct evhttp_connection *mrb_http2_upstream_evcon_new(struct event_base *evbase, struct evdns_base *dnsbase,
+                                                       const char *address, int port, SSL *ssl);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+// mrb_http2_upstream_tls.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_upstream_tls.h"
+#include "mrb_http2_resolver.h"
+
+#include <openssl/x509v3.h>
+#include <event2/util.h>
+
+// set on an SSL after its handshake was counted
+static int mrb_http2_upstream_tls_counted_idx = -1;
+
+// sessions are kept per host:port by the application, not in the internal
+// cache of the SSL_CTX, the callback owns sess when it returns 1
+static int mrb_http2_upstream_tls_new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+  mrb_http2_upstream_tls_session *s = (mrb_http2_upstream_tls_session *)SSL_get_app_data(ssl);
+
+  if (s == NULL) {
+    return 0;
+  }
+  if (s->session != NULL) {
+    SSL_SESSION_free(s->session);
+  }
+  s->session = sess;
+  return 1;
+}
+
+// TLS 1.3 reports HANDSHAKE_DONE again for tickets received later
+static void mrb_http2_upstream_tls_info_cb(const SSL *ssl, int where, int ret)
+{
+  mrb_http2_upstream_tls *tls;
+
+  if (!(where & SSL_CB_HANDSHAKE_DONE) || SSL_get_ex_data(ssl, mrb_http2_upstream_tls_counted_idx) != NULL) {
+    return;
+  }
+  SSL_set_ex_data((SSL *)ssl, mrb_http2_upstream_tls_counted_idx, (void *)ssl);
+  tls = (mrb_http2_upstream_tls *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  if (tls->handshakes != NULL) {
+    MRB_HTTP2_STAT_INC(*tls->handshakes);
+  }
+  if (tls->resumptions != NULL && SSL_session_reused((SSL *)ssl)) {
+    MRB_HTTP2_STAT_INC(*tls->resumptions);
+  }
+}
+
+mrb_http2_upstream_tls *mrb_http2_upstream_tls_new(const char *ca_file, int verify, int session_cache,
+                                                   uint64_t *handshakes, uint64_t *resumptions)
+{
+  mrb_http2_upstream_tls *tls;
+
+  if (mrb_http2_upstream_tls_counted_idx == -1) {
+    mrb_http2_upstream_tls_counted_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+  }
+  tls = (mrb_http2_upstream_tls *)calloc(1, sizeof(mrb_http2_upstream_tls));
+  if (tls == NULL) {
+    return NULL;
+  }
+  tls->ctx = SSL_CTX_new(SSLv23_client_method());
+  if (tls->ctx == NULL) {
+    free(tls);
+    return NULL;
+  }
+  tls->verify = verify ? 1 : 0;
+  tls->handshakes = handshakes;
+  tls->resumptions = resumptions;
+
+  SSL_CTX_set_app_data(tls->ctx, tls);
+  SSL_CTX_set_options(tls->ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+  SSL_CTX_set_mode(tls->ctx, SSL_MODE_RELEASE_BUFFERS);
+  if (session_cache) {
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls->ctx, mrb_http2_upstream_tls_new_session_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(tls->ctx, SSL_OP_NO_TICKET);
+  }
+  SSL_CTX_set_info_callback(tls->ctx, mrb_http2_upstream_tls_info_cb);
+
+  if (verify) {
+    SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER, NULL);
+    if ((ca_file != NULL ? SSL_CTX_load_verify_locations(tls->ctx, ca_file, NULL)
+                         : SSL_CTX_set_default_verify_paths(tls->ctx)) != 1) {
+      SSL_CTX_free(tls->ctx);
+      free(tls);
+      return NULL;
+    }
+  }
+  return tls;
+}
+
+static mrb_http2_upstream_tls_session *mrb_http2_upstream_tls_session_get(mrb_http2_upstream_tls *tls,
+                                                                          const char *name, int port)
+{
+  mrb_http2_upstream_tls_session *s;
+
+  for (s = tls->sessions; s != NULL; s = s->next) {
+    if (s->port == port && strcmp(s->name, name) == 0) {
+      return s;
+    }
+  }
+
+  s = (mrb_http2_upstream_tls_session *)calloc(1, sizeof(mrb_http2_upstream_tls_session));
+  if (s == NULL) {
+    return NULL;
+  }
+  s->name = strdup(name);
+  s->port = port;
+  s->next = tls->sessions;
+  tls->sessions = s;
+
+  return s;
+}
+
+// a client SSL to name, verified against name and resuming the last session
+// of name:port, for bufferevent_openssl_socket_new
+SSL *mrb_http2_upstream_tls_ssl_new(mrb_http2_upstream_tls *tls, const char *name, int port, const char *alpn,
+                                    size_t alpnlen)
+{
+  mrb_http2_upstream_tls_session *s;
+  const char *server_name = name;
+  struct in6_addr addr;
+  int numeric;
+  SSL *ssl;
+
+  s = mrb_http2_upstream_tls_session_get(tls, name, port);
+  if (s == NULL) {
+    return NULL;
+  }
+  ssl = SSL_new(tls->ctx);
+  if (ssl == NULL) {
+    return NULL;
+  }
+  SSL_set_app_data(ssl, s);
+
+  // a unix domain socket is served as localhost
+  if (mrb_http2_resolver_unix_path(name) != NULL) {
+    server_name = "localhost";
+  }
+  numeric = evutil_inet_pton(AF_INET, server_name, &addr) == 1 || evutil_inet_pton(AF_INET6, server_name, &addr) == 1;
+
+  // no SNI for an address
+  if (!numeric) {
+    SSL_set_tlsext_host_name(ssl, server_name);
+  }
+  if (tls->verify &&
+      (numeric ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), server_name)
+               : X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), server_name, 0)) != 1) {
+    SSL_free(ssl);
+    return NULL;
+  }
+  if (alpn != NULL) {
+    SSL_set_alpn_protos(ssl, (const unsigned char *)alpn, alpnlen);
+  }
+  if (s->session != NULL) {
+    SSL_set_session(ssl, s->session);
+  }
+  return ssl;
+}
+
+void mrb_http2_upstream_tls_free(mrb_http2_upstream_tls *tls)
+{
+  mrb_http2_upstream_tls_session *s, *next;
+
+  for (s = tls->sessions; s != NULL; s = next) {
+    next = s->next;
+    if (s->session != NULL) {
+      SSL_SESSION_free(s->session);
+    }
+    free(s->name);
+    free(s);
+  }
+  SSL_CTX_free(tls->ctx);
+  free(tls);
+}
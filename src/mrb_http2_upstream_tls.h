@@ -0,0 +1,45 @@
+/*
+// mrb_http2_upstream_tls.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_UPSTREAM_TLS_H
+#define MRB_HTTP2_UPSTREAM_TLS_H
+
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+// the session of one upstream host:port resumed by its next connection
+typedef struct mrb_http2_upstream_tls_session {
+  struct mrb_http2_upstream_tls_session *next;
+  char *name;
+  int port;
+
+  // NULL until a handshake finished, replaced by new tickets
+  SSL_SESSION *session;
+} mrb_http2_upstream_tls_session;
+
+// client side TLS of a worker to https upstreams
+typedef struct mrb_http2_upstream_tls {
+  SSL_CTX *ctx;
+  mrb_http2_upstream_tls_session *sessions;
+
+  // counted per handshake when not NULL
+  uint64_t *handshakes;
+  uint64_t *resumptions;
+
+  unsigned int verify : 1;
+} mrb_http2_upstream_tls;
+
+// ALPN protocol lists of the upstream connections
+#define MRB_HTTP2_UPSTREAM_TLS_ALPN_H2 "\x02h2"
+#define MRB_HTTP2_UPSTREAM_TLS_ALPN_HTTP1 "\x08http/1.1"
+
+mrb_http2_upstream_tls *mrb_http2_upstream_tls_new(const char *ca_file, int verify, int session_cache,
+                                                   uint64_t *handshakes, uint64_t *resumptions);
+SSL *mrb_http2_upstream_tls_ssl_new(mrb_http2_upstream_tls *tls, const char *name, int port, const char *alpn,
+                                    size_t alpnlen);
+void mrb_http2_upstream_tls_free(mrb_http2_upstream_tls *tls);
+
+#endif
@@ -1,8 +1,10 @@
+#include "mrb_http2.h"
 #include "mrb_http2_worker.h"
 
 mrb_http2_worker_t *mrb_http2_worker_init(mrb_state *mrb)
 {
   mrb_http2_worker_t *worker = (mrb_http2_worker_t *)mrb_malloc(mrb, sizeof(mrb_http2_worker_t));
+  memset(worker, 0, sizeof(mrb_http2_worker_t));
 
   worker->session_requests_per_worker = 0;
   worker->stream_requests_per_worker = 0;
@@ -12,6 +14,26 @@ mrb_http2_worker_t *mrb_http2_worker_init(mrb_state *mrb)
   return worker;
 }
 
+void mrb_http2_worker_gc_record(mrb_http2_worker_t *worker, uint64_t usec, int full)
+{
+  static const uint64_t buckets[] = MRB_HTTP2_GC_PAUSE_BUCKETS;
+  int i;
+
+  if (full) {
+    MRB_HTTP2_STAT_INC(worker->gc_full_count);
+  } else {
+    MRB_HTTP2_STAT_INC(worker->gc_step_count);
+  }
+  MRB_HTTP2_STAT_ADD(worker->gc_time, usec);
+  if (usec > worker->gc_pause_max) {
+    __atomic_store_n(&worker->gc_pause_max, usec, __ATOMIC_RELAXED);
+  }
+
+  for (i = 0; i < ARRLEN(buckets) && usec > buckets[i]; i++)
+    ;
+  MRB_HTTP2_STAT_INC(worker->gc_pause_hist[i]);
+}
+
 void mrb_http2_worker_free(mrb_state *mrb, mrb_http2_worker_t *worker)
 {
   mrb_free(mrb, worker);
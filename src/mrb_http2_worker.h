@@ -8,6 +8,15 @@
 #define MRB_HTTP2_WORKER_H
 
 #include "mruby.h"
+#include "mrb_http2_slab.h"
+
+// gc pause distribution buckets, upper bound usec of each bucket and
+// the last bucket counts pauses over the largest bound
+#define MRB_HTTP2_GC_PAUSE_BUCKETS                                                                                     \
+  {                                                                                                                    \
+    50, 100, 250, 500, 1000, 2500, 5000, 10000                                                                         \
+  }
+#define MRB_HTTP2_GC_PAUSE_HIST_LEN 9
 
 typedef struct {
 
@@ -22,9 +31,80 @@ typedef struct {
   // the number of current processing stream
   uint64_t active_stream;
 
+  // the number of requests aborted by the handler execution budget
+  uint64_t handler_budget_exceeded;
+
+  // the number of gc runs scheduled by the worker event loop
+  uint64_t gc_step_count;
+  uint64_t gc_full_count;
+
+  // total and max gc pause time in usec
+  uint64_t gc_time;
+  uint64_t gc_pause_max;
+
+  // the number of gc pauses for each MRB_HTTP2_GC_PAUSE_BUCKETS
+  uint64_t gc_pause_hist[MRB_HTTP2_GC_PAUSE_HIST_LEN];
+
+  // upstream requests sent on an idle pooled connection, on a new
+  // connection, and queued on a busy one by upstream_max_connections
+  uint64_t upstream_conn_hits;
+  uint64_t upstream_conn_connects;
+  uint64_t upstream_conn_waits;
+
+  // upstream group servers ejected by passive health check
+  uint64_t upstream_ejections;
+
+  // upstream responses served from the cache as fresh, stale while
+  // revalidated or on error, and revalidated by 304, requests sent
+  // upstream for a missing or stale response, and the body bytes served
+  // from the cache and stored into it
+  uint64_t upstream_cache_hits;
+  uint64_t upstream_cache_stale;
+  uint64_t upstream_cache_revalidated;
+  uint64_t upstream_cache_misses;
+  uint64_t upstream_cache_hit_bytes;
+  uint64_t upstream_cache_stored_bytes;
+
+  // upstream requests attached to the same request in flight
+  uint64_t upstream_collapsed;
+
+  // upstream requests failed by the connect or first byte timeout, sent
+  // again after no response, circuits opened by failures, and requests
+  // replied 503 by an open circuit
+  uint64_t upstream_timeouts;
+  uint64_t upstream_retries;
+  uint64_t upstream_breaker_opens;
+  uint64_t upstream_breaker_rejects;
+
+  // TLS handshakes with https upstreams, and those resuming a session
+  uint64_t upstream_tls_handshakes;
+  uint64_t upstream_tls_resumptions;
+
+  // upstream names answered by the dns cache with an address, and with a
+  // failure still within dns_negative_ttl
+  uint64_t dns_cache_hits;
+  uint64_t dns_cache_negative_hits;
+
+  // sessions closed by each timeout, and accepts paused by max_connections
+  uint64_t handshake_timeouts;
+  uint64_t idle_timeouts;
+  uint64_t header_timeouts;
+  uint64_t write_timeouts;
+  uint64_t accept_pauses;
+
+  // receive windows doubled by window_autotune
+  uint64_t window_grows;
+
+  // PRIORITY_UPDATE frames received
+  uint64_t priority_updates;
+
+  // allocations of the slab of the worker thread
+  mrb_http2_slab_stats slab;
+
 } mrb_http2_worker_t;
 
 mrb_http2_worker_t *mrb_http2_worker_init(mrb_state *);
 void mrb_http2_worker_free(mrb_state *mrb, mrb_http2_worker_t *);
+void mrb_http2_worker_gc_record(mrb_http2_worker_t *worker, uint64_t usec, int full);
 
 #endif
@@ -20,3 +20,154 @@ assert("HTTP2::Client#uri,get") do
   r = s.get
   assert_equal(200, r.status)
 end
+
+# h2c to example/http2_server_status.rb for the frames HTTP2::Client
+# can't send and the counters of /server-status
+h2c_host = "127.0.0.1"
+h2c_port = 8082
+
+def h2c_frame(type, flags, stream_id, payload)
+  [payload.size >> 16, payload.size & 0xffff, type, flags, stream_id].pack("CnCCN") + payload
+end
+
+# GET with :method GET and :scheme http indexed, :authority and :path
+# literal without indexing
+def h2c_get(host, port, path, frames = [])
+  authority = "#{host}:#{port}"
+  block = [0x82, 0x86, 0x01, authority.size].pack("CCCC") + authority + [0x04, path.size].pack("CC") + path
+
+  sock = TCPSocket.new(host, port)
+  # SETTINGS_NO_RFC7540_PRIORITIES
+  sock.write "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + h2c_frame(0x04, 0, 0, [0x09, 1].pack("nN"))
+  frames.each { |f| sock.write f }
+  # END_STREAM and END_HEADERS
+  sock.write h2c_frame(0x01, 0x05, 1, block)
+
+  body = ""
+  loop do
+    hd = sock.read(9)
+    break if hd.nil? || hd.size < 9
+    hi, lo, type, flags, stream_id = hd.unpack("CnCCN")
+    len = (hi << 16) | lo
+    payload = len > 0 ? sock.read(len) : ""
+    # GOAWAY or RST_STREAM
+    break if type == 0x07 || type == 0x03
+    next if stream_id != 1
+    body << payload if type == 0x00
+    # END_STREAM of DATA or HEADERS
+    break if (type == 0x00 || type == 0x01) && flags & 0x01 != 0
+  end
+  sock.close
+  body
+end
+
+def h2c_status(host, port)
+  status = {}
+  h2c_get(host, port, "/server-status").each_line do |l|
+    k, v = l.chomp.split(": ")
+    status[k] = v.to_i
+  end
+  status
+end
+
+assert("HTTP2::Server counters") do
+  status = h2c_status(h2c_host, h2c_port)
+  %w(
+    priority_updates window_grows upstream_cache_hits upstream_cache_stale upstream_cache_revalidated
+    upstream_cache_misses upstream_cache_hit_bytes upstream_cache_stored_bytes dns_cache_hits dns_cache_negative_hits
+    gc_count gc_full_count gc_time gc_pause_max
+    handler_budget_exceeded
+    upstream_conn_hits upstream_conn_connects upstream_conn_waits
+    upstream_ejections
+    upstream_collapsed
+    upstream_timeouts upstream_retries upstream_breaker_opens upstream_breaker_rejects
+    upstream_tls_handshakes upstream_tls_resumptions
+    handshake_timeouts idle_timeouts header_timeouts write_timeouts accept_pauses
+    slab_bytes slab_held_bytes
+  ).each do |name|
+    assert_true(status.key?(name), name)
+    assert_true(status[name] >= 0, name)
+  end
+end
+
+assert("HTTP2::Server#priority_updates") do
+  before = h2c_status(h2c_host, h2c_port)["priority_updates"]
+  # PRIORITY_UPDATE of stream 1 with urgency 0, sent before its HEADERS
+  h2c_get(h2c_host, h2c_port, "/index.html", [h2c_frame(0x10, 0, 0, [1].pack("N") + "u=0")])
+  assert_equal(before + 1, h2c_status(h2c_host, h2c_port)["priority_updates"])
+end
+
+# raised by HTTP2::Server.new before the server starts
+def assert_config_error(config)
+  assert_raise(RuntimeError) do
+    HTTP2::Server.new({:port => 8083, :tls => false}.merge(config))
+  end
+end
+
+assert("HTTP2::Server SETTINGS ranges") do
+  assert_config_error(:max_frame_size => 16383)
+  assert_config_error(:max_frame_size => 16777216)
+  assert_config_error(:max_concurrent_streams => -1)
+  assert_config_error(:header_table_size => -1)
+  assert_config_error(:max_header_list_size => -1)
+  assert_config_error(:initial_window_size => -1)
+  assert_config_error(:connection_window_size => -1)
+  assert_config_error(:window_max_size => -1)
+end
+
+# hits of the second of two requests for the response with the
+# cache-control of name, the query makes the key new for each run
+def h2c_cache_hits(host, port, name)
+  path = "/proxy/#{name}?#{rand(1 << 30)}"
+  h2c_get(host, port, path)
+  before = h2c_status(host, port)["upstream_cache_hits"]
+  h2c_get(host, port, path)
+  h2c_status(host, port)["upstream_cache_hits"] - before
+end
+
+assert("HTTP2::Server upstream cache freshness") do
+  assert_equal(1, h2c_cache_hits(h2c_host, h2c_port, "max-age"))
+  # s-maxage takes precedence over max-age in a shared cache
+  assert_equal(1, h2c_cache_hits(h2c_host, h2c_port, "s-maxage"))
+  assert_equal(0, h2c_cache_hits(h2c_host, h2c_port, "expired"))
+  assert_equal(0, h2c_cache_hits(h2c_host, h2c_port, "no-store"))
+  assert_equal(0, h2c_cache_hits(h2c_host, h2c_port, "private"))
+end
+
+assert("HTTP2::Server#dns_cache_hits") do
+  before = h2c_status(h2c_host, h2c_port)["dns_cache_hits"]
+  # localhost is answered from the hosts file, later tries hit the cache
+  h2c_get(h2c_host, h2c_port, "/dns")
+  h2c_get(h2c_host, h2c_port, "/dns")
+  assert_true(h2c_status(h2c_host, h2c_port)["dns_cache_hits"] - before >= 1)
+end
+
+assert("HTTP2::Server DNS TTL ranges") do
+  assert_config_error(:dns_positive_ttl => -1)
+  assert_config_error(:dns_negative_ttl => -1)
+end
+
+assert("HTTP2::Server#gc_pause_max") do
+  status = h2c_status(h2c_host, h2c_port)
+  assert_true(status["gc_pause_max"] <= status["gc_time"])
+end
+
+assert("HTTP2::Server#handler_budget_exceeded") do
+  before = h2c_status(h2c_host, h2c_port)["handler_budget_exceeded"]
+  h2c_get(h2c_host, h2c_port, "/spin")
+  assert_equal(before + 1, h2c_status(h2c_host, h2c_port)["handler_budget_exceeded"])
+end
+
+assert("HTTP2::Server#upstream_conn_connects") do
+  before = h2c_status(h2c_host, h2c_port)["upstream_conn_connects"]
+  # no connection to a port nothing listens on is kept idle
+  h2c_get(h2c_host, h2c_port, "/dns")
+  assert_true(h2c_status(h2c_host, h2c_port)["upstream_conn_connects"] > before)
+end
+
+assert("HTTP2::Server timeout ranges") do
+  assert_config_error(:handshake_timeout => -1)
+  assert_config_error(:idle_timeout => -1)
+  assert_config_error(:header_timeout => -1)
+  assert_config_error(:write_timeout => -1)
+end